@@ -0,0 +1,110 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+/* Time rooms_put_saved_events() on a large sync response with an increasing
+ * number of workers. */
+#include "app/room_ds.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { ROOMS = 4000, EVENTS = 50, RUNS = 3 };
+
+static char displayname[] = "Benchmark";
+static char sender[] = "@sender:localhost";
+static char body[]
+  = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+	"tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim "
+	"veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip.";
+
+static uint64_t
+ms_since(const struct timespec *start) {
+	const uint64_t ms_in_sec = 1000;
+	const long ns_in_ms = 1000000;
+
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (((uint64_t) (now.tv_sec - start->tv_sec)) * ms_in_sec)
+		 + (uint64_t) ((now.tv_nsec - start->tv_nsec) / ns_in_ms);
+}
+
+static void
+rooms_init(struct saved_room *rooms, struct saved_event *events) {
+	for (size_t i = 0; i < ROOMS; i++) {
+		rooms[i].room = room_alloc((struct room_info) {0});
+
+		if (!rooms[i].room
+			|| (room_put_member(rooms[i].room, sender, displayname)) != 0) {
+			abort();
+		}
+
+		/* Shared by the rooms, as they're only read. */
+		rooms[i].events = events;
+	}
+}
+
+static void
+rooms_finish(struct saved_room *rooms) {
+	for (size_t i = 0; i < ROOMS; i++) {
+		room_destroy(rooms[i].room);
+	}
+}
+
+int
+main(void) {
+	struct saved_room *rooms = calloc(ROOMS, sizeof(*rooms));
+	struct saved_event *events = NULL;
+
+	if (!rooms) {
+		return EXIT_FAILURE;
+	}
+
+	for (uint64_t i = 0; i < EVENTS; i++) {
+		arrput(events,
+		  ((struct saved_event) {.event = {.type = MATRIX_EVENT_TIMELINE,
+								   .timeline = {.type = MATRIX_ROOM_MESSAGE,
+									 .base = {.sender = sender},
+									 .message = {.body = body}}},
+			.index = i,
+			.related_index = (uint64_t) -1}));
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned max_workers = cores > 0 ? (unsigned) cores : 1;
+	uint64_t baseline = 0;
+
+	printf("%d rooms, %d events each\n", ROOMS, EVENTS);
+
+	for (unsigned workers = 1; workers <= max_workers; workers *= 2) {
+		uint64_t best = UINT64_MAX;
+
+		for (size_t i = 0; i < RUNS; i++) {
+			rooms_init(rooms, events);
+
+			struct timespec start = {0};
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			rooms_put_saved_events(rooms, ROOMS, workers);
+
+			uint64_t ms = ms_since(&start);
+			best = ms < best ? ms : best;
+
+			rooms_finish(rooms);
+		}
+
+		if (workers == 1) {
+			baseline = best;
+		}
+
+		printf("%2u workers: %5" PRIu64 " ms, %.2fx\n", workers, best,
+		  best > 0 ? (double) baseline / (double) best : 0.0);
+	}
+
+	arrfree(events);
+	free(rooms);
+
+	return EXIT_SUCCESS;
+}
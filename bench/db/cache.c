@@ -0,0 +1,768 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+/* Save synthetic sync responses with a txn per room and for next_batch, as
+ * before the batch was introduced, then with a single batch per response in
+ * each durability mode. Then time an initial sync with members and the
+ * responses after it through cache_save_event(), compare the sorted appends of
+ * the staged writes of each room with unsorted puts in the same DBs, and
+ * count the pages of the event DBs with schema version 1 and now. */
+#include "db/cache.h"
+#include "stb_ds.h"
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { ROOMS = 200, EVENTS = 50, MEMBERS = 20, ID_MAX = 64 };
+/* Responses after the initial one, where every room already has events. */
+enum { SYNCS = 20 };
+/* [u32 room][u64 index] like the keys of the event DBs. */
+enum { ROOM_KEY_SIZE = sizeof(uint32_t) + sizeof(uint64_t) };
+enum { DB_EVENTS = 0, DB_EVENT_IDS, DB_MAX_BENCH };
+
+static char sender[] = "@sender:localhost";
+static char type[] = "m.room.message";
+static char msgtype[] = "m.text";
+static char body[]
+  = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod "
+	"tempor incididunt ut labore et dolore magna aliqua.";
+
+static char room_ids[ROOMS][ID_MAX];
+
+static uint64_t
+ms_since(const struct timespec *start) {
+	const uint64_t ms_in_sec = 1000;
+	const long ns_in_ms = 1000000;
+
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (((uint64_t) (now.tv_sec - start->tv_sec)) * ms_in_sec)
+		 + (uint64_t) ((now.tv_nsec - start->tv_nsec) / ns_in_ms);
+}
+
+/* Event IDs are hashes, so they arrive in no particular order. */
+static uint64_t
+mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* '$' and 43 characters like the hashes of room versions 4 and up. */
+static void
+event_id_hash(char *buf, uint64_t seed) {
+	static const char alphabet[]
+	  = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	enum { hash_len = 43, chars_per_word = 10, bits_per_char = 6 };
+
+	uint64_t bits = 0;
+
+	buf[0] = '$';
+
+	for (size_t i = 0; i < hash_len; i++) {
+		if ((i % chars_per_word) == 0) {
+			bits = mix((seed * hash_len) + i);
+		}
+
+		buf[i + 1] = alphabet[bits & ((1 << bits_per_char) - 1)];
+		bits >>= bits_per_char;
+	}
+
+	buf[hash_len + 1] = '\0';
+}
+
+static void
+remove_env(const char *dir) {
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/data.mdb", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/lock.mdb", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+/* Save EVENTS messages of the given response to the room, after it's parsed
+ * member events if members isn't NULL. */
+static void
+save_room(struct cache_batch *batch, size_t room_index, size_t sync,
+  struct matrix_sync_event *members) {
+	struct matrix_room room = {
+	  .id = room_ids[room_index],
+	  .type = MATRIX_ROOM_JOIN,
+	};
+	struct cache_save_txn txn = {0};
+	struct cache_deferred_space_event *deferred_events = NULL;
+	uint64_t index = 0;
+	uint64_t related_index = 0;
+
+	cache_save_txn_init(batch, &txn, room.id);
+
+	if ((cache_save_txn_room(&txn, &room)) != MDB_SUCCESS
+		|| (cache_save_room(&txn, &room)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	for (size_t i = 0; members && i < MEMBERS; i++) {
+		if ((cache_save_event(
+			  &txn, &members[i], &index, &related_index, &deferred_events))
+			!= CACHE_EVENT_SAVED) {
+			abort();
+		}
+	}
+
+	for (size_t i = 0; i < EVENTS; i++) {
+		char event_id[ID_MAX];
+		event_id_hash(
+		  event_id, (((sync * ROOMS) + room_index) * EVENTS) + i);
+
+		struct matrix_sync_event event = {
+		  .type = MATRIX_EVENT_TIMELINE,
+		  .timeline = {
+			.type = MATRIX_ROOM_MESSAGE,
+			.base = {
+			  .event_id = event_id,
+			  .sender = sender,
+			  .type = type,
+			  .origin_server_ts = (sync * EVENTS) + i + 1,
+			},
+			.message = {.body = body, .msgtype = msgtype},
+		  }};
+
+		if ((cache_save_event(
+			  &txn, &event, &index, &related_index, &deferred_events))
+			!= CACHE_EVENT_SAVED) {
+			abort();
+		}
+	}
+
+	if ((cache_save_txn_finish(&txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	arrfree(deferred_events);
+}
+
+/* How each of the SYNCS + 1 responses of save_responses() is committed. */
+enum save_mode {
+	/* A txn per room and another for next_batch, as before the batch was
+	 * introduced. */
+	SAVE_PER_ROOM = 0,
+	/* A single batch per response with every commit fsync'd. */
+	SAVE_BATCH,
+	/* A single batch per response without syncing the meta page. */
+	SAVE_BATCH_NOMETASYNC,
+	/* A single batch per response, synced once per commit window. */
+	SAVE_BATCH_WINDOW,
+	SAVE_MAX
+};
+
+static const char *const save_mode_names[SAVE_MAX] = {
+  [SAVE_PER_ROOM] = "txn per room        ",
+  [SAVE_BATCH] = "single batch        ",
+  [SAVE_BATCH_NOMETASYNC] = "batch, no meta sync ",
+  [SAVE_BATCH_WINDOW] = "batch, commit window",
+};
+
+static const enum cache_durability save_mode_durability[SAVE_MAX] = {
+  [SAVE_PER_ROOM] = CACHE_DURABILITY_SYNC,
+  [SAVE_BATCH] = CACHE_DURABILITY_SYNC,
+  [SAVE_BATCH_NOMETASYNC] = CACHE_DURABILITY_NOMETASYNC,
+  [SAVE_BATCH_WINDOW] = CACHE_DURABILITY_NOSYNC,
+};
+
+/* Returns the time taken in ms by SYNCS + 1 responses, including the final
+ * sync of the env when the cache is closed. */
+static uint64_t
+save_responses(const char *dir, enum save_mode mode) {
+	struct cache cache = {0};
+
+	if ((cache_init(&cache,
+		  &(struct cache_options) {
+			.dir = dir,
+			.durability = save_mode_durability[mode],
+		  }))
+		!= 0) {
+		abort();
+	}
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t sync = 0; sync <= SYNCS; sync++) {
+		struct cache_batch batch = {0};
+		char next_batch[ID_MAX];
+
+		snprintf(next_batch, sizeof(next_batch), "s%zu", sync);
+
+		for (size_t i = 0; i < ROOMS; i++) {
+			if ((i == 0 || mode == SAVE_PER_ROOM)
+				&& (cache_batch_init(&cache, &batch)) != MDB_SUCCESS) {
+				abort();
+			}
+
+			save_room(&batch, i, sync, NULL);
+
+			if (mode == SAVE_PER_ROOM
+				&& (cache_batch_finish(&batch)) != MDB_SUCCESS) {
+				abort();
+			}
+		}
+
+		if (mode == SAVE_PER_ROOM) {
+			if ((cache_auth_set(&cache, DB_KEY_NEXT_BATCH, next_batch))
+				!= MDB_SUCCESS) {
+				abort();
+			}
+		} else if ((cache_batch_auth_set(
+					 &batch, DB_KEY_NEXT_BATCH, next_batch))
+					 != MDB_SUCCESS
+				   || (cache_batch_finish(&batch)) != MDB_SUCCESS) {
+			abort();
+		}
+	}
+
+	cache_finish(&cache);
+
+	uint64_t ms = ms_since(&start);
+
+	remove_env(dir);
+
+	return ms;
+}
+
+/* Member events of every room, parsed before timing like the syncer does.
+ * *jsons stores the JSON they point into. */
+static struct matrix_sync_event *
+parse_members(matrix_json_t ***jsons) {
+	struct matrix_sync_event *members = NULL;
+
+	arrsetlen(members, (size_t) ROOMS * MEMBERS);
+	memset(members, 0, sizeof(*members) * arrlenu(members));
+
+	for (size_t room = 0; room < ROOMS; room++) {
+		for (size_t i = 0; i < MEMBERS; i++) {
+			char buf[256];
+			int len = snprintf(buf, sizeof(buf),
+			  "{\"type\":\"m.room.member\",\"event_id\":\"$member%zu_%zu\","
+			  "\"sender\":\"@user%zu:localhost\",\"state_key\":\"@user%zu:"
+			  "localhost\",\"origin_server_ts\":1,\"content\":{"
+			  "\"membership\":\"join\",\"displayname\":\"User %zu\"}}",
+			  room, i, i, i, i);
+			matrix_json_t *json = matrix_json_parse(buf, (size_t) len);
+
+			if (!json
+				|| (matrix_event_sync_parse(
+					 &members[(room * MEMBERS) + i], json))
+					 != 0) {
+				abort();
+			}
+
+			arrput(*jsons, json);
+		}
+	}
+
+	return members;
+}
+
+/* Returns the time taken in ms by the SYNCS responses after the initial one,
+ * which takes *initial_ms. Each response is saved in a single batch. */
+static uint64_t
+ingest(const char *dir, uint64_t *initial_ms) {
+	struct cache cache = {0};
+	matrix_json_t **jsons = NULL;
+	struct matrix_sync_event *members = parse_members(&jsons);
+
+	if ((cache_init(&cache, &(struct cache_options) {.dir = dir})) != 0) {
+		abort();
+	}
+
+	struct timespec start = {0};
+	uint64_t ms = 0;
+
+	for (size_t sync = 0; sync <= SYNCS; sync++) {
+		struct cache_batch batch = {0};
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if ((cache_batch_init(&cache, &batch)) != MDB_SUCCESS) {
+			abort();
+		}
+
+		for (size_t i = 0; i < ROOMS; i++) {
+			save_room(
+			  &batch, i, sync, sync == 0 ? &members[i * MEMBERS] : NULL);
+		}
+
+		if ((cache_batch_finish(&batch)) != MDB_SUCCESS) {
+			abort();
+		}
+
+		if (sync == 0) {
+			*initial_ms = ms_since(&start);
+		} else {
+			ms += ms_since(&start);
+		}
+	}
+
+	cache_finish(&cache);
+	remove_env(dir);
+
+	for (size_t i = 0; i < arrlenu(jsons); i++) {
+		matrix_json_delete(jsons[i]);
+	}
+
+	arrfree(jsons);
+	arrfree(members);
+
+	return ms;
+}
+
+/* The per-room event DBs of schema version 1. */
+enum { V1_EVENT_DBS = 3 };
+
+static const char *const v1_event_db_names[V1_EVENT_DBS]
+  = {"events", "order2event", "event2order"};
+static const unsigned v1_event_db_flags[V1_EVENT_DBS] = {0, MDB_INTEGERKEY, 0};
+
+/* Write the messages of the initial response in the layout of schema version
+ * 1, keyed by event ID in every DB. Returns the pages of the event DBs. */
+static uint64_t
+put_v1(const char *dir) {
+	const unsigned long mib = 1024 * 1024;
+	struct kv_env *env = NULL;
+	struct kv_txn *txn = NULL;
+	kv_dbi rooms = 0;
+	char empty[] = "";
+
+	if ((mkdir(dir, S_IRWXU)) != 0
+		|| (kv_env_open(&kv_lmdb, &env, dir, MDB_NOSYNC, 256 * mib,
+			 (ROOMS * V1_EVENT_DBS) + 1))
+			 != MDB_SUCCESS
+		|| (kv_txn_begin(env, 0, &txn)) != MDB_SUCCESS
+		|| (kv_dbi_open(txn, "rooms", MDB_CREATE, &rooms)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	uint64_t pages = 0;
+
+	for (size_t room = 0; room < ROOMS; room++) {
+		kv_dbi dbs[V1_EVENT_DBS] = {0};
+
+		for (size_t i = 0; i < V1_EVENT_DBS; i++) {
+			char name[ID_MAX * 2];
+			snprintf(name, sizeof(name), "%s/%s", room_ids[room],
+			  v1_event_db_names[i]);
+
+			if ((kv_dbi_open(
+				  txn, name, MDB_CREATE | v1_event_db_flags[i], &dbs[i]))
+				!= MDB_SUCCESS) {
+				abort();
+			}
+		}
+
+		if ((kv_put(txn, rooms,
+			  &(MDB_val) {strlen(room_ids[room]) + 1, room_ids[room]},
+			  &(MDB_val) {sizeof(empty), empty}, 0))
+			!= MDB_SUCCESS) {
+			abort();
+		}
+
+		for (uint64_t i = 0; i < EVENTS; i++) {
+			char event_id[ID_MAX];
+			char json[512];
+
+			event_id_hash(event_id, (room * EVENTS) + i);
+
+			int len = snprintf(json, sizeof(json),
+			  "{\"type\":\"%s\",\"event_id\":\"%s\",\"sender\":\"%s\","
+			  "\"origin_server_ts\":%" PRIu64 ",\"content\":{\"msgtype\":"
+			  "\"%s\",\"body\":\"%s\"}}",
+			  type, event_id, sender, i + 1, msgtype, body);
+			MDB_val id = {strlen(event_id) + 1, event_id};
+
+			if ((kv_put(txn, dbs[0], &id, &(MDB_val) {(size_t) len + 1, json},
+				  0))
+				  != MDB_SUCCESS
+				|| (kv_put(txn, dbs[1], &(MDB_val) {sizeof(i), &i}, &id, 0))
+					 != MDB_SUCCESS
+				|| (kv_put(txn, dbs[2], &id, &(MDB_val) {sizeof(i), &i}, 0))
+					 != MDB_SUCCESS) {
+				abort();
+			}
+		}
+
+		for (size_t i = 0; i < V1_EVENT_DBS; i++) {
+			struct kv_stat stat = {0};
+
+			if ((kv_stat(txn, dbs[i], &stat)) != MDB_SUCCESS) {
+				abort();
+			}
+
+			pages += stat.pages;
+		}
+	}
+
+	if ((kv_txn_commit(txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	kv_env_close(env);
+
+	return pages;
+}
+
+static uint64_t
+event_pages(struct cache *cache) {
+	struct cache_stats stats = {0};
+	cache_stats(cache, &stats);
+
+	return stats.event_pages;
+}
+
+/* Returns the pages of the event DBs after saving the messages of the initial
+ * response, and in *v1 and *migrated the pages they took with schema version 1
+ * and after migrating that cache. */
+static uint64_t
+measure_pages(
+  const char *v1_dir, const char *dir, uint64_t *v1, uint64_t *migrated) {
+	struct cache cache = {0};
+
+	*v1 = put_v1(v1_dir);
+
+	if ((cache_init(&cache, &(struct cache_options) {.dir = v1_dir})) != 0) {
+		abort();
+	}
+
+	*migrated = event_pages(&cache);
+
+	cache_finish(&cache);
+	remove_env(v1_dir);
+
+	cache = (struct cache) {0};
+
+	if ((cache_init(&cache, &(struct cache_options) {.dir = dir})) != 0) {
+		abort();
+	}
+
+	struct cache_batch batch = {0};
+
+	if ((cache_batch_init(&cache, &batch)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	for (size_t i = 0; i < ROOMS; i++) {
+		save_room(&batch, i, 0, NULL);
+	}
+
+	if ((cache_batch_finish(&batch)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	uint64_t pages = event_pages(&cache);
+
+	cache_finish(&cache);
+	remove_env(dir);
+
+	return pages;
+}
+
+struct staged_put {
+	unsigned db;
+	MDB_val key;
+	MDB_val data;
+};
+
+struct put_bench {
+	struct kv_env *env;
+	kv_dbi dbs[DB_MAX_BENCH];
+	/* Room keys and event IDs of the current response. */
+	unsigned char (*keys)[ROOM_KEY_SIZE];
+	char (*ids)[ID_MAX];
+};
+
+static void
+write_be(unsigned char *buf, uint64_t value, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = (unsigned char) (value >> ((len - i - 1) * CHAR_BIT));
+	}
+}
+
+static int
+cmp_staged_puts(const void *a, const void *b) {
+	const struct staged_put *put_a = a;
+	const struct staged_put *put_b = b;
+
+	if (put_a->db != put_b->db) {
+		return put_a->db < put_b->db ? -1 : 1;
+	}
+
+	int ret = memcmp(put_a->key.mv_data, put_b->key.mv_data,
+	  put_a->key.mv_size < put_b->key.mv_size ? put_a->key.mv_size
+											  : put_b->key.mv_size);
+
+	if (ret == 0 && put_a->key.mv_size != put_b->key.mv_size) {
+		ret = put_a->key.mv_size < put_b->key.mv_size ? -1 : 1;
+	}
+
+	return ret;
+}
+
+/* Write the puts of a room like flush_staged() in cache.c, sorted and
+ * appended to each DB if they all sort after it's last key. */
+static void
+flush_sorted(struct put_bench *bench, struct kv_txn *txn,
+  struct staged_put *puts, size_t len) {
+	qsort(puts, len, sizeof(*puts), cmp_staged_puts);
+
+	for (size_t i = 0; i < len;) {
+		unsigned db = puts[i].db;
+		struct kv_cursor *cursor = NULL;
+		MDB_val last = {0};
+		MDB_val data = {0};
+
+		if ((kv_cursor_open(txn, bench->dbs[db], &cursor)) != MDB_SUCCESS) {
+			abort();
+		}
+
+		int ret = kv_cursor_get(cursor, &last, &data, MDB_LAST);
+		const bool append
+		  = ret == MDB_NOTFOUND
+		 || (ret == MDB_SUCCESS
+			 && (cmp_staged_puts(&puts[i],
+				  &(struct staged_put) {.db = db, .key = last}))
+				  > 0);
+
+		for (; i < len && puts[i].db == db; i++) {
+			if ((kv_cursor_put(cursor, &puts[i].key, &puts[i].data,
+				  append ? MDB_APPEND : 0))
+				!= MDB_SUCCESS) {
+				abort();
+			}
+		}
+
+		kv_cursor_close(cursor);
+	}
+}
+
+/* Save a response with EVENTS events for every room in a single txn, with the
+ * indices of each room continuing from the previous response. */
+static void
+put_response(struct put_bench *bench, size_t sync, bool sorted) {
+	struct kv_txn *txn = NULL;
+	struct staged_put *puts = NULL;
+
+	if ((kv_txn_begin(bench->env, 0, &txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	for (size_t room = 0; room < ROOMS; room++) {
+		arrsetlen(puts, 0);
+
+		for (size_t i = 0; i < EVENTS; i++) {
+			const size_t n = (room * EVENTS) + i;
+			unsigned char *key = bench->keys[n];
+
+			write_be(key, room, sizeof(uint32_t));
+			write_be(&key[sizeof(uint32_t)], (sync * EVENTS) + i,
+			  sizeof(uint64_t));
+			snprintf(bench->ids[n], ID_MAX, "$%016" PRIx64 ":localhost",
+			  mix((sync * ROOMS * EVENTS) + n));
+
+			struct staged_put event = {
+			  .db = DB_EVENTS,
+			  .key = {ROOM_KEY_SIZE, key},
+			  .data = {sizeof(body), body},
+			};
+			struct staged_put id = {
+			  .db = DB_EVENT_IDS,
+			  .key = {strlen(bench->ids[n]) + 1, bench->ids[n]},
+			  .data = {ROOM_KEY_SIZE, key},
+			};
+
+			if (sorted) {
+				arrput(puts, event);
+				arrput(puts, id);
+			} else if ((kv_put(txn, bench->dbs[event.db], &event.key,
+						 &event.data, 0))
+						 != MDB_SUCCESS
+					   || (kv_put(txn, bench->dbs[id.db], &id.key, &id.data, 0))
+							!= MDB_SUCCESS) {
+				abort();
+			}
+		}
+
+		if (sorted) {
+			flush_sorted(bench, txn, puts, arrlenu(puts));
+		}
+	}
+
+	if ((kv_txn_commit(txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	arrfree(puts);
+}
+
+/* Returns the time taken in ms by the initial response in *initial_ms and by
+ * the following SYNCS responses. */
+static uint64_t
+put_responses(const char *dir, bool sorted, uint64_t *initial_ms) {
+	const unsigned long mib = 1024 * 1024;
+	struct put_bench bench = {0};
+	struct kv_txn *txn = NULL;
+	const char *const names[DB_MAX_BENCH] = {"events", "event_ids"};
+
+	if ((mkdir(dir, S_IRWXU)) != 0
+		|| (kv_env_open(&kv_lmdb, &bench.env, dir, MDB_NOSYNC, 256 * mib,
+			 DB_MAX_BENCH))
+			 != MDB_SUCCESS
+		|| (kv_txn_begin(bench.env, 0, &txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	for (size_t i = 0; i < DB_MAX_BENCH; i++) {
+		if ((kv_dbi_open(txn, names[i], MDB_CREATE, &bench.dbs[i]))
+			!= MDB_SUCCESS) {
+			abort();
+		}
+	}
+
+	if ((kv_txn_commit(txn)) != MDB_SUCCESS) {
+		abort();
+	}
+
+	arrsetlen(bench.keys, ROOMS * EVENTS);
+	arrsetlen(bench.ids, ROOMS * EVENTS);
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	put_response(&bench, 0, sorted);
+
+	*initial_ms = ms_since(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 1; i <= SYNCS; i++) {
+		put_response(&bench, i, sorted);
+	}
+
+	uint64_t ms = ms_since(&start);
+
+	kv_env_close(bench.env);
+	arrfree(bench.keys);
+	arrfree(bench.ids);
+	remove_env(dir);
+
+	return ms;
+}
+
+static double
+rate(size_t events, uint64_t ms) {
+	return ms > 0 ? (double) events * 1000 / (double) ms : 0.0;
+}
+
+static void
+print_puts(const char *name, uint64_t ms, size_t events, uint64_t baseline) {
+	printf("%s: %5" PRIu64 " ms, %.0f events/s, %.2fx\n", name, ms,
+	  ms > 0 ? (double) events * 1000 / (double) ms : 0.0,
+	  ms > 0 ? (double) baseline / (double) ms : 0.0);
+}
+
+static void
+print_pages(const char *name, uint64_t pages, uint64_t baseline) {
+	printf("%s: %6" PRIu64 " pages, %.1f events per page, %.2fx smaller\n",
+	  name, pages, pages > 0 ? (double) (ROOMS * EVENTS) / (double) pages : 0.0,
+	  pages > 0 ? (double) baseline / (double) pages : 0.0);
+}
+
+int
+main(void) {
+	char dir[] = "/tmp/cache_bench_XXXXXX";
+
+	if (!(mkdtemp(dir))) {
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0; i < ROOMS; i++) {
+		snprintf(room_ids[i], ID_MAX, "!room%zu:localhost", i);
+	}
+
+	char save_dir[sizeof(dir) + sizeof("/save")];
+	char ingest_dir[sizeof(dir) + sizeof("/ingest")];
+	char unsorted_dir[sizeof(dir) + sizeof("/unsorted")];
+	char sorted_dir[sizeof(dir) + sizeof("/sorted")];
+	char v1_dir[sizeof(dir) + sizeof("/v1")];
+	char pages_dir[sizeof(dir) + sizeof("/pages")];
+
+	snprintf(v1_dir, sizeof(v1_dir), "%s/v1", dir);
+	snprintf(pages_dir, sizeof(pages_dir), "%s/pages", dir);
+	snprintf(save_dir, sizeof(save_dir), "%s/save", dir);
+	snprintf(ingest_dir, sizeof(ingest_dir), "%s/ingest", dir);
+	snprintf(unsorted_dir, sizeof(unsorted_dir), "%s/unsorted", dir);
+	snprintf(sorted_dir, sizeof(sorted_dir), "%s/sorted", dir);
+
+	uint64_t save_ms[SAVE_MAX] = {0};
+
+	for (size_t i = 0; i < SAVE_MAX; i++) {
+		save_ms[i] = save_responses(save_dir, (enum save_mode) i);
+	}
+
+	uint64_t ingest_initial_ms = 0;
+	uint64_t ingest_ms = ingest(ingest_dir, &ingest_initial_ms);
+
+	uint64_t unsorted_initial_ms = 0;
+	uint64_t sorted_initial_ms = 0;
+	uint64_t unsorted_ms
+	  = put_responses(unsorted_dir, false, &unsorted_initial_ms);
+	uint64_t sorted_ms = put_responses(sorted_dir, true, &sorted_initial_ms);
+
+	uint64_t v1_pages = 0;
+	uint64_t migrated_pages = 0;
+	uint64_t pages
+	  = measure_pages(v1_dir, pages_dir, &v1_pages, &migrated_pages);
+
+	rmdir(dir);
+
+	printf("%d responses, %d rooms with %d events each\n", SYNCS + 1, ROOMS,
+	  EVENTS);
+
+	for (size_t i = 0; i < SAVE_MAX; i++) {
+		print_puts(save_mode_names[i], save_ms[i],
+		  (size_t) (SYNCS + 1) * ROOMS * EVENTS, save_ms[SAVE_PER_ROOM]);
+	}
+
+	printf("\nThrough cache_save_event(), %d members and a batch per "
+		   "response\n",
+	  MEMBERS);
+	printf("initial sync: %5" PRIu64 " ms, %.0f events/s\n", ingest_initial_ms,
+	  rate((size_t) ROOMS * (EVENTS + MEMBERS), ingest_initial_ms));
+	printf("%d responses: %5" PRIu64 " ms, %.0f events/s\n", SYNCS, ingest_ms,
+	  rate((size_t) SYNCS * ROOMS * EVENTS, ingest_ms));
+
+	printf("\nInitial response, every room is new\n");
+	print_puts("unsorted puts ", unsorted_initial_ms, ROOMS * EVENTS,
+	  unsorted_initial_ms);
+	print_puts("sorted appends", sorted_initial_ms, ROOMS * EVENTS,
+	  unsorted_initial_ms);
+
+	printf("\n%d more responses, appended to existing rooms\n", SYNCS);
+	const size_t events = (size_t) SYNCS * ROOMS * EVENTS;
+
+	print_puts("unsorted puts ", unsorted_ms, events, unsorted_ms);
+	print_puts("sorted appends", sorted_ms, events, unsorted_ms);
+
+	printf("\nPages of the event DBs after the initial response\n");
+	print_pages("schema version 1", v1_pages, v1_pages);
+	print_pages("migrated        ", migrated_pages, v1_pages);
+	print_pages("saved           ", pages, v1_pages);
+
+	return EXIT_SUCCESS;
+}
@@ -1,8 +1,12 @@
 /* SPDX-FileCopyrightText: 2021 git-bruh
  * SPDX-License-Identifier: GPL-3.0-or-later */
 #include "app/state.h"
+#include "util/log.h"
 
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 static enum widget_error
 handle_tree(struct tab_room *tab_room, struct state_rooms *state_rooms,
@@ -17,6 +21,7 @@ handle_tree(struct tab_room *tab_room, struct state_rooms *state_rooms,
 		if (tab_room->treeview.selected
 			&& tab_room->treeview.selected->parent->parent) {
 			tab_room->selected_room = tab_room->treeview.selected->data;
+			tab_room_close_window(tab_room);
 
 			if (tab_room->selected_room->value->info.is_space) {
 				arrput(tab_room->path, tab_room->selected_room->key);
@@ -108,6 +113,289 @@ handle_message_buffer(struct message_buffer *buf, struct tb_event *event) {
 	return WIDGET_NOOP;
 }
 
+/* "prefix: body" on a single line, NULL on failure. */
+static char *
+result_line(const char *prefix, const char *body) {
+	char *line = NULL;
+
+	if ((asprintf(&line, "%s: %s", prefix, body ? body : "")) == -1) {
+		return NULL;
+	}
+
+	for (char *c = line; *c; c++) {
+		if (*c == '\n') {
+			*c = ' ';
+		}
+	}
+
+	return line;
+}
+
+/* Replace the results with the hits for query once the queue thread found
+ * them, taking ownership of it. */
+static void
+search_run(struct state *state, struct tab_room *tab_room, char *query) {
+	assert(state);
+	assert(tab_room);
+	assert(query);
+
+	tab_room_search_reset(tab_room);
+	tab_room->search.query = query;
+
+	char *copy = strdup(query);
+
+	/* The item frees the copy on failure. */
+	if (!copy
+		|| (lock_and_push(state, queue_item_alloc(QUEUE_ITEM_SEARCH, copy)))
+			 == -1) {
+		LOG(LOG_ERROR, "Failed to queue search for '%s'", query);
+		return;
+	}
+
+	tab_room->search.searching = true;
+}
+
+bool
+state_handle_search(struct state *state, struct tab_room *tab_room) {
+	assert(state);
+	assert(tab_room);
+
+	char wake = 0;
+	ssize_t ret
+	  = safe_read(state->search_pipe[PIPE_READ], &wake, sizeof(wake));
+
+	assert(ret == 0);
+
+	pthread_mutex_lock(&state->search_mutex);
+	struct search_results *results = state->search_results;
+	state->search_results = NULL;
+	pthread_mutex_unlock(&state->search_mutex);
+
+	/* Taken by an earlier wakeup, or the query changed meanwhile. */
+	if (!results || !tab_room->search.searching
+		|| strcmp(results->query, tab_room->search.query) != 0) {
+		search_results_free(results);
+		return false;
+	}
+
+	tab_room->search.searching = false;
+
+	struct cache_search_hit *hits = results->hits;
+
+	for (size_t i = 0, len = arrlenu(hits); i < len; i++) {
+		struct room *room = rooms_get_room(state->state_rooms.rooms,
+		  hits[i].room_id);
+		char *name = hits[i].room_id;
+
+		if (room && room->info.name) {
+			name = room->info.name;
+		}
+
+		char *line = result_line(name, hits[i].body);
+
+		if (!line) {
+			continue;
+		}
+
+		struct tab_room_search_result result = {
+		  .room_id = hits[i].room_id,
+		  .index = hits[i].index,
+		  .line = line,
+		};
+
+		hits[i].room_id = NULL;
+		arrput(tab_room->search.results, result);
+	}
+
+	search_results_free(results);
+
+	return true;
+}
+
+/* Show the messages of the selected room around the event at index in the
+ * message buffer, in place of it's live timeline. */
+static void
+open_window(struct state *state, struct tab_room *tab_room, uint64_t index) {
+	assert(state);
+	assert(tab_room);
+	assert(tab_room->selected_room);
+
+	tab_room_close_window(tab_room);
+
+	struct room *window
+	  = state_load_window(state, tab_room->selected_room->key, index);
+
+	/* The live timeline is shown on failure. */
+	if (window) {
+		tab_room->window.room = window;
+		tab_room->window.of = tab_room->selected_room->value;
+		tab_room->window.index = index;
+	}
+
+	tab_room->search.active = false;
+	tab_room->widget = TAB_ROOM_MESSAGE_BUFFER;
+}
+
+/* "YYYY-MM-DD" or "YYYY-MM-DD HH:MM" in local time to ms since the epoch. */
+static bool
+parse_date(const char *str, uint64_t *ts) {
+	assert(str);
+	assert(ts);
+
+	struct tm tm = {0};
+	const char *end = strptime(str, "%Y-%m-%d", &tm);
+
+	if (end && *end) {
+		end = strptime(end, " %H:%M", &tm);
+	}
+
+	if (!end || *end) {
+		return false;
+	}
+
+	tm.tm_isdst = -1;
+
+	time_t secs = mktime(&tm);
+
+	if (secs < 0) {
+		return false;
+	}
+
+	const uint64_t ms_in_sec = 1000;
+	*ts = (uint64_t) secs * ms_in_sec;
+
+	return true;
+}
+
+/* Open a window of the selected room at the first event sent at or after the
+ * date in query, taking ownership of it. The query is kept if it's invalid. */
+static void
+jump_run(struct state *state, struct tab_room *tab_room, char *query) {
+	assert(state);
+	assert(tab_room);
+	assert(query);
+
+	tab_room_search_reset(tab_room);
+	tab_room->search.query = query;
+
+	uint64_t ts = 0;
+
+	if (!tab_room->selected_room || !(parse_date(query, &ts))) {
+		return;
+	}
+
+	const char *room_id = tab_room->selected_room->key;
+	struct cache_snapshot snapshot = {0};
+
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
+		return;
+	}
+
+	uint64_t index = (uint64_t) -1;
+
+	ret = cache_event_index_at(&snapshot, room_id, ts, &index);
+	cache_snapshot_end(&snapshot);
+
+	switch (ret) {
+	case MDB_SUCCESS:
+		break;
+	case MDB_NOTFOUND:
+		/* Every event is older, show the latest ones. */
+		index = (uint64_t) -1;
+		break;
+	default:
+		LOG(LOG_ERROR, "Failed to find events of room '%s' at '%s': %s",
+		  room_id, query, mdb_strerror(ret));
+		return;
+	}
+
+	open_window(state, tab_room, index);
+	tab_room_search_reset(tab_room);
+}
+
+static enum widget_error
+handle_search(
+  struct state *state, struct tab_room *tab_room, struct tb_event *event) {
+	assert(state);
+	assert(tab_room);
+	assert(event);
+
+	size_t results = arrlenu(tab_room->search.results);
+
+	switch (event->key) {
+	case TB_KEY_ESC:
+		tab_room->search.active = false;
+		return WIDGET_REDRAW;
+	case TB_KEY_ARROW_UP:
+		if (tab_room->search.selected > 0) {
+			tab_room->search.selected--;
+			return WIDGET_REDRAW;
+		}
+
+		return WIDGET_NOOP;
+	case TB_KEY_ARROW_DOWN:
+		if ((tab_room->search.selected + 1) < results) {
+			tab_room->search.selected++;
+			return WIDGET_REDRAW;
+		}
+
+		return WIDGET_NOOP;
+	default:
+		break;
+	}
+
+	bool enter_pressed = false;
+	enum widget_error ret
+	  = handle_input(&tab_room->search.input, event, &enter_pressed);
+
+	if (!enter_pressed) {
+		return ret;
+	}
+
+	char *query = input_buf(&tab_room->search.input);
+
+	/* Empty field. */
+	if (!query) {
+		return ret;
+	}
+
+	/* Enter without changing the query opens the selected result. */
+	if (tab_room->search.query && results > 0
+		&& strcmp(query, tab_room->search.query) == 0) {
+		free(query);
+
+		struct tab_room_search_result *result
+		  = &tab_room->search.results[tab_room->search.selected];
+		ptrdiff_t index
+		  = rooms_get_index(state->state_rooms.rooms, result->room_id);
+
+		if (index != -1) {
+			tab_room_select_room(
+			  tab_room, &state->state_rooms, &state->state_rooms.rooms[index]);
+			open_window(state, tab_room, result->index);
+		}
+
+		tab_room->search.active = false;
+		return WIDGET_REDRAW;
+	}
+
+	switch (tab_room->search.mode) {
+	case TAB_ROOM_SEARCH_TEXT:
+		search_run(state, tab_room, query);
+		break;
+	case TAB_ROOM_SEARCH_DATE:
+		jump_run(state, tab_room, query);
+		break;
+	default:
+		assert(0);
+	}
+
+	return WIDGET_REDRAW;
+}
+
 static enum tab_room_widget
 tab_room_find_widget(struct tab_room *tab_room, int x, int y) {
 	struct widget_points points[TAB_ROOM_MAX] = {0};
@@ -135,6 +423,37 @@ handle_tab_room(
 		return WIDGET_REDRAW;
 	}
 
+	if (event->type == TB_EVENT_KEY
+		&& (event->key == TB_KEY_CTRL_F || event->key == TB_KEY_CTRL_G)) {
+		enum tab_room_search_mode mode = event->key == TB_KEY_CTRL_F
+										 ? TAB_ROOM_SEARCH_TEXT
+										 : TAB_ROOM_SEARCH_DATE;
+
+		/* Dates are looked up in the selected room. */
+		if (mode == TAB_ROOM_SEARCH_DATE && !tab_room->selected_room) {
+			return WIDGET_NOOP;
+		}
+
+		if (mode != tab_room->search.mode) {
+			tab_room_search_reset(tab_room);
+			input_handle_event(&tab_room->search.input, INPUT_CLEAR);
+			tab_room->search.mode = mode;
+			tab_room->search.active = true;
+		} else {
+			tab_room->search.active = !tab_room->search.active;
+		}
+
+		tab_room->widget = TAB_ROOM_INPUT;
+		return WIDGET_REDRAW;
+	}
+
+	/* The search prompt takes over the input and the message buffer. */
+	if (tab_room->search.active) {
+		return event->type == TB_EVENT_KEY
+				 ? handle_search(state, tab_room, event)
+				 : WIDGET_NOOP;
+	}
+
 	/* Find the new widget to switch to, forwarding the event to the current
 	 * widget in case of no change. */
 	if (event->type == TB_EVENT_MOUSE && event->key == TB_KEY_MOUSE_LEFT) {
@@ -152,13 +471,12 @@ handle_tab_room(
 	}
 
 	if (event->type == TB_EVENT_MOUSE) {
-		if (tab_room->widget != TAB_ROOM_MESSAGE_BUFFER
-			|| !tab_room->selected_room) {
+		struct room *room = tab_room_shown_room(tab_room);
+
+		if (tab_room->widget != TAB_ROOM_MESSAGE_BUFFER || !room) {
 			return WIDGET_NOOP;
 		}
 
-		struct room *room = tab_room->selected_room->value;
-
 		pthread_mutex_lock(&room->realloc_or_modify_mutex);
 		ret = handle_message_buffer(&room->buffer, event);
 		pthread_mutex_unlock(&room->realloc_or_modify_mutex);
@@ -198,6 +516,11 @@ handle_tab_room(
 			}
 			break;
 		case TAB_ROOM_MESSAGE_BUFFER:
+			/* Back to the live timeline. */
+			if (event->key == TB_KEY_ESC && tab_room->window.room) {
+				tab_room_close_window(tab_room);
+				ret = WIDGET_REDRAW;
+			}
 			break;
 		default:
 			assert(0);
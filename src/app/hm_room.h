@@ -10,6 +10,10 @@ struct hm_room {
 };
 
 struct state_rooms {
+	/* Only the UI thread modifies the map and the children of it's rooms,
+	 * holding this for writing. Other threads hold it for reading while they
+	 * use them. */
+	pthread_rwlock_t lock;
 	struct hm_room *rooms;
 	/* Orphaned rooms/spaces without a parent space. */
 	struct hm_room *orphaned_rooms;
@@ -7,6 +7,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 void
 queue_item_free(struct queue_item *item) {
@@ -124,7 +125,61 @@ handle_login(struct state *state, void *data) {
 	free(access_token);
 }
 
+void
+search_results_free(struct search_results *results) {
+	if (results) {
+		free(results->query);
+		cache_search_hits_free(results->hits);
+		free(results);
+	}
+}
+
+/* Search the cache for the query off the UI thread, replacing any results
+ * that it didn't take yet. */
+static void
+handle_search(struct state *state, void *data) {
+	assert(state);
+	assert(data);
+
+	struct search_results *results = malloc(sizeof(*results));
+	struct cache_snapshot snapshot = {0};
+
+	if (!results) {
+		return;
+	}
+
+	*results = (struct search_results) {.query = strdup(data)};
+
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret == MDB_SUCCESS) {
+		/* Hits are copies, so they outlive the snapshot. */
+		ret = cache_search(&snapshot, data, SEARCH_MAX_HITS, &results->hits);
+		cache_snapshot_end(&snapshot);
+	}
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to search for '%s': %s", (char *) data,
+		  mdb_strerror(ret));
+	}
+
+	if (!results->query) {
+		search_results_free(results);
+		return;
+	}
+
+	pthread_mutex_lock(&state->search_mutex);
+	search_results_free(state->search_results);
+	state->search_results = results;
+	pthread_mutex_unlock(&state->search_mutex);
+
+	/* The UI thread takes the latest results once it's woken up. */
+	char wake = 0;
+	safe_write(state->search_pipe[PIPE_WRITE], &wake, sizeof(wake));
+}
+
 const struct queue_callback queue_callbacks[QUEUE_ITEM_MAX] = {
   [QUEUE_ITEM_MESSAGE] = {handle_sent_message, free_sent_message},
   [QUEUE_ITEM_LOGIN] = {		handle_login,			  free},
+  [QUEUE_ITEM_SEARCH] = {	  handle_search,			  free},
 };
@@ -17,6 +17,7 @@ struct queue_item {
 	enum queue_item_type {
 		QUEUE_ITEM_MESSAGE = 0,
 		QUEUE_ITEM_LOGIN,
+		QUEUE_ITEM_SEARCH,
 		QUEUE_ITEM_MAX
 	} type;
 	void *data;
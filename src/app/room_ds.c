@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 static int
 cmp_forward(const void *key, const void *array_item) {
@@ -40,18 +41,29 @@ cmp_backward(const void *key, const void *array_item) {
 	return 0; /* Equal. */
 }
 
+/* Free the body and sender, unless they are borrowed. */
+static void
+message_strings_finish(struct message *message) {
+	if (!message->borrowed) {
+		free(noconst(message->body));
+		free(noconst(message->sender));
+	}
+
+	message->body = message->sender = NULL;
+	message->borrowed = false;
+}
+
 static void
 message_destroy(struct message *message) {
 	if (message) {
-		arrfree(message->body);
-		free(message->sender);
+		message_strings_finish(message);
 		free(message);
 	}
 }
 
 static struct message * /* NOLINTNEXTLINE(readability-non-const-parameter) */
 message_alloc(const char *body, const char *sender, uint32_t *username,
-  uint64_t index, const uint64_t *index_reply, bool formatted) {
+  uint64_t index, const uint64_t *index_reply, bool formatted, bool borrow) {
 	assert(body);
 	assert(sender);
 	assert(username);
@@ -59,13 +71,14 @@ message_alloc(const char *body, const char *sender, uint32_t *username,
 	struct message *message = malloc(sizeof(*message));
 
 	if (message) {
-		*message = (struct message) {.formatted = formatted,
+		*message = (struct message) {.borrowed = borrow,
+		  .formatted = formatted,
 		  .reply = !!index_reply,
 		  .index = index,
 		  .index_reply = (index_reply ? *index_reply : 0),
 		  .username = username,
-		  .body = buf_to_uint32_t(body, 0),
-		  .sender = strdup(sender)};
+		  .body = borrow ? body : strdup(body),
+		  .sender = borrow ? sender : strdup(sender)};
 
 		if (!message->body || !message->sender) {
 			message_destroy(message);
@@ -76,6 +89,29 @@ message_alloc(const char *body, const char *sender, uint32_t *username,
 	return message;
 }
 
+/* Own copies of the strings of a borrowed message. */
+static int
+message_unborrow(struct message *message) {
+	if (!message->borrowed) {
+		return 0;
+	}
+
+	char *body = message->body ? strdup(message->body) : NULL;
+	char *sender = strdup(message->sender);
+
+	if ((message->body && !body) || !sender) {
+		free(body);
+		free(sender);
+		return -1;
+	}
+
+	message->body = body;
+	message->sender = sender;
+	message->borrowed = false;
+
+	return 0;
+}
+
 struct message *
 room_bsearch(struct room *room, uint64_t index) {
 	if (!room) {
@@ -125,15 +161,38 @@ room_remove_child(struct room *room, char *child) {
 	shdel(room->children, child);
 }
 
+bool
+room_has_member(struct room *room, char *mxid) {
+	assert(room);
+	assert(mxid);
+
+	ptrdiff_t tmp = 0;
+
+	return shgeti_ts(room->members, mxid, tmp) >= 0;
+}
+
 int
 room_put_member(struct room *room, char *mxid, char *username) {
 	assert(room);
 	assert(mxid);
 
 	/* If len < 1 then displayname has been removed. */
-	uint32_t *username_or_stripped_mxid
-	  = (username && (strnlen(username, 1)) > 0) ? buf_to_uint32_t(username, 0)
-												 : mxid_to_uint32_t(mxid);
+	return room_put_member_uint32(room, mxid,
+	  (username && (strnlen(username, 1)) > 0) ? buf_to_uint32_t(username, 0)
+											   : NULL);
+}
+
+int
+room_put_member_uint32(struct room *room, char *mxid, uint32_t *username) {
+	assert(room);
+	assert(mxid);
+
+	uint32_t *username_or_stripped_mxid = username;
+
+	if (arrlenu(username) == 0) {
+		arrfree(username);
+		username_or_stripped_mxid = mxid_to_uint32_t(mxid);
+	}
 
 	assert(username_or_stripped_mxid);
 
@@ -159,28 +218,12 @@ room_put_member(struct room *room, char *mxid, char *username) {
 	return 0;
 }
 
-static int
-room_put_message_event(struct room *room, enum timeline_type timeline,
-  uint64_t index, const struct matrix_timeline_event *event) {
+static void
+timeline_put(
+  struct room *room, enum timeline_type timeline, struct message *message) {
 	assert(room);
-	assert(event->base.sender);
-	assert(event->message.body);
-	assert(event->type == MATRIX_ROOM_MESSAGE);
 	assert(timeline < TIMELINE_MAX);
-	assert(!(room_bsearch(room, index)));
-
-	ptrdiff_t tmp = 0;
-	uint32_t **usernames = shget_ts(room->members, event->base.sender, tmp);
-	size_t usernames_len = arrlenu(usernames);
-
-	assert(usernames_len);
-
-	struct message *message = message_alloc(event->message.body,
-	  event->base.sender, usernames[usernames_len - 1], index, NULL, false);
-
-	if (!message) {
-		return -1;
-	}
+	assert(message);
 
 	/* We only lock if the message buffer actually needs to
 	 * grow. Otherwise, the reader thread has a length of the
@@ -212,6 +255,66 @@ room_put_message_event(struct room *room, enum timeline_type timeline,
 	}
 
 	room->timelines[timeline].len = len;
+}
+
+static int
+room_put_message_event(struct room *room, enum timeline_type timeline,
+  uint64_t index, const struct matrix_timeline_event *event, bool borrow) {
+	assert(room);
+	assert(event->base.sender);
+	assert(event->message.body);
+	assert(event->type == MATRIX_ROOM_MESSAGE);
+	assert(timeline < TIMELINE_MAX);
+	assert(!(room_bsearch(room, index)));
+
+	ptrdiff_t tmp = 0;
+	uint32_t **usernames = shget_ts(room->members, event->base.sender, tmp);
+	size_t usernames_len = arrlenu(usernames);
+
+	assert(usernames_len);
+
+	struct message *message = message_alloc(event->message.body,
+	  event->base.sender, usernames[usernames_len - 1], index, NULL, false,
+	  borrow);
+
+	if (!message) {
+		return -1;
+	}
+
+	timeline_put(room, timeline, message);
+
+	return 0;
+}
+
+int
+room_put_borrowed_message(struct room *room, const struct message *message) {
+	assert(room);
+	assert(message);
+	assert(message->body);
+	assert(message->sender);
+	assert(!message->redacted);
+	assert(!(room_bsearch(room, message->index)));
+
+	ptrdiff_t tmp = 0;
+	uint32_t **usernames
+	  = shget_ts(room->members, noconst(message->sender), tmp);
+	size_t usernames_len = arrlenu(usernames);
+
+	if (usernames_len == 0) {
+		return -1;
+	}
+
+	struct message *copy = malloc(sizeof(*copy));
+
+	if (!copy) {
+		return -1;
+	}
+
+	*copy = *message;
+	copy->borrowed = true;
+	copy->username = usernames[usernames_len - 1];
+
+	timeline_put(room, TIMELINE_BACKWARD, copy);
 
 	return 0;
 }
@@ -226,25 +329,103 @@ room_redact_event(struct room *room, uint64_t index) {
 		return -1;
 	}
 
+	/* The sender outlives the body, so it can't stay borrowed. */
+	char *sender = strdup(to_redact->sender);
+
+	if (!sender) {
+		return -1;
+	}
+
 	pthread_mutex_lock(&room->realloc_or_modify_mutex);
 	assert(!to_redact->redacted); /* Can't redact something we already did. */
 	assert(to_redact->body);
 	to_redact->redacted = true;
-	arrfree(to_redact->body);
-	to_redact->body = NULL;
+	message_strings_finish(to_redact);
+	to_redact->sender = sender;
 	message_buffer_redact(&room->buffer, index);
 	pthread_mutex_unlock(&room->realloc_or_modify_mutex);
 
 	return 0;
 }
 
+static bool
+is_edit(const struct matrix_timeline_event *event) {
+	return event->relation.rel_type
+		&& strcmp(event->relation.rel_type, "m.replace") == 0;
+}
+
+/* Edits have a fallback body prefixed with "* " for clients that don't
+ * support them. */
+static const char *
+strip_edit_fallback(const char *body) {
+	return strncmp(body, "* ", 2) == 0 ? &body[2] : body;
+}
+
+static int
+room_edit_message(struct room *room, uint64_t index, const char *body) {
+	assert(room);
+
+	struct message *to_edit = room_bsearch(room, index);
+
+	if (!to_edit || to_edit->redacted || !body) {
+		return -1;
+	}
+
+	char *new_body = strdup(strip_edit_fallback(body));
+	char *sender = strdup(to_edit->sender);
+
+	if (!new_body || !sender) {
+		free(new_body);
+		free(sender);
+		return -1;
+	}
+
+	pthread_mutex_lock(&room->realloc_or_modify_mutex);
+	message_strings_finish(to_edit);
+	to_edit->body = new_body;
+	to_edit->sender = sender;
+	to_edit->edited = true;
+
+	/* The rendered lines point into the old body, so everything is laid out
+	 * again on the next fill. */
+	for (size_t i = 0; i < TIMELINE_MAX; i++) {
+		room->timelines[i].consumed = 0;
+	}
+
+	message_buffer_zero(&room->buffer);
+	pthread_mutex_unlock(&room->realloc_or_modify_mutex);
+
+	return 0;
+}
+
 int
-room_put_event(struct room *room, const struct matrix_sync_event *event,
-  bool backward, uint64_t index, uint64_t redaction_index) {
+room_put_aggregation(struct room *room, uint64_t index,
+  const struct cache_aggregation *aggregation, const char *edit_body) {
+	assert(room);
+	assert(aggregation);
+
+	struct message *message = room_bsearch(room, index);
+
+	if (!message) {
+		return -1;
+	}
+
+	message->reactions = aggregation->annotations;
+
+	if (edit_body) {
+		return room_edit_message(room, index, edit_body);
+	}
+
+	return 0;
+}
+
+static int
+put_event(struct room *room, const struct matrix_sync_event *event,
+  bool backward, uint64_t index, uint64_t related_index, bool borrow) {
 	assert(room);
 	assert(event);
 
-	bool redaction_valid_if_present = false;
+	bool related_valid_if_present = false;
 
 	if (event->type == MATRIX_EVENT_STATE && !event->state.is_in_timeline) {
 		assert(index == (uint64_t) -1);
@@ -267,14 +448,26 @@ room_put_event(struct room *room, const struct matrix_sync_event *event,
 	case MATRIX_EVENT_TIMELINE:
 		switch (event->timeline.type) {
 		case MATRIX_ROOM_MESSAGE:
+			/* Edits replace the body of the original message, those loaded
+			 * from the cache are already applied by room_put_aggregation(). */
+			if (is_edit(&event->timeline)) {
+				if (related_index != (uint64_t) -1) {
+					related_valid_if_present
+					  = (room_edit_message(room, related_index,
+						   event->timeline.message.body)
+						 == 0);
+				}
+				break;
+			}
+
 			room_put_message_event(room,
 			  (backward ? TIMELINE_BACKWARD : TIMELINE_FORWARD), index,
-			  &event->timeline);
+			  &event->timeline, borrow);
 			break;
 		case MATRIX_ROOM_REDACTION:
-			if (redaction_index != (uint64_t) -1) {
-				redaction_valid_if_present
-				  = (room_redact_event(room, redaction_index) == 0);
+			if (related_index != (uint64_t) -1) {
+				related_valid_if_present
+				  = (room_redact_event(room, related_index) == 0);
 			}
 			break;
 		case MATRIX_ROOM_ATTACHMENT:
@@ -287,13 +480,92 @@ room_put_event(struct room *room, const struct matrix_sync_event *event,
 		assert(0);
 	}
 
-	if (redaction_index != (uint64_t) -1 && !redaction_valid_if_present) {
+	if (related_index != (uint64_t) -1 && !related_valid_if_present) {
 		return -1;
 	}
 
 	return 0;
 }
 
+int
+room_put_event(struct room *room, const struct matrix_sync_event *event,
+  bool backward, uint64_t index, uint64_t related_index) {
+	return put_event(room, event, backward, index, related_index, false);
+}
+
+int
+room_put_cached_event(
+  struct room *room, const struct cache_iterator_event *event) {
+	assert(event);
+
+	return put_event(
+	  room, &event->event, true, event->index, (uint64_t) -1, event->pinned);
+}
+
+/* Borrow the strings of the message from the stored event if it's content
+ * is the same, false otherwise. */
+static bool
+message_rebind(struct message *message, struct cache_snapshot *next,
+  const char *room_id) {
+	struct matrix_sync_event event = {0};
+
+	if (!next || message->redacted || message->edited
+		|| (cache_event_pinned(next, room_id, message->index, &event))
+			 != MDB_SUCCESS
+		|| event.type != MATRIX_EVENT_TIMELINE
+		|| event.timeline.type != MATRIX_ROOM_MESSAGE
+		|| !event.timeline.message.body || !event.timeline.base.sender) {
+		return false;
+	}
+
+	/* The page is shared by both snapshots if it wasn't written to, so it's
+	 * already borrowed from the next one. */
+	if (message->borrowed && event.timeline.message.body == message->body
+		&& event.timeline.base.sender == message->sender) {
+		return true;
+	}
+
+	if (strcmp(event.timeline.message.body, message->body) != 0
+		|| strcmp(event.timeline.base.sender, message->sender) != 0) {
+		return false;
+	}
+
+	message_strings_finish(message);
+	message->body = event.timeline.message.body;
+	message->sender = event.timeline.base.sender;
+	message->borrowed = true;
+
+	return true;
+}
+
+void
+room_rebind(
+  struct room *room, struct cache_snapshot *next, const char *room_id) {
+	assert(room);
+	assert(room_id);
+
+	pthread_mutex_lock(&room->realloc_or_modify_mutex);
+
+	for (size_t i = 0; i < TIMELINE_MAX; i++) {
+		struct timeline *timeline = &room->timelines[i];
+
+		for (size_t j = 0, len = timeline->len; j < len; j++) {
+			struct message *message = timeline->buf[j];
+
+			/* Messages copied from live events are borrowed once they are
+			 * stored, the rest are copied as the old snapshot is about to
+			 * end. */
+			if (!(message_rebind(message, next, room_id))) {
+				int ret = message_unborrow(message);
+				assert(ret == 0);
+				(void) ret;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&room->realloc_or_modify_mutex);
+}
+
 static void
 timeline_finish(struct timeline *timeline) {
 	if (timeline && timeline->buf) {
@@ -323,6 +595,95 @@ timeline_init(struct timeline *timeline) {
 	return -1;
 }
 
+void
+room_set_loaded(struct room *room, const struct room_info *info) {
+	assert(room);
+	assert(info);
+
+	/* Every event in the summary has a timestamp, an index of 0 would be
+	 * ambiguous without it. */
+	room->loaded_index
+	  = info->last_activity_ts > 0 ? info->last_index : (uint64_t) -1;
+	room->loaded = true;
+}
+
+bool
+room_wants_event(const struct room *room, uint64_t index) {
+	assert(room);
+
+	/* State events outside of the timeline have no index, they're applied
+	 * even if they were read when loading as that is harmless. */
+	return room->loaded
+		&& (index == (uint64_t) -1 || room->loaded_index == (uint64_t) -1
+			|| index > room->loaded_index);
+}
+
+/* Starting a thread costs more than converting the events of a few rooms. */
+enum { PUT_PARALLEL_MIN_ROOMS = 32 };
+
+struct put_saved_events {
+	struct saved_room *rooms;
+	size_t len;
+	/* Index of the next room, taken by each worker. */
+	_Atomic size_t next;
+};
+
+static void *
+put_saved_events(void *arg) {
+	struct put_saved_events *put = arg;
+	assert(put);
+
+	for (size_t i = 0; (i = put->next++) < put->len;) {
+		struct room *room = put->rooms[i].room;
+		struct saved_event *events = put->rooms[i].events;
+
+		pthread_mutex_lock(&room->load_mutex);
+
+		/* Events of rooms that aren't loaded yet are read back when they
+		 * are. */
+		for (size_t j = 0, len = arrlenu(events); j < len; j++) {
+			if (room_wants_event(room, events[j].index)) {
+				room_put_event(room, &events[j].event, false, events[j].index,
+				  events[j].related_index);
+			}
+		}
+
+		pthread_mutex_unlock(&room->load_mutex);
+	}
+
+	return NULL;
+}
+
+void
+rooms_put_saved_events(
+  struct saved_room *rooms, size_t len, unsigned workers) {
+	assert(rooms || len == 0);
+
+	struct put_saved_events put = {.rooms = rooms, .len = len};
+	pthread_t *threads = NULL;
+
+	/* The calling thread is one of the workers. */
+	for (size_t i = 1; len >= PUT_PARALLEL_MIN_ROOMS && i < workers && i < len;
+		 i++) {
+		pthread_t thread = 0;
+
+		/* The rooms are left to the workers that did start. */
+		if ((pthread_create(&thread, NULL, put_saved_events, &put)) != 0) {
+			break;
+		}
+
+		arrput(threads, thread);
+	}
+
+	put_saved_events(&put);
+
+	for (size_t i = 0, threads_len = arrlenu(threads); i < threads_len; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	arrfree(threads);
+}
+
 bool
 room_maybe_reset_and_fill_events(
   struct room *room, struct widget_points *points) {
@@ -400,6 +761,10 @@ room_alloc(struct room_info info) {
 	if (room) {
 		*room = (struct room) {
 		  .realloc_or_modify_mutex = PTHREAD_MUTEX_INITIALIZER,
+		  .load_mutex = PTHREAD_MUTEX_INITIALIZER,
+		  .members_mutex = PTHREAD_MUTEX_INITIALIZER,
+		  .loaded = true,
+		  .loaded_index = (uint64_t) -1,
 		  .info = info,
 		};
 
@@ -34,17 +34,21 @@ enum timeline_type {
 enum { TIMELINE_INITIAL_RESERVE = 50 };
 
 struct message {
-	bool edited;
+	/* The body and sender point into the pinned snapshot of the cache instead
+	 * of being owned, see room_rebind(). */
+	bool borrowed;
+	bool edited; /* The body is that of the latest edit. */
 	bool formatted;
 	bool redacted;
 	bool reply;
 	uint64_t index; /* Index from database. */
 	uint64_t
 	  index_reply; /* Index (from database) of the message being replied to. */
+	uint32_t reactions; /* Number of m.annotation events. */
 	/* Pointer to username at the current index from hashmap. */
 	uint32_t *username;
-	uint32_t *body; /* HTML, if formatted is true. */
-	char *sender;
+	const char *body; /* UTF-8, HTML if formatted is true. */
+	const char *sender;
 };
 
 struct timeline {
@@ -76,6 +80,38 @@ struct room {
 	/* Locked by reader for the whole duration of an iteration. Used to realloc
 	 * the message buffer or mark existing messages as edited/redacetd. */
 	pthread_mutex_t realloc_or_modify_mutex;
+	/* Rooms read on startup only have their info and children until they're
+	 * loaded from the cache, by the first thread to need them. Held by the
+	 * loader and by the syncer while adding events, so that they don't both
+	 * write to the room. Taken after beginning a cache snapshot and never
+	 * the other way around, as snapshots hold resize_lock for reading (see
+	 * struct cache) and a pending resize blocks new readers. */
+	pthread_mutex_t load_mutex;
+	bool loaded;
+	/* Events up to this index were read from the cache when loading, so the
+	 * syncer skips them. -1 if none were. */
+	uint64_t loaded_index;
+	/* Loading the room only loads the senders of it's timeline, the whole
+	 * member list is loaded in the background by a single thread holding
+	 * members_mutex. Members themselves are written under load_mutex. */
+	pthread_mutex_t members_mutex;
+	bool members_loaded;
+};
+
+/* An event saved in the cache, it's only added to it's room once the batch
+ * is committed. */
+struct saved_event {
+	struct matrix_sync_event event;
+	uint64_t index;
+	uint64_t related_index;
+};
+
+/* The saved events of a room in a single sync response. */
+struct saved_room {
+	struct room *room;
+	/* Borrowed from the response. */
+	const char *id;
+	struct saved_event *events;
 };
 
 struct message *
@@ -84,11 +120,49 @@ void
 room_add_child(struct room *room, char *child);
 void
 room_remove_child(struct room *room, char *child);
+bool
+room_has_member(struct room *room, char *mxid);
 int
 room_put_member(struct room *room, char *mxid, char *username);
+/* Takes ownership of username, an array of codepoints. */
+int
+room_put_member_uint32(struct room *room, char *mxid, uint32_t *username);
+/* related_index is the index of the redacted or edited message, if any.
+ * Returns -1 if that message isn't loaded. */
 int
 room_put_event(struct room *room, const struct matrix_sync_event *event,
-  bool backward, uint64_t index, uint64_t redaction_index);
+  bool backward, uint64_t index, uint64_t related_index);
+/* Backfill an event read from the cache, borrowing it's strings if they point
+ * into a pinned snapshot. */
+int
+room_put_cached_event(
+  struct room *room, const struct cache_iterator_event *event);
+/* Borrow the strings of every message from the next pinned snapshot, copying
+ * those that can't be referenced from it or all of them if next is NULL. */
+void
+room_rebind(
+  struct room *room, struct cache_snapshot *next, const char *room_id);
+/* Backfill a copy of message, it's body and sender are borrowed from memory
+ * that outlives the room. -1 if the sender isn't a member. */
+int
+room_put_borrowed_message(struct room *room, const struct message *message);
+/* Apply the relations aggregated by the cache to a loaded message. */
+int
+room_put_aggregation(struct room *room, uint64_t index,
+  const struct cache_aggregation *aggregation, const char *edit_body);
+/* Mark the room as loaded with the events summarized by info. */
+void
+room_set_loaded(struct room *room, const struct room_info *info);
+/* Whether the syncer must add an event that it saved at index, called with
+ * load_mutex held. */
+bool
+room_wants_event(const struct room *room, uint64_t index);
+/* Add the saved events that each room wants, holding it's load_mutex. The
+ * rooms are independent, so they're converted to messages by up to workers
+ * threads. The events of a room are added in order by a single thread. */
+void
+rooms_put_saved_events(
+  struct saved_room *rooms, size_t len, unsigned workers);
 bool
 room_maybe_reset_and_fill_events(
   struct room *room, struct widget_points *points);
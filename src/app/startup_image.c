@@ -0,0 +1,564 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "app/startup_image.h"
+
+#include "util/log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	IMAGE_VERSION = 2,
+	IMAGE_BYTE_ORDER = 0x01020304,
+	/* Every struct in the image starts at a multiple of this. */
+	IMAGE_ALIGN = 8,
+	/* As many as a room shows before it's scrolled. */
+	IMAGE_MAX_MESSAGES = 50,
+};
+
+enum image_message_flags {
+	IMAGE_MESSAGE_EDITED = 1 << 0,
+	IMAGE_MESSAGE_FORMATTED = 1 << 1,
+	IMAGE_MESSAGE_REPLY = 1 << 2,
+};
+
+static const char image_magic[8] = "MTUIIMG";
+
+/* Offsets are relative to the start of the image. The header is always at the
+ * start, so an offset of 0 is a NULL string. */
+struct image_header {
+	char magic[8];
+	uint32_t version;
+	/* The image is only read on the machine that wrote it. */
+	uint32_t byte_order;
+	uint64_t size;
+	uint64_t next_batch;
+	uint64_t rooms;
+	uint64_t num_rooms;
+};
+
+struct image_room {
+	uint64_t id;
+	uint64_t name;
+	uint64_t topic;
+	uint64_t last_activity_ts;
+	uint64_t last_index;
+	uint64_t members;
+	/* Offsets of the IDs. */
+	uint64_t children;
+	/* Descending indices, the order of a backfilled timeline. */
+	uint64_t messages;
+	uint32_t num_members;
+	uint32_t num_children;
+	uint32_t num_messages;
+	uint32_t member_count;
+	uint8_t invite;
+	uint8_t is_space;
+	/* Unloaded rooms only have their info and children. */
+	uint8_t loaded;
+	uint8_t padding[5];
+};
+
+struct image_member {
+	uint64_t mxid;
+	/* Codepoints of the latest username. */
+	uint64_t username;
+	uint64_t username_len;
+};
+
+struct image_message {
+	uint64_t index;
+	uint64_t index_reply;
+	uint64_t body;
+	uint64_t sender;
+	uint32_t reactions;
+	uint32_t flags;
+};
+
+/* The buffer moves as it grows, so structs are filled on the stack and copied
+ * to their offset. */
+struct image_writer {
+	char *buf;
+};
+
+/* Zeroed and aligned space for count structs of size. */
+static uint64_t
+writer_reserve(struct image_writer *writer, size_t count, size_t size) {
+	size_t offset = arrlenu(writer->buf);
+	size_t padding = (IMAGE_ALIGN - (offset % IMAGE_ALIGN)) % IMAGE_ALIGN;
+	size_t len = padding + (count * size);
+
+	if (len > 0) {
+		memset(arraddnptr(writer->buf, len), 0, len);
+	}
+
+	return offset + padding;
+}
+
+static uint64_t
+writer_str(struct image_writer *writer, const char *str) {
+	if (!str) {
+		return 0;
+	}
+
+	size_t offset = arrlenu(writer->buf);
+	size_t len = strlen(str) + 1;
+
+	memcpy(arraddnptr(writer->buf, len), str, len);
+
+	return offset;
+}
+
+static void
+writer_set(
+  struct image_writer *writer, uint64_t offset, const void *data, size_t size) {
+	assert((offset + size) <= arrlenu(writer->buf));
+
+	memcpy(&writer->buf[offset], data, size);
+}
+
+/* The latest messages of the room, newest first. */
+static size_t
+latest_messages(
+  struct room *room, struct message *messages[IMAGE_MAX_MESSAGES]) {
+	struct timeline *forward = &room->timelines[TIMELINE_FORWARD];
+	struct timeline *backward = &room->timelines[TIMELINE_BACKWARD];
+	size_t num = 0;
+
+	for (size_t i = forward->len; i > 0 && num < IMAGE_MAX_MESSAGES; i--) {
+		if (!forward->buf[i - 1]->redacted) {
+			messages[num++] = forward->buf[i - 1];
+		}
+	}
+
+	for (size_t i = 0, len = backward->len; i < len && num < IMAGE_MAX_MESSAGES;
+		 i++) {
+		if (!backward->buf[i]->redacted) {
+			messages[num++] = backward->buf[i];
+		}
+	}
+
+	return num;
+}
+
+static void
+write_members(struct image_writer *writer, struct image_room *image_room,
+  struct room *room) {
+	image_room->num_members = (uint32_t) shlenu(room->members);
+	image_room->members = writer_reserve(
+	  writer, image_room->num_members, sizeof(struct image_member));
+
+	for (size_t i = 0; i < image_room->num_members; i++) {
+		uint32_t **usernames = room->members[i].value;
+		size_t usernames_len = arrlenu(usernames);
+
+		assert(usernames_len);
+
+		uint32_t *username = usernames[usernames_len - 1];
+		struct image_member member = {
+		  .mxid = writer_str(writer, room->members[i].key),
+		  .username_len = arrlenu(username),
+		};
+
+		member.username
+		  = writer_reserve(writer, member.username_len, sizeof(*username));
+
+		if (member.username_len > 0) {
+			writer_set(writer, member.username, username,
+			  member.username_len * sizeof(*username));
+		}
+
+		writer_set(writer, image_room->members + (i * sizeof(member)), &member,
+		  sizeof(member));
+	}
+}
+
+static void
+write_room(struct image_writer *writer, uint64_t offset, const char *id,
+  struct room *room) {
+	struct image_room image_room = {
+	  .id = writer_str(writer, id),
+	  .name = writer_str(writer, room->info.name),
+	  .topic = writer_str(writer, room->info.topic),
+	  .last_activity_ts = room->info.last_activity_ts,
+	  .last_index = room->info.last_index,
+	  .member_count = room->info.member_count,
+	  .invite = room->info.invite,
+	  .is_space = room->info.is_space,
+	  .loaded = room->loaded,
+	};
+
+	if (room->loaded) {
+		write_members(writer, &image_room, room);
+	}
+
+	image_room.num_children = (uint32_t) shlenu(room->children);
+	image_room.children
+	  = writer_reserve(writer, image_room.num_children, sizeof(uint64_t));
+
+	for (size_t i = 0; i < image_room.num_children; i++) {
+		uint64_t child = writer_str(writer, room->children[i].key);
+
+		writer_set(writer, image_room.children + (i * sizeof(child)), &child,
+		  sizeof(child));
+	}
+
+	struct message *messages[IMAGE_MAX_MESSAGES];
+
+	image_room.num_messages
+	  = room->loaded ? (uint32_t) latest_messages(room, messages) : 0;
+	image_room.messages = writer_reserve(
+	  writer, image_room.num_messages, sizeof(struct image_message));
+
+	for (size_t i = 0; i < image_room.num_messages; i++) {
+		struct image_message message = {
+		  .index = messages[i]->index,
+		  .index_reply = messages[i]->index_reply,
+		  .body = writer_str(writer, messages[i]->body),
+		  .sender = writer_str(writer, messages[i]->sender),
+		  .reactions = messages[i]->reactions,
+		  .flags = (messages[i]->edited ? IMAGE_MESSAGE_EDITED : 0)
+				 | (messages[i]->formatted ? IMAGE_MESSAGE_FORMATTED : 0)
+				 | (messages[i]->reply ? IMAGE_MESSAGE_REPLY : 0),
+		};
+
+		writer_set(writer, image_room.messages + (i * sizeof(message)),
+		  &message, sizeof(message));
+	}
+
+	writer_set(writer, offset, &image_room, sizeof(image_room));
+}
+
+/* Written next to path and renamed over it, so a crash never leaves a partial
+ * image behind. */
+static int
+write_file(const char *path, const char *buf, size_t size) {
+	char *tmp_path = NULL;
+
+	if ((asprintf(&tmp_path, "%s.tmp", path)) == -1) {
+		return -1;
+	}
+
+	int ret = -1;
+	/* Messages are private. */
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	FILE *file = fd != -1 ? fdopen(fd, "wb") : NULL;
+
+	if (file) {
+		bool written = (fwrite(buf, 1, size, file)) == size;
+
+		if ((fclose(file)) == 0 && written && (rename(tmp_path, path)) == 0) {
+			ret = 0;
+		}
+	} else if (fd != -1) {
+		close(fd);
+	}
+
+	if (ret == -1) {
+		LOG(LOG_WARN, "Failed to write startup image '%s': %s", path,
+		  strerror(errno));
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+
+	return ret;
+}
+
+int
+startup_image_write(
+  struct state_rooms *state_rooms, const char *path, const char *next_batch) {
+	assert(state_rooms);
+	assert(path);
+	assert(next_batch);
+
+	struct image_writer writer = {0};
+	uint64_t header_offset
+	  = writer_reserve(&writer, 1, sizeof(struct image_header));
+
+	assert(header_offset == 0);
+	(void) header_offset;
+
+	struct image_header header = {
+	  .version = IMAGE_VERSION,
+	  .byte_order = IMAGE_BYTE_ORDER,
+	  .next_batch = writer_str(&writer, next_batch),
+	  .num_rooms = shlenu(state_rooms->rooms),
+	};
+
+	memcpy(header.magic, image_magic, sizeof(header.magic));
+	header.rooms
+	  = writer_reserve(&writer, header.num_rooms, sizeof(struct image_room));
+
+	for (size_t i = 0; i < header.num_rooms; i++) {
+		struct room *room = state_rooms->rooms[i].value;
+
+		/* Rooms might be loaded by other threads. */
+		pthread_mutex_lock(&room->load_mutex);
+		write_room(&writer, header.rooms + (i * sizeof(struct image_room)),
+		  state_rooms->rooms[i].key, room);
+		pthread_mutex_unlock(&room->load_mutex);
+	}
+
+	header.size = arrlenu(writer.buf);
+	writer_set(&writer, 0, &header, sizeof(header));
+
+	int ret = write_file(path, writer.buf, header.size);
+
+	arrfree(writer.buf);
+
+	return ret;
+}
+
+static const void *
+image_at(const struct startup_image *image, uint64_t offset) {
+	return &((const char *) image->map)[offset];
+}
+
+/* NULL unless a NUL-terminated string is at offset. */
+static const char *
+image_str(const struct startup_image *image, uint64_t offset) {
+	if (offset == 0 || offset >= image->size) {
+		return NULL;
+	}
+
+	const char *str = image_at(image, offset);
+
+	return (memchr(str, '\0', image->size - offset)) ? str : NULL;
+}
+
+static bool
+image_array_valid(const struct startup_image *image, uint64_t offset,
+  uint64_t count, size_t size) {
+	return (offset % IMAGE_ALIGN) == 0 && offset <= image->size
+		&& count <= ((image->size - offset) / size);
+}
+
+/* Every offset is checked once after mapping, so populating can trust them. */
+static bool
+room_valid(const struct startup_image *image, const struct image_room *room) {
+	if (!(image_str(image, room->id))
+		|| (room->name && !(image_str(image, room->name)))
+		|| (room->topic && !(image_str(image, room->topic)))
+		|| !(image_array_valid(
+		  image, room->members, room->num_members, sizeof(struct image_member)))
+		|| !(image_array_valid(
+		  image, room->children, room->num_children, sizeof(uint64_t)))
+		|| !(image_array_valid(image, room->messages, room->num_messages,
+		  sizeof(struct image_message)))) {
+		return false;
+	}
+
+	const struct image_member *members = image_at(image, room->members);
+
+	for (size_t i = 0; i < room->num_members; i++) {
+		if (!(image_str(image, members[i].mxid))
+			|| !(image_array_valid(image, members[i].username,
+			  members[i].username_len, sizeof(uint32_t)))) {
+			return false;
+		}
+	}
+
+	const uint64_t *children = image_at(image, room->children);
+
+	for (size_t i = 0; i < room->num_children; i++) {
+		if (!(image_str(image, children[i]))) {
+			return false;
+		}
+	}
+
+	const struct image_message *messages = image_at(image, room->messages);
+
+	for (size_t i = 0; i < room->num_messages; i++) {
+		if (!(image_str(image, messages[i].body))
+			|| !(image_str(image, messages[i].sender))
+			|| (i > 0 && messages[i].index >= messages[i - 1].index)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+image_valid(const struct startup_image *image) {
+	const struct image_header *header = image->map;
+
+	if ((memcmp(header->magic, image_magic, sizeof(header->magic))) != 0
+		|| header->version != IMAGE_VERSION
+		|| header->byte_order != IMAGE_BYTE_ORDER
+		|| header->size != image->size
+		|| !(image_str(image, header->next_batch))
+		|| !(image_array_valid(image, header->rooms, header->num_rooms,
+		  sizeof(struct image_room)))) {
+		return false;
+	}
+
+	const struct image_room *rooms = image_at(image, header->rooms);
+
+	for (size_t i = 0; i < header->num_rooms; i++) {
+		if (!(room_valid(image, &rooms[i]))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int
+startup_image_map(
+  struct startup_image *image, const char *path, const char *next_batch) {
+	assert(image);
+	assert(path);
+	assert(next_batch);
+
+	*image = (struct startup_image) {0};
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat st = {0};
+	void *map = MAP_FAILED;
+
+	if ((fstat(fd, &st)) == 0
+		&& st.st_size >= (off_t) sizeof(struct image_header)) {
+		map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		LOG(LOG_WARN, "Failed to map startup image '%s'", path);
+		return -1;
+	}
+
+	*image = (struct startup_image) {.map = map, .size = (size_t) st.st_size};
+
+	if (!(image_valid(image))) {
+		LOG(LOG_WARN, "Ignoring corrupt startup image '%s'", path);
+	} else if ((strcmp(image_str(image,
+				  ((const struct image_header *) image->map)->next_batch),
+				 next_batch))
+			   != 0) {
+		LOG(LOG_MESSAGE, "Ignoring stale startup image '%s'", path);
+	} else {
+		return 0;
+	}
+
+	startup_image_finish(image);
+
+	return -1;
+}
+
+static struct room *
+populate_room(
+  const struct startup_image *image, const struct image_room *image_room) {
+	const char *name = image_str(image, image_room->name);
+	const char *topic = image_str(image, image_room->topic);
+
+	struct room *room = room_alloc((struct room_info) {
+	  .invite = image_room->invite,
+	  .is_space = image_room->is_space,
+	  .name = name ? strdup(name) : NULL,
+	  .topic = topic ? strdup(topic) : NULL,
+	  .member_count = image_room->member_count,
+	  .last_activity_ts = image_room->last_activity_ts,
+	  .last_index = image_room->last_index,
+	});
+
+	assert(room);
+
+	const struct image_member *members = image_at(image, image_room->members);
+
+	for (size_t i = 0; i < image_room->num_members; i++) {
+		size_t len = (size_t) members[i].username_len;
+		uint32_t *username = NULL;
+
+		if (len > 0) {
+			arrsetlen(username, len);
+			assert(username);
+			memcpy(username, image_at(image, members[i].username),
+			  len * sizeof(*username));
+		}
+
+		int ret = room_put_member_uint32(
+		  room, noconst(image_str(image, members[i].mxid)), username);
+
+		assert(ret == 0);
+		(void) ret;
+	}
+
+	const uint64_t *children = image_at(image, image_room->children);
+
+	for (size_t i = 0; i < image_room->num_children; i++) {
+		room_add_child(room, noconst(image_str(image, children[i])));
+	}
+
+	const struct image_message *messages
+	  = image_at(image, image_room->messages);
+
+	for (size_t i = 0; i < image_room->num_messages; i++) {
+		struct message message = {
+		  .edited = messages[i].flags & IMAGE_MESSAGE_EDITED,
+		  .formatted = messages[i].flags & IMAGE_MESSAGE_FORMATTED,
+		  .reply = messages[i].flags & IMAGE_MESSAGE_REPLY,
+		  .index = messages[i].index,
+		  .index_reply = messages[i].index_reply,
+		  .reactions = messages[i].reactions,
+		  .body = image_str(image, messages[i].body),
+		  .sender = image_str(image, messages[i].sender),
+		};
+
+		/* Senders that left aren't members. */
+		room_put_borrowed_message(room, &message);
+	}
+
+	/* The image was written at the token that the cache is at. */
+	if (image_room->loaded) {
+		room_set_loaded(room, &room->info);
+	} else {
+		room->loaded = false;
+	}
+
+	return room;
+}
+
+void
+startup_image_populate(
+  struct startup_image *image, struct state_rooms *state_rooms) {
+	assert(image);
+	assert(image->map);
+	assert(state_rooms);
+
+	const struct image_header *header = image->map;
+	const struct image_room *rooms = image_at(image, header->rooms);
+
+	for (size_t i = 0; i < header->num_rooms; i++) {
+		char *id = noconst(image_str(image, rooms[i].id));
+
+		/* Only possible if the image was tampered with. */
+		if (rooms_get_room(state_rooms->rooms, id)) {
+			continue;
+		}
+
+		shput(state_rooms->rooms, id, populate_room(image, &rooms[i]));
+	}
+}
+
+void
+startup_image_finish(struct startup_image *image) {
+	if (image && image->map) {
+		munmap(image->map, image->size);
+		*image = (struct startup_image) {0};
+	}
+}
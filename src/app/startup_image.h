@@ -0,0 +1,34 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "app/hm_room.h"
+
+/* Flat image of the loaded rooms, written on shutdown and periodically so
+ * that the next startup can map it instead of reading every room back from
+ * the cache. It only stores offsets, so it's usable wherever it's mapped.
+ *
+ * The image is tagged with the next_batch token that the rooms reflect, it's
+ * stale if the cache has moved past it. */
+struct startup_image {
+	/* Mapped read-only, the messages loaded from the image borrow their
+	 * strings from it so it must outlive the rooms. */
+	void *map;
+	size_t size;
+};
+
+/* Replace the image at path atomically, an image that's already mapped stays
+ * valid. Only their loaders may modify the rooms while they're written. */
+int
+startup_image_write(
+  struct state_rooms *state_rooms, const char *path, const char *next_batch);
+/* Map and validate the image at path, -1 if it's missing, corrupt or wasn't
+ * written at next_batch. */
+int
+startup_image_map(
+  struct startup_image *image, const char *path, const char *next_batch);
+/* Allocate the rooms of a mapped image. */
+void
+startup_image_populate(
+  struct startup_image *image, struct state_rooms *state_rooms);
+void
+startup_image_finish(struct startup_image *image);
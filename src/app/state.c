@@ -5,6 +5,17 @@
 #include "util/log.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+
+enum {
+	/* Latest events loaded with a room. */
+	NUM_PAGINATE = 50,
+	/* Events loaded on either side of the one a window is opened at. */
+	WINDOW_NUM_BEFORE = 50,
+	WINDOW_NUM_AFTER = 50,
+};
 
 void
 state_reset_orphans(struct state_rooms *state_rooms) {
@@ -66,8 +77,8 @@ handle_accumulated_sync(struct state_rooms *state_rooms,
 
 		if (!(rooms_get_room(state_rooms->rooms, room->id))) {
 			any_tree_changes = true; /* New room added */
-			/* This doesn't need locking as the syncer thread waits until
-			 * we use all the accumulated data (this function). */
+			/* The caller holds the lock for writing. */
+			assert(room->is_new);
 			shput(state_rooms->rooms, room->id, room->room);
 		}
 
@@ -110,20 +121,114 @@ handle_accumulated_sync(struct state_rooms *state_rooms,
 	return any_tree_changes || any_room_events;
 }
 
-static int
-populate_room_users(struct state *state, const char *room_id) {
+bool
+state_handle_sync(struct state *state, struct tab_room *tab_room,
+  struct accumulated_sync_data *data) {
 	assert(state);
+	assert(tab_room);
+	assert(data);
+
+	pthread_rwlock_wrlock(&state->state_rooms.lock);
+
+	bool redraw = handle_accumulated_sync(&state->state_rooms, tab_room, data);
+
+	/* The rooms now reflect this sync, unless it's only part of one. */
+	if (data->next_batch) {
+		free(state->next_batch);
+		state->next_batch = data->next_batch;
+		data->next_batch = NULL;
+	}
+
+	pthread_rwlock_unlock(&state->state_rooms.lock);
+
+	accumulated_sync_free(data, true);
+
+	pthread_mutex_lock(&state->sync_mutex);
+	assert(state->syncs_queued > 0);
+	state->syncs_queued--;
+	pthread_cond_signal(&state->sync_cond);
+	pthread_mutex_unlock(&state->sync_mutex);
+
+	return redraw;
+}
+
+void
+accumulated_sync_free(struct accumulated_sync_data *data, bool handled) {
+	if (!data) {
+		return;
+	}
+
+	for (size_t i = 0, len = arrlenu(data->rooms); i < len; i++) {
+		if (!handled && data->rooms[i].is_new) {
+			room_destroy(data->rooms[i].room);
+		}
+
+		free(data->rooms[i].id);
+	}
+
+	for (size_t i = 0, len = arrlenu(data->space_events); i < len; i++) {
+		free(data->space_events[i].parent);
+		free(data->space_events[i].child);
+	}
+
+	arrfree(data->rooms);
+	arrfree(data->space_events);
+	free(data->next_batch);
+	free(data);
+}
+
+static char *
+event_sender(const struct matrix_sync_event *event) {
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		return event->state.base.sender;
+	case MATRIX_EVENT_TIMELINE:
+		return event->timeline.base.sender;
+	default:
+		return NULL;
+	}
+}
+
+/* Load a single member from the displayname projection so that events can be
+ * rendered without loading the whole member list of huge rooms. */
+static void
+ensure_member(struct room *room, struct cache_snapshot *snapshot,
+  const char *room_id, char *mxid) {
+	assert(room);
+	assert(snapshot);
 	assert(room_id);
 
-	struct cache_iterator iterator = {0};
+	if (!mxid || room_has_member(room, mxid)) {
+		return;
+	}
 
-	struct room *room
-	  = rooms_get_room(state->state_rooms.rooms, noconst(room_id));
 	struct cache_iterator_member member = {0};
 
+	int ret = cache_member_get(snapshot, room_id, mxid, &member);
+
+	if (ret != MDB_SUCCESS && ret != MDB_NOTFOUND) {
+		LOG(LOG_WARN, "Failed to get member '%s' of room '%s': %s", mxid,
+		  room_id, mdb_strerror(ret));
+	}
+
+	/* Unknown members are shown by their stripped mxid. */
+	room_put_member(room, mxid, ret == MDB_SUCCESS ? member.username : NULL);
+}
+
+/* Takes the load_mutex for each member rather than for the whole list, so
+ * that selecting the room or adding synced events doesn't wait for the
+ * members of huge rooms. */
+static int
+populate_room_users(struct room *room, struct cache_snapshot *snapshot,
+  const char *room_id) {
 	assert(room);
+	assert(snapshot);
+	assert(room_id);
 
-	int ret = cache_iterator_member(&state->cache, &iterator, room_id, &member);
+	struct cache_iterator iterator = {0};
+	struct cache_iterator_member member = {0};
+
+	int ret = cache_iterator_member(snapshot, &iterator, room_id, &member);
 
 	if (ret != MDB_SUCCESS) {
 		LOG(LOG_ERROR, "Failed to create member iterator for room '%s': %s",
@@ -132,7 +237,14 @@ populate_room_users(struct state *state, const char *room_id) {
 	}
 
 	while ((cache_iterator_next(&iterator)) == MDB_SUCCESS) {
-		room_put_member(room, member.mxid, member.username);
+		pthread_mutex_lock(&room->load_mutex);
+
+		/* Already loaded along with the timeline, or newer from a sync. */
+		if (!room_has_member(room, member.mxid)) {
+			room_put_member(room, member.mxid, member.username);
+		}
+
+		pthread_mutex_unlock(&room->load_mutex);
 	}
 
 	cache_iterator_finish(&iterator);
@@ -140,25 +252,19 @@ populate_room_users(struct state *state, const char *room_id) {
 	return 0;
 }
 
+/* Load num_fetch events ending at end_index, along with their senders. */
 static int
-populate_room_from_cache(struct state *state, const char *room_id) {
-	assert(state);
+populate_room_from_cache(struct room *room, struct cache_snapshot *snapshot,
+  const char *room_id, uint64_t end_index, uint64_t num_fetch) {
+	assert(room);
+	assert(snapshot);
 	assert(room_id);
 
 	struct cache_iterator iterator = {0};
-
-	populate_room_users(state, room_id);
-
-	struct room *room
-	  = rooms_get_room(state->state_rooms.rooms, noconst(room_id));
 	struct cache_iterator_event event = {0};
 
-	assert(room);
-
-	const uint64_t num_paginate = 50;
-
-	int ret = cache_iterator_events(&state->cache, &iterator, room_id, &event,
-	  (uint64_t) -1, num_paginate, EVENTS_IN_TIMELINE, STATE_IN_TIMELINE);
+	int ret = cache_iterator_events(snapshot, &iterator, room_id, &event,
+	  end_index, num_fetch, EVENTS_IN_TIMELINE, STATE_IN_TIMELINE);
 
 	if (ret != MDB_SUCCESS) {
 		LOG(LOG_ERROR, "Failed to create events iterator for room '%s': %s",
@@ -170,7 +276,14 @@ populate_room_from_cache(struct state *state, const char *room_id) {
 		struct matrix_sync_event *sync_event = &event.event;
 		assert(sync_event->type != MATRIX_EVENT_EPHEMERAL);
 
-		room_put_event(room, sync_event, true, event.index, (uint64_t) -1);
+		ensure_member(room, snapshot, room_id, event_sender(sync_event));
+
+		room_put_cached_event(room, &event);
+
+		if (event.edit_body || event.aggregation.annotations > 0) {
+			room_put_aggregation(
+			  room, event.index, &event.aggregation, event.edit_body);
+		}
 	}
 
 	cache_iterator_finish(&iterator);
@@ -178,49 +291,342 @@ populate_room_from_cache(struct state *state, const char *room_id) {
 	return ret;
 }
 
+int
+state_load_room(struct state *state, const char *room_id, struct room *room) {
+	assert(state);
+	assert(room_id);
+	assert(room);
+
+	struct cache_snapshot snapshot = {0};
+	struct room_info info = {0};
+
+	/* The snapshot is begun before taking load_mutex, like the syncer does,
+	 * as it holds off resizing the map until it ends. */
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
+		return -1;
+	}
+
+	pthread_mutex_lock(&room->load_mutex);
+
+	if (room->loaded) {
+		pthread_mutex_unlock(&room->load_mutex);
+		cache_snapshot_end(&snapshot);
+		return 0;
+	}
+
+	/* The summary tells which events the snapshot has. Only the senders of
+	 * the timeline are loaded, state_load_members loads the rest. */
+	if ((ret = cache_room_info_init(&snapshot, &info, room_id))
+		  == MDB_SUCCESS
+		&& (ret = populate_room_from_cache(
+			  room, &snapshot, room_id, (uint64_t) -1, NUM_PAGINATE))
+			 == MDB_SUCCESS) {
+		room_set_loaded(room, &info);
+	} else {
+		LOG(LOG_ERROR, "Failed to load room '%s': %s", room_id,
+		  mdb_strerror(ret));
+	}
+
+	bool loaded = room->loaded;
+
+	pthread_mutex_unlock(&room->load_mutex);
+
+	cache_room_info_finish(&info);
+	cache_snapshot_end(&snapshot);
+
+	return loaded ? 0 : -1;
+}
+
+struct room *
+state_load_window(struct state *state, const char *room_id, uint64_t index) {
+	assert(state);
+	assert(room_id);
+
+	struct cache_snapshot snapshot = {0};
+
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
+		return NULL;
+	}
+
+	/* Indices are contiguous, the iterator starts at the last event if there
+	 * are fewer events after index. */
+	uint64_t end_index = index < (UINT64_MAX - WINDOW_NUM_AFTER)
+						 ? index + WINDOW_NUM_AFTER
+						 : (uint64_t) -1;
+
+	struct room *window = room_alloc((struct room_info) {0});
+
+	/* Only the UI thread knows about it, the syncer doesn't add to it. */
+	if (window
+		&& (ret = populate_room_from_cache(window, &snapshot, room_id,
+			  end_index, WINDOW_NUM_BEFORE + WINDOW_NUM_AFTER))
+			 != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to load window of room '%s': %s", room_id,
+		  mdb_strerror(ret));
+		room_destroy(window);
+		window = NULL;
+	}
+
+	cache_snapshot_end(&snapshot);
+
+	return window;
+}
+
+int
+state_load_members(struct state *state, const char *room_id,
+  struct room *room) {
+	assert(state);
+	assert(room_id);
+	assert(room);
+
+	pthread_mutex_lock(&room->members_mutex);
+
+	if (room->members_loaded) {
+		pthread_mutex_unlock(&room->members_mutex);
+		return 0;
+	}
+
+	struct cache_snapshot snapshot = {0};
+
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
+		pthread_mutex_unlock(&room->members_mutex);
+		return -1;
+	}
+
+	if ((ret = populate_room_users(room, &snapshot, room_id)) == MDB_SUCCESS) {
+		room->members_loaded = true;
+	}
+
+	cache_snapshot_end(&snapshot);
+
+	pthread_mutex_unlock(&room->members_mutex);
+
+	return room->members_loaded ? 0 : -1;
+}
+
+static int
+cmp_last_activity(const void *a, const void *b) {
+	uint64_t first = ((const struct hm_room *) a)->value->info.last_activity_ts;
+	uint64_t second
+	  = ((const struct hm_room *) b)->value->info.last_activity_ts;
+
+	/* Descending. */
+	return (first < second) - (first > second);
+}
+
+/* Rooms that weren't loaded on startup and the member lists of all rooms are
+ * loaded in the background, the most recently active first. */
+static void
+prefetch_init(struct state *state) {
+	for (size_t i = 0, len = shlenu(state->state_rooms.rooms); i < len; i++) {
+		arrput(state->prefetch, state->state_rooms.rooms[i]);
+	}
+
+	if (arrlenu(state->prefetch) > 1) {
+		qsort(state->prefetch, arrlenu(state->prefetch),
+		  sizeof(*state->prefetch), cmp_last_activity);
+	}
+}
+
+/* Called from the thread that renews the pin, the writer thread once syncing
+ * has started. */
+static void
+rebind_rooms(struct cache_snapshot *next, void *userp) {
+	struct state *state = userp;
+	assert(state);
+
+	/* Rooms that aren't published yet only have messages from sync, which
+	 * are never borrowed before they're rebound. */
+	pthread_rwlock_rdlock(&state->state_rooms.lock);
+
+	for (size_t i = 0, len = shlenu(state->state_rooms.rooms); i < len; i++) {
+		room_rebind(state->state_rooms.rooms[i].value, next,
+		  state->state_rooms.rooms[i].key);
+	}
+
+	pthread_rwlock_unlock(&state->state_rooms.lock);
+}
+
+/* Called by a thread that waits for the pinned snapshot to grow or compact the
+ * map, as the writer might not get another sync for a while. */
+static void
+wake_writer(void *userp) {
+	struct state *state = userp;
+	assert(state);
+
+	pthread_mutex_lock(&state->writer.mutex);
+	state->writer.release_pin = true;
+	pthread_cond_broadcast(&state->writer.cond);
+	pthread_mutex_unlock(&state->writer.mutex);
+}
+
+static uint64_t
+ms_since(const struct timespec *start) {
+	const uint64_t ms_in_sec = 1000;
+	const long ns_in_ms = 1000000;
+
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (((uint64_t) (now.tv_sec - start->tv_sec)) * ms_in_sec)
+		 + (uint64_t) ((now.tv_nsec - start->tv_nsec) / ns_in_ms);
+}
+
+/* The image is only kept next to a cache that outlives the process. */
+static char *
+image_path(struct state *state) {
+	char *path = NULL;
+
+	if (state->image_interval_ms == 0 || !state->cache.backend->durable
+		|| (asprintf(&path, "%s/startup.img", state->cache.dir)) == -1) {
+		return NULL;
+	}
+
+	return path;
+}
+
+/* Map the rooms written on the last run if the cache didn't move past them. */
+static int
+populate_from_image(struct state *state) {
+	char *path = image_path(state);
+	int ret = -1;
+
+	if (path && state->next_batch
+		&& (startup_image_map(&state->image, path, state->next_batch)) == 0) {
+		startup_image_populate(&state->image, &state->state_rooms);
+		LOG(LOG_MESSAGE, "Loaded %zu rooms from startup image '%s'",
+		  shlenu(state->state_rooms.rooms), path);
+		ret = 0;
+	}
+
+	free(path);
+
+	return ret;
+}
+
+void
+state_write_image(struct state *state) {
+	assert(state);
+
+	char *path = image_path(state);
+
+	clock_gettime(CLOCK_MONOTONIC, &state->image_written);
+
+	/* Queued syncs were already added to the rooms, but their token wasn't
+	 * handled yet. */
+	pthread_mutex_lock(&state->sync_mutex);
+	bool caught_up = state->syncs_queued == 0;
+	pthread_mutex_unlock(&state->sync_mutex);
+
+	pthread_rwlock_rdlock(&state->state_rooms.lock);
+
+	if (path && state->next_batch && caught_up) {
+		struct timespec start = {0};
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		if ((startup_image_write(&state->state_rooms, path, state->next_batch))
+			== 0) {
+			LOG(LOG_MESSAGE, "Wrote startup image '%s' in %" PRIu64 "ms", path,
+			  ms_since(&start));
+		}
+	}
+
+	pthread_rwlock_unlock(&state->state_rooms.lock);
+
+	free(path);
+}
+
 int
 populate_from_cache(struct state *state) {
 	assert(state);
 
+	clock_gettime(CLOCK_MONOTONIC, &state->image_written);
+	state->next_batch = cache_auth_get(&state->cache, DB_KEY_NEXT_BATCH);
+
+	struct cache_snapshot snapshot = {0};
 	struct cache_iterator iterator = {0};
 	const char *id = NULL;
 
-	int ret = cache_iterator_rooms(&state->cache, &iterator, &id);
+	/* The room list is read from a single txn, which stays open with zero
+	 * copy. Messages loaded later borrow from it once it's renewed. Ending a
+	 * pinned snapshot is a no-op. */
+	int ret = ENOTSUP;
+
+	if (state->zero_copy
+		&& (ret = cache_pin_begin(
+			  &state->cache, rebind_rooms, wake_writer, state, &snapshot))
+			 == ENOTSUP) {
+		LOG(LOG_WARN, "Zero copy isn't supported by the '%s' backend",
+		  state->cache.backend->name);
+		state->zero_copy = false;
+	}
+
+	if (ret == ENOTSUP) {
+		ret = cache_snapshot_begin(&state->cache, &snapshot);
+	}
 
 	if (ret != MDB_SUCCESS) {
-		LOG(LOG_ERROR, "Failed to create room iterator: %s", mdb_strerror(ret));
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
 		return -1;
 	}
 
-	while ((cache_iterator_next(&iterator)) == MDB_SUCCESS) {
-		assert(id);
+	/* Ending a pinned snapshot is a no-op, the pin is still renewed on every
+	 * sync. */
+	if ((populate_from_image(state)) == 0) {
+		cache_snapshot_end(&snapshot);
+		state_reset_orphans(&state->state_rooms);
+		prefetch_init(state);
 
-		struct room_info info = {0};
+		return 0;
+	}
 
-		if ((ret = cache_room_info_init(&state->cache, &info, id))
-			!= MDB_SUCCESS) {
-			LOG(LOG_ERROR, "Failed to get room info for room '%s': %s", id,
-			  mdb_strerror(ret));
-			cache_iterator_finish(&iterator);
+	struct room_info info = {0};
 
-			return -1;
-		}
+	/* The room info is read from the summary stored with each room. */
+	ret = cache_iterator_rooms(&snapshot, &iterator, &id, &info);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to create room iterator: %s", mdb_strerror(ret));
+		cache_snapshot_end(&snapshot);
+		return -1;
+	}
+
+	while ((ret = cache_iterator_next(&iterator)) == MDB_SUCCESS) {
+		assert(id);
 
 		struct room *room = room_alloc(info);
 		assert(room);
 
+		/* Only the room list is needed to show the UI. */
+		room->loaded = false;
 		shput(state->state_rooms.rooms, noconst(id), room);
-		populate_room_from_cache(state, id);
 	}
 
 	cache_iterator_finish(&iterator);
 
+	if (ret != MDB_NOTFOUND) {
+		LOG(LOG_ERROR, "Failed to get room info: %s", mdb_strerror(ret));
+		cache_snapshot_end(&snapshot);
+
+		return -1;
+	}
+
 	struct cache_iterator_space space = {0};
-	ret = cache_iterator_spaces(&state->cache, &iterator, &space);
+	ret = cache_iterator_spaces(&snapshot, &iterator, &space);
 
 	if (ret != MDB_SUCCESS) {
 		LOG(
 		  LOG_ERROR, "Failed to create spaces iterator: %s", mdb_strerror(ret));
+		cache_snapshot_end(&snapshot);
 		return -1;
 	}
 
@@ -265,30 +671,366 @@ populate_from_cache(struct state *state) {
 	}
 
 	cache_iterator_finish(&iterator);
+	cache_snapshot_end(&snapshot);
 
 	state_reset_orphans(&state->state_rooms);
+	prefetch_init(state);
 
 	return 0;
 }
 
+/* An event parsed by the syncer thread, the writer thread stores whether it
+ * was saved along with it's indices. */
+struct sync_write_event {
+	struct matrix_sync_event event;
+	enum cache_save_error status;
+	uint64_t index;
+	uint64_t related_index;
+};
+
+/* A room handed to the writer thread, it's only touched by the syncer thread
+ * again once the response is committed. */
+struct sync_write_room {
+	struct matrix_room room;
+	struct sync_write_event *events;
+	bool saved;
+};
+
+struct saved_sync {
+	/* Passed to the UI thread once the events are added. */
+	struct accumulated_sync_data *data;
+	/* The rooms in the order they were parsed. */
+	struct sync_write_room **rooms;
+	/* The saved events grouped by room, as a room might appear more than
+	 * once in a response. */
+	struct saved_room *saved_rooms;
+	/* Indices into data->rooms of rooms that were allocated in this sync. */
+	size_t *new_rooms;
+};
+
+/* Destroys the rooms allocated by the sync, unless it was passed on. */
+static void
+saved_sync_finish(struct state *state, struct saved_sync *saved) {
+	assert(state);
+	assert(saved);
+
+	for (size_t i = 0, len = arrlenu(saved->new_rooms); saved->data && i < len;
+		 i++) {
+		shdel(state->unpublished_rooms,
+		  saved->data->rooms[saved->new_rooms[i]].id);
+	}
+
+	for (size_t i = 0, len = arrlenu(saved->rooms); i < len; i++) {
+		arrfree(saved->rooms[i]->events);
+		free(saved->rooms[i]);
+	}
+
+	for (size_t i = 0, len = arrlenu(saved->saved_rooms); i < len; i++) {
+		arrfree(saved->saved_rooms[i].events);
+	}
+
+	accumulated_sync_free(saved->data, false);
+	arrfree(saved->rooms);
+	arrfree(saved->saved_rooms);
+	arrfree(saved->new_rooms);
+
+	memset(saved, 0, sizeof(*saved));
+}
+
+/* Rooms of queued syncs are found before the UI thread adds them. */
+static struct room *
+sync_get_room(struct state *state, char *id) {
+	pthread_rwlock_rdlock(&state->state_rooms.lock);
+	struct room *room = rooms_get_room(state->state_rooms.rooms, id);
+	pthread_rwlock_unlock(&state->state_rooms.lock);
+
+	if (room) {
+		shdel(state->unpublished_rooms, id);
+		return room;
+	}
+
+	return rooms_get_room(state->unpublished_rooms, id);
+}
+
+static void
+write_room(struct cache_batch *batch, struct sync_write_room *room,
+  struct cache_deferred_space_event **deferred_events) {
+	assert(batch);
+	assert(room);
+
+	struct cache_save_txn txn = {0};
+	cache_save_txn_init(batch, &txn, room->room.id);
+
+	int ret = MDB_SUCCESS;
+
+	if ((ret = cache_save_txn_room(&txn, &room->room)) != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to look up room '%s': %s", room->room.id,
+		  mdb_strerror(ret));
+		cache_save_txn_finish(&txn);
+		return;
+	}
+
+	if ((ret = cache_save_room(&txn, &room->room)) != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to save room '%s': %s", room->room.id,
+		  mdb_strerror(ret));
+		cache_save_txn_finish(&txn);
+		return;
+	}
+
+	for (size_t i = 0, len = arrlenu(room->events); i < len; i++) {
+		struct sync_write_event *event = &room->events[i];
+
+		event->status = cache_save_event(&txn, &event->event, &event->index,
+		  &event->related_index, deferred_events);
+
+		switch (event->status) {
+		case CACHE_EVENT_SAVED:
+		case CACHE_EVENT_IGNORED:
+		case CACHE_EVENT_DEFERRED:
+			break;
+		case CACHE_EVENT_FAILED:
+			/* The whole batch is saved again after growing the map. */
+			cache_save_txn_finish(&txn);
+			return;
+		default:
+			assert(0);
+		}
+	}
+
+	if ((ret = cache_save_txn_finish(&txn)) != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to save events of room '%s': %s",
+		  room->room.id, mdb_strerror(ret));
+		return;
+	}
+
+	room->saved = true;
+}
+
+/* Renew the pinned snapshot if another thread waits for it, or if it wasn't
+ * renewed for PIN_RENEW_MS. Only called by the writer thread. */
+static void
+renew_pin(struct state *state) {
+	assert(state);
+
+	if (!state->zero_copy
+		|| (!(cache_pin_release_pending(&state->cache))
+			&& ms_since(&state->pin_renewed) < PIN_RENEW_MS)) {
+		return;
+	}
+
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int ret = cache_pin_renew(&state->cache);
+
+	if (ret != 0) {
+		LOG(LOG_ERROR, "Failed to renew pinned snapshot: %s",
+		  mdb_strerror(ret));
+		return;
+	}
+
+	LOG(LOG_MESSAGE, "Renewed pinned snapshot in %" PRIu64 " ms",
+	  ms_since(&start));
+
+	state->pin_renewed = start;
+}
+
+/* Save the queued rooms of a response in a single batch, along with the
+ * deferred space events and next_batch once every room was parsed. */
+static int
+write_response(struct state *state, struct sync_writer *writer) {
+	assert(state);
+	assert(writer);
+
+	int ret = MDB_SUCCESS;
+
+	/* The syncer thread only adds events once the response is committed, so
+	 * the borrowed bodies can be moved to a new snapshot. It's renewed by this
+	 * thread so that growing the map doesn't wait for another renewal. */
+	renew_pin(state);
+
+	struct cache_batch batch = {0};
+
+	/* Left over from a response that wasn't saved completely. */
+	if (writer->first) {
+		arrsetlen(writer->deferred_events, 0);
+	}
+
+	const size_t deferred_len = arrlenu(writer->deferred_events);
+
+	if ((ret = cache_batch_init(&state->cache, &batch)) != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to start batch for sync response: %s",
+		  mdb_strerror(ret));
+	}
+
+	pthread_mutex_lock(&writer->mutex);
+
+	bool last = false;
+
+	for (;;) {
+		struct sync_write_room *room = queue_pop_head(&writer->rooms);
+
+		if (!room) {
+			if (writer->parsed) {
+				last = writer->last;
+				break;
+			}
+
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+			continue;
+		}
+
+		writer->queued--;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+
+		/* The rooms are still taken off the queue if the batch failed, as
+		 * the syncer might be waiting for space in it. */
+		if (ret == MDB_SUCCESS && !(cache_batch_failed(&batch))) {
+			write_room(&batch, room, &writer->deferred_events);
+		}
+
+		pthread_mutex_lock(&writer->mutex);
+	}
+
+	pthread_mutex_unlock(&writer->mutex);
+
+	if (ret != MDB_SUCCESS) {
+		arrsetlen(writer->deferred_events, deferred_len);
+		return ret;
+	}
+
+	/* The other parts of the response were committed before. */
+	for (size_t i = 0, len = arrlenu(writer->deferred_events); last && i < len;
+		 i++) {
+		enum cache_deferred_ret deferred_ret = cache_process_deferred_event(
+		  &batch, &writer->deferred_events[i]);
+
+		if (deferred_ret == CACHE_DEFERRED_FAIL) {
+			continue;
+		}
+
+		struct accumulated_space_event event = {
+		  .status = deferred_ret,
+		  .parent = strdup(writer->deferred_events[i].parent),
+		  .child = strdup(writer->deferred_events[i].child),
+		};
+
+		assert(event.parent);
+		assert(event.child);
+
+		arrput(writer->space_events, event);
+	}
+
+	/* The next_batch key is committed in the same txn as the last events, so
+	 * if we crash before the commit we'll just receive the same events on the
+	 * next boot. The events of the parts committed before are ignored then. */
+	if (last
+		&& (ret = cache_batch_auth_set(
+			  &batch, DB_KEY_NEXT_BATCH, writer->next_batch))
+			 != MDB_SUCCESS
+		&& ret != MDB_MAP_FULL && ret != MDB_BAD_TXN) {
+		LOG(LOG_ERROR, "Failed to save next batch: %s", mdb_strerror(ret));
+		assert(0);
+	}
+
+	if ((ret = cache_batch_finish(&batch)) != MDB_SUCCESS) {
+		arrsetlen(writer->deferred_events, deferred_len);
+	} else if (last) {
+		arrsetlen(writer->deferred_events, 0);
+	}
+
+	return ret;
+}
+
 void
-sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
-	assert(matrix);
-	assert(response);
+sync_writer_run(struct state *state) {
+	assert(state);
 
-	struct state *state = matrix_userp(matrix);
+	struct sync_writer *writer = &state->writer;
 
+	pthread_mutex_lock(&writer->mutex);
+
+	for (;;) {
+		while (!writer->writing && !writer->stop && !writer->release_pin) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		}
+
+		/* Renewed by write_response() otherwise. */
+		if (!writer->writing && writer->release_pin) {
+			writer->release_pin = false;
+			pthread_mutex_unlock(&writer->mutex);
+
+			renew_pin(state);
+
+			pthread_mutex_lock(&writer->mutex);
+			continue;
+		}
+
+		if (!writer->writing) {
+			break;
+		}
+
+		writer->release_pin = false;
+		pthread_mutex_unlock(&writer->mutex);
+
+		int ret = write_response(state, writer);
+
+		pthread_mutex_lock(&writer->mutex);
+
+		writer->ret = ret;
+		writer->writing = false;
+		pthread_cond_broadcast(&writer->cond);
+	}
+
+	pthread_mutex_unlock(&writer->mutex);
+
+	/* Nothing renews it anymore, so don't let growing the map wait for it. */
+	if (state->zero_copy) {
+		cache_pin_end(&state->cache);
+	}
+
+	arrfree(writer->deferred_events);
+}
+
+/* Parse the next part of the response and hand it's rooms to the writer
+ * thread, which saves them meanwhile. *last is set if it was the last part.
+ * Returns MDB_MAP_FULL if the part must be saved again. */
+static int
+save_sync(struct state *state, struct matrix_sync_response *response,
+  struct saved_sync *saved, bool first, bool *last) {
 	assert(state);
+	assert(response);
+	assert(saved);
+	assert(last);
 
+	struct sync_writer *writer = &state->writer;
 	struct matrix_room sync_room;
-	struct cache_save_txn txn = {0};
 
-	struct accumulated_sync_data data = {0};
-	struct cache_deferred_space_event *deferred_events = NULL;
+	struct timespec start = {0};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&writer->mutex);
+
+	assert(!writer->writing);
+	assert(!writer->space_events);
 
-	int ret = 0;
+	writer->writing = true;
+	writer->parsed = false;
+	writer->first = first;
+	writer->last = false;
+	writer->max_queued = 0;
+	writer->next_batch = response->next_batch;
+	pthread_cond_broadcast(&writer->cond);
 
-	while ((matrix_sync_room_next(response, &sync_room)) == 0) {
+	pthread_mutex_unlock(&writer->mutex);
+
+	size_t events = 0;
+
+	/* The rest of the response is saved in another part once this one has
+	 * enough events. */
+	while (events < SYNC_PART_EVENTS
+		   && !(*last = (matrix_sync_room_next(response, &sync_room)) != 0)) {
 		switch (sync_room.type) {
 		case MATRIX_ROOM_LEAVE:
 		case MATRIX_ROOM_JOIN:
@@ -298,118 +1040,269 @@ sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
 			assert(0);
 		}
 
-		if ((ret = cache_save_txn_init(&state->cache, &txn, sync_room.id))
-			!= MDB_SUCCESS) {
-			LOG(LOG_ERROR, "Failed to start save txn for room '%s': %s",
-			  sync_room.id, mdb_strerror(ret));
-			continue;
+		struct sync_write_room *room = calloc(1, sizeof(*room));
+		assert(room);
+
+		room->room = sync_room;
+
+		struct matrix_sync_event event;
+
+		while ((matrix_sync_event_next(&sync_room, &event)) == 0) {
+			arrput(room->events, ((struct sync_write_event) {.event = event}));
 		}
 
-		if ((ret = cache_set_room_dbs(&txn, &sync_room)) != MDB_SUCCESS) {
-			LOG(LOG_ERROR, "Failed to open room DBs for room '%s': %s",
-			  sync_room.id, mdb_strerror(ret));
-			cache_save_txn_finish(&txn);
-			continue;
+		events += arrlenu(room->events);
+		arrput(saved->rooms, room);
+
+		pthread_mutex_lock(&writer->mutex);
+
+		/* Wait for the writer if it fell behind. */
+		while ((queue_push_tail(&writer->rooms, room)) == -1) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
 		}
 
-		if ((ret = cache_save_room(&txn, &sync_room)) != MDB_SUCCESS) {
-			LOG(LOG_ERROR, "Failed to save room '%s': %s", sync_room.id,
-			  mdb_strerror(ret));
-			cache_save_txn_finish(&txn);
-			continue;
+		writer->queued++;
+
+		if (writer->queued > writer->max_queued) {
+			writer->max_queued = writer->queued;
 		}
 
-		struct matrix_sync_event event;
+		pthread_cond_broadcast(&writer->cond);
+		pthread_mutex_unlock(&writer->mutex);
+	}
 
-		struct room *room
-		  = rooms_get_room(state->state_rooms.rooms, sync_room.id);
+	const uint64_t parse_ms = ms_since(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&writer->mutex);
+
+	writer->parsed = true;
+	writer->last = *last;
+	pthread_cond_broadcast(&writer->cond);
+
+	while (writer->writing) {
+		pthread_cond_wait(&writer->cond, &writer->mutex);
+	}
+
+	int ret = writer->ret;
+	size_t max_queued = writer->max_queued;
+
+	struct accumulated_space_event *space_events = writer->space_events;
+	writer->space_events = NULL;
+
+	pthread_mutex_unlock(&writer->mutex);
 
-		bool room_needs_info = !room;
+	LOG(LOG_MESSAGE,
+	  "Parsed %zu rooms in %" PRIu64 " ms, waited %" PRIu64
+	  " ms for the writer, at most %zu queued",
+	  arrlenu(saved->rooms), parse_ms, ms_since(&start), max_queued);
 
-		if (room_needs_info) {
+	saved->data = calloc(1, sizeof(*saved->data));
+	assert(saved->data);
+
+	/* Freed along with the sync if it's saved again. */
+	saved->data->space_events = space_events;
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	/* Indices into saved->saved_rooms. */
+	struct {
+		struct room *key;
+		size_t value;
+	} *groups = NULL;
+
+	for (size_t i = 0, len = arrlenu(saved->rooms); i < len; i++) {
+		struct sync_write_room *written = saved->rooms[i];
+
+		if (!written->saved) {
+			continue;
+		}
+
+		struct room *room = sync_get_room(state, written->room.id);
+		bool is_new = !room;
+
+		if (is_new) {
 			/* TODO make room_alloc take a timeline so we don't need this hack
 			 */
 			room = room_alloc((struct room_info) {0});
 			assert(room);
+
+			arrput(saved->new_rooms, arrlenu(saved->data->rooms));
+			shput(state->unpublished_rooms, written->room.id, room);
 		}
 
-		while ((matrix_sync_event_next(&sync_room, &event)) == 0) {
-			uint64_t index = 0;
-			uint64_t redaction_index = 0;
+		ptrdiff_t group = hmgeti(groups, room);
 
-			switch ((cache_save_event(
-			  &txn, &event, &index, &redaction_index, &deferred_events))) {
-			case CACHE_EVENT_SAVED:
-				room_put_event(room, &event, false, index, redaction_index);
-				break;
-			case CACHE_EVENT_IGNORED:
-			case CACHE_EVENT_DEFERRED:
-				break;
-			default:
-				assert(0);
-			}
+		if (group == -1) {
+			group = (ptrdiff_t) arrlenu(saved->saved_rooms);
+			hmput(groups, room, (size_t) group);
+			arrput(saved->saved_rooms,
+			  ((struct saved_room) {.room = room, .id = written->room.id}));
+		} else {
+			group = (ptrdiff_t) groups[group].value;
 		}
 
-		cache_save_txn_finish(&txn);
-
-		if (room_needs_info) {
-			ret
-			  = cache_room_info_init(&state->cache, &room->info, sync_room.id);
+		for (size_t j = 0, events_len = arrlenu(written->events);
+			 j < events_len; j++) {
+			struct sync_write_event *event = &written->events[j];
 
-			if (ret != MDB_SUCCESS) {
-				LOG(LOG_ERROR, "Failed to get room info for room '%s': %s",
-				  sync_room.id, mdb_strerror(ret));
-				assert(0);
+			if (event->status == CACHE_EVENT_SAVED) {
+				arrput(saved->saved_rooms[group].events,
+				  ((struct saved_event) {.event = event->event,
+					.index = event->index,
+					.related_index = event->related_index}));
 			}
 		}
 
-		arrput(data.rooms,
-		  ((struct accumulated_sync_room) {
-			.type = sync_room.type, .room = room, .id = sync_room.id}));
-	}
+		char *id = strdup(written->room.id);
+		assert(id);
 
-	for (size_t i = 0, len = arrlenu(deferred_events); i < len; i++) {
-		enum cache_deferred_ret deferred_ret
-		  = cache_process_deferred_event(&state->cache, &deferred_events[i]);
+		arrput(saved->data->rooms,
+		  ((struct accumulated_sync_room) {.type = written->room.type,
+			.is_new = is_new,
+			.room = room,
+			.id = id}));
+	}
 
-		if (deferred_ret == CACHE_DEFERRED_FAIL) {
-			continue;
-		}
+	hmfree(groups);
 
-		arrput(data.space_events, ((struct accumulated_space_event) {
-									.status = deferred_ret,
-									.parent = deferred_events[i].parent,
-									.child = deferred_events[i].child,
-								  }));
+	if (*last) {
+		saved->data->next_batch = strdup(response->next_batch);
+		assert(saved->data->next_batch);
 	}
 
-	arrfree(deferred_events);
+	return MDB_SUCCESS;
+}
 
-	/* Set the next_batch key at the end in case we somehow crashed during the
-	 * above loop. This will ensure that we receive the left out events on the
-	 * next boot. */
-	if ((ret = cache_auth_set(
-		   &state->cache, DB_KEY_NEXT_BATCH, response->next_batch))
-		!= MDB_SUCCESS) {
-		LOG(LOG_ERROR, "Failed to save next batch: %s", mdb_strerror(ret));
+/* Add the events of a saved part of a response to the rooms, and queue it
+ * for the UI thread. Returns false if it's exiting. */
+static bool
+publish_sync(struct state *state, struct saved_sync *saved) {
+	assert(state);
+	assert(saved);
+
+	/* Member lists and room info can only be read back after the batch is
+	 * committed. */
+	struct cache_snapshot snapshot = {0};
+
+	int ret = cache_snapshot_begin(&state->cache, &snapshot);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to begin snapshot: %s", mdb_strerror(ret));
 		assert(0);
 	}
 
-	uintptr_t ptr = (uintptr_t) &data;
+	/* The member list might still be loading in the background. */
+	for (size_t i = 0, len = arrlenu(saved->saved_rooms); i < len; i++) {
+		struct saved_room *room = &saved->saved_rooms[i];
+
+		pthread_mutex_lock(&room->room->load_mutex);
+
+		for (size_t j = 0, events_len = arrlenu(room->events); j < events_len;
+			 j++) {
+			if (room_wants_event(room->room, room->events[j].index)) {
+				ensure_member(room->room, &snapshot, room->id,
+				  event_sender(&room->events[j].event));
+			}
+		}
+
+		pthread_mutex_unlock(&room->room->load_mutex);
+	}
+
+	rooms_put_saved_events(
+	  saved->saved_rooms, arrlenu(saved->saved_rooms), state->ingest_workers);
+
+	for (size_t i = 0, len = arrlenu(saved->new_rooms); i < len; i++) {
+		struct accumulated_sync_room *room
+		  = &saved->data->rooms[saved->new_rooms[i]];
+
+		ret = cache_room_info_init(&snapshot, &room->room->info, room->id);
+
+		if (ret != MDB_SUCCESS) {
+			LOG(LOG_ERROR, "Failed to get room info for room '%s': %s",
+			  room->id, mdb_strerror(ret));
+			assert(0);
+		}
+	}
 
-	safe_write(state->thread_comm_pipe[PIPE_WRITE], &ptr, sizeof(ptr));
+	cache_snapshot_end(&snapshot);
 
 	pthread_mutex_lock(&state->sync_mutex);
 
-	/* Wait until the main thread acknowledges the data passed above. */
-	while (!(state->sync_cond_signaled)) {
+	/* The next response is fetched while the UI thread handles this one,
+	 * unless it has fallen behind. */
+	while (state->syncs_queued >= SYNC_QUEUE_MAX && !state->done) {
 		pthread_cond_wait(&state->sync_cond, &state->sync_mutex);
 	}
 
-	state->sync_cond_signaled = false;
+	bool queued = !state->done;
+
+	if (queued) {
+		state->syncs_queued++;
+	}
 
 	pthread_mutex_unlock(&state->sync_mutex);
 
-	arrfree(data.rooms);
-	arrfree(data.space_events);
+	if (queued) {
+		uintptr_t ptr = (uintptr_t) saved->data;
+
+		safe_write(state->thread_comm_pipe[PIPE_WRITE], &ptr, sizeof(ptr));
+
+		/* The sync and it's new rooms are now owned by the main thread. */
+		saved->data = NULL;
+	}
+
+	saved_sync_finish(state, saved);
+
+	return queued;
+}
+
+void
+sync_cb(struct matrix *matrix, struct matrix_sync_response *response) {
+	assert(matrix);
+	assert(response);
+
+	struct state *state = matrix_userp(matrix);
+
+	assert(state);
+
+	int ret = MDB_SUCCESS;
+
+	if (state->image_interval_ms > 0
+		&& ms_since(&state->image_written) >= state->image_interval_ms) {
+		state_write_image(state);
+	}
+
+	/* Huge responses are saved and shown in parts, so that the parsed events
+	 * of only one part are held at a time. */
+	for (bool first = true, last = false; !last; first = false) {
+		/* Iterating only advances the state stored in the response, so a copy
+		 * allows iterating over the part again. */
+		const struct matrix_sync_response start = *response;
+		struct saved_sync saved = {0};
+
+		while ((ret = save_sync(state, response, &saved, first, &last))
+			   == MDB_MAP_FULL) {
+			LOG(LOG_WARN, "Saving sync response again after growing the map");
+
+			saved_sync_finish(state, &saved);
+			*response = start;
+		}
+
+		if (ret != MDB_SUCCESS) {
+			LOG(LOG_ERROR, "Failed to commit sync response: %s",
+			  mdb_strerror(ret));
+			saved_sync_finish(state, &saved);
+			assert(0);
+			return;
+		}
+
+		/* The rest is received again on the next start, as next_batch is only
+		 * saved with the last part. */
+		if (!(publish_sync(state, &saved))) {
+			break;
+		}
+	}
 }
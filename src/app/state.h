@@ -3,14 +3,30 @@
  * SPDX-License-Identifier: GPL-3.0-or-later */
 #include "app/hm_room.h"
 #include "app/queue_callbacks.h"
+#include "app/startup_image.h"
 #include "db/cache.h"
 #include "ui/login_form.h"
 #include "ui/tab_room.h"
 #include "util/queue.h"
 #include "widgets.h"
 
-enum { THREAD_SYNC = 0, THREAD_QUEUE, THREAD_MAX };
+enum {
+	THREAD_SYNC = 0,
+	THREAD_QUEUE,
+	THREAD_MAINTENANCE,
+	THREAD_WRITER,
+	THREAD_MAX
+};
 enum { PIPE_READ = 0, PIPE_WRITE, PIPE_MAX };
+/* Saved syncs that the UI thread hasn't handled yet, the syncer waits for it
+ * to catch up beyond this. */
+enum { SYNC_QUEUE_MAX = 4 };
+/* Responses are saved and passed on in parts of about this many events. */
+enum { SYNC_PART_EVENTS = 10000 };
+/* Rebinding visits every loaded message, so the pinned snapshot is renewed
+ * at most this often unless another thread waits for it. */
+enum { PIN_RENEW_MS = 30000 };
+enum { SEARCH_MAX_HITS = 100 };
 
 enum {
 	EVENTS_IN_TIMELINE = MATRIX_ROOM_MESSAGE | MATRIX_ROOM_ATTACHMENT,
@@ -18,6 +34,49 @@ enum {
 	= MATRIX_ROOM_MEMBER | MATRIX_ROOM_NAME | MATRIX_ROOM_TOPIC
 };
 
+struct accumulated_space_event;
+
+/* Hits of a search run by the queue thread, owned by the UI thread once it
+ * takes them. */
+struct search_results {
+	char *query;
+	struct cache_search_hit *hits;
+};
+
+/* The syncer thread parses the rooms of a response and queues them for the
+ * writer thread, which saves them meanwhile in a write txn that only it uses.
+ * The syncer waits for the response to be committed before passing it on to
+ * the UI thread, so next_batch only advances once it's saved. */
+struct sync_writer {
+	pthread_cond_t cond;
+	pthread_mutex_t mutex;
+	/* Parsed rooms that weren't saved yet, the syncer waits if it's full. */
+	struct queue rooms;
+	size_t queued;
+	/* Most rooms queued at once while writing the part. */
+	size_t max_queued;
+	/* Set by the syncer for each part of a response, and cleared by the
+	 * writer once it's committed with the result in ret. */
+	bool writing;
+	/* All rooms of the part were queued. */
+	bool parsed;
+	/* The part is the first or the last one of the response. */
+	bool first;
+	bool last;
+	bool stop;
+	/* Another thread waits for the pinned snapshot, which the writer renews
+	 * even if it's idle. */
+	bool release_pin;
+	int ret;
+	/* Borrowed from the response. */
+	const char *next_batch;
+	/* Processed after all rooms, taken by the syncer. */
+	struct accumulated_space_event *space_events;
+	/* Collected from every part, they're processed with the last one. Only
+	 * used by the writer. */
+	struct cache_deferred_space_event *deferred_events;
+};
+
 struct state {
 	_Atomic bool done;
 	/* Pass data between the syncer thread and the UI thread. This exists as the
@@ -25,16 +84,51 @@ struct state {
 	 * terminal along with matrix sync events. */
 	int thread_comm_pipe[PIPE_MAX];
 	pthread_t threads[THREAD_MAX];
-	/* TODO array */
-	_Atomic bool sync_cond_signaled;
+	/* Syncs written to thread_comm_pipe that the UI thread hasn't handled yet,
+	 * sync_cond is signaled as they're handled. */
+	size_t syncs_queued;
 	pthread_cond_t sync_cond;
 	pthread_mutex_t sync_mutex;
+	/* Rooms allocated by queued syncs, which the UI thread didn't add to
+	 * state_rooms yet. Only used by the syncer. */
+	struct hm_room *unpublished_rooms;
+	struct sync_writer writer;
 	pthread_cond_t queue_cond;
 	pthread_mutex_t queue_mutex;
 	struct cache cache;
+	/* Compact the cache after pruning it on startup. */
+	bool compact_cache;
+	/* Borrow message bodies from a pinned snapshot instead of copying them. */
+	bool zero_copy;
+	/* When the writer last renewed the pinned snapshot. */
+	struct timespec pin_renewed;
 	struct queue queue;
+	/* Searches run on the queue thread, which stores the results of the
+	 * latest one and writes a byte to search_pipe to wake up the UI thread. */
+	int search_pipe[PIPE_MAX];
+	pthread_mutex_t search_mutex;
+	struct search_results *search_results;
 	struct matrix *matrix;
 	struct state_rooms state_rooms;
+	/* Rooms to load in the background, in order. The keys are owned by
+	 * state_rooms.rooms. */
+	struct hm_room *prefetch;
+	/* Index of the next room to prefetch, taken by each worker. */
+	_Atomic size_t prefetch_next;
+	/* Number of workers loading rooms in parallel, 0 disables prefetching. */
+	unsigned prefetch_workers;
+	pthread_t *prefetch_threads;
+	/* Number of threads that add the events of a sync response to the rooms,
+	 * each taking whole rooms. */
+	unsigned ingest_workers;
+	/* Mapped on startup if it matched the cache, the rooms borrow from it. */
+	struct startup_image image;
+	/* Token of the last sync handled by the UI thread, which the rooms
+	 * reflect. */
+	char *next_batch;
+	/* Rewrite the startup image at most this often, 0 disables it. */
+	uint64_t image_interval_ms;
+	struct timespec image_written;
 };
 
 struct queue_item;
@@ -46,31 +140,42 @@ safe_write(int fildes, const void *buf, size_t nbyte);
 
 struct accumulated_sync_room {
 	enum matrix_room_type type;
+	/* Allocated by this sync, it's destroyed along with the sync unless it
+	 * was handled. */
+	bool is_new;
 	struct room *room;
 	char *id;
 };
 
 struct accumulated_space_event {
 	enum cache_deferred_ret status;
-	const char *parent;
-	const char *child;
+	char *parent;
+	char *child;
 };
 
 /* We pass this struct to the main thread after processing each sync response.
- * This saves us from most threading related issues but wastes a bit more
- * space as temp arrays are constructed instead of using the data in-place
- * when consuming an iterator. */
+ * It owns copies of the strings as the syncer moves on to the next response
+ * meanwhile, and is owned by the main thread once it's read from the pipe. */
 struct accumulated_sync_data {
 	struct accumulated_sync_room
 	  *rooms; /* Array of rooms that received events. */
 	/* Array of space-related events which might require shifting nodes
 	 * in the treeview. */
 	struct accumulated_space_event *space_events;
+	/* NULL unless it's the last part of the response. */
+	char *next_batch;
 };
 
 /* TODO make everything take individual pointers instead of full struct state.
  */
 
+void
+search_results_free(struct search_results *results);
+/* Show the latest search results if they're for the running search. Returns
+ * whether a redraw is needed. */
+bool
+state_handle_search(struct state *state, struct tab_room *tab_room);
+
 enum widget_error
 handle_tab_room(
   struct state *state, struct tab_room *tab_room, struct tb_event *event);
@@ -83,7 +188,35 @@ state_reset_orphans(struct state_rooms *state_rooms);
 bool
 handle_accumulated_sync(struct state_rooms *state_rooms,
   struct tab_room *tab_room, struct accumulated_sync_data *data);
+/* Handle and free a sync read from the pipe, letting the syncer queue another.
+ * Returns whether a redraw is needed. */
+bool
+state_handle_sync(struct state *state, struct tab_room *tab_room,
+  struct accumulated_sync_data *data);
+/* Free a sync, destroying the rooms it allocated unless it was handled. */
+void
+accumulated_sync_free(struct accumulated_sync_data *data, bool handled);
 int
 populate_from_cache(struct state *state);
+/* Load the latest events of a room that was only listed on startup and their
+ * senders, waiting if another thread is already loading it. */
+int
+state_load_room(struct state *state, const char *room_id, struct room *room);
+/* Read-only copy of the messages of a room around the event at index, or the
+ * latest ones if it's -1. Destroyed with room_destroy(). */
+struct room *
+state_load_window(struct state *state, const char *room_id, uint64_t index);
+/* Load the remaining members of a room, which can take a while for huge rooms
+ * so it's only called from background threads. */
+int
+state_load_members(struct state *state, const char *room_id,
+  struct room *room);
 void
 sync_cb(struct matrix *matrix, struct matrix_sync_response *response);
+/* Save the responses parsed by sync_cb until writer.stop is set. */
+void
+sync_writer_run(struct state *state);
+/* Write the loaded rooms to the startup image if it's enabled and the UI
+ * thread has handled every queued sync. */
+void
+state_write_image(struct state *state);
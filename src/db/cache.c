@@ -4,25 +4,61 @@
  * https://github.com/Nheko-Reborn/nheko/blob/master/src/Cache.cpp */
 #include "db/cache.h"
 
+#include "db/event_block.h"
+#include "db/event_record.h"
+#include "db/search.h"
 #include "stb_ds.h"
 #include "util/log.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+enum { MIB = 1024 * 1024 };
 
 static const char *const db_names[DB_MAX] = {
   [DB_AUTH] = "auth",
   [DB_ROOMS] = "rooms",
   [DB_SPACE_CHILDREN] = "space_children",
+  [DB_ROOM_IDS] = "room_ids",
+  [DB_META] = "meta",
+  [DB_SEARCH] = "search",
+  [DB_ROOM_SURROGATES] = "room_surrogates",
 };
 
 static const unsigned db_flags[DB_MAX] = {
   [DB_SPACE_CHILDREN] = MDB_DUPSORT,
+  [DB_SEARCH] = MDB_DUPSORT | MDB_DUPFIXED,
+};
+
+/* 1 is the old layout with a set of DBs for every room, keyed by event ID. */
+enum { SCHEMA_VERSION = 2 };
+
+enum meta_key {
+	META_SCHEMA_VERSION = 0,
+	META_NEXT_ROOM,
+	META_NEXT_BLOCK,
+	/* Dictionary of the blocks in ROOM_DB_EVENT_BLOCKS. */
+	META_EVENT_DICT,
+	/* Last room migrated from schema version 1, while migrating. */
+	META_MIGRATED_ROOM,
+	META_MAX,
+};
+
+static const char *const meta_keys[META_MAX] = {
+  [META_SCHEMA_VERSION] = "schema_version",
+  [META_NEXT_ROOM] = "next_room",
+  [META_NEXT_BLOCK] = "next_block",
+  [META_EVENT_DICT] = "event_dict",
+  [META_MIGRATED_ROOM] = "migrated_room",
 };
 
 static const char *const db_keys[DB_KEY_MAX] = {
@@ -33,19 +69,74 @@ static const char *const db_keys[DB_KEY_MAX] = {
 };
 
 static const char *const room_db_names[ROOM_DB_MAX] = {
-  [ROOM_DB_EVENTS] = "events",
-  [ROOM_DB_ORDER_TO_EVENTS] = "order2event",
-  [ROOM_DB_EVENTS_TO_ORDER] = "event2order",
-  [ROOM_DB_RELATIONS] = "relations",
-  [ROOM_DB_MEMBERS] = "members",
-  [ROOM_DB_STATE] = "state",
-  [ROOM_DB_SPACE_PARENT] = "space_parent",
-  [ROOM_DB_SPACE_CHILD] = "space_child",
+  [ROOM_DB_EVENTS] = "room_event_records",
+  [ROOM_DB_EVENTS_JSON] = "room_event_json",
+  [ROOM_DB_EVENT_BLOCKS] = "room_event_blocks",
+  [ROOM_DB_EVENTS_TO_ORDER] = "room_event2order",
+  [ROOM_DB_RELATIONS] = "room_relations_by_parent",
+  [ROOM_DB_TS_TO_ORDER] = "room_ts2order",
+  [ROOM_DB_AGGREGATIONS] = "room_aggregations",
+  [ROOM_DB_MEMBERS] = "room_members",
+  [ROOM_DB_MEMBER_NAMES] = "room_member_names",
+  [ROOM_DB_STATE] = "room_state",
+  [ROOM_DB_SPACE_PARENT] = "room_space_parent",
+  [ROOM_DB_SPACE_CHILD] = "room_space_child",
 };
 
 static const unsigned room_db_flags[ROOM_DB_MAX] = {
-  [ROOM_DB_ORDER_TO_EVENTS] = MDB_INTEGERKEY,
-  [ROOM_DB_RELATIONS] = MDB_DUPSORT,
+  [ROOM_DB_RELATIONS] = MDB_DUPSORT | MDB_DUPFIXED,
+  [ROOM_DB_TS_TO_ORDER] = MDB_DUPSORT | MDB_DUPFIXED,
+};
+
+/* Per-room DBs of schema version 1, named "room_id/name". */
+enum legacy_room_db {
+	/* Event ID => JSON or record */
+	LEGACY_EVENTS = 0,
+	/* Event ID => JSON of the record */
+	LEGACY_EVENTS_JSON,
+	/* Index => Event ID, native-endian index. */
+	LEGACY_ORDER_TO_EVENTS,
+	/* Event ID => Index, rebuilt from LEGACY_ORDER_TO_EVENTS. */
+	LEGACY_EVENTS_TO_ORDER,
+	/* Event ID => [Event ID, ...], rebuilt from the records. */
+	LEGACY_RELATIONS,
+	LEGACY_MEMBERS,
+	LEGACY_STATE,
+	LEGACY_SPACE_PARENT,
+	LEGACY_SPACE_CHILD,
+	LEGACY_ROOM_DB_MAX
+};
+
+static const char *const legacy_room_db_names[LEGACY_ROOM_DB_MAX] = {
+  [LEGACY_EVENTS] = "events",
+  [LEGACY_EVENTS_JSON] = "events_json",
+  [LEGACY_ORDER_TO_EVENTS] = "order2event",
+  [LEGACY_EVENTS_TO_ORDER] = "event2order",
+  [LEGACY_RELATIONS] = "relations",
+  [LEGACY_MEMBERS] = "members",
+  [LEGACY_STATE] = "state",
+  [LEGACY_SPACE_PARENT] = "space_parent",
+  [LEGACY_SPACE_CHILD] = "space_child",
+};
+
+static const unsigned legacy_room_db_flags[LEGACY_ROOM_DB_MAX] = {
+  [LEGACY_ORDER_TO_EVENTS] = MDB_INTEGERKEY,
+  [LEGACY_RELATIONS] = MDB_DUPSORT,
+};
+
+/* Relations are sorted by their type first, so that the edits of an event are
+ * next to each other. */
+enum relation_type {
+	RELATION_REPLACE = 0,
+	RELATION_ANNOTATION,
+	RELATION_OTHER,
+};
+
+enum {
+	/* [u8 relation type][u64 child index] in ROOM_DB_RELATIONS. */
+	RELATION_SIZE = 1 + sizeof(uint64_t),
+	/* [u64 edit index][u32 annotations] in ROOM_DB_AGGREGATIONS. */
+	AGGREGATION_SIZE = sizeof(uint64_t) + sizeof(uint32_t),
 };
 
 /* Modifies path[] in-place but restores it. */
@@ -93,6 +184,11 @@ cpy_index(MDB_val *index, uint64_t *out_index) {
 		case MDB_SUCCESS:                                                      \
 		case MDB_KEYEXIST:                                                     \
 		case MDB_NOTFOUND:                                                     \
+		/* The txn is retried after growing the map. A full map leaves the     \
+		 * txn in an error state so subsequent operations fail with            \
+		 * MDB_BAD_TXN. */                                                     \
+		case MDB_MAP_FULL:                                                     \
+		case MDB_BAD_TXN:                                                      \
 			break;                                                             \
 		default:                                                               \
 			LOG(LOG_ERROR, "LMDB returned failure: %s", mdb_strerror(_res));   \
@@ -101,55 +197,132 @@ cpy_index(MDB_val *index, uint64_t *out_index) {
 		return _res;                                                           \
 	} while (0)
 
-static int
-commit(MDB_txn *txn) {
-	ABORT_OR_RETURN(mdb_txn_commit(txn));
+
+/* Rooms are identified by a surrogate in the keys of the room DBs, followed
+ * by the actual key. Matrix identifiers are limited to 255 bytes so this is
+ * plenty. The whole key is limited to the maximum key size of the backends,
+ * longer ones are rejected with EINVAL before reaching them. */
+enum { ROOM_KEY_MAX = 511 };
+
+struct room_key {
+	MDB_val val;
+	unsigned char buf[ROOM_KEY_MAX];
+};
+
+static void
+write_be(unsigned char *buf, uint64_t num, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		buf[len - i - 1] = (unsigned char) (num >> (i * CHAR_BIT));
+	}
+}
+
+static uint64_t
+read_be(const unsigned char *buf, size_t len) {
+	uint64_t num = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		num = (num << CHAR_BIT) | buf[i];
+	}
+
+	return num;
 }
 
-#define mdb_txn_commit(txn) commit(txn)
+/* Same as cpy_index() but for the big-endian indices in keys. */
+static void
+cpy_index_be(MDB_val *index, uint64_t *out_index) {
+	assert(index);
+	assert(out_index);
+
+	if (index->mv_size != sizeof(*out_index)) {
+		LOG(LOG_ERROR,
+		  "Expected size %zu for index but got %zu! Corrupt database?",
+		  sizeof(*out_index), index->mv_size);
+		abort();
+	}
+
+	*out_index = read_be(index->mv_data, sizeof(*out_index));
+}
 
 static int
-get_dbi(enum room_db db, MDB_txn *txn, MDB_dbi *dbi, const char *room_id) {
-	assert(txn);
-	assert(dbi);
-	assert(room_id);
-	assert(db >= 0 && db < ROOM_DB_MAX);
+room_key(struct room_key *key, uint32_t room, const void *data, size_t len) {
+	assert(key);
 
-	char *room = NULL;
+	if (len > (sizeof(key->buf) - sizeof(room))) {
+		LOG(LOG_WARN, "Key of length %zu is too large!", len);
+		return EINVAL;
+	}
 
-	if ((asprintf(&room, "%s/%s", room_id, room_db_names[db])) == -1) {
-		return ENOMEM;
+	write_be(key->buf, room, sizeof(room));
+
+	if (len > 0) {
+		memcpy(&key->buf[sizeof(room)], data, len);
 	}
 
-	int ret = mdb_dbi_open(txn, room, MDB_CREATE | room_db_flags[db], dbi);
-	free(room);
+	key->val = (MDB_val) {sizeof(room) + len, key->buf};
 
-	ABORT_OR_RETURN(ret);
+	return 0;
+}
+
+static int
+room_key_str(struct room_key *key, uint32_t room, const char *str) {
+	if (!str) {
+		return EINVAL;
+	}
+
+	return room_key(key, room, str, strlen(str) + 1);
+}
+
+/* Big-endian so that the keys sort by index within a room. */
+static void
+room_key_index(struct room_key *key, uint32_t room, uint64_t index) {
+	unsigned char buf[sizeof(index)];
+	write_be(buf, index, sizeof(buf));
+
+	int ret = room_key(key, room, buf, sizeof(buf));
+	assert(ret == 0);
+}
+
+static bool
+room_key_in_room(const MDB_val *key, uint32_t room) {
+	assert(key);
+
+	return key->mv_size >= sizeof(room)
+		&& read_be(key->mv_data, sizeof(room)) == room;
+}
+
+/* The actual key without the room prefix. */
+static MDB_val
+room_key_data(const MDB_val *key) {
+	assert(key);
+	assert(key->mv_size >= sizeof(uint32_t));
+
+	return (MDB_val) {key->mv_size - sizeof(uint32_t),
+	  (unsigned char *) key->mv_data + sizeof(uint32_t)};
 }
 
 static int
-del_str(MDB_txn *txn, MDB_dbi dbi, const char *key, const char *data) {
+del_str(struct kv_txn *txn, kv_dbi dbi, const char *key, const char *data) {
 	if (!key) {
 		return EINVAL;
 	}
 
 	ABORT_OR_RETURN(
-	  mdb_del(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)},
+	  kv_del(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)},
 		(data ? &(MDB_val) {strlen(data) + 1, noconst(data)} : NULL)));
 }
 
 static int
-get_str(MDB_txn *txn, MDB_dbi dbi, const char *key, MDB_val *data) {
+get_str(struct kv_txn *txn, kv_dbi dbi, const char *key, MDB_val *data) {
 	if (!txn || !key || !data) {
 		return EINVAL;
 	}
 
 	ABORT_OR_RETURN(
-	  mdb_get(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)}, data));
+	  kv_get(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)}, data));
 }
 
 static char *
-get_str_and_dup(MDB_txn *txn, MDB_dbi dbi, const char *key) {
+get_str_and_dup(struct kv_txn *txn, kv_dbi dbi, const char *key) {
 	if (txn && key) {
 		MDB_val data = {0};
 
@@ -162,716 +335,5028 @@ get_str_and_dup(MDB_txn *txn, MDB_dbi dbi, const char *key) {
 }
 
 static int
-put_str(MDB_txn *txn, MDB_dbi dbi, const char *key, const char *data,
+put_str(struct kv_txn *txn, kv_dbi dbi, const char *key, const char *data,
   unsigned flags) {
 	if (!txn || !key || !data) {
 		return EINVAL;
 	}
 
 	ABORT_OR_RETURN(
-	  mdb_put(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)},
+	  kv_put(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)},
 		&(MDB_val) {strlen(data) + 1, noconst(data)}, flags));
 }
 
+/* Encodes the event directly into the space reserved by LMDB. */
 static int
-put_int(
-  MDB_txn *txn, MDB_dbi dbi, uint64_t key, const char *data, unsigned flags) {
-	if (!txn || !data) {
+put_record(struct kv_txn *txn, kv_dbi dbi, MDB_val *key,
+  const struct matrix_sync_event *event, unsigned record_flags,
+  unsigned flags) {
+	if (!txn || !key || !event) {
 		return EINVAL;
 	}
 
-	ABORT_OR_RETURN(mdb_put(txn, dbi, &(MDB_val) {sizeof(key), &key},
-	  &(MDB_val) {strlen(data) + 1, noconst(data)}, flags));
+	MDB_val data = {event_record_size(event, record_flags), NULL};
+
+	int ret = kv_put(txn, dbi, key, &data, flags | MDB_RESERVE);
+
+	if (ret == MDB_SUCCESS) {
+		event_record_write(event, record_flags, data.mv_data);
+	}
+
+	ABORT_OR_RETURN(ret);
 }
 
 static int
-put_str_int(
-  MDB_txn *txn, MDB_dbi dbi, const char *key, uint64_t data, unsigned flags) {
-	if (!txn || !key) {
+room_get(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, const char *key, MDB_val *data) {
+	assert(cache);
+
+	struct room_key rkey;
+	int ret = room_key_str(&rkey, room, key);
+
+	if (!txn || !data || ret != 0) {
 		return EINVAL;
 	}
 
-	ABORT_OR_RETURN(
-	  mdb_put(txn, dbi, &(MDB_val) {strlen(key) + 1, noconst(key)},
-		&(MDB_val) {sizeof(data), &data}, flags));
+	ABORT_OR_RETURN(kv_get(txn, cache->room_dbs[db], &rkey.val, data));
 }
 
 static int
-get_txn(struct cache *cache, unsigned flags, MDB_txn **txn) {
+room_put(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, const char *key, MDB_val *data, unsigned flags) {
 	assert(cache);
 
-	ABORT_OR_RETURN(mdb_txn_begin(cache->env, NULL, flags, txn));
-}
+	struct room_key rkey;
+	int ret = room_key_str(&rkey, room, key);
 
-static bool
-is_str(MDB_val *val) {
-	assert(val);
+	if (!txn || !data || ret != 0) {
+		return EINVAL;
+	}
 
-	return (
-	  val->mv_size > 0 && ((char *) val->mv_data)[val->mv_size - 1] == '\0');
+	ABORT_OR_RETURN(kv_put(txn, cache->room_dbs[db], &rkey.val, data, flags));
 }
 
 static int
-cache_rooms_next(struct cache_iterator *iterator) {
-	assert(iterator);
-	assert(iterator->type == CACHE_ITERATOR_ROOMS);
+room_put_str(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, const char *key, const char *data, unsigned flags) {
+	if (!data) {
+		return EINVAL;
+	}
 
-	MDB_val key = {0};
-	MDB_val data = {0};
+	return room_put(cache, txn, room, db, key,
+	  &(MDB_val) {strlen(data) + 1, noconst(data)}, flags);
+}
 
-	int ret = mdb_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
+/* Store the event as a record, read back with record_decode() which also
+ * reads the JSON of caches migrated from schema version 1. */
+static int
+room_put_record(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, const char *key, const struct matrix_sync_event *event) {
+	assert(event);
 
-	if (ret != MDB_SUCCESS) {
-		return ret;
-	}
+	MDB_val data = {event_record_size(event, 0), NULL};
+	int ret = room_put(cache, txn, room, db, key, &data, MDB_RESERVE);
 
-	assert(is_str(&key));
-	assert(is_str(&data));
+	if (ret == MDB_SUCCESS) {
+		event_record_write(event, 0, data.mv_data);
+	}
 
-	*iterator->room_id = key.mv_data;
 	return ret;
 }
 
+/* For the DBs keyed by event index. */
 static int
-cache_event_next(struct cache_iterator *iterator) {
-	assert(iterator);
-	assert(iterator->type == CACHE_ITERATOR_EVENTS);
+room_get_index(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, uint64_t index, MDB_val *data) {
+	assert(cache);
 
-	matrix_json_delete(iterator->event_json);
-	iterator->event_json = NULL;
+	if (!txn || !data) {
+		return EINVAL;
+	}
 
-	for (;;) {
-		if (iterator->num_fetch == 0) {
-			return EINVAL;
-		}
+	struct room_key rkey;
+	room_key_index(&rkey, room, index);
 
-		MDB_val db_index = {0};
-		MDB_val id = {0};
+	ABORT_OR_RETURN(kv_get(txn, cache->room_dbs[db], &rkey.val, data));
+}
 
-		int ret = (iterator->fetched_once ? (
-					 mdb_cursor_get(iterator->cursor, &db_index, &id, MDB_PREV))
-										  : mdb_cursor_get(iterator->cursor,
-											&db_index, &id, MDB_GET_CURRENT));
+static int
+room_del_index(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, uint64_t index) {
+	assert(cache);
 
-		iterator->fetched_once = true;
+	if (!txn) {
+		return EINVAL;
+	}
 
-		if (ret != MDB_SUCCESS) {
-			return ret;
-		}
+	struct room_key rkey;
+	room_key_index(&rkey, room, index);
 
-		assert(is_str(&id));
+	ABORT_OR_RETURN(kv_del(txn, cache->room_dbs[db], &rkey.val, NULL));
+}
 
-		MDB_val db_json = {0};
-		ret = mdb_get(iterator->txn, iterator->events_dbi, &id, &db_json);
+/* Add or remove the index of an event sent at ts in ROOM_DB_TS_TO_ORDER. */
+static int
+room_ts_index(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t ts, uint64_t index, bool add) {
+	assert(cache);
 
-		if (ret != MDB_SUCCESS) {
-			return ret;
-		}
+	if (!txn) {
+		return EINVAL;
+	}
 
-		assert(is_str(&db_json));
+	struct room_key rkey;
+	room_key_index(&rkey, room, ts);
 
-		uint64_t index = 0;
-		cpy_index(&db_index, &index);
+	unsigned char buf[sizeof(index)];
+	write_be(buf, index, sizeof(buf));
 
-		matrix_json_t *json
-		  = matrix_json_parse(db_json.mv_data, db_json.mv_size);
-		assert(json);
+	MDB_val data = {sizeof(buf), buf};
+	kv_dbi dbi = cache->room_dbs[ROOM_DB_TS_TO_ORDER];
 
-		ret = matrix_event_sync_parse(&iterator->event->event, json);
+	ABORT_OR_RETURN(add ? kv_put(txn, dbi, &rkey.val, &data, 0)
+						: kv_del(txn, dbi, &rkey.val, &data));
+}
 
-		if (ret != 0) {
-			if (iterator->event->event.type == MATRIX_EVENT_TIMELINE
-				&& !(matrix_json_has_content(json))) {
-				/* A redacted event. */
-				matrix_json_delete(json);
-				continue;
-			}
+static int
+aggregation_get(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t index, struct cache_aggregation *aggregation) {
+	assert(aggregation);
 
-			LOG(LOG_ERROR, "Failed to parse event JSON '%s'",
-			  (char *) db_json.mv_data);
-			abort();
-		}
+	*aggregation = (struct cache_aggregation) {.edit_index = (uint64_t) -1};
 
-		switch (iterator->event->event.type) {
-		case MATRIX_EVENT_STATE:
-			if ((iterator->state_events & iterator->event->event.state.type)
-				!= iterator->event->event.state.type) {
-				matrix_json_delete(json);
-				continue;
-			}
+	MDB_val data = {0};
+	int ret
+	  = room_get_index(cache, txn, room, ROOM_DB_AGGREGATIONS, index, &data);
 
-			iterator->event->event.state.is_in_timeline = true;
-			break;
-		case MATRIX_EVENT_TIMELINE:
-			if ((iterator->timeline_events
-				  & iterator->event->event.timeline.type)
-				!= iterator->event->event.timeline.type) {
-				matrix_json_delete(json);
-				continue;
-			}
-			break;
-		default:
-			assert(0);
+	if (ret == MDB_SUCCESS) {
+		if (data.mv_size != AGGREGATION_SIZE) {
+			LOG(LOG_ERROR,
+			  "Expected size %d for aggregation but got %zu! Corrupt "
+			  "database?",
+			  AGGREGATION_SIZE, data.mv_size);
+			abort();
 		}
 
-		iterator->num_fetch--;
-
-		iterator->event->index = index;
-		iterator->event_json = json;
+		const unsigned char *buf = data.mv_data;
 
-		return ret;
+		memcpy(&aggregation->edit_index, buf, sizeof(aggregation->edit_index));
+		memcpy(&aggregation->annotations,
+		  &buf[sizeof(aggregation->edit_index)],
+		  sizeof(aggregation->annotations));
 	}
+
+	return ret;
 }
 
+/* Empty aggregations are deleted. */
 static int
-cache_member_next(struct cache_iterator *iterator) {
-	assert(iterator);
-	assert(iterator->type == CACHE_ITERATOR_MEMBER);
-
-	MDB_val key = {0};
-	MDB_val data = {0};
-
-	matrix_json_delete(iterator->member_json);
-	iterator->member_json = NULL;
-
-	int ret = mdb_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
-
-	if (ret != MDB_SUCCESS) {
-		return ret;
+aggregation_put(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t index, const struct cache_aggregation *aggregation) {
+	assert(aggregation);
+
+	if (aggregation->edit_index == (uint64_t) -1
+		&& aggregation->annotations == 0) {
+		int ret
+		  = room_del_index(cache, txn, room, ROOM_DB_AGGREGATIONS, index);
+		return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
 	}
 
-	assert(is_str(&key));
-	assert(is_str(&data));
+	unsigned char buf[AGGREGATION_SIZE];
+	memcpy(buf, &aggregation->edit_index, sizeof(aggregation->edit_index));
+	memcpy(&buf[sizeof(aggregation->edit_index)], &aggregation->annotations,
+	  sizeof(aggregation->annotations));
 
-	matrix_json_t *json = matrix_json_parse(data.mv_data, data.mv_size);
-	assert(json);
+	struct room_key key;
+	room_key_index(&key, room, index);
 
-	struct matrix_state_event event = {0};
+	ABORT_OR_RETURN(kv_put(txn, cache->room_dbs[ROOM_DB_AGGREGATIONS],
+	  &key.val, &(MDB_val) {sizeof(buf), buf}, 0));
+}
 
-	ret = matrix_event_state_parse(&event, json);
+static int
+room_del(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  enum room_db db, const char *key, const char *data) {
+	assert(cache);
 
-	if (ret != 0 || event.type != MATRIX_ROOM_MEMBER) {
-		LOG(
-		  LOG_ERROR, "Failed to parse member JSON '%s'", (char *) data.mv_data);
-		assert(0);
+	struct room_key rkey;
+	int ret = room_key_str(&rkey, room, key);
 
-		matrix_json_delete(json);
+	if (!txn || ret != 0) {
 		return EINVAL;
 	}
 
-	*iterator->member = (struct cache_iterator_member) {
-	  .mxid = key.mv_data,
-	  .username = event.content.member.displayname,
-	};
-
-	iterator->member_json = json;
-
-	return ret;
+	ABORT_OR_RETURN(kv_del(txn, cache->room_dbs[db], &rkey.val,
+	  (data ? &(MDB_val) {strlen(data) + 1, noconst(data)} : NULL)));
 }
 
 static int
-cache_iterator_space_children(struct cache *cache, MDB_cursor *cursor,
-  struct cache_iterator *iterator, char **child_id) {
+room_id_get(struct cache *cache, struct kv_txn *txn, const char *room_id,
+  uint32_t *room) {
 	assert(cache);
-	assert(iterator);
-	assert(child_id);
+	assert(room);
 
-	*iterator = (struct cache_iterator) {.type = CACHE_ITERATOR_SPACE_CHILDREN,
-	  .cursor = cursor,
-	  .cache = cache,
-	  .child_id = child_id};
+	MDB_val data = {0};
+	int ret = get_str(txn, cache->dbs[DB_ROOM_IDS], room_id, &data);
 
-	return MDB_SUCCESS;
-}
+	if (ret == MDB_SUCCESS) {
+		if (data.mv_size != sizeof(*room)) {
+			LOG(LOG_ERROR, "Invalid surrogate for room '%s'! Corrupt database?",
+			  room_id);
+			abort();
+		}
 
-static int
-cache_spaces_next(struct cache_iterator *iterator) {
-	assert(iterator);
-	assert(iterator->type == CACHE_ITERATOR_SPACES);
+		memcpy(room, data.mv_data, sizeof(*room));
+	}
 
-	MDB_val key = {0};
-	MDB_val data = {0};
+	return ret;
+}
 
-	int ret = mdb_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
+/* Same as room_get() but for rooms that might not be in the cache yet. */
+static int
+room_get_by_id(struct cache *cache, struct kv_txn *txn, const char *room_id,
+  enum room_db db, const char *key, MDB_val *data) {
+	uint32_t room = 0;
+	int ret = room_id_get(cache, txn, room_id, &room);
 
 	if (ret != MDB_SUCCESS) {
 		return ret;
 	}
 
-	assert(is_str(&key));
+	return room_get(cache, txn, room, db, key, data);
+}
 
-	iterator->space->id = key.mv_data;
-	return cache_iterator_space_children(iterator->cache, iterator->cursor,
-	  &iterator->space->children_iterator, &iterator->space->child_id);
+static int
+room_surrogate_put(
+  struct cache *cache, struct kv_txn *txn, uint32_t room, const char *room_id) {
+	unsigned char key[sizeof(room)];
+	write_be(key, room, sizeof(key));
+
+	return kv_put(txn, cache->dbs[DB_ROOM_SURROGATES],
+	  &(MDB_val) {sizeof(key), key},
+	  &(MDB_val) {strlen(room_id) + 1, noconst(room_id)}, 0);
 }
 
+/* Allocates a new surrogate if the room doesn't have one. */
 static int
-cache_space_children_next(struct cache_iterator *iterator) {
-	assert(iterator);
-	assert(iterator->type == CACHE_ITERATOR_SPACE_CHILDREN);
+room_id_create(struct cache *cache, struct kv_txn *txn, const char *room_id,
+  uint32_t *room) {
+	int ret = room_id_get(cache, txn, room_id, room);
 
-	MDB_val key = {0};
-	MDB_val data = {0};
+	if (ret != MDB_NOTFOUND) {
+		return ret;
+	}
 
-	int ret = mdb_cursor_get(iterator->cursor, &key, &data,
-	  (iterator->child_iterated_once ? MDB_NEXT_DUP : MDB_FIRST_DUP));
+	uint32_t next = 0;
+	MDB_val data = {0};
 
-	if (ret != MDB_SUCCESS) {
+	if ((ret = get_str(txn, cache->dbs[DB_META], meta_keys[META_NEXT_ROOM],
+		   &data))
+		== MDB_SUCCESS) {
+		assert(data.mv_size == sizeof(next));
+		memcpy(&next, data.mv_data, sizeof(next));
+	} else if (ret != MDB_NOTFOUND) {
 		return ret;
 	}
 
-	iterator->child_iterated_once = true;
+	if (next == UINT32_MAX) {
+		LOG(LOG_ERROR, "Ran out of room surrogates!");
+		return ENOSPC;
+	}
 
-	assert(is_str(&data));
-	*iterator->child_id = data.mv_data;
+	uint32_t after = next + 1;
 
-	return ret;
+	if ((ret = kv_put(txn, cache->dbs[DB_META],
+		   &(MDB_val) {strlen(meta_keys[META_NEXT_ROOM]) + 1,
+			 noconst(meta_keys[META_NEXT_ROOM])},
+		   &(MDB_val) {sizeof(after), &after}, 0))
+		  == MDB_SUCCESS
+		&& (ret = kv_put(txn, cache->dbs[DB_ROOM_IDS],
+			  &(MDB_val) {strlen(room_id) + 1, noconst(room_id)},
+			  &(MDB_val) {sizeof(next), &next}, MDB_NOOVERWRITE))
+			 == MDB_SUCCESS
+		&& (ret = room_surrogate_put(cache, txn, next, room_id))
+			 == MDB_SUCCESS) {
+		*room = next;
+	}
+
+	ABORT_OR_RETURN(ret);
 }
 
-int
-cache_iterator_rooms(
-  struct cache *cache, struct cache_iterator *iterator, const char **room_id) {
+/* Take a reset txn from the pool, NULL if it's empty. */
+static struct kv_txn *
+pop_read_txn(struct cache *cache) {
 	assert(cache);
-	assert(iterator);
-
-	MDB_txn *txn = NULL;
-	int ret = get_txn(cache, MDB_RDONLY, &txn);
-
-	if (ret != 0) {
-		return ret;
-	}
 
-	MDB_cursor *cursor = NULL;
-	ret = mdb_cursor_open(txn, cache->dbs[DB_ROOMS], &cursor);
+	struct kv_txn *txn = NULL;
 
-	*iterator = (struct cache_iterator) {
-	  .type = CACHE_ITERATOR_ROOMS,
-	  .txn = txn,
-	  .cursor = cursor,
-	  .cache = cache,
-	  .room_id = room_id,
-	};
+	pthread_mutex_lock(&cache->read_txns.mutex);
 
-	if (ret != 0) {
-		cache_iterator_finish(iterator);
+	if (cache->read_txns.len > 0) {
+		txn = cache->read_txns.txns[--cache->read_txns.len];
 	}
 
-	return ret;
+	pthread_mutex_unlock(&cache->read_txns.mutex);
+
+	return txn;
 }
 
-int
-cache_iterator_events(struct cache *cache, struct cache_iterator *iterator,
-  const char *room_id, struct cache_iterator_event *event, uint64_t end_index,
-  uint64_t num_fetch, unsigned timeline_events, unsigned state_events) {
+/* Abort all pooled txns, the pool must not be used concurrently. */
+static void
+drain_read_txns(struct cache *cache) {
 	assert(cache);
-	assert(iterator);
-	assert(room_id);
-	assert(event);
 
-	MDB_txn *txn = NULL;
-	int ret = get_txn(cache, MDB_RDONLY, &txn);
+	pthread_mutex_lock(&cache->read_txns.mutex);
 
-	if (ret != 0) {
-		return ret;
+	for (size_t i = 0; i < cache->read_txns.len; i++) {
+		kv_txn_abort(cache->read_txns.txns[i]);
 	}
 
-	MDB_dbi events_dbi = 0;
-	MDB_dbi order_dbi = 0;
-	MDB_cursor *cursor = NULL;
+	cache->read_txns.len = 0;
 
-	if ((ret = get_dbi(ROOM_DB_EVENTS, txn, &events_dbi, room_id)) == 0
-		&& (ret = get_dbi(ROOM_DB_ORDER_TO_EVENTS, txn, &order_dbi, room_id))
-			 == 0
-		&& (ret = mdb_cursor_open(txn, order_dbi, &cursor)) == 0) {
-		MDB_val start_key = {sizeof(end_index), &end_index};
+	pthread_mutex_unlock(&cache->read_txns.mutex);
+}
+
+/* The lock is held until end_txn(), end_read_txn() or abort_txn(), as the map
+ * can only be resized when there are no active txns. */
+static int
+get_txn(struct cache *cache, unsigned flags, struct kv_txn **txn) {
+	assert(cache);
+	assert(txn);
+
+	const bool write = !(flags & MDB_RDONLY);
+
+	if (write) {
+		pthread_mutex_lock(&cache->write_lock);
+	}
+
+	pthread_rwlock_rdlock(&cache->resize_lock);
 
-		if (end_index == (uint64_t) -1) {
-			MDB_val start_value = {0};
-			ret = mdb_cursor_get(cursor, &start_key, &start_value, MDB_LAST);
+	int ret = MDB_NOTFOUND;
+
+	/* Lost after failing to reopen it when compacting. */
+	if (!cache->env) {
+		ret = EIO;
+	} else if ((flags & MDB_RDONLY) && (*txn = pop_read_txn(cache))) {
+		if ((ret = kv_txn_renew(*txn)) == MDB_SUCCESS) {
+			cache->txn_renews++;
+		} else {
+			kv_txn_abort(*txn);
+		}
+	}
+
+	if (ret != MDB_SUCCESS && cache->env
+		&& (ret = kv_txn_begin(cache->env, flags, txn))
+			 == MDB_SUCCESS) {
+		cache->txn_begins++;
+	}
+
+	if (ret != MDB_SUCCESS) {
+		*txn = NULL;
+		pthread_rwlock_unlock(&cache->resize_lock);
+
+		if (write) {
+			pthread_mutex_unlock(&cache->write_lock);
 		}
 
-		if (ret == 0) {
-			/* Position at given index. */
-			ret = mdb_cursor_get(cursor, &start_key, NULL, MDB_SET);
+		if (!cache->env) {
+			return ret;
 		}
 	}
 
-	*iterator = (struct cache_iterator) {
-	  .type = CACHE_ITERATOR_EVENTS,
-	  .txn = txn,
-	  .cursor = cursor,
-	  .cache = cache,
-	  .event = event,
-	  .events_dbi = events_dbi,
-	  .num_fetch = num_fetch,
-	  .timeline_events = timeline_events,
-	  .state_events = state_events,
-	};
+	ABORT_OR_RETURN(ret);
+}
 
-	if (ret != 0) {
-		cache_iterator_finish(iterator);
+/* Only for write txns, read txns are ended with end_read_txn(). */
+static int
+end_txn(struct cache *cache, struct kv_txn *txn) {
+	assert(cache);
+
+	if (!txn) {
+		return MDB_SUCCESS;
 	}
 
-	return ret;
+	int ret = kv_txn_commit(txn);
+	pthread_rwlock_unlock(&cache->resize_lock);
+	pthread_mutex_unlock(&cache->write_lock);
+
+	ABORT_OR_RETURN(ret);
 }
 
-int
-cache_iterator_member(struct cache *cache, struct cache_iterator *iterator,
-  const char *room_id, struct cache_iterator_member *member) {
+/* Read-only txns are reset and put back in the pool instead of committing. */
+static void
+end_read_txn(struct cache *cache, struct kv_txn *txn) {
 	assert(cache);
-	assert(iterator);
-	assert(room_id);
-	assert(member);
 
-	MDB_txn *txn = NULL;
-	int ret = get_txn(cache, MDB_RDONLY, &txn);
+	if (!txn) {
+		return;
+	}
 
-	if (ret != 0) {
-		return ret;
+	kv_txn_reset(txn);
+
+	pthread_mutex_lock(&cache->read_txns.mutex);
+
+	if (cache->read_txns.len < CACHE_READ_TXN_POOL_MAX) {
+		cache->read_txns.txns[cache->read_txns.len++] = txn;
+		txn = NULL;
 	}
 
-	MDB_dbi dbi = 0;
-	MDB_cursor *cursor = NULL;
+	pthread_mutex_unlock(&cache->read_txns.mutex);
 
-	if ((ret = get_dbi(ROOM_DB_MEMBERS, txn, &dbi, room_id)) == 0
-		&& (ret = mdb_cursor_open(txn, dbi, &cursor)) == 0) {
-		/* Success */
+	if (txn) {
+		kv_txn_abort(txn);
 	}
 
-	*iterator = (struct cache_iterator) {
-	  .type = CACHE_ITERATOR_MEMBER,
-	  .txn = txn,
-	  .cursor = cursor,
+	pthread_rwlock_unlock(&cache->resize_lock);
+}
+
+/* Only for write txns. */
+static void
+abort_txn(struct cache *cache, struct kv_txn *txn) {
+	assert(cache);
+
+	if (txn) {
+		kv_txn_abort(txn);
+		pthread_rwlock_unlock(&cache->resize_lock);
+		pthread_mutex_unlock(&cache->write_lock);
+	}
+}
+
+/* The txn of a pinned snapshot only holds resize_lock while it begins. */
+static int
+begin_pin_txn(struct cache *cache, struct cache_snapshot *snapshot) {
+	assert(cache);
+	assert(snapshot);
+
+	*snapshot = (struct cache_snapshot) {
 	  .cache = cache,
-	  .member = member,
+	  .events_epoch = event_cache_epoch(&cache->events),
+	  .pinned = true,
 	};
 
-	if (ret != 0) {
-		cache_iterator_finish(iterator);
+	pthread_rwlock_rdlock(&cache->resize_lock);
+	int ret = cache->env
+				? kv_txn_begin(cache->env, MDB_RDONLY, &snapshot->txn)
+				: EIO;
+	pthread_rwlock_unlock(&cache->resize_lock);
+
+	if (ret == MDB_SUCCESS) {
+		cache->txn_begins++;
+	} else {
+		snapshot->txn = NULL;
 	}
 
 	return ret;
 }
 
-int
-cache_iterator_spaces(struct cache *cache, struct cache_iterator *iterator,
-  struct cache_iterator_space *space) {
+/* Copy everything referencing the pinned snapshot and end it, with the mutex
+ * of the pin held. */
+static void
+release_pin(struct cache *cache) {
 	assert(cache);
-	assert(iterator);
-	assert(space);
 
-	MDB_txn *txn = NULL;
-	int ret = get_txn(cache, MDB_RDONLY, &txn);
+	if (cache->pin.txn) {
+		cache->pin.cb(NULL, cache->pin.userp);
+		kv_txn_abort(cache->pin.txn);
+		cache->pin.txn = NULL;
+	}
+}
 
-	if (ret != 0) {
-		return ret;
+/* Lock the pin with the pinned snapshot released, so that the map can be
+ * resized or swapped. The owner releases it right away, other threads wake it
+ * up and wait for it's next cache_pin_renew(). */
+static void
+lock_pin(struct cache *cache) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->pin.mutex);
+
+	if (pthread_equal(cache->pin.owner, pthread_self())) {
+		release_pin(cache);
 	}
 
-	MDB_cursor *cursor = NULL;
+	while (cache->pin.txn) {
+		if (!cache->pin.release) {
+			cache->pin.release = true;
 
-	if ((ret = mdb_cursor_open(txn, cache->dbs[DB_SPACE_CHILDREN], &cursor))
-		!= MDB_SUCCESS) {
-		mdb_txn_commit(txn);
-		return ret;
+			if (cache->pin.wake) {
+				cache->pin.wake(cache->pin.userp);
+			}
+		}
+
+		pthread_cond_wait(&cache->pin.cond, &cache->pin.mutex);
 	}
+}
 
-	*iterator = (struct cache_iterator) {.type = CACHE_ITERATOR_SPACES,
-	  .txn = txn,
-	  .cursor = cursor,
-	  .cache = cache,
-	  .space = space};
+static void
+unlock_pin(struct cache *cache) {
+	assert(cache);
 
-	return ret;
+	cache->pin.release = false;
+	pthread_mutex_unlock(&cache->pin.mutex);
 }
 
-void
-cache_iterator_finish(struct cache_iterator *iterator) {
-	if (iterator) {
-		/* Cursor might be inherited from another iterator so only free it if we
-		 * have a txn. */
-		if (iterator->txn) {
-			mdb_cursor_close(iterator->cursor);
+/* Must not be called with an active txn in the calling thread, other than the
+ * pinned snapshot. */
+static int
+grow_map(struct cache *cache) {
+	assert(cache);
+
+	lock_pin(cache);
+	pthread_rwlock_wrlock(&cache->resize_lock);
+
+	/* Don't let any txn outlive the old mapping. */
+	drain_read_txns(cache);
+
+	struct kv_env_info info = {0};
+	int ret = cache->env ? kv_env_info(cache->env, &info) : EIO;
+
+	if (ret == MDB_SUCCESS) {
+		size_t map_size = info.map_size * 2;
+
+		if (map_size <= info.map_size) {
+			ret = ENOMEM;
+		} else if ((ret = kv_env_set_mapsize(cache->env, map_size))
+				   == MDB_SUCCESS) {
+			LOG(LOG_MESSAGE, "Grew map from %zu to %zu MiB",
+			  info.map_size / MIB, map_size / MIB);
 		}
+	}
 
-		mdb_txn_commit(iterator->txn);
+	pthread_rwlock_unlock(&cache->resize_lock);
+	unlock_pin(cache);
 
-		memset(iterator, 0, sizeof(*iterator));
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to grow map: %s", mdb_strerror(ret));
 	}
+
+	return ret;
 }
 
-int
-cache_init(struct cache *cache) {
+/* Grow the map before it's full, so that a sync response rarely has to be
+ * saved again. */
+static void
+maybe_grow_map(struct cache *cache) {
 	assert(cache);
 
-	*cache = (struct cache) {0};
+	struct kv_env_info info = {0};
 
-	const mode_t dir_perms = 0755;
-	const mode_t db_perms = 0600;
+	if (!cache->env || (kv_env_info(cache->env, &info)) != MDB_SUCCESS) {
+		return;
+	}
 
-	enum {
-		max_dbs = 4096,
-		db_size = 1 * 1024 * 1024 * 1024, /* 1 GB */
-		/* Arbitrarily large map size.
-		 * https://github.com/zevv/duc/issues/163 */
-		map_size = db_size,
-	};
+	const size_t threshold = (info.map_size / 4) * 3;
 
-	char dir[] = "/tmp/db";
+	if (info.used >= threshold) {
+		grow_map(cache);
+	}
+}
 
-	int ret = 0;
+/* LMDB doesn't expose the error state of a txn, but any operation on a txn
+ * that failed returns MDB_BAD_TXN. */
+static bool
+txn_failed(struct cache *cache, struct kv_txn *txn) {
+	assert(cache);
+	assert(txn);
 
-	if ((ret = mkdir_parents(dir, dir_perms)) != 0) {
-		return ret;
-	}
+	const char *key = meta_keys[META_SCHEMA_VERSION];
+	MDB_val data = {0};
 
-	MDB_txn *txn = NULL;
+	return (kv_get(txn, cache->dbs[DB_META],
+			 &(MDB_val) {strlen(key) + 1, noconst(key)}, &data))
+		== MDB_BAD_TXN;
+}
 
-	const unsigned multiple_readonly_txn_per_thread = MDB_NOTLS;
+static uint64_t
+ms_since(const struct timespec *start) {
+	assert(start);
 
-	if ((ret = mdb_env_create(&cache->env)) == MDB_SUCCESS
-		&& (ret = mdb_env_set_maxdbs(cache->env, max_dbs)) == MDB_SUCCESS
-		&& (ret = mdb_env_set_mapsize(cache->env, map_size)) == MDB_SUCCESS
-		&& (ret = mdb_env_open(
-			  cache->env, dir, multiple_readonly_txn_per_thread, db_perms))
-			 == MDB_SUCCESS
-		&& (ret = get_txn(cache, 0, &txn)) == MDB_SUCCESS) {
+	struct timespec now = {0};
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-		for (size_t i = 0; i < DB_MAX; i++) {
-			if ((ret = mdb_dbi_open(
-				   txn, db_names[i], MDB_CREATE | db_flags[i], &cache->dbs[i]))
-				!= MDB_SUCCESS) {
-				cache_finish(cache);
-				mdb_txn_commit(txn);
+	const int64_t ms_in_sec = 1000;
+	const int64_t ns_in_ms = 1000000;
 
-				return ret;
-			}
-		}
+	int64_t ms = ((now.tv_sec - start->tv_sec) * ms_in_sec)
+			   + ((now.tv_nsec - start->tv_nsec) / ns_in_ms);
 
-		mdb_txn_commit(txn);
-		return 0;
+	return ms > 0 ? (uint64_t) ms : 0;
+}
+
+/* Sync commits that weren't fully synced due to the durability mode. */
+static int
+flush(struct cache *cache) {
+	assert(cache);
+
+	if (cache->durability == CACHE_DURABILITY_SYNC) {
+		return MDB_SUCCESS;
 	}
 
-	cache_finish(cache);
-	mdb_txn_commit(txn);
+	/* The map must not be resized while msync'ing it with MDB_WRITEMAP. */
+	pthread_rwlock_rdlock(&cache->resize_lock);
+	int ret = cache->env ? kv_env_sync(cache->env) : EIO;
+	pthread_rwlock_unlock(&cache->resize_lock);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to flush cache: %s", mdb_strerror(ret));
+	}
 
 	return ret;
 }
 
-void
-cache_finish(struct cache *cache) {
-	if (!cache) {
+/* Sync everything committed so far, and only then save the next_batch token
+ * covering it. Otherwise a crash could persist the token without the events,
+ * which would never be fetched again. */
+static void
+flush_pending(struct cache *cache) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->flusher.mutex);
+
+	char *next_batch = cache->flusher.next_batch;
+	bool dirty = cache->flusher.dirty;
+
+	cache->flusher.next_batch = NULL;
+	cache->flusher.dirty = false;
+
+	pthread_mutex_unlock(&cache->flusher.mutex);
+
+	if (!dirty) {
+		assert(!next_batch);
 		return;
 	}
 
-	mdb_env_close(cache->env);
-	memset(cache, 0, sizeof(*cache));
+	int ret = flush(cache);
+
+	if (ret == MDB_SUCCESS && next_batch) {
+		/* Synced by cache_auth_set() itself. */
+		ret = cache_auth_set(cache, DB_KEY_NEXT_BATCH, next_batch);
+	}
+
+	if (ret != MDB_SUCCESS) {
+		pthread_mutex_lock(&cache->flusher.mutex);
+
+		/* Retry in the next interval unless a newer token was committed. */
+		if (!cache->flusher.next_batch) {
+			cache->flusher.next_batch = next_batch;
+			next_batch = NULL;
+		}
+
+		cache->flusher.dirty = true;
+
+		pthread_mutex_unlock(&cache->flusher.mutex);
+	}
+
+	free(next_batch);
 }
 
-char *
-cache_auth_get(struct cache *cache, enum auth_key key) {
+static void *
+flusher_thread(void *arg) {
+	struct cache *cache = arg;
 	assert(cache);
 
-	MDB_txn *txn = NULL;
-	char *ret = NULL;
+	const long ms_in_sec = 1000;
+	const long ns_in_ms = 1000000;
+	const long ns_in_sec = 1000000000;
 
-	if ((get_txn(cache, 0, &txn)) == MDB_SUCCESS && txn) {
-		ret = get_str_and_dup(txn, cache->dbs[DB_AUTH], noconst(db_keys[key]));
+	pthread_mutex_lock(&cache->flusher.mutex);
+
+	while (!cache->flusher.stop) {
+		struct timespec deadline = {0};
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+		deadline.tv_sec += cache->commit_window_ms / ms_in_sec;
+		deadline.tv_nsec += (cache->commit_window_ms % ms_in_sec) * ns_in_ms;
+
+		if (deadline.tv_nsec >= ns_in_sec) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= ns_in_sec;
+		}
+
+		while (!cache->flusher.stop
+			   && (pthread_cond_timedwait(
+					&cache->flusher.cond, &cache->flusher.mutex, &deadline))
+					!= ETIMEDOUT) {
+		}
+
+		if (cache->flusher.stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&cache->flusher.mutex);
+		flush_pending(cache);
+		pthread_mutex_lock(&cache->flusher.mutex);
 	}
 
-	mdb_txn_commit(txn);
+	pthread_mutex_unlock(&cache->flusher.mutex);
 
-	return ret;
+	return NULL;
 }
 
-int
-cache_auth_set(struct cache *cache, enum auth_key key, char *auth) {
+static int
+start_flusher(struct cache *cache) {
 	assert(cache);
-	assert(auth);
 
-	MDB_txn *txn = NULL;
-	int ret = get_txn(cache, 0, &txn);
+	pthread_condattr_t attr;
 
-	if (ret == MDB_SUCCESS) {
-		ret = put_str(txn, cache->dbs[DB_AUTH], noconst(db_keys[key]), auth, 0);
+	if ((pthread_condattr_init(&attr)) != 0) {
+		return ENOMEM;
+	}
+
+	int ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	if (ret == 0
+		&& (ret = pthread_mutex_init(&cache->flusher.mutex, NULL)) == 0) {
+		if ((ret = pthread_cond_init(&cache->flusher.cond, &attr)) == 0) {
+			cache->flusher.initialized = true;
+		} else {
+			pthread_mutex_destroy(&cache->flusher.mutex);
+		}
+	}
+
+	pthread_condattr_destroy(&attr);
+
+	if (ret == 0
+		&& (ret = pthread_create(
+			  &cache->flusher.thread, NULL, flusher_thread, cache))
+			 == 0) {
+		cache->flusher.running = true;
 	}
 
-	mdb_txn_commit(txn);
 	return ret;
 }
 
-char *
-cache_room_name(struct cache *cache, MDB_txn *txn, const char *room_id) {
-	if (cache && txn && room_id) {
-		MDB_dbi dbi = 0;
-		char *res = NULL;
-		matrix_json_t *json = NULL;
+/* Stop the flusher and sync whatever it didn't get to. */
+static void
+stop_flusher(struct cache *cache) {
+	assert(cache);
 
-		if (get_dbi(ROOM_DB_STATE, txn, &dbi, room_id) == MDB_SUCCESS) {
-			char state_key[] = "m.room.name";
-			char state_fallback[] = "m.room.canonical_alias";
+	if (!cache->flusher.initialized) {
+		return;
+	}
 
-			MDB_val value = {0};
-			struct matrix_state_event sevent;
-
-			if (((get_str(txn, dbi, state_key, &value)) == MDB_SUCCESS
-				  || (get_str(txn, dbi, state_fallback, &value)) == MDB_SUCCESS)
-				&& (json
-					= matrix_json_parse((char *) value.mv_data, value.mv_size))
-				&& (matrix_event_state_parse(&sevent, json)) == 0) {
-				switch (sevent.type) {
-				case MATRIX_ROOM_NAME:
-					res = sevent.content.name.name;
-					break;
-				case MATRIX_ROOM_CANONICAL_ALIAS:
-					res = sevent.content.canonical_alias.alias;
-					break;
-				default:
-					break;
-				}
-			} else {
-				/* TODO Check if DM. */
-			}
-		}
+	if (cache->flusher.running) {
+		pthread_mutex_lock(&cache->flusher.mutex);
+		cache->flusher.stop = true;
+		pthread_cond_signal(&cache->flusher.cond);
+		pthread_mutex_unlock(&cache->flusher.mutex);
+
+		pthread_join(cache->flusher.thread, NULL);
+		cache->flusher.running = false;
+	}
+
+	flush_pending(cache);
+
+	free(cache->flusher.next_batch);
+	pthread_cond_destroy(&cache->flusher.cond);
+	pthread_mutex_destroy(&cache->flusher.mutex);
+
+	cache->flusher.next_batch = NULL;
+	cache->flusher.initialized = false;
+}
+
+/* Log the rate at which txns are started, at most once a minute. */
+static void
+log_stats(struct cache *cache) {
+	assert(cache);
+
+	const uint64_t interval_ms = 60000;
+	uint64_t elapsed = ms_since(&cache->last_stats);
+
+	if (elapsed < interval_ms) {
+		return;
+	}
+
+	struct cache_stats stats = {0};
+	cache_stats(cache, &stats);
+
+	const uint64_t txns = stats.txn_begins + stats.txn_renews;
+	const uint64_t ms_in_sec = 1000;
+
+	LOG(LOG_MESSAGE,
+	  "%" PRIu64 " txns/s over the last %" PRIu64 " s, %" PRIu64
+	  " begun and %" PRIu64 " renewed in total, %" PRIu64
+	  " event pages, %" PRIu64 "/%" PRIu64 " decoded events cached",
+	  ((txns - cache->last_stats_txns) * ms_in_sec) / elapsed,
+	  elapsed / ms_in_sec, stats.txn_begins, stats.txn_renews,
+	  stats.event_pages, stats.event_hits,
+	  stats.event_hits + stats.event_misses);
+
+	cache->last_stats_txns = txns;
+	clock_gettime(CLOCK_MONOTONIC, &cache->last_stats);
+}
+
+static bool
+is_str(MDB_val *val) {
+	assert(val);
+
+	return (
+	  val->mv_size > 0 && ((char *) val->mv_data)[val->mv_size - 1] == '\0');
+}
+
+/* ROOM_DB_MEMBER_NAMES values are [u8 flags][displayname], with an empty
+ * displayname if the user has none. The membership is kept next to it so that
+ * member events don't have to parse the previous event. */
+enum { MEMBER_NAME_JOINED = 1 << 0 };
+
+static bool
+member_name_joined(const MDB_val *data) {
+	assert(data);
+
+	return data->mv_size > 0
+		&& (((unsigned char *) data->mv_data)[0] & MEMBER_NAME_JOINED);
+}
+
+static char *
+member_name(MDB_val *data) {
+	assert(data);
+	assert(data->mv_size > 1);
+	assert(is_str(data));
+
+	return data->mv_size > 2 ? &((char *) data->mv_data)[1] : NULL;
+}
+
+/* Position the cursor at the last event in ROOM_DB_EVENTS for the room, by
+ * seeking to the first key of the next room and going back. */
+static int
+seek_last_event(struct kv_cursor *cursor, uint32_t room, MDB_val *key) {
+	assert(cursor);
+	assert(key);
+
+	struct room_key next_room;
+	MDB_val data = {0};
+
+	int ret = room_key(&next_room, room + 1, NULL, 0);
+	assert(ret == 0);
+
+	*key = next_room.val;
+
+	ret = kv_cursor_get(cursor, key, &data, MDB_SET_RANGE);
+	ret = kv_cursor_get(
+	  cursor, key, &data, (ret == MDB_SUCCESS ? MDB_PREV : MDB_LAST));
+
+	if (ret == MDB_SUCCESS && !(room_key_in_room(key, room))) {
+		ret = MDB_NOTFOUND;
+	}
+
+	return ret;
+}
+
+/* Position the cursor at the last event of the room with an index <= index,
+ * the same way as seek_last_event(). */
+static int
+seek_event_before(
+  struct kv_cursor *cursor, uint32_t room, uint64_t index, MDB_val *key) {
+	assert(cursor);
+	assert(key);
+
+	if (index == UINT64_MAX) {
+		return seek_last_event(cursor, room, key);
+	}
+
+	struct room_key next;
+	MDB_val data = {0};
+
+	room_key_index(&next, room, index + 1);
+
+	*key = next.val;
+
+	int ret = kv_cursor_get(cursor, key, &data, MDB_SET_RANGE);
+
+	if (ret == MDB_SUCCESS || ret == MDB_NOTFOUND) {
+		ret = kv_cursor_get(
+		  cursor, key, &data, (ret == MDB_SUCCESS ? MDB_PREV : MDB_LAST));
+	}
+
+	if (ret == MDB_SUCCESS && !(room_key_in_room(key, room))) {
+		ret = MDB_NOTFOUND;
+	}
+
+	return ret;
+}
+
+static void
+block_dict(struct cache *cache, const unsigned char **dict, size_t *size) {
+	assert(cache);
+	assert(dict);
+	assert(size);
+
+	pthread_mutex_lock(&cache->blocks.mutex);
+	*dict = cache->blocks.dict;
+	*size = cache->blocks.dict_size;
+	pthread_mutex_unlock(&cache->blocks.mutex);
+}
+
+/* Reference the decompressed block stored in data, it is only inflated if it
+ * isn't cached. NULL if the block is corrupt. */
+static struct event_block *
+block_load(struct cache *cache, const MDB_val *data) {
+	assert(cache);
+	assert(data);
+
+	struct event_block_header header = {0};
+
+	if ((event_block_header(data->mv_data, data->mv_size, &header)) == -1) {
+		LOG(LOG_ERROR, "Invalid event block! Corrupt database?");
+		return NULL;
+	}
+
+	struct event_block **lru = cache->blocks.lru;
+
+	pthread_mutex_lock(&cache->blocks.mutex);
+
+	for (size_t i = 0; i < cache->blocks.len; i++) {
+		if (lru[i]->id == header.id) {
+			struct event_block *block = lru[i];
+
+			memmove(
+			  &lru[i], &lru[i + 1], (cache->blocks.len - i - 1) * sizeof(*lru));
+			lru[cache->blocks.len - 1] = event_block_ref(block);
+
+			pthread_mutex_unlock(&cache->blocks.mutex);
+			return block;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->blocks.mutex);
+
+	const unsigned char *dict = NULL;
+	size_t dict_size = 0;
+	block_dict(cache, &dict, &dict_size);
+
+	/* Inflated without holding the lock, at worst another thread inflates
+	 * the same block concurrently. */
+	struct event_block *block
+	  = event_block_decompress(data->mv_data, data->mv_size, dict, dict_size);
+
+	if (!block) {
+		LOG(LOG_ERROR, "Invalid event block %" PRIu64 "! Corrupt database?",
+		  header.id);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->blocks.mutex);
+
+	if (cache->blocks.len == CACHE_BLOCK_CACHE_MAX) {
+		event_block_unref(lru[0]);
+		memmove(&lru[0], &lru[1], (cache->blocks.len - 1) * sizeof(*lru));
+		cache->blocks.len--;
+	}
+
+	lru[cache->blocks.len++] = event_block_ref(block);
+
+	pthread_mutex_unlock(&cache->blocks.mutex);
+
+	return block;
+}
+
+/* Find the block of the room that contains the event. */
+static int
+block_find(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t index, MDB_val *data) {
+	assert(cache);
+	assert(txn);
+	assert(data);
+
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = {0};
+	struct event_block_header header = {0};
+
+	int ret = kv_cursor_open(
+	  txn, cache->room_dbs[ROOM_DB_EVENT_BLOCKS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = seek_event_before(cursor, room, index, &key)) == MDB_SUCCESS
+		&& (ret = kv_cursor_get(cursor, &key, data, MDB_GET_CURRENT))
+			 == MDB_SUCCESS
+		&& ((event_block_header(data->mv_data, data->mv_size, &header)) == -1
+			|| header.last_index < index)) {
+		ret = MDB_NOTFOUND;
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret;
+}
+
+/* Look up the record of an event, whether it is compressed or not. If it is
+ * in a block, *block stores a reference that must be released once the
+ * record isn't used anymore. */
+static int
+event_get(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t index, MDB_val *record, struct event_block **block) {
+	assert(record);
+	assert(block);
+
+	*block = NULL;
+
+	int ret = room_get_index(cache, txn, room, ROOM_DB_EVENTS, index, record);
+	MDB_val data = {0};
+
+	if (ret != MDB_NOTFOUND
+		|| (ret = block_find(cache, txn, room, index, &data)) != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct event_block *found = block_load(cache, &data);
+	ptrdiff_t entry = found ? event_block_find(found, index) : -1;
+
+	if (entry == -1) {
+		event_block_unref(found);
+		return MDB_NOTFOUND;
+	}
+
+	*record = (MDB_val) {found->entries[entry].record_size,
+	  (void *) (uintptr_t) found->entries[entry].record};
+	*block = found;
+
+	return MDB_SUCCESS;
+}
+
+/* Move the events of a block back to ROOM_DB_EVENTS and ROOM_DB_EVENTS_JSON,
+ * so that they can be modified or pruned. They're compressed again by the
+ * next cache_freeze(). */
+static int
+block_thaw(
+  struct cache *cache, struct kv_txn *txn, uint32_t room, const MDB_val *data) {
+	assert(cache);
+	assert(txn);
+	assert(data);
+
+	struct event_block *block = block_load(cache, data);
+
+	/* The events can't be recovered. */
+	if (!block) {
+		abort();
+	}
+
+	int ret = MDB_SUCCESS;
+
+	for (size_t i = 0, len = arrlenu(block->entries);
+		 i < len && ret == MDB_SUCCESS; i++) {
+		const struct event_block_entry *entry = &block->entries[i];
+		struct room_key key;
+		room_key_index(&key, room, entry->index);
+
+		ret = kv_put(txn, cache->room_dbs[ROOM_DB_EVENTS], &key.val,
+		  &(MDB_val) {entry->record_size, (void *) (uintptr_t) entry->record},
+		  0);
+
+		if (ret == MDB_SUCCESS && entry->json) {
+			ret = kv_put(txn, cache->room_dbs[ROOM_DB_EVENTS_JSON], &key.val,
+			  &(MDB_val) {entry->json_size, noconst(entry->json)}, 0);
+		}
+	}
+
+	/* Blocks are keyed by the index of their first event. */
+	if (ret == MDB_SUCCESS) {
+		ret = room_del_index(cache, txn, room, ROOM_DB_EVENT_BLOCKS,
+		  block->entries[0].index);
+	}
+
+	event_block_unref(block);
+
+	ABORT_OR_RETURN(ret);
+}
+
+/* Thaw the block containing the event, MDB_NOTFOUND if it isn't compressed. */
+static int
+event_thaw(
+  struct cache *cache, struct kv_txn *txn, uint32_t room, uint64_t index) {
+	MDB_val data = {0};
+	int ret = block_find(cache, txn, room, index, &data);
+
+	return ret == MDB_SUCCESS ? block_thaw(cache, txn, room, &data) : ret;
+}
+
+/* Defined with the other room info helpers below. */
+static int
+room_info_from_summary(struct cache *cache, struct kv_txn *txn,
+  const char *room_id, MDB_val *value, struct room_info *info);
+
+static int
+cache_rooms_next(struct cache_iterator *iterator) {
+	assert(iterator);
+	assert(iterator->type == CACHE_ITERATOR_ROOMS);
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	int ret = kv_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	assert(is_str(&key));
+
+	*iterator->room_id = key.mv_data;
+
+	if (iterator->room_info) {
+		ret = room_info_from_summary(iterator->cache, iterator->txn,
+		  key.mv_data, &data, iterator->room_info);
+	}
+
+	return ret;
+}
+
+/* Parse an event from JSON into the entry, either a legacy record or from
+ * ROOM_DB_EVENTS_JSON. Returns false if the event was redacted. */
+static bool
+parse_event_json(struct event_cache_entry *entry, MDB_val *db_json) {
+	assert(entry);
+	assert(db_json);
+	assert(is_str(db_json));
+
+	matrix_json_t *json = matrix_json_parse(db_json->mv_data, db_json->mv_size);
+	assert(json);
+
+	if ((matrix_event_sync_parse(&entry->event, json)) != 0) {
+		if (entry->event.type == MATRIX_EVENT_TIMELINE
+			&& !(matrix_json_has_content(json))) {
+			matrix_json_delete(json);
+			return false;
+		}
+
+		LOG(LOG_ERROR, "Failed to parse event JSON '%s'",
+		  (char *) db_json->mv_data);
+		abort();
+	}
+
+	event_cache_entry_set_json(entry, json, db_json->mv_size);
+	return true;
+}
+
+static bool
+event_wanted(
+  struct cache_iterator *iterator, enum matrix_event_type type, unsigned sub) {
+	assert(iterator);
+
+	switch (type) {
+	case MATRIX_EVENT_STATE:
+		return (iterator->state_events & sub) == sub;
+	case MATRIX_EVENT_TIMELINE:
+		return (iterator->timeline_events & sub) == sub;
+	default:
+		assert(0);
+		return false;
+	}
+}
+
+/* A single lookup for the summary and another for the latest edit, whatever
+ * the number of relations. Edits stored as legacy JSON records are skipped
+ * as the body would have to outlive the parsed JSON. */
+static void
+decode_aggregation(struct cache_iterator *iterator, uint64_t index) {
+	assert(iterator);
+
+	struct cache_iterator_event *event = iterator->event;
+	MDB_val record = {0};
+	struct matrix_sync_event edit = {0};
+	unsigned flags = 0;
+
+	if ((aggregation_get(iterator->cache, iterator->txn, iterator->events_room,
+		  index, &event->aggregation))
+		  != MDB_SUCCESS
+		|| event->aggregation.edit_index == (uint64_t) -1
+		|| (event_get(iterator->cache, iterator->txn, iterator->events_room,
+			 event->aggregation.edit_index, &record, &iterator->edit_block))
+			 != MDB_SUCCESS
+		|| (event_record_decode(record.mv_data, record.mv_size, &edit, &flags))
+			 != 0
+		|| (flags & EVENT_RECORD_REDACTED)
+		|| edit.type != MATRIX_EVENT_TIMELINE
+		|| edit.timeline.type != MATRIX_ROOM_MESSAGE) {
+		return;
+	}
+
+	event->edit_body = edit.timeline.message.body;
+}
+
+/* Decode the record into a new entry, NULL if the event was redacted. json is
+ * the raw JSON of compressed events, NULL if it has to be looked up in
+ * ROOM_DB_EVENTS_JSON. */
+static struct event_cache_entry *
+decode_entry(struct cache_iterator *iterator, uint64_t index, MDB_val *record,
+  MDB_val *json) {
+	assert(iterator);
+	assert(record);
+
+	struct event_cache_entry *entry = NULL;
+
+	if (event_record_is_legacy(record->mv_data, record->mv_size)) {
+		entry = event_cache_entry_new(iterator->events_room, index, NULL, 0);
+		assert(entry);
+
+		if (!(parse_event_json(entry, record))) {
+			event_cache_entry_unref(entry);
+			return NULL;
+		}
+
+		return entry;
+	}
+
+	/* The event points into the copy of the record. */
+	entry = event_cache_entry_new(
+	  iterator->events_room, index, record->mv_data, record->mv_size);
+	assert(entry);
+
+	unsigned flags = 0;
+
+	if ((event_record_decode(entry->record, record->mv_size, &entry->event,
+		  &flags))
+		== -1) {
+		LOG(LOG_ERROR,
+		  "Invalid record for event %" PRIu64 "! Corrupt database?", index);
+		abort();
+	}
+
+	/* Attachments aren't representable by a record. */
+	if ((flags & EVENT_RECORD_HAS_JSON)
+		&& entry->event.type == MATRIX_EVENT_TIMELINE
+		&& entry->event.timeline.type == MATRIX_ROOM_ATTACHMENT) {
+		MDB_val db_json = {0};
+		int ret = MDB_NOTFOUND;
+
+		if (!json) {
+			ret = room_get_index(iterator->cache, iterator->txn,
+			  iterator->events_room, ROOM_DB_EVENTS_JSON, index, &db_json);
+		} else if (json->mv_size > 0) {
+			db_json = *json;
+			ret = MDB_SUCCESS;
+		}
+
+		assert(ret == MDB_SUCCESS);
+
+		if (ret != MDB_SUCCESS || !(parse_event_json(entry, &db_json))) {
+			event_cache_entry_unref(entry);
+			return NULL;
+		}
+	}
+
+	return entry;
+}
+
+/* Fill iterator->event from the event cache, decoding the record on a miss.
+ * Hot events of a pinned snapshot are decoded in place instead, as the record
+ * outlives the iteration. Returns false if the event should be skipped. */
+static bool
+decode_event(struct cache_iterator *iterator, uint64_t index, MDB_val *record,
+  MDB_val *json) {
+	assert(iterator);
+	assert(record);
+
+	struct event_cache *events = &iterator->cache->events;
+
+	iterator->event->aggregation
+	  = (struct cache_aggregation) {.edit_index = (uint64_t) -1};
+	iterator->event->edit_body = NULL;
+
+	bool pinned = false;
+
+	if (!(event_record_is_legacy(record->mv_data, record->mv_size))) {
+		struct event_record_header header = {0};
+
+		if ((event_record_header(record->mv_data, record->mv_size, &header))
+			== -1) {
+			LOG(LOG_ERROR,
+			  "Invalid record for event %" PRIu64 "! Corrupt database?",
+			  index);
+			abort();
+		}
+
+		/* Filter before looking up or decoding the whole record. */
+		if ((header.flags & EVENT_RECORD_REDACTED)
+			|| !event_wanted(iterator, header.event_type, header.type)) {
+			return false;
+		}
+
+		/* Attachments are parsed from their JSON by decode_entry(). */
+		pinned = iterator->events_pinned && !json
+			  && !((header.flags & EVENT_RECORD_HAS_JSON)
+				   && header.event_type == MATRIX_EVENT_TIMELINE
+				   && header.type == MATRIX_ROOM_ATTACHMENT);
+	}
+
+	struct matrix_sync_event *event = &iterator->event->event;
+	iterator->event->pinned = pinned;
+
+	if (pinned) {
+		unsigned flags = 0;
+
+		if ((event_record_decode(
+			  record->mv_data, record->mv_size, event, &flags))
+			== -1) {
+			LOG(LOG_ERROR,
+			  "Invalid record for event %" PRIu64 "! Corrupt database?",
+			  index);
+			abort();
+		}
+	} else {
+		iterator->entry
+		  = event_cache_get(events, iterator->events_room, index);
+
+		if (!iterator->entry) {
+			if (!(iterator->entry
+				  = decode_entry(iterator, index, record, json))) {
+				return false;
+			}
+
+			event_cache_put(events, iterator->entry, iterator->events_epoch);
+		}
+
+		*event = iterator->entry->event;
+	}
+
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		if (!event_wanted(iterator, event->type, event->state.type)) {
+			return false;
+		}
+
+		event->state.is_in_timeline = true;
+		break;
+	case MATRIX_EVENT_TIMELINE:
+		if (!event_wanted(iterator, event->type, event->timeline.type)) {
+			return false;
+		}
+
+		if (event->timeline.type == MATRIX_ROOM_MESSAGE) {
+			decode_aggregation(iterator, index);
+		}
+		break;
+	default:
+		assert(0);
+	}
+
+	return true;
+}
+
+/* The compressed event that comes next, moving to the previous block once
+ * every entry of the current one was returned. NULL if there are no more
+ * compressed events. */
+static const struct event_block_entry *
+next_cold_event(struct cache_iterator *iterator) {
+	assert(iterator);
+
+	while (iterator->block_pending == 0 && iterator->block_cursor) {
+		MDB_val key = {0};
+		MDB_val data = {0};
+
+		event_block_unref(iterator->block);
+		iterator->block = NULL;
+
+		if ((kv_cursor_get(iterator->block_cursor, &key, &data, MDB_PREV))
+			  != MDB_SUCCESS
+			|| !(room_key_in_room(&key, iterator->events_room))
+			|| !(iterator->block = block_load(iterator->cache, &data))) {
+			kv_cursor_close(iterator->block_cursor);
+			iterator->block_cursor = NULL;
+			break;
+		}
+
+		iterator->block_pending = arrlenu(iterator->block->entries);
+	}
+
+	return iterator->block_pending > 0
+		   ? &iterator->block->entries[iterator->block_pending - 1]
+		   : NULL;
+}
+
+/* Compressed and uncompressed events never overlap, so the iterator returns
+ * whichever of the next events from both has the larger index. */
+static int
+cache_event_next(struct cache_iterator *iterator) {
+	assert(iterator);
+	assert(iterator->type == CACHE_ITERATOR_EVENTS);
+
+	for (;;) {
+		event_cache_entry_unref(iterator->entry);
+		iterator->entry = NULL;
+		event_block_unref(iterator->edit_block);
+		iterator->edit_block = NULL;
+
+		if (iterator->num_fetch == 0) {
+			return EINVAL;
+		}
+
+		MDB_val db_index = {0};
+		MDB_val record = {0};
+		uint64_t index = 0;
+		bool hot = false;
+
+		if (iterator->hot_pending) {
+			int ret = kv_cursor_get(
+			  iterator->cursor, &db_index, &record, MDB_GET_CURRENT);
+
+			if (ret != MDB_SUCCESS) {
+				return ret;
+			}
+
+			MDB_val index_data = room_key_data(&db_index);
+			cpy_index_be(&index_data, &index);
+			hot = true;
+		}
+
+		const struct event_block_entry *cold = next_cold_event(iterator);
+		MDB_val json = {0};
+		MDB_val *cold_json = NULL;
+
+		if (cold && (!hot || cold->index > index)) {
+			index = cold->index;
+			record = (MDB_val) {
+			  cold->record_size, (void *) (uintptr_t) cold->record};
+			json = (MDB_val) {cold->json_size, noconst(cold->json)};
+			cold_json = &json;
+
+			iterator->block_pending--;
+		} else if (hot) {
+			/* Stops at the events of the previous room. */
+			iterator->hot_pending
+			  = (kv_cursor_get(iterator->cursor, &db_index,
+				   &(MDB_val) {0}, MDB_PREV))
+				 == MDB_SUCCESS
+			 && room_key_in_room(&db_index, iterator->events_room);
+		} else {
+			return MDB_NOTFOUND;
+		}
+
+		if (!(decode_event(iterator, index, &record, cold_json))) {
+			continue;
+		}
+
+		iterator->num_fetch--;
+		iterator->event->index = index;
+
+		return MDB_SUCCESS;
+	}
+}
+
+static int
+cache_member_next(struct cache_iterator *iterator) {
+	assert(iterator);
+	assert(iterator->type == CACHE_ITERATOR_MEMBER);
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	int ret = MDB_SUCCESS;
+	struct room_key start_key;
+
+	if (iterator->member_iterated_once) {
+		ret = kv_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
+	} else {
+		/* Seek to the first member of the room. */
+		ret = room_key(&start_key, iterator->member_room, NULL, 0);
+		assert(ret == 0);
+
+		key = start_key.val;
+		ret = kv_cursor_get(iterator->cursor, &key, &data, MDB_SET_RANGE);
+		iterator->member_iterated_once = true;
+	}
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if (!(room_key_in_room(&key, iterator->member_room))) {
+		return MDB_NOTFOUND;
+	}
+
+	key = room_key_data(&key);
+
+	assert(is_str(&key));
+
+	*iterator->member = (struct cache_iterator_member) {
+	  .mxid = key.mv_data,
+	  .username = member_name(&data),
+	};
+
+	return ret;
+}
+
+static int
+cache_iterator_space_children(struct cache *cache, struct kv_cursor *cursor,
+  struct cache_iterator *iterator, char **child_id) {
+	assert(cache);
+	assert(iterator);
+	assert(child_id);
+
+	*iterator = (struct cache_iterator) {.type = CACHE_ITERATOR_SPACE_CHILDREN,
+	  .cursor = cursor,
+	  .cache = cache,
+	  .child_id = child_id};
+
+	return MDB_SUCCESS;
+}
+
+static int
+cache_spaces_next(struct cache_iterator *iterator) {
+	assert(iterator);
+	assert(iterator->type == CACHE_ITERATOR_SPACES);
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	int ret = kv_cursor_get(iterator->cursor, &key, &data, MDB_NEXT);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	assert(is_str(&key));
+
+	iterator->space->id = key.mv_data;
+	return cache_iterator_space_children(iterator->cache, iterator->cursor,
+	  &iterator->space->children_iterator, &iterator->space->child_id);
+}
+
+static int
+cache_space_children_next(struct cache_iterator *iterator) {
+	assert(iterator);
+	assert(iterator->type == CACHE_ITERATOR_SPACE_CHILDREN);
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	int ret = kv_cursor_get(iterator->cursor, &key, &data,
+	  (iterator->child_iterated_once ? MDB_NEXT_DUP : MDB_FIRST_DUP));
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	iterator->child_iterated_once = true;
+
+	assert(is_str(&data));
+	*iterator->child_id = data.mv_data;
+
+	return ret;
+}
+
+int
+cache_iterator_rooms(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char **room_id,
+  struct room_info *info) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(iterator);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	struct kv_cursor *cursor = NULL;
+
+	int ret = kv_cursor_open(txn, cache->dbs[DB_ROOMS], &cursor);
+
+	*iterator = (struct cache_iterator) {
+	  .type = CACHE_ITERATOR_ROOMS,
+	  .txn = txn,
+	  .cursor = cursor,
+	  .cache = cache,
+	  .room_id = room_id,
+	  .room_info = info,
+	};
+
+	if (ret != 0) {
+		cache_iterator_finish(iterator);
+	}
+
+	return ret;
+}
+
+int
+cache_iterator_events(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char *room_id,
+  struct cache_iterator_event *event, uint64_t end_index, uint64_t num_fetch,
+  unsigned timeline_events, unsigned state_events) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(iterator);
+	assert(room_id);
+	assert(event);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	uint32_t room = 0;
+	struct kv_cursor *cursor = NULL;
+	int ret = 0;
+
+	struct kv_cursor *block_cursor = NULL;
+	struct event_block *block = NULL;
+	size_t block_pending = 0;
+	bool hot_pending = false;
+
+	if ((ret = room_id_get(cache, txn, room_id, &room)) == 0
+		&& (ret
+			 = kv_cursor_open(txn, cache->room_dbs[ROOM_DB_EVENTS], &cursor))
+			 == 0
+		&& (ret = kv_cursor_open(
+			  txn, cache->room_dbs[ROOM_DB_EVENT_BLOCKS], &block_cursor))
+			 == 0) {
+		MDB_val start_key = {0};
+		MDB_val data = {0};
+
+		ret = seek_event_before(cursor, room, end_index, &start_key);
+		hot_pending = ret == MDB_SUCCESS;
+
+		/* The block is positioned at the first event <= end_index, the
+		 * entries after it are skipped. */
+		if ((seek_event_before(block_cursor, room, end_index, &start_key))
+			  == MDB_SUCCESS
+			&& (kv_cursor_get(
+				 block_cursor, &start_key, &data, MDB_GET_CURRENT))
+				 == MDB_SUCCESS
+			&& (block = block_load(cache, &data))) {
+			block_pending = event_block_count_before(block, end_index);
+
+			if (ret == MDB_NOTFOUND) {
+				ret = MDB_SUCCESS;
+			}
+		} else {
+			kv_cursor_close(block_cursor);
+			block_cursor = NULL;
+		}
+	}
+
+	*iterator = (struct cache_iterator) {
+	  .type = CACHE_ITERATOR_EVENTS,
+	  .txn = txn,
+	  .cursor = cursor,
+	  .cache = cache,
+	  .hot_pending = hot_pending,
+	  .events_epoch = snapshot->events_epoch,
+	  .events_pinned = snapshot->pinned,
+	  .event = event,
+	  .events_room = room,
+	  .num_fetch = num_fetch,
+	  .timeline_events = timeline_events,
+	  .state_events = state_events,
+	  .block_cursor = block_cursor,
+	  .block = block,
+	  .block_pending = block_pending,
+	};
+
+	if (ret != 0) {
+		cache_iterator_finish(iterator);
+	}
+
+	return ret;
+}
+
+int
+cache_event_index_at(struct cache_snapshot *snapshot, const char *room_id,
+  uint64_t ts, uint64_t *index) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(room_id);
+	assert(index);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	uint32_t room = 0;
+	struct kv_cursor *cursor = NULL;
+
+	int ret = room_id_get(cache, txn, room_id, &room);
+
+	if (ret != MDB_SUCCESS
+		|| (ret = kv_cursor_open(
+			  txn, cache->room_dbs[ROOM_DB_TS_TO_ORDER], &cursor))
+			 != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct room_key key;
+	room_key_index(&key, room, ts);
+
+	MDB_val data = {0};
+
+	/* Duplicates are sorted, so this is the oldest event with that ts. */
+	ret = kv_cursor_get(cursor, &key.val, &data, MDB_SET_RANGE);
+
+	if (ret == MDB_SUCCESS) {
+		if (room_key_in_room(&key.val, room)) {
+			cpy_index_be(&data, index);
+		} else {
+			ret = MDB_NOTFOUND;
+		}
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret;
+}
+
+int
+cache_iterator_member(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char *room_id,
+  struct cache_iterator_member *member) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(iterator);
+	assert(room_id);
+	assert(member);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	uint32_t room = 0;
+	struct kv_cursor *cursor = NULL;
+	int ret = 0;
+
+	if ((ret = room_id_get(cache, txn, room_id, &room)) == 0
+		&& (ret = kv_cursor_open(
+			  txn, cache->room_dbs[ROOM_DB_MEMBER_NAMES], &cursor))
+			 == 0) {
+		/* Success */
+	}
+
+	*iterator = (struct cache_iterator) {
+	  .type = CACHE_ITERATOR_MEMBER,
+	  .txn = txn,
+	  .cursor = cursor,
+	  .cache = cache,
+	  .member_room = room,
+	  .member = member,
+	};
+
+	if (ret != 0) {
+		cache_iterator_finish(iterator);
+	}
+
+	return ret;
+}
+
+int
+cache_member_get(struct cache_snapshot *snapshot, const char *room_id,
+  const char *mxid, struct cache_iterator_member *member) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(room_id);
+	assert(mxid);
+	assert(member);
+
+	MDB_val data = {0};
+
+	int ret = room_get_by_id(snapshot->cache, snapshot->txn, room_id,
+	  ROOM_DB_MEMBER_NAMES, mxid, &data);
+
+	if (ret == MDB_SUCCESS) {
+		*member = (struct cache_iterator_member) {
+		  .mxid = noconst(mxid),
+		  .username = member_name(&data),
+		};
+	}
+
+	return ret;
+}
+
+int
+cache_iterator_spaces(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, struct cache_iterator_space *space) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(iterator);
+	assert(space);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	struct kv_cursor *cursor = NULL;
+
+	int ret = kv_cursor_open(txn, cache->dbs[DB_SPACE_CHILDREN], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	*iterator = (struct cache_iterator) {.type = CACHE_ITERATOR_SPACES,
+	  .txn = txn,
+	  .cursor = cursor,
+	  .cache = cache,
+	  .space = space};
+
+	return ret;
+}
+
+void
+cache_iterator_finish(struct cache_iterator *iterator) {
+	if (iterator) {
+		/* Cursor might be inherited from another iterator so only free it if we
+		 * have a txn. The txn itself belongs to the snapshot. */
+		if (iterator->txn) {
+			kv_cursor_close(iterator->cursor);
+		}
+
+		if (iterator->type == CACHE_ITERATOR_EVENTS) {
+			kv_cursor_close(iterator->block_cursor);
+			event_block_unref(iterator->block);
+			event_block_unref(iterator->edit_block);
+			event_cache_entry_unref(iterator->entry);
+		}
+
+		memset(iterator, 0, sizeof(*iterator));
+	}
+}
+
+/* Decode a binary or legacy JSON record. *json is set for legacy records and
+ * must be deleted by the caller. */
+static bool
+record_decode(const MDB_val *record, struct matrix_sync_event *event,
+  matrix_json_t **json) {
+	assert(record);
+	assert(event);
+	assert(json);
+
+	unsigned flags = 0;
+
+	*event = (struct matrix_sync_event) {0};
+	*json = NULL;
+
+	if (event_record_is_legacy(record->mv_data, record->mv_size)) {
+		*json = matrix_json_parse(record->mv_data, record->mv_size);
+
+		/* Redacted events fail to parse but still have their base fields. */
+		if (*json) {
+			matrix_event_sync_parse(event, *json);
+		}
+
+		return !!*json;
+	}
+
+	return (event_record_decode(
+			 record->mv_data, record->mv_size, event, &flags))
+		== 0;
+}
+
+static uint64_t
+event_ts(const struct matrix_sync_event *event) {
+	assert(event);
+
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		return event->state.base.origin_server_ts;
+	case MATRIX_EVENT_TIMELINE:
+		return event->timeline.base.origin_server_ts;
+	default:
+		return 0;
+	}
+}
+
+/* Only legacy records have to be parsed for their timestamp. */
+static bool
+record_ts(const MDB_val *record, uint64_t *ts) {
+	assert(record);
+	assert(ts);
+
+	if (!event_record_is_legacy(record->mv_data, record->mv_size)) {
+		struct event_record_header header = {0};
+
+		if ((event_record_header(record->mv_data, record->mv_size, &header))
+			!= 0) {
+			return false;
+		}
+
+		*ts = header.origin_server_ts;
+		return true;
+	}
+
+	struct matrix_sync_event event = {0};
+	matrix_json_t *json = NULL;
+	bool decoded = record_decode(record, &event, &json);
+
+	if (decoded) {
+		*ts = event_ts(&event);
+	}
+
+	matrix_json_delete(json);
+
+	return decoded;
+}
+
+/* The text of the event in DB_SEARCH, NULL if it isn't searchable. */
+static const char *
+event_search_text(const struct matrix_sync_event *event) {
+	assert(event);
+
+	if (event->type == MATRIX_EVENT_TIMELINE
+		&& event->timeline.type == MATRIX_ROOM_MESSAGE) {
+		return event->timeline.message.body;
+	}
+
+	return NULL;
+}
+
+/* Copy the ID and the searchable text of the event in the record, as the
+ * record might be moved by writes. *text must be freed by the caller. */
+static bool
+record_copy_id_text(
+  const MDB_val *record, char event_id[ROOM_KEY_MAX], char **text) {
+	assert(record);
+	assert(event_id);
+	assert(text);
+
+	struct matrix_sync_event event = {0};
+	matrix_json_t *json = NULL;
+	const char *id = NULL;
+
+	*text = NULL;
+
+	if (record_decode(record, &event, &json)) {
+		const char *event_text = event_search_text(&event);
+
+		if (event_text) {
+			*text = strdup(event_text);
+			assert(*text);
+		}
+
+		id = matrix_sync_event_id(&event);
+	}
+
+	const bool fits = id && strlen(id) < ROOM_KEY_MAX;
+
+	if (fits) {
+		memcpy(event_id, id, strlen(id) + 1);
+	}
+
+	matrix_json_delete(json);
+
+	return fits;
+}
+
+/* Add or remove the posting of the event for every token of the text. */
+static int
+search_index(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t index, uint64_t ts, const char *text, bool add) {
+	assert(cache);
+	assert(txn);
+
+	if (!text) {
+		return MDB_SUCCESS;
+	}
+
+	unsigned char posting[SEARCH_POSTING_SIZE];
+	search_posting_write(posting, ts, room, index);
+
+	char token[SEARCH_TOKEN_MAX + 1];
+	size_t len = 0;
+	int ret = MDB_SUCCESS;
+
+	while (ret == MDB_SUCCESS && (len = search_token_next(&text, token)) > 0) {
+		MDB_val key = {len + 1, token};
+		MDB_val data = {sizeof(posting), posting};
+
+		ret = add ? kv_put(txn, cache->dbs[DB_SEARCH], &key, &data, 0)
+				  : kv_del(txn, cache->dbs[DB_SEARCH], &key, &data);
+
+		/* Tokens repeated within the text. */
+		if (ret == MDB_KEYEXIST || ret == MDB_NOTFOUND) {
+			ret = MDB_SUCCESS;
+		}
+	}
+
+	ABORT_OR_RETURN(ret);
+}
+
+static enum relation_type
+relation_type(const char *rel_type) {
+	if (rel_type && strcmp(rel_type, "m.replace") == 0) {
+		return RELATION_REPLACE;
+	}
+
+	if (rel_type && strcmp(rel_type, "m.annotation") == 0) {
+		return RELATION_ANNOTATION;
+	}
+
+	return RELATION_OTHER;
+}
+
+/* Copy the relation of the event in the record, false if it has none. */
+static bool
+record_relation(const MDB_val *record, enum relation_type *type,
+  char parent_id[ROOM_KEY_MAX]) {
+	assert(record);
+	assert(type);
+	assert(parent_id);
+
+	struct matrix_sync_event event = {0};
+	matrix_json_t *json = NULL;
+	bool found = false;
+
+	if (record_decode(record, &event, &json)
+		&& event.type == MATRIX_EVENT_TIMELINE
+		&& event.timeline.relation.event_id
+		&& strlen(event.timeline.relation.event_id) < ROOM_KEY_MAX) {
+		*type = relation_type(event.timeline.relation.rel_type);
+		memcpy(parent_id, event.timeline.relation.event_id,
+		  strlen(event.timeline.relation.event_id) + 1);
+		found = true;
+	}
+
+	matrix_json_delete(json);
+
+	return found;
+}
+
+/* The last relation before the first non-edit is the latest edit. */
+static uint64_t
+latest_edit(
+  struct cache *cache, struct kv_txn *txn, uint32_t room, uint64_t index) {
+	assert(cache);
+	assert(txn);
+
+	struct kv_cursor *cursor = NULL;
+
+	if ((kv_cursor_open(txn, cache->room_dbs[ROOM_DB_RELATIONS], &cursor))
+		!= MDB_SUCCESS) {
+		return (uint64_t) -1;
+	}
+
+	struct room_key key;
+	room_key_index(&key, room, index);
+
+	unsigned char bound[RELATION_SIZE] = {RELATION_REPLACE + 1};
+	MDB_val data = {sizeof(bound), bound};
+
+	int ret = kv_cursor_get(cursor, &key.val, &data, MDB_GET_BOTH_RANGE);
+
+	if (ret == MDB_SUCCESS) {
+		ret = kv_cursor_get(cursor, &key.val, &data, MDB_PREV_DUP);
+	} else if (ret == MDB_NOTFOUND
+			   && (ret = kv_cursor_get(cursor, &key.val, &data, MDB_SET))
+					== MDB_SUCCESS) {
+		/* Every relation is an edit. */
+		ret = kv_cursor_get(cursor, &key.val, &data, MDB_LAST_DUP);
+	}
+
+	uint64_t edit_index = (uint64_t) -1;
+
+	if (ret == MDB_SUCCESS && data.mv_size == RELATION_SIZE
+		&& ((const unsigned char *) data.mv_data)[0] == RELATION_REPLACE) {
+		edit_index
+		  = read_be((const unsigned char *) data.mv_data + 1, sizeof(uint64_t));
+	}
+
+	kv_cursor_close(cursor);
+
+	return edit_index;
+}
+
+/* Add or remove the relation of the child to the parent in ROOM_DB_RELATIONS
+ * and update the parent's aggregation. */
+static int
+relation_update(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t parent, enum relation_type type, uint64_t child, bool add) {
+	assert(cache);
+	assert(txn);
+
+	struct room_key key;
+	room_key_index(&key, room, parent);
+
+	unsigned char relation[RELATION_SIZE];
+	relation[0] = (unsigned char) type;
+	write_be(&relation[1], child, sizeof(child));
+
+	MDB_val data = {sizeof(relation), relation};
+	kv_dbi dbi = cache->room_dbs[ROOM_DB_RELATIONS];
+
+	int ret = add ? kv_put(txn, dbi, &key.val, &data, MDB_NODUPDATA)
+				  : kv_del(txn, dbi, &key.val, &data);
+
+	/* Already added or removed, the aggregation is up to date. */
+	if (ret == MDB_KEYEXIST || ret == MDB_NOTFOUND) {
+		return MDB_SUCCESS;
+	}
+
+	if (ret != MDB_SUCCESS) {
+		ABORT_OR_RETURN(ret);
+	}
+
+	if (type == RELATION_OTHER) {
+		return MDB_SUCCESS;
+	}
+
+	struct cache_aggregation aggregation;
+
+	if ((ret = aggregation_get(cache, txn, room, parent, &aggregation))
+		  != MDB_SUCCESS
+		&& ret != MDB_NOTFOUND) {
+		return ret;
+	}
+
+	switch (type) {
+	case RELATION_REPLACE:
+		if (add) {
+			if (aggregation.edit_index == (uint64_t) -1
+				|| child > aggregation.edit_index) {
+				aggregation.edit_index = child;
+			}
+		} else if (aggregation.edit_index == child) {
+			aggregation.edit_index = latest_edit(cache, txn, room, parent);
+		}
+		break;
+	case RELATION_ANNOTATION:
+		if (add) {
+			aggregation.annotations++;
+		} else if (aggregation.annotations > 0) {
+			aggregation.annotations--;
+		}
+		break;
+	default:
+		assert(0);
+	}
+
+	return aggregation_put(cache, txn, room, parent, &aggregation);
+}
+
+/* Remove the relation of an event that is being deleted or redacted, the
+ * parent might've been pruned already. */
+static int
+relation_remove(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  const char *parent_id, enum relation_type type, uint64_t child) {
+	MDB_val data = {0};
+	uint64_t parent = 0;
+
+	int ret
+	  = room_get(cache, txn, room, ROOM_DB_EVENTS_TO_ORDER, parent_id, &data);
+
+	if (ret != MDB_SUCCESS) {
+		return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+	}
+
+	cpy_index(&data, &parent);
+
+	return relation_update(cache, txn, room, parent, type, child, false);
+}
+
+static bool
+is_join(const char *membership) {
+	return membership && (strcmp(membership, "join")) == 0;
+}
+
+/* Key is the room key of the user. */
+static int
+member_name_put(struct cache *cache, struct kv_txn *txn, MDB_val *key,
+  const char *displayname, bool joined) {
+	assert(cache);
+	assert(txn);
+	assert(key);
+
+	if (!displayname) {
+		displayname = "";
+	}
+
+	size_t len = strlen(displayname) + 1;
+	MDB_val data = {1 + len, NULL};
+
+	int ret = kv_put(
+	  txn, cache->room_dbs[ROOM_DB_MEMBER_NAMES], key, &data, MDB_RESERVE);
+
+	if (ret == MDB_SUCCESS) {
+		unsigned char *buf = data.mv_data;
+		buf[0] = joined ? MEMBER_NAME_JOINED : 0;
+		memcpy(&buf[1], displayname, len);
+	}
+
+	ABORT_OR_RETURN(ret);
+}
+
+/* Number of users whose stored membership in the room is a join. */
+static uint32_t
+count_joined(struct cache *cache, struct kv_txn *txn, uint32_t room) {
+	assert(cache);
+	assert(txn);
+
+	struct kv_cursor *cursor = NULL;
+	uint32_t count = 0;
+
+	if ((kv_cursor_open(txn, cache->room_dbs[ROOM_DB_MEMBER_NAMES], &cursor))
+		!= MDB_SUCCESS) {
+		return count;
+	}
+
+	struct room_key start;
+	room_key(&start, room, NULL, 0);
+
+	MDB_val key = start.val;
+	MDB_val data = {0};
+
+	for (int ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+		 ret == MDB_SUCCESS && room_key_in_room(&key, room);
+		 ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+		if (member_name_joined(&data)) {
+			count++;
+		}
+	}
+
+	kv_cursor_close(cursor);
+
+	return count;
+}
+
+/* Defined with the other summary helpers below. */
+static void
+summary_finish(struct room_summary *summary);
+static void
+summary_rebuild(struct cache *cache, struct kv_txn *txn, const char *room_id,
+  struct room_summary *summary);
+
+/* The DBs of a room of schema version 1, only those that exist are open. */
+struct legacy_room {
+	uint32_t room;
+	kv_dbi dbis[LEGACY_ROOM_DB_MAX];
+	bool open[LEGACY_ROOM_DB_MAX];
+};
+
+/* The room being migrated has the newest surrogate, so it's keys sort after
+ * every other key of the global DBs and can be appended. */
+static int
+put_append(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	int ret = kv_put(txn, dbi, key, data, MDB_APPEND);
+
+	if (ret == MDB_KEYEXIST) {
+		ret = kv_put(txn, dbi, key, data, 0);
+	}
+
+	ABORT_OR_RETURN(ret);
+}
+
+/* Add the relations of the room's events, once every event has an index. */
+static int
+migrate_room_relations(
+  struct cache *cache, struct kv_txn *txn, const struct legacy_room *legacy) {
+	assert(cache);
+	assert(txn);
+	assert(legacy);
+
+	struct kv_cursor *cursor = NULL;
+
+	int ret
+	  = kv_cursor_open(txn, legacy->dbis[LEGACY_ORDER_TO_EVENTS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	MDB_val key = {0};
+	MDB_val id = {0};
+
+	while ((ret = kv_cursor_get(cursor, &key, &id, MDB_NEXT))
+		   == MDB_SUCCESS) {
+		char parent_id[ROOM_KEY_MAX];
+		enum relation_type type = RELATION_OTHER;
+		MDB_val record = {0};
+		MDB_val parent_val = {0};
+		uint64_t index = 0;
+		uint64_t parent = 0;
+
+		if (!is_str(&id)
+			|| (kv_get(txn, legacy->dbis[LEGACY_EVENTS], &id, &record))
+				 != MDB_SUCCESS
+			|| !(record_relation(&record, &type, parent_id))) {
+			continue;
+		}
+
+		cpy_index(&key, &index);
+
+		if ((ret = room_get(cache, txn, legacy->room, ROOM_DB_EVENTS_TO_ORDER,
+			   parent_id, &parent_val))
+			== MDB_NOTFOUND) {
+			continue;
+		}
+
+		if (ret == MDB_SUCCESS) {
+			cpy_index(&parent_val, &parent);
+			ret = relation_update(
+			  cache, txn, legacy->room, parent, type, index, true);
+		}
+
+		if (ret != MDB_SUCCESS) {
+			break;
+		}
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+}
+
+/* Key the events of the room by index instead of event ID, and index them by
+ * their text, timestamp and relations. */
+static int
+migrate_room_events(
+  struct cache *cache, struct kv_txn *txn, const struct legacy_room *legacy) {
+	assert(cache);
+	assert(txn);
+	assert(legacy);
+
+	if (!legacy->open[LEGACY_ORDER_TO_EVENTS]
+		|| !legacy->open[LEGACY_EVENTS]) {
+		return MDB_SUCCESS;
+	}
+
+	struct kv_cursor *cursor = NULL;
+
+	int ret
+	  = kv_cursor_open(txn, legacy->dbis[LEGACY_ORDER_TO_EVENTS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	MDB_val key = {0};
+	MDB_val id = {0};
+
+	/* The old DBs aren't modified until they're dropped, so the values read
+	 * from them stay valid while writing. */
+	while ((ret = kv_cursor_get(cursor, &key, &id, MDB_NEXT))
+		   == MDB_SUCCESS) {
+		struct room_key id_key;
+		struct room_key index_key;
+		MDB_val record = {0};
+		MDB_val json = {0};
+		uint64_t index = 0;
+		uint64_t ts = 0;
+
+		if (!is_str(&id)
+			|| (room_key(&id_key, legacy->room, id.mv_data, id.mv_size)) != 0
+			|| (kv_get(txn, legacy->dbis[LEGACY_EVENTS], &id, &record))
+				 != MDB_SUCCESS) {
+			continue;
+		}
+
+		cpy_index(&key, &index);
+		room_key_index(&index_key, legacy->room, index);
+
+		char event_id[ROOM_KEY_MAX];
+		char *text = NULL;
+		const bool has_ts = record_ts(&record, &ts);
+
+		record_copy_id_text(&record, event_id, &text);
+
+		if ((ret = put_append(txn, cache->room_dbs[ROOM_DB_EVENTS],
+			   &index_key.val, &record))
+				== MDB_SUCCESS
+			&& (ret = kv_put(txn, cache->room_dbs[ROOM_DB_EVENTS_TO_ORDER],
+				  &id_key.val, &(MDB_val) {sizeof(index), &index}, 0))
+				 == MDB_SUCCESS
+			&& has_ts) {
+			ret = room_ts_index(cache, txn, legacy->room, ts, index, true);
+		}
+
+		if (ret == MDB_SUCCESS) {
+			ret = search_index(cache, txn, legacy->room, index, ts, text, true);
+		}
+
+		if (ret == MDB_SUCCESS && legacy->open[LEGACY_EVENTS_JSON]
+			&& (kv_get(txn, legacy->dbis[LEGACY_EVENTS_JSON], &id, &json))
+				 == MDB_SUCCESS) {
+			ret = put_append(txn, cache->room_dbs[ROOM_DB_EVENTS_JSON],
+			  &index_key.val, &json);
+		}
+
+		free(text);
+
+		if (ret != MDB_SUCCESS) {
+			break;
+		}
+	}
+
+	kv_cursor_close(cursor);
+
+	if (ret != MDB_NOTFOUND) {
+		return ret;
+	}
+
+	return migrate_room_relations(cache, txn, legacy);
+}
+
+/* Project a member event of schema version 1 into ROOM_DB_MEMBER_NAMES. */
+static int
+migrate_member_name(
+  struct cache *cache, struct kv_txn *txn, MDB_val *key, const MDB_val *data) {
+	assert(cache);
+	assert(txn);
+	assert(key);
+	assert(data);
+
+	matrix_json_t *json = matrix_json_parse(data->mv_data, data->mv_size);
+	struct matrix_state_event event = {0};
+	const char *displayname = NULL;
+	bool joined = false;
+
+	if (json && (matrix_event_state_parse(&event, json)) == 0
+		&& event.type == MATRIX_ROOM_MEMBER) {
+		displayname = event.content.member.displayname;
+		joined = is_join(event.content.member.membership);
+	}
+
+	int ret = member_name_put(cache, txn, key, displayname, joined);
+
+	matrix_json_delete(json);
+
+	return ret;
+}
+
+/* Copy a DB of schema version 1 into the global room DB, prefixing the keys
+ * with the room. */
+static int
+migrate_room_db(struct cache *cache, struct kv_txn *txn,
+  const struct legacy_room *legacy, enum legacy_room_db from,
+  enum room_db to) {
+	assert(cache);
+	assert(txn);
+	assert(legacy);
+
+	if (!legacy->open[from]) {
+		return MDB_SUCCESS;
+	}
+
+	struct kv_cursor *cursor = NULL;
+
+	int ret = kv_cursor_open(txn, legacy->dbis[from], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	while ((ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT))
+		   == MDB_SUCCESS) {
+		struct room_key rkey;
+
+		/* Only state keys longer than the spec allows don't fit. */
+		if ((room_key(&rkey, legacy->room, key.mv_data, key.mv_size)) != 0) {
+			continue;
+		}
+
+		if ((ret = put_append(txn, cache->room_dbs[to], &rkey.val, &data))
+				== MDB_SUCCESS
+			&& to == ROOM_DB_MEMBERS) {
+			ret = migrate_member_name(cache, txn, &rkey.val, &data);
+		}
+
+		if (ret != MDB_SUCCESS) {
+			break;
+		}
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+}
+
+/* Move a room of schema version 1 into the global DBs, dropping it's DBs so
+ * that the number of DBs doesn't grow with the number of rooms. */
+static int
+migrate_room(struct cache *cache, struct kv_txn *txn, const char *room_id) {
+	assert(cache);
+	assert(txn);
+	assert(room_id);
+
+	struct legacy_room legacy = {0};
+	int ret = room_id_create(cache, txn, room_id, &legacy.room);
+
+	for (size_t i = 0; i < LEGACY_ROOM_DB_MAX && ret == MDB_SUCCESS; i++) {
+		char *name = NULL;
+
+		if ((asprintf(&name, "%s/%s", room_id, legacy_room_db_names[i]))
+			== -1) {
+			return ENOMEM;
+		}
+
+		ret = kv_dbi_open(txn, name, legacy_room_db_flags[i], &legacy.dbis[i]);
+		free(name);
+
+		legacy.open[i] = ret == MDB_SUCCESS;
+
+		if (ret == MDB_NOTFOUND) {
+			ret = MDB_SUCCESS;
+		}
+	}
+
+	if (ret != MDB_SUCCESS
+		|| (ret = migrate_room_events(cache, txn, &legacy)) != MDB_SUCCESS
+		|| (ret = migrate_room_db(
+			  cache, txn, &legacy, LEGACY_MEMBERS, ROOM_DB_MEMBERS))
+			 != MDB_SUCCESS
+		|| (ret = migrate_room_db(
+			  cache, txn, &legacy, LEGACY_STATE, ROOM_DB_STATE))
+			 != MDB_SUCCESS
+		|| (ret = migrate_room_db(cache, txn, &legacy, LEGACY_SPACE_PARENT,
+			  ROOM_DB_SPACE_PARENT))
+			 != MDB_SUCCESS
+		|| (ret = migrate_room_db(cache, txn, &legacy, LEGACY_SPACE_CHILD,
+			  ROOM_DB_SPACE_CHILD))
+			 != MDB_SUCCESS) {
+		return ret;
+	}
+
+	for (size_t i = 0; i < LEGACY_ROOM_DB_MAX && ret == MDB_SUCCESS; i++) {
+		if (legacy.open[i]) {
+			ret = kv_drop(txn, legacy.dbis[i], true);
+		}
+	}
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	/* Schema version 1 stored an empty summary. */
+	struct room_summary summary = {0};
+	summary_rebuild(cache, txn, room_id, &summary);
+
+	MDB_val data = {room_summary_size(&summary), NULL};
+
+	if ((ret = kv_put(txn, cache->dbs[DB_ROOMS],
+		   &(MDB_val) {strlen(room_id) + 1, noconst(room_id)}, &data,
+		   MDB_RESERVE))
+		== MDB_SUCCESS) {
+		room_summary_write(&summary, data.mv_data);
+	}
+
+	summary_finish(&summary);
+
+	ABORT_OR_RETURN(ret);
+}
+
+/* The room after the last migrated one in DB_ROOMS, *room_id must be freed. */
+static int
+next_legacy_room(struct cache *cache, struct kv_txn *txn, char **room_id) {
+	assert(cache);
+	assert(txn);
+	assert(room_id);
+
+	struct kv_cursor *cursor = NULL;
+	MDB_val last = {0};
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	int ret
+	  = get_str(txn, cache->dbs[DB_META], meta_keys[META_MIGRATED_ROOM], &last);
+	const bool resume = ret == MDB_SUCCESS;
+
+	if ((!resume && ret != MDB_NOTFOUND)
+		|| (ret = kv_cursor_open(txn, cache->dbs[DB_ROOMS], &cursor))
+			 != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if (resume) {
+		key = last;
+		ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+
+		if (ret == MDB_SUCCESS && key.mv_size == last.mv_size
+			&& (memcmp(key.mv_data, last.mv_data, last.mv_size)) == 0) {
+			ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT);
+		}
+	} else {
+		ret = kv_cursor_get(cursor, &key, &data, MDB_FIRST);
+	}
+
+	if (ret == MDB_SUCCESS) {
+		assert(is_str(&key));
+
+		*room_id = strdup(key.mv_data);
+		assert(*room_id);
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret;
+}
+
+/* Migrate every room of schema version 1 in it's own txn, which also records
+ * the room as migrated. An interrupted migration, or one that filled the map,
+ * continues with the next room. */
+static int
+migrate_rooms(struct cache *cache, size_t *num_rooms) {
+	assert(cache);
+	assert(num_rooms);
+
+	enum { log_interval = 1000 };
+
+	for (;;) {
+		struct kv_txn *txn = NULL;
+		char *room_id = NULL;
+
+		int ret = get_txn(cache, 0, &txn);
+
+		if (ret != MDB_SUCCESS) {
+			return ret;
+		}
+
+		if ((ret = next_legacy_room(cache, txn, &room_id)) != MDB_SUCCESS) {
+			abort_txn(cache, txn);
+			return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+		}
+
+		if ((ret = migrate_room(cache, txn, room_id)) == MDB_SUCCESS
+			&& (ret = put_str(txn, cache->dbs[DB_META],
+				  meta_keys[META_MIGRATED_ROOM], room_id, 0))
+				 == MDB_SUCCESS) {
+			ret = end_txn(cache, txn);
+		} else {
+			/* Operations fail with MDB_BAD_TXN once the map is full. */
+			if (txn_failed(cache, txn)) {
+				ret = MDB_MAP_FULL;
+			}
+
+			abort_txn(cache, txn);
+		}
+
+		if (ret != MDB_SUCCESS) {
+			if (ret != MDB_MAP_FULL) {
+				LOG(LOG_ERROR, "Failed to migrate room '%s': %s", room_id,
+				  mdb_strerror(ret));
+			}
+
+			free(room_id);
+			return ret;
+		}
+
+		free(room_id);
+
+		if ((++*num_rooms % log_interval) == 0) {
+			LOG(LOG_MESSAGE, "Migrated %zu rooms", *num_rooms);
+		}
+	}
+}
+
+/* Bring a cache of schema version 1 up to SCHEMA_VERSION. The version is only
+ * written once every room was migrated. */
+static int
+migrate(struct cache *cache, uint32_t version) {
+	assert(cache);
+
+	if (version != 1) {
+		LOG(LOG_ERROR, "Unknown cache schema version %" PRIu32 "!", version);
+		return EINVAL;
+	}
+
+	const char *version_key = meta_keys[META_SCHEMA_VERSION];
+	struct kv_txn *txn = NULL;
+	size_t num_rooms = 0;
+
+	int ret = migrate_rooms(cache, &num_rooms);
+
+	if (ret != MDB_SUCCESS || (ret = get_txn(cache, 0, &txn)) != MDB_SUCCESS) {
+		return ret;
+	}
+
+	version = SCHEMA_VERSION;
+
+	if ((ret = kv_put(txn, cache->dbs[DB_META],
+		   &(MDB_val) {strlen(version_key) + 1, noconst(version_key)},
+		   &(MDB_val) {sizeof(version), &version}, 0))
+			!= MDB_SUCCESS
+		|| ((ret = del_str(txn, cache->dbs[DB_META],
+			   meta_keys[META_MIGRATED_ROOM], NULL))
+			  != MDB_SUCCESS
+			&& ret != MDB_NOTFOUND)) {
+		abort_txn(cache, txn);
+		ABORT_OR_RETURN(ret);
+	}
+
+	if ((ret = end_txn(cache, txn)) == MDB_SUCCESS && num_rooms > 0) {
+		LOG(LOG_MESSAGE, "Migrated %zu rooms from schema version 1 to %d",
+		  num_rooms, SCHEMA_VERSION);
+	}
+
+	return ret;
+}
+
+static int
+open_dbis(struct cache *cache, struct kv_txn *txn) {
+	assert(cache);
+	assert(txn);
+
+	int ret = MDB_SUCCESS;
+
+	for (size_t i = 0; i < DB_MAX && ret == MDB_SUCCESS; i++) {
+		ret = kv_dbi_open(
+		  txn, db_names[i], MDB_CREATE | db_flags[i], &cache->dbs[i]);
+	}
+
+	for (size_t i = 0; i < ROOM_DB_MAX && ret == MDB_SUCCESS; i++) {
+		ret = kv_dbi_open(txn, room_db_names[i],
+		  MDB_CREATE | room_db_flags[i], &cache->room_dbs[i]);
+	}
+
+	return ret;
+}
+
+/* Caches without a version are either new or of version 1. */
+static int
+schema_version(struct cache *cache, struct kv_txn *txn, uint32_t *version) {
+	assert(cache);
+	assert(txn);
+	assert(version);
+
+	MDB_val data = {0};
+
+	int ret = get_str(
+	  txn, cache->dbs[DB_META], meta_keys[META_SCHEMA_VERSION], &data);
+
+	*version = 1;
+
+	if (ret == MDB_SUCCESS) {
+		*version = 0;
+
+		if (data.mv_size == sizeof(*version)) {
+			memcpy(version, data.mv_data, sizeof(*version));
+		}
+	}
+
+	return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+}
+
+static int
+open_dbs(struct cache *cache) {
+	assert(cache);
+
+	struct kv_txn *txn = NULL;
+	uint32_t version = 0;
+
+	int ret = get_txn(cache, 0, &txn);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if ((ret = open_dbis(cache, txn)) != MDB_SUCCESS
+		|| (ret = schema_version(cache, txn, &version)) != MDB_SUCCESS) {
+		abort_txn(cache, txn);
+		return ret;
+	}
+
+	/* The DBs are only kept open if the txn is committed. */
+	if ((ret = end_txn(cache, txn)) != MDB_SUCCESS) {
+		return ret;
+	}
+
+	return version == SCHEMA_VERSION ? MDB_SUCCESS : migrate(cache, version);
+}
+
+/* The dictionary is copied out of the map as it's used by every thread that
+ * inflates a block, regardless of their txn. */
+static int
+dict_read(struct cache *cache, struct kv_txn *txn) {
+	assert(cache);
+	assert(txn);
+
+	MDB_val data = {0};
+	const char *key = meta_keys[META_EVENT_DICT];
+
+	int ret = get_str(txn, cache->dbs[DB_META], key, &data);
+
+	if (ret == MDB_SUCCESS && data.mv_size > 0) {
+		if ((cache->blocks.dict = malloc(data.mv_size))) {
+			memcpy(cache->blocks.dict, data.mv_data, data.mv_size);
+			cache->blocks.dict_size = data.mv_size;
+		} else {
+			ret = ENOMEM;
+		}
+	}
+
+	return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+}
+
+static int
+dict_load(struct cache *cache) {
+	assert(cache);
+
+	struct kv_txn *txn = NULL;
+
+	int ret = get_txn(cache, MDB_RDONLY, &txn);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	ret = dict_read(cache, txn);
+
+	end_read_txn(cache, txn);
+
+	return ret;
+}
+
+static int
+open_env(struct cache *cache, size_t map_size) {
+	assert(cache);
+	assert(cache->dir);
+
+	enum {
+		/* The global DBs, and the DBs of a room of the old schema while
+		 * migrating. */
+		max_dbs = 32,
+	};
+
+	int ret = kv_env_open(cache->backend, &cache->env, cache->dir,
+	  cache->env_flags, map_size, max_dbs);
+
+	if (ret != MDB_SUCCESS) {
+		cache->env = NULL;
+	}
+
+	return ret;
+}
+
+int
+cache_init(struct cache *cache, const struct cache_options *options) {
+	assert(cache);
+	assert(options);
+
+	enum {
+		/* Grown on demand by grow_map(). */
+		default_map_size = 1024 * MIB,
+		default_event_cache_size = 8 * MIB,
+	};
+
+	assert(options->durability < CACHE_DURABILITY_MAX);
+
+	enum { default_commit_window_ms = 1000 };
+
+	*cache = (struct cache) {
+	  .backend = options->backend ? options->backend : &kv_lmdb,
+	  .durability = options->durability,
+	  .commit_window_ms = options->commit_window_ms > 0
+							  ? options->commit_window_ms
+							  : default_commit_window_ms,
+	  .keep_event_json = options->keep_event_json,
+	  .retain_events = options->retain_events,
+	  .retain_age_ms = options->retain_age_ms,
+	  .cold_age_ms = options->cold_age_ms,
+	};
+	clock_gettime(CLOCK_MONOTONIC, &cache->last_stats);
+
+	pthread_rwlockattr_t resize_attr;
+
+	if ((pthread_rwlockattr_init(&resize_attr)) != 0) {
+		return ENOMEM;
+	}
+
+#ifdef __GLIBC__
+	/* Readers are preferred by default, so a resize could wait forever while
+	 * snapshots are begun back to back. */
+	pthread_rwlockattr_setkind_np(
+	  &resize_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	int lock_ret = pthread_rwlock_init(&cache->resize_lock, &resize_attr);
+	pthread_rwlockattr_destroy(&resize_attr);
+
+	if (lock_ret != 0) {
+		return ENOMEM;
+	}
+
+	cache->resize_lock_initialized = true;
+
+	if ((pthread_mutex_init(&cache->write_lock, NULL)) != 0) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	cache->write_lock_initialized = true;
+
+	if ((pthread_mutex_init(&cache->pin.mutex, NULL)) != 0) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	if ((pthread_cond_init(&cache->pin.cond, NULL)) != 0) {
+		pthread_mutex_destroy(&cache->pin.mutex);
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	cache->pin.initialized = true;
+
+	if ((pthread_mutex_init(&cache->read_txns.mutex, NULL)) != 0) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	cache->read_txns.initialized = true;
+
+	if ((pthread_mutex_init(&cache->blocks.mutex, NULL)) != 0) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	cache->blocks.initialized = true;
+
+	const size_t event_cache_size = options->event_cache_size > 0
+									 ? options->event_cache_size
+									 : (size_t) default_event_cache_size;
+
+	if ((event_cache_init(&cache->events, event_cache_size)) != 0) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	const mode_t dir_perms = 0755;
+	const size_t map_size
+	  = options->map_size > 0 ? options->map_size : (size_t) default_map_size;
+
+	cache->dir = strdup(options->dir ? options->dir : "/tmp/db");
+
+	if (!cache->dir) {
+		cache_finish(cache);
+		return ENOMEM;
+	}
+
+	int ret = 0;
+
+	if (cache->backend->durable
+		&& (ret = mkdir_parents(cache->dir, dir_perms)) != 0) {
+		cache_finish(cache);
+		return ret;
+	}
+
+	const unsigned multiple_readonly_txn_per_thread = MDB_NOTLS;
+	const unsigned durability_flags[CACHE_DURABILITY_MAX] = {
+	  [CACHE_DURABILITY_SYNC] = 0,
+	  [CACHE_DURABILITY_NOMETASYNC] = MDB_NOMETASYNC,
+	  /* Writing through the map avoids copying dirty pages on commit. */
+	  [CACHE_DURABILITY_NOSYNC] = MDB_NOSYNC | MDB_WRITEMAP,
+	};
+	cache->env_flags
+	  = multiple_readonly_txn_per_thread | durability_flags[cache->durability];
+
+	if ((ret = open_env(cache, map_size)) == MDB_SUCCESS) {
+		/* The migration might not fit in the initial map. */
+		while ((ret = open_dbs(cache)) == MDB_MAP_FULL
+			   && (ret = grow_map(cache)) == MDB_SUCCESS) {
+		}
+	}
+
+	if (ret == MDB_SUCCESS) {
+		ret = dict_load(cache);
+	}
+
+	if (ret == MDB_SUCCESS && cache->durability == CACHE_DURABILITY_NOSYNC) {
+		ret = start_flusher(cache);
+	}
+
+	if (ret != MDB_SUCCESS) {
+		cache_finish(cache);
+	}
+
+	return ret;
+}
+
+void
+cache_finish(struct cache *cache) {
+	if (!cache) {
+		return;
+	}
+
+	if (cache->pin.initialized) {
+		kv_txn_abort(cache->pin.txn);
+		pthread_cond_destroy(&cache->pin.cond);
+		pthread_mutex_destroy(&cache->pin.mutex);
+	}
+
+	if (cache->read_txns.initialized) {
+		drain_read_txns(cache);
+		pthread_mutex_destroy(&cache->read_txns.mutex);
+	}
+
+	if (cache->blocks.initialized) {
+		for (size_t i = 0; i < cache->blocks.len; i++) {
+			event_block_unref(cache->blocks.lru[i]);
+		}
+
+		free(cache->blocks.dict);
+		pthread_mutex_destroy(&cache->blocks.mutex);
+	}
+
+	event_cache_finish(&cache->events);
+
+	if (cache->env) {
+		stop_flusher(cache);
+		flush(cache);
+	}
+
+	kv_env_close(cache->env);
+	free(cache->dir);
+
+	if (cache->write_lock_initialized) {
+		pthread_mutex_destroy(&cache->write_lock);
+	}
+
+	if (cache->resize_lock_initialized) {
+		pthread_rwlock_destroy(&cache->resize_lock);
+	}
+
+	memset(cache, 0, sizeof(*cache));
+}
+
+void
+cache_stats(struct cache *cache, struct cache_stats *stats) {
+	assert(cache);
+	assert(stats);
+
+	*stats = (struct cache_stats) {
+	  .txn_begins = cache->txn_begins,
+	  .txn_renews = cache->txn_renews,
+	  .event_hits = cache->events.hits,
+	  .event_misses = cache->events.misses,
+	};
+
+	static const enum room_db event_dbs[] = {ROOM_DB_EVENTS,
+	  ROOM_DB_EVENTS_JSON, ROOM_DB_EVENT_BLOCKS, ROOM_DB_EVENTS_TO_ORDER,
+	  ROOM_DB_RELATIONS, ROOM_DB_TS_TO_ORDER, ROOM_DB_AGGREGATIONS};
+
+	struct kv_txn *txn = NULL;
+
+	if ((get_txn(cache, MDB_RDONLY, &txn)) != MDB_SUCCESS) {
+		return;
+	}
+
+	for (size_t i = 0; i < (sizeof(event_dbs) / sizeof(*event_dbs)); i++) {
+		struct kv_stat stat = {0};
+
+		if ((kv_stat(txn, cache->room_dbs[event_dbs[i]], &stat))
+			== MDB_SUCCESS) {
+			stats->event_pages += stat.pages;
+		}
+	}
+
+	end_read_txn(cache, txn);
+}
+
+int
+cache_snapshot_begin(struct cache *cache, struct cache_snapshot *snapshot) {
+	assert(cache);
+	assert(snapshot);
+
+	/* Read first, so that events decoded from a txn older than an
+	 * invalidation are never cached. */
+	*snapshot = (struct cache_snapshot) {
+	  .cache = cache,
+	  .events_epoch = event_cache_epoch(&cache->events),
+	};
+
+	return get_txn(cache, MDB_RDONLY, &snapshot->txn);
+}
+
+/* Pinned snapshots are ended by the cache. */
+void
+cache_snapshot_end(struct cache_snapshot *snapshot) {
+	if (snapshot && snapshot->cache && !snapshot->pinned) {
+		end_read_txn(snapshot->cache, snapshot->txn);
+		memset(snapshot, 0, sizeof(*snapshot));
+	}
+}
+
+int
+cache_pin_begin(struct cache *cache, cache_pin_cb cb, cache_pin_wake_cb wake,
+  void *userp, struct cache_snapshot *snapshot) {
+	assert(cache);
+	assert(cb);
+	assert(snapshot);
+
+	if (!cache->backend->concurrent_readers) {
+		return ENOTSUP;
+	}
+
+	pthread_mutex_lock(&cache->pin.mutex);
+
+	assert(!cache->pin.cb);
+
+	int ret = begin_pin_txn(cache, snapshot);
+
+	if (ret == MDB_SUCCESS) {
+		cache->pin.txn = snapshot->txn;
+		cache->pin.cb = cb;
+		cache->pin.wake = wake;
+		cache->pin.userp = userp;
+		cache->pin.owner = pthread_self();
+	}
+
+	pthread_mutex_unlock(&cache->pin.mutex);
+
+	return ret;
+}
+
+int
+cache_pin_renew(struct cache *cache) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->pin.mutex);
+
+	if (!cache->pin.cb) {
+		pthread_mutex_unlock(&cache->pin.mutex);
+		return EINVAL;
+	}
+
+	cache->pin.owner = pthread_self();
+
+	int ret = MDB_SUCCESS;
+
+	/* Pinned again by the next call, once the waiting thread is done with
+	 * the map. */
+	if (cache->pin.release) {
+		release_pin(cache);
+		pthread_cond_broadcast(&cache->pin.cond);
+	} else {
+		struct cache_snapshot next = {0};
+
+		if ((ret = begin_pin_txn(cache, &next)) == MDB_SUCCESS) {
+			cache->pin.cb(&next, cache->pin.userp);
+			kv_txn_abort(cache->pin.txn);
+			cache->pin.txn = next.txn;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->pin.mutex);
+
+	return ret;
+}
+
+bool
+cache_pin_release_pending(struct cache *cache) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->pin.mutex);
+	bool release = cache->pin.release;
+	pthread_mutex_unlock(&cache->pin.mutex);
+
+	return release;
+}
+
+void
+cache_pin_end(struct cache *cache) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->pin.mutex);
+
+	if (cache->pin.cb) {
+		release_pin(cache);
+		cache->pin.cb = NULL;
+		cache->pin.wake = NULL;
+		pthread_cond_broadcast(&cache->pin.cond);
+	}
+
+	pthread_mutex_unlock(&cache->pin.mutex);
+}
+
+int
+cache_event_pinned(struct cache_snapshot *snapshot, const char *room_id,
+  uint64_t index, struct matrix_sync_event *event) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(snapshot->pinned);
+	assert(room_id);
+	assert(event);
+
+	struct cache *cache = snapshot->cache;
+	uint32_t room = 0;
+	MDB_val record = {0};
+	struct event_record_header header = {0};
+	unsigned flags = 0;
+
+	int ret = room_id_get(cache, snapshot->txn, room_id, &room);
+
+	if (ret == MDB_SUCCESS
+		&& (ret = room_get_index(cache, snapshot->txn, room, ROOM_DB_EVENTS,
+			  index, &record))
+			 == MDB_SUCCESS
+		&& ((event_record_is_legacy(record.mv_data, record.mv_size))
+			|| (event_record_header(record.mv_data, record.mv_size, &header))
+				 == -1
+			|| (header.flags & EVENT_RECORD_REDACTED)
+			|| (event_record_decode(
+				 record.mv_data, record.mv_size, event, &flags))
+				 == -1
+			|| (flags & EVENT_RECORD_HAS_JSON))) {
+		ret = MDB_NOTFOUND;
+	}
+
+	return ret;
+}
+
+char *
+cache_auth_get(struct cache *cache, enum auth_key key) {
+	assert(cache);
+
+	struct kv_txn *txn = NULL;
+	char *ret = NULL;
+
+	if ((get_txn(cache, MDB_RDONLY, &txn)) == MDB_SUCCESS && txn) {
+		ret = get_str_and_dup(txn, cache->dbs[DB_AUTH], noconst(db_keys[key]));
+	}
+
+	end_read_txn(cache, txn);
+
+	return ret;
+}
+
+int
+cache_auth_set(struct cache *cache, enum auth_key key, char *auth) {
+	assert(cache);
+	assert(auth);
+
+	struct kv_txn *txn = NULL;
+	int ret = MDB_SUCCESS;
+
+	do {
+		if ((ret = get_txn(cache, 0, &txn)) != MDB_SUCCESS) {
+			return ret;
+		}
+
+		if ((ret
+			  = put_str(txn, cache->dbs[DB_AUTH], noconst(db_keys[key]), auth, 0))
+			== MDB_SUCCESS) {
+			ret = end_txn(cache, txn);
+		} else {
+			abort_txn(cache, txn);
+		}
+	} while (ret == MDB_MAP_FULL && (grow_map(cache)) == MDB_SUCCESS);
+
+	flush(cache);
+
+	return ret;
+}
+
+enum { SEARCH_QUERY_TOKENS_MAX = 16 };
+
+struct search_candidate {
+	uint32_t room;
+	unsigned score;
+	uint64_t index;
+	uint64_t ts;
+};
+
+static int
+cmp_candidates(const void *a, const void *b) {
+	const struct search_candidate *candidate_a = a;
+	const struct search_candidate *candidate_b = b;
+
+	if (candidate_a->score != candidate_b->score) {
+		return candidate_a->score > candidate_b->score ? -1 : 1;
+	}
+
+	if (candidate_a->ts != candidate_b->ts) {
+		return candidate_a->ts > candidate_b->ts ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Reverse lookup of the ID of a room by it's surrogate. */
+static int
+room_surrogate_get(
+  struct cache *cache, struct kv_txn *txn, uint32_t room, MDB_val *room_id) {
+	unsigned char key[sizeof(room)];
+	write_be(key, room, sizeof(key));
+
+	int ret = kv_get(txn, cache->dbs[DB_ROOM_SURROGATES],
+	  &(MDB_val) {sizeof(key), key}, room_id);
+
+	if (ret == MDB_SUCCESS && !is_str(room_id)) {
+		LOG(LOG_ERROR, "Invalid ID for room %" PRIu32 "! Corrupt database?",
+		  room);
+		abort();
+	}
+
+	return ret;
+}
+
+/* Fill in the room ID and body of the hit. */
+static int
+search_hit(struct cache *cache, struct kv_txn *txn,
+  const struct search_candidate *candidate, struct cache_search_hit *hit) {
+	assert(cache);
+	assert(txn);
+	assert(candidate);
+	assert(hit);
+
+	*hit = (struct cache_search_hit) {
+	  .index = candidate->index,
+	  .origin_server_ts = candidate->ts,
+	  .score = candidate->score,
+	};
+
+	MDB_val data = {0};
+	int ret = room_surrogate_get(cache, txn, candidate->room, &data);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	hit->room_id = strdup(data.mv_data);
+
+	struct matrix_sync_event event = {0};
+	matrix_json_t *json = NULL;
+	struct event_block *block = NULL;
+
+	if ((ret = event_get(
+		   cache, txn, candidate->room, candidate->index, &data, &block))
+			== MDB_SUCCESS
+		&& record_decode(&data, &event, &json)) {
+		const char *text = event_search_text(&event);
+		hit->body = text ? strdup(text) : NULL;
+	}
+
+	matrix_json_delete(json);
+	event_block_unref(block);
+
+	return ret;
+}
+
+/* Collect the postings of the rarest token from the newest, scored by the
+ * number of query tokens that the event contains. Stops once max_hits of them
+ * contain every token, as older events can't rank above those. */
+static int
+search_candidates(struct kv_cursor *cursor, struct kv_cursor *probe,
+  char (*tokens)[SEARCH_TOKEN_MAX + 1], size_t num_tokens, size_t rarest,
+  size_t max_hits, struct search_candidate **out) {
+	assert(cursor);
+	assert(probe);
+	assert(tokens);
+	assert(out);
+
+	MDB_val key = {strlen(tokens[rarest]) + 1, tokens[rarest]};
+	MDB_val data = {0};
+	size_t full_matches = 0;
+
+	int ret = kv_cursor_get(cursor, &key, &data, MDB_SET);
+
+	for (ret = (ret == MDB_SUCCESS
+				   ? kv_cursor_get(cursor, &key, &data, MDB_LAST_DUP)
+				   : ret);
+		 ret == MDB_SUCCESS && full_matches < max_hits
+		 && arrlenu(*out) < CACHE_SEARCH_CANDIDATES_MAX;
+		 ret = kv_cursor_get(cursor, &key, &data, MDB_PREV_DUP)) {
+		if (data.mv_size != SEARCH_POSTING_SIZE) {
+			continue;
+		}
+
+		struct search_candidate candidate = {.score = 1};
+		search_posting_read(
+		  data.mv_data, &candidate.ts, &candidate.room, &candidate.index);
+
+		for (size_t i = 0; i < num_tokens; i++) {
+			MDB_val probe_key = {strlen(tokens[i]) + 1, tokens[i]};
+			MDB_val probe_data = data;
+
+			if (i != rarest
+				&& (kv_cursor_get(probe, &probe_key, &probe_data, MDB_GET_BOTH))
+					 == MDB_SUCCESS) {
+				candidate.score++;
+			}
+		}
+
+		if (candidate.score == num_tokens) {
+			full_matches++;
+		}
+
+		arrput(*out, candidate);
+	}
+
+	return ret;
+}
+
+int
+cache_search(struct cache_snapshot *snapshot, const char *query,
+  size_t max_hits, struct cache_search_hit **hits) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(query);
+	assert(hits);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	struct kv_cursor *cursor = NULL;
+	struct kv_cursor *probe = NULL;
+
+	*hits = NULL;
+
+	int ret = kv_cursor_open(txn, cache->dbs[DB_SEARCH], &cursor);
+
+	if (ret != MDB_SUCCESS
+		|| (ret = kv_cursor_open(txn, cache->dbs[DB_SEARCH], &probe))
+			 != MDB_SUCCESS) {
+		kv_cursor_close(cursor);
+		return ret;
+	}
+
+	char tokens[SEARCH_QUERY_TOKENS_MAX][SEARCH_TOKEN_MAX + 1];
+	char token[SEARCH_TOKEN_MAX + 1];
+	size_t num_tokens = 0;
+	size_t rarest = 0;
+	size_t rarest_count = SIZE_MAX;
+
+	while (num_tokens < SEARCH_QUERY_TOKENS_MAX
+		   && (search_token_next(&query, token)) > 0) {
+		MDB_val key = {strlen(token) + 1, token};
+		MDB_val data = {0};
+		size_t count = 0;
+		bool duplicate = false;
+
+		for (size_t i = 0; i < num_tokens; i++) {
+			duplicate = duplicate || strcmp(tokens[i], token) == 0;
+		}
+
+		/* Tokens without any postings only lower the possible score. */
+		if (duplicate
+			|| (kv_cursor_get(cursor, &key, &data, MDB_SET)) != MDB_SUCCESS
+			|| (kv_cursor_count(cursor, &count)) != MDB_SUCCESS) {
+			continue;
+		}
+
+		if (count < rarest_count) {
+			rarest = num_tokens;
+			rarest_count = count;
+		}
+
+		memcpy(tokens[num_tokens++], token, sizeof(token));
+	}
+
+	struct search_candidate *candidates = NULL;
+
+	if (num_tokens > 0 && max_hits > 0) {
+		ret = search_candidates(
+		  cursor, probe, tokens, num_tokens, rarest, max_hits, &candidates);
+	}
+
+	kv_cursor_close(probe);
+	kv_cursor_close(cursor);
+
+	if (ret != MDB_SUCCESS && ret != MDB_NOTFOUND) {
+		arrfree(candidates);
+		return ret;
+	}
+
+	size_t len = arrlenu(candidates);
+
+	if (len > 0) {
+		qsort(candidates, len, sizeof(*candidates), cmp_candidates);
+	}
+
+	for (size_t i = 0; i < len && arrlenu(*hits) < max_hits; i++) {
+		struct cache_search_hit hit = {0};
+
+		if ((search_hit(cache, txn, &candidates[i], &hit)) == MDB_SUCCESS) {
+			arrput(*hits, hit);
+		} else {
+			free(hit.room_id);
+			free(hit.body);
+		}
+	}
+
+	arrfree(candidates);
+
+	return MDB_SUCCESS;
+}
+
+void
+cache_search_hits_free(struct cache_search_hit *hits) {
+	for (size_t i = 0; i < arrlenu(hits); i++) {
+		free(hits[i].room_id);
+		free(hits[i].body);
+	}
+
+	arrfree(hits);
+}
+
+/* Events saved before the binary records existed aren't pruned by age. */
+static bool
+event_older_than(const MDB_val *record, uint64_t cutoff_ts) {
+	assert(record);
+
+	struct event_record_header header = {0};
+
+	return !event_record_is_legacy(record->mv_data, record->mv_size)
+		&& (event_record_header(record->mv_data, record->mv_size, &header)) == 0
+		&& header.origin_server_ts < cutoff_ts;
+}
+
+/* If the oldest block of the room is older than the first uncompressed event,
+ * *older is set and the block is thawed if it's first event is over the
+ * retention limits. */
+static int
+thaw_prunable(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t first_hot, uint64_t last, uint64_t cutoff_ts, bool *older,
+  bool *thawed) {
+	assert(cache);
+	assert(txn);
+	assert(older);
+	assert(thawed);
+
+	*older = *thawed = false;
+
+	struct kv_cursor *cursor = NULL;
+	int ret = kv_cursor_open(
+	  txn, cache->room_dbs[ROOM_DB_EVENT_BLOCKS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct room_key start;
+	room_key_index(&start, room, 0);
+
+	MDB_val key = start.val;
+	MDB_val data = {0};
+	uint64_t first = 0;
+	struct event_block_header header = {0};
+
+	if ((ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE))
+		  == MDB_SUCCESS
+		&& room_key_in_room(&key, room)) {
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &first);
+
+		*older = first < first_hot;
+	}
+
+	if (*older
+		&& (event_block_header(data.mv_data, data.mv_size, &header)) == 0
+		&& ((cache->retain_events > 0
+			  && (last - first + 1) > cache->retain_events)
+			|| header.first_ts < cutoff_ts)) {
+		*thawed = (ret = block_thaw(cache, txn, room, &data)) == MDB_SUCCESS;
+	}
+
+	kv_cursor_close(cursor);
+
+	return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+}
+
+/* Delete the uncompressed events from the cursor onwards while they're over
+ * the retention limits. *gap is set if an event is missing as it's
+ * compressed, the events after it can only be pruned after the block. */
+static int
+prune_run(struct cache *cache, struct kv_txn *txn, struct kv_cursor *cursor,
+  uint32_t room, uint64_t last, uint64_t cutoff_ts, size_t *pruned,
+  bool *gap) {
+	assert(cache);
+	assert(txn);
+	assert(cursor);
+	assert(pruned);
+	assert(gap);
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+	uint64_t next = 0;
+
+	*gap = false;
+
+	int ret = kv_cursor_get(cursor, &key, &data, MDB_GET_CURRENT);
+
+	for (bool first = true; ret == MDB_SUCCESS && room_key_in_room(&key, room);
+		 first = false) {
+		uint64_t index = 0;
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &index);
+
+		/* The latest event is always kept so that indices keep increasing. */
+		if (index >= last) {
+			break;
+		}
+
+		if (!first && index != next) {
+			*gap = true;
+			break;
+		}
+
+		next = index + 1;
+
+		const bool over_count = cache->retain_events > 0
+							 && (last - index + 1) > cache->retain_events;
+
+		if (!over_count
+			&& !(cutoff_ts > 0 && event_older_than(&data, cutoff_ts))) {
+			break;
+		}
+
+		/* Copied as the page might be touched by the deletions below. */
+		char event_id[ROOM_KEY_MAX];
+		char *text = NULL;
+		uint64_t ts = 0;
+		const bool has_ts = record_ts(&data, &ts);
+		char parent_id[ROOM_KEY_MAX];
+		enum relation_type type = RELATION_OTHER;
+		const bool has_relation = record_relation(&data, &type, parent_id);
+
+		if (record_copy_id_text(&data, event_id, &text)) {
+			room_del(cache, txn, room, ROOM_DB_EVENTS_TO_ORDER, event_id, NULL);
+		} else {
+			LOG(LOG_WARN, "Pruning event %" PRIu64 " without a readable ID",
+			  index);
+		}
+
+		search_index(cache, txn, room, index, ts, text, false);
+		free(text);
+
+		if (has_ts) {
+			room_ts_index(cache, txn, room, ts, index, false);
+		}
+
+		if (has_relation) {
+			relation_remove(cache, txn, room, parent_id, type, index);
+		}
+
+		room_del_index(cache, txn, room, ROOM_DB_EVENTS_JSON, index);
+		room_del_index(cache, txn, room, ROOM_DB_RELATIONS, index);
+		room_del_index(cache, txn, room, ROOM_DB_AGGREGATIONS, index);
+
+		if ((ret = kv_cursor_del(cursor, 0)) != MDB_SUCCESS) {
+			break;
+		}
+
+		(*pruned)++;
+
+		/* Returns the item after the deleted one. */
+		ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT);
+	}
+
+	return ret;
+}
+
+/* Delete the oldest events of the room until it is within the retention
+ * limits. Indices within a room are contiguous as events are only appended
+ * and pruned from the start, so the count is derived from the first and last
+ * index. Blocks are thawed to be pruned, always before the events after
+ * them. */
+static int
+prune_room(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t cutoff_ts, size_t *pruned) {
+	assert(cache);
+	assert(txn);
+	assert(pruned);
+
+	struct kv_cursor *cursor = NULL;
+	int ret = kv_cursor_open(txn, cache->room_dbs[ROOM_DB_EVENTS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+	uint64_t last = 0;
+
+	if ((ret = seek_last_event(cursor, room, &key)) == MDB_SUCCESS) {
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &last);
+	}
+
+	for (bool more = true; more && ret == MDB_SUCCESS;) {
+		struct room_key first;
+		room_key_index(&first, room, 0);
+
+		uint64_t first_hot = 0;
+		bool older = false;
+		bool thawed = false;
+
+		key = first.val;
+
+		if ((ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE))
+			!= MDB_SUCCESS) {
+			break;
+		}
+
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &first_hot);
+
+		if ((ret = thaw_prunable(cache, txn, room, first_hot, last, cutoff_ts,
+			   &older, &thawed))
+			  != MDB_SUCCESS
+			|| thawed) {
+			continue;
+		}
+
+		/* The events after a block that is kept are newer than it. */
+		if (older) {
+			break;
+		}
+
+		ret = prune_run(
+		  cache, txn, cursor, room, last, cutoff_ts, pruned, &more);
+	}
+
+	kv_cursor_close(cursor);
+
+	ABORT_OR_RETURN(ret == MDB_NOTFOUND ? MDB_SUCCESS : ret);
+}
+
+/* Timestamp (in ms) of the events that are older than age_ms, 0 if age_ms is
+ * 0. */
+static uint64_t
+cutoff_from_age(uint64_t age_ms) {
+	const uint64_t ms_in_sec = 1000;
+	const uint64_t now_ms = (uint64_t) time(NULL) * ms_in_sec;
+
+	return (age_ms > 0 && now_ms > age_ms) ? now_ms - age_ms : 0;
+}
+
+/* *rooms stores an stb array of the surrogates of all rooms. */
+static int
+room_surrogates(struct cache *cache, uint32_t **rooms) {
+	assert(cache);
+	assert(rooms);
+
+	struct cache_snapshot snapshot = {0};
+	struct kv_cursor *cursor = NULL;
+
+	int ret = cache_snapshot_begin(cache, &snapshot);
+
+	if (ret == MDB_SUCCESS
+		&& (ret = kv_cursor_open(
+			  snapshot.txn, cache->dbs[DB_ROOM_IDS], &cursor))
+			 == MDB_SUCCESS) {
+		MDB_val key = {0};
+		MDB_val data = {0};
+
+		while ((ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT))
+			   == MDB_SUCCESS) {
+			uint32_t room = 0;
+			assert(data.mv_size == sizeof(room));
+			memcpy(&room, data.mv_data, sizeof(room));
+
+			arrput(*rooms, room);
+		}
+
+		kv_cursor_close(cursor);
+	}
+
+	cache_snapshot_end(&snapshot);
+
+	if (ret != MDB_NOTFOUND) {
+		arrfree(*rooms);
+		return ret;
+	}
+
+	return MDB_SUCCESS;
+}
+
+/* Run fn for each room in a separate txn, so that syncing isn't blocked for
+ * long. *count stores the sum of the counts of all rooms. */
+static int
+each_room(struct cache *cache,
+  int (*fn)(struct cache *, struct kv_txn *, uint32_t, uint64_t, size_t *),
+  uint64_t cutoff_ts, size_t *count) {
+	assert(cache);
+	assert(fn);
+	assert(count);
+
+	uint32_t *rooms = NULL;
+
+	int ret = room_surrogates(cache, &rooms);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	for (size_t i = 0, len = arrlenu(rooms); i < len && ret == MDB_SUCCESS;
+		 i++) {
+		do {
+			struct kv_txn *txn = NULL;
+			size_t room_count = 0;
+
+			if ((ret = get_txn(cache, 0, &txn)) != MDB_SUCCESS) {
+				break;
+			}
+
+			if ((ret = fn(cache, txn, rooms[i], cutoff_ts, &room_count))
+				  == MDB_SUCCESS
+				&& !txn_failed(cache, txn)) {
+				ret = end_txn(cache, txn);
+			} else {
+				abort_txn(cache, txn);
+				ret = MDB_MAP_FULL;
+			}
+
+			if (ret == MDB_SUCCESS) {
+				*count += room_count;
+			}
+		} while (ret == MDB_MAP_FULL && (ret = grow_map(cache)) == MDB_SUCCESS);
+	}
+
+	arrfree(rooms);
+
+	return ret;
+}
+
+int
+cache_prune(struct cache *cache, size_t *pruned) {
+	assert(cache);
+	assert(pruned);
+
+	*pruned = 0;
+
+	if (cache->retain_events == 0 && cache->retain_age_ms == 0) {
+		return MDB_SUCCESS;
+	}
+
+	int ret = each_room(
+	  cache, prune_room, cutoff_from_age(cache->retain_age_ms), pruned);
+
+	LOG(LOG_MESSAGE, "Pruned %zu events", *pruned);
+
+	return ret;
+}
+
+static int
+next_block_id(struct cache *cache, struct kv_txn *txn, uint64_t *id) {
+	assert(cache);
+	assert(txn);
+	assert(id);
+
+	MDB_val data = {0};
+	const char *key = meta_keys[META_NEXT_BLOCK];
+
+	*id = 0;
+
+	int ret = get_str(txn, cache->dbs[DB_META], key, &data);
+
+	if (ret == MDB_SUCCESS) {
+		assert(data.mv_size == sizeof(*id));
+		memcpy(id, data.mv_data, sizeof(*id));
+	} else if (ret != MDB_NOTFOUND) {
+		return ret;
+	}
+
+	uint64_t after = *id + 1;
+
+	ABORT_OR_RETURN(kv_put(txn, cache->dbs[DB_META],
+	  &(MDB_val) {strlen(key) + 1, noconst(key)},
+	  &(MDB_val) {sizeof(after), &after}, 0));
+}
+
+/* Compress the run of events starting at first and delete their uncompressed
+ * copies. */
+static int
+block_write(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t first, struct event_block_header *header, const unsigned char *raw,
+  size_t raw_size) {
+	assert(cache);
+	assert(txn);
+	assert(header);
+	assert(raw);
+
+	const unsigned char *dict = NULL;
+	size_t dict_size = 0;
+	unsigned char *buf = NULL;
+	size_t size = 0;
+
+	int ret = next_block_id(cache, txn, &header->id);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	block_dict(cache, &dict, &dict_size);
+
+	if ((event_block_compress(
+		  header, raw, raw_size, dict, dict_size, &buf, &size))
+		== -1) {
+		return ENOMEM;
+	}
+
+	struct room_key key;
+	room_key_index(&key, room, first);
+
+	ret = kv_put(txn, cache->room_dbs[ROOM_DB_EVENT_BLOCKS], &key.val,
+	  &(MDB_val) {size, buf}, MDB_NOOVERWRITE);
+
+	free(buf);
+
+	for (uint64_t i = first; i <= header->last_index && ret == MDB_SUCCESS;
+		 i++) {
+		ret = room_del_index(cache, txn, room, ROOM_DB_EVENTS, i);
+		room_del_index(cache, txn, room, ROOM_DB_EVENTS_JSON, i);
+	}
+
+	ABORT_OR_RETURN(ret);
+}
+
+/* Compress runs of consecutive events older than cutoff_ts, oldest first.
+ * Legacy JSON records aren't compressed as they have no timestamp in their
+ * header. */
+static int
+freeze_room(struct cache *cache, struct kv_txn *txn, uint32_t room,
+  uint64_t cutoff_ts, size_t *frozen) {
+	assert(cache);
+	assert(txn);
+	assert(frozen);
+
+	struct kv_cursor *cursor = NULL;
+	int ret = kv_cursor_open(txn, cache->room_dbs[ROOM_DB_EVENTS], &cursor);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	MDB_val key = {0};
+	MDB_val data = {0};
+	uint64_t last = 0;
+	uint64_t first = 0;
+	unsigned char *raw = NULL;
+	struct event_block_header header = {0};
+
+	if ((ret = seek_last_event(cursor, room, &key)) == MDB_SUCCESS) {
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &last);
+
+		struct room_key start;
+		room_key_index(&start, room, 0);
+
+		key = start.val;
+		ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+	}
+
+	while (ret == MDB_SUCCESS && room_key_in_room(&key, room)) {
+		uint64_t index = 0;
+		MDB_val index_val = room_key_data(&key);
+		cpy_index_be(&index_val, &index);
+
+		/* The latest event is never compressed, so that the next index is
+		 * found without looking at the blocks. */
+		if (index >= last || !event_older_than(&data, cutoff_ts)) {
+			break;
+		}
+
+		struct event_record_header record_header = {0};
+		event_record_header(data.mv_data, data.mv_size, &record_header);
+
+		/* Blocks only hold consecutive events, the events before a gap are
+		 * compressed already. */
+		if (header.count > 0 && index != (first + header.count)) {
+			arrsetlen(raw, 0);
+			header.count = 0;
+		}
+
+		if (header.count == 0) {
+			first = index;
+			header.first_ts = record_header.origin_server_ts;
+		}
+
+		MDB_val json = {0};
+
+		if ((record_header.flags & EVENT_RECORD_HAS_JSON)
+			&& ((room_get_index(
+				  cache, txn, room, ROOM_DB_EVENTS_JSON, index, &json))
+				  != MDB_SUCCESS
+				|| !is_str(&json))) {
+			json = (MDB_val) {0};
+		}
+
+		assert(data.mv_size <= UINT32_MAX && json.mv_size <= UINT32_MAX);
+
+		event_block_append(&raw, &(struct event_block_entry) {
+								   .index = index,
+								   .record = data.mv_data,
+								   .record_size = (uint32_t) data.mv_size,
+								   .json = json.mv_data,
+								   .json_size = (uint32_t) json.mv_size,
+								 });
+
+		header.count++;
+		header.last_index = index;
+
+		if (header.count < CACHE_EVENT_BLOCK_SIZE) {
+			ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT);
+			continue;
+		}
+
+		if ((ret = block_write(
+			   cache, txn, room, first, &header, raw, arrlenu(raw)))
+			!= MDB_SUCCESS) {
+			break;
+		}
+
+		*frozen += header.count;
+		header.count = 0;
+		arrsetlen(raw, 0);
+
+		/* The cursor was invalidated by the deletions. */
+		struct room_key after;
+		room_key_index(&after, room, index + 1);
+
+		key = after.val;
+		ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+	}
+
+	arrfree(raw);
+	kv_cursor_close(cursor);
+
+	ABORT_OR_RETURN(ret == MDB_NOTFOUND ? MDB_SUCCESS : ret);
+}
+
+/* Train the dictionary on the oldest events of each room, as they're the
+ * ones that are compressed. */
+static int
+dict_train(struct cache *cache) {
+	assert(cache);
+
+	enum {
+		samples_per_room = 64,
+		samples_max = 4096,
+	};
+
+	const unsigned char **samples = NULL;
+	size_t *sizes = NULL;
+	struct cache_snapshot snapshot = {0};
+	struct kv_cursor *cursor = NULL;
+	unsigned char *dict = NULL;
+	size_t dict_size = 0;
+
+	int ret = cache_snapshot_begin(cache, &snapshot);
+
+	if (ret == MDB_SUCCESS
+		&& (ret = kv_cursor_open(
+			  snapshot.txn, cache->room_dbs[ROOM_DB_EVENTS], &cursor))
+			 == MDB_SUCCESS) {
+		MDB_val key = {0};
+		MDB_val data = {0};
+		uint32_t room = 0;
+		size_t in_room = 0;
+
+		ret = kv_cursor_get(cursor, &key, &data, MDB_FIRST);
+
+		while (ret == MDB_SUCCESS && arrlenu(samples) < samples_max) {
+			if (!room_key_in_room(&key, room)) {
+				room = (uint32_t) read_be(key.mv_data, sizeof(room));
+				in_room = 0;
+			}
+
+			if (in_room++ < samples_per_room) {
+				if (!event_record_is_legacy(data.mv_data, data.mv_size)) {
+					arrput(samples, data.mv_data);
+					arrput(sizes, data.mv_size);
+				}
+
+				ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT);
+				continue;
+			}
+
+			/* Skip to the next room. */
+			struct room_key next;
+			room_key(&next, room + 1, NULL, 0);
+
+			key = next.val;
+			ret = kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+		}
+
+		kv_cursor_close(cursor);
+	}
+
+	if ((ret == MDB_SUCCESS || ret == MDB_NOTFOUND)
+		&& (dict = malloc(EVENT_BLOCK_DICT_MAX))) {
+		dict_size = event_block_dict_train(
+		  samples, sizes, arrlenu(samples), dict, EVENT_BLOCK_DICT_MAX);
+	}
+
+	cache_snapshot_end(&snapshot);
+
+	arrfree(samples);
+	arrfree(sizes);
+
+	if (dict_size == 0) {
+		free(dict);
+		return (ret == MDB_NOTFOUND) ? MDB_SUCCESS : ret;
+	}
+
+	struct kv_txn *txn = NULL;
+	const char *key = meta_keys[META_EVENT_DICT];
+
+	if ((ret = get_txn(cache, 0, &txn)) == MDB_SUCCESS) {
+		if ((ret = kv_put(txn, cache->dbs[DB_META],
+			   &(MDB_val) {strlen(key) + 1, noconst(key)},
+			   &(MDB_val) {dict_size, dict}, MDB_NOOVERWRITE))
+			  == MDB_SUCCESS
+			&& !txn_failed(cache, txn)) {
+			ret = end_txn(cache, txn);
+		} else {
+			abort_txn(cache, txn);
+		}
+	}
+
+	if (ret != MDB_SUCCESS) {
+		free(dict);
+		return ret;
+	}
+
+	pthread_mutex_lock(&cache->blocks.mutex);
+	cache->blocks.dict = dict;
+	cache->blocks.dict_size = dict_size;
+	pthread_mutex_unlock(&cache->blocks.mutex);
+
+	LOG(LOG_MESSAGE, "Trained a %zu byte dictionary", dict_size);
+
+	return ret;
+}
+
+int
+cache_freeze(struct cache *cache, size_t *frozen) {
+	assert(cache);
+	assert(frozen);
+
+	*frozen = 0;
+
+	if (cache->cold_age_ms == 0) {
+		return MDB_SUCCESS;
+	}
+
+	int ret = MDB_SUCCESS;
+
+	if (!cache->blocks.dict) {
+		ret = dict_train(cache);
+	}
+
+	/* Without a dictionary the blocks are still compressed, just worse. */
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_WARN, "Failed to train dictionary: %s", mdb_strerror(ret));
+	}
+
+	ret = each_room(cache, freeze_room, cutoff_from_age(cache->cold_age_ms),
+	  frozen);
+
+	LOG(LOG_MESSAGE, "Compressed %zu events", *frozen);
+
+	return ret;
+}
+
+static int
+sync_path(const char *path) {
+	assert(path);
+
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		return errno;
+	}
+
+	int ret = fsync(fd) == 0 ? 0 : errno;
+	close(fd);
+
+	return ret;
+}
+
+/* Reopen the env at the current path with the given map size. */
+static int
+reopen_env(struct cache *cache, size_t map_size) {
+	assert(cache);
+
+	struct kv_txn *txn = NULL;
+	int ret = open_env(cache, map_size);
+
+	if (ret == MDB_SUCCESS
+		&& (ret = kv_txn_begin(cache->env, 0, &txn)) == MDB_SUCCESS) {
+		if ((ret = open_dbis(cache, txn)) == MDB_SUCCESS) {
+			ret = kv_txn_commit(txn);
+		} else {
+			kv_txn_abort(txn);
+		}
+	}
+
+	if (ret != MDB_SUCCESS && cache->env) {
+		kv_env_close(cache->env);
+		cache->env = NULL;
+	}
+
+	return ret;
+}
+
+/* Replace the env with the compacted copy and reopen it. The original is
+ * linked to backup first, and put back if the copy can't be opened. The env
+ * is only left NULL if the original can't be reopened either. */
+static int
+swap_env(struct cache *cache, const char *copy, const char *path,
+  const char *backup) {
+	assert(cache);
+	assert(copy);
+	assert(path);
+	assert(backup);
+
+	drain_read_txns(cache);
+
+	struct kv_env_info info = {0};
+	int ret = kv_env_info(cache->env, &info);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	kv_env_close(cache->env);
+	cache->env = NULL;
+
+	unlink(backup);
+
+	bool swapped = false;
+
+	if ((link(path, backup)) == -1 || (rename(copy, path)) == -1) {
+		ret = errno;
+	} else {
+		swapped = true;
+		ret = sync_path(cache->dir);
+	}
+
+	if (swapped) {
+		int open_ret = reopen_env(cache, info.map_size);
+
+		if (open_ret == MDB_SUCCESS) {
+			unlink(backup);
+			return ret;
+		}
+
+		LOG(LOG_ERROR, "Failed to open compacted cache: %s",
+		  mdb_strerror(open_ret));
+
+		if ((rename(backup, path)) == -1) {
+			ret = errno;
+			LOG(LOG_ERROR, "Failed to restore cache from '%s': %s", backup,
+			  strerror(ret));
+			return ret;
+		}
+
+		sync_path(cache->dir);
+		ret = open_ret;
+	} else {
+		unlink(backup);
+	}
+
+	int open_ret = reopen_env(cache, info.map_size);
+
+	if (open_ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to reopen cache: %s", mdb_strerror(open_ret));
+		return open_ret;
+	}
+
+	return ret;
+}
+
+/* ID of the last commit, to tell whether anything was written since. */
+static int
+env_last_txn(struct cache *cache, uint64_t *txn) {
+	assert(cache);
+	assert(txn);
+
+	struct kv_env_info info = {0};
+	int ret = kv_env_info(cache->env, &info);
+
+	if (ret == MDB_SUCCESS) {
+		*txn = info.last_txn;
+	}
+
+	return ret;
+}
+
+/* Copy the env without holding write_lock, and swap it in only if nothing was
+ * committed since the copy began. EAGAIN if something was. */
+static int
+compact_once(struct cache *cache, const char *copy_dir, const char *copy,
+  const char *path, const char *backup) {
+	assert(cache);
+	assert(copy_dir);
+	assert(copy);
+	assert(path);
+	assert(backup);
+
+	/* Left over from an interrupted compaction. */
+	unlink(copy);
+
+	uint64_t before = 0;
+	uint64_t after = 0;
+
+	/* Can't be resized while copying. */
+	pthread_rwlock_rdlock(&cache->resize_lock);
+
+	int ret = cache->env ? env_last_txn(cache, &before) : EIO;
+
+	if (ret == MDB_SUCCESS) {
+		ret = kv_env_copy(cache->env, copy_dir);
+	}
+
+	pthread_rwlock_unlock(&cache->resize_lock);
+
+	if (ret == MDB_SUCCESS) {
+		ret = sync_path(copy);
+	}
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	lock_pin(cache);
+	pthread_mutex_lock(&cache->write_lock);
+	pthread_rwlock_wrlock(&cache->resize_lock);
+
+	if (!cache->env) {
+		ret = EIO;
+	} else if ((ret = env_last_txn(cache, &after)) == MDB_SUCCESS) {
+		/* Writes committed after the copy began would be lost by the swap. */
+		ret = after == before ? swap_env(cache, copy, path, backup) : EAGAIN;
+	}
+
+	pthread_rwlock_unlock(&cache->resize_lock);
+	pthread_mutex_unlock(&cache->write_lock);
+	unlock_pin(cache);
+
+	return ret;
+}
+
+int
+cache_compact(struct cache *cache) {
+	assert(cache);
+
+	/* Nothing on disk to compact. */
+	if (!cache->backend->durable) {
+		return ENOTSUP;
+	}
+
+	enum {
+		/* The copy is retried if a sync was saved while copying. */
+		max_attempts = 3,
+	};
+
+	char copy_dir[PATH_MAX];
+	char copy[PATH_MAX];
+	char path[PATH_MAX];
+	char backup[PATH_MAX];
+
+	if ((snprintf(copy_dir, sizeof(copy_dir), "%s/compact", cache->dir))
+		  >= (int) sizeof(copy_dir)
+		|| (snprintf(copy, sizeof(copy), "%s/data.mdb", copy_dir))
+			 >= (int) sizeof(copy)
+		|| (snprintf(path, sizeof(path), "%s/data.mdb", cache->dir))
+			 >= (int) sizeof(path)
+		|| (snprintf(backup, sizeof(backup), "%s/data.mdb.orig", copy_dir))
+			 >= (int) sizeof(backup)) {
+		return ENAMETOOLONG;
+	}
+
+	const mode_t dir_perms = 0755;
+
+	if ((mkdir(copy_dir, dir_perms)) == -1 && errno != EEXIST) {
+		return errno;
+	}
+
+	struct stat before = {0};
+	struct stat after = {0};
+	stat(path, &before);
+
+	int ret = EAGAIN;
+
+	for (int i = 0; i < max_attempts && ret == EAGAIN; i++) {
+		ret = compact_once(cache, copy_dir, copy, path, backup);
+	}
+
+	unlink(copy);
+	rmdir(copy_dir);
+
+	if (ret == MDB_SUCCESS) {
+		stat(path, &after);
+
+		LOG(LOG_MESSAGE, "Compacted cache from %jd to %jd MiB",
+		  (intmax_t) before.st_size / MIB, (intmax_t) after.st_size / MIB);
+	} else if (ret == EAGAIN) {
+		LOG(LOG_WARN, "Skipped compacting cache, it was written to while "
+					  "copying");
+	} else {
+		LOG(LOG_ERROR, "Failed to compact cache: %s", mdb_strerror(ret));
+	}
+
+	return ret;
+}
+
+int
+cache_batch_init(struct cache *cache, struct cache_batch *batch) {
+	assert(cache);
+	assert(batch);
+
+	maybe_grow_map(cache);
+
+	*batch = (struct cache_batch) {.cache = cache};
+	clock_gettime(CLOCK_MONOTONIC, &batch->start);
+
+	return get_txn(cache, 0, &batch->txn);
+}
+
+bool
+cache_batch_failed(struct cache_batch *batch) {
+	assert(batch);
+
+	return txn_failed(batch->cache, batch->txn);
+}
+
+int
+cache_batch_finish(struct cache_batch *batch) {
+	assert(batch);
+
+	struct cache *cache = batch->cache;
+	int ret = MDB_MAP_FULL;
+
+	/* Operations only fail without aborting if the map is full. */
+	if (txn_failed(cache, batch->txn)) {
+		abort_txn(cache, batch->txn);
+	} else {
+		ret = end_txn(cache, batch->txn);
+	}
+
+	if (ret == MDB_MAP_FULL || ret == MDB_BAD_TXN) {
+		LOG(LOG_WARN, "Map full after %zu rooms, %zu events", batch->num_rooms,
+		  batch->num_events);
+		free(batch->next_batch);
+		arrfree(batch->redacted);
+		memset(batch, 0, sizeof(*batch));
+
+		int grow_ret = grow_map(cache);
+		return grow_ret == MDB_SUCCESS ? MDB_MAP_FULL : grow_ret;
+	}
+
+	uint64_t elapsed = ms_since(&batch->start);
+
+	LOG(LOG_MESSAGE, "Committed %zu rooms, %zu events in %" PRIu64 " ms",
+	  batch->num_rooms, batch->num_events, elapsed);
+
+	if (ret == MDB_SUCCESS && cache->durability == CACHE_DURABILITY_NOSYNC) {
+		pthread_mutex_lock(&cache->flusher.mutex);
+
+		cache->flusher.dirty = true;
+
+		if (batch->next_batch) {
+			free(cache->flusher.next_batch);
+			cache->flusher.next_batch = batch->next_batch;
+			batch->next_batch = NULL;
+		}
+
+		pthread_mutex_unlock(&cache->flusher.mutex);
+	}
+
+	if (ret == MDB_SUCCESS) {
+		for (size_t i = 0, len = arrlenu(batch->redacted); i < len; i++) {
+			struct event_cache_key *key = &batch->redacted[i];
+			event_cache_invalidate(&cache->events, key->room, key->index);
+		}
+	}
+
+	log_stats(cache);
+
+	free(batch->next_batch);
+	arrfree(batch->redacted);
+	memset(batch, 0, sizeof(*batch));
+
+	return ret;
+}
+
+int
+cache_batch_auth_set(
+  struct cache_batch *batch, enum auth_key key, const char *auth) {
+	assert(batch);
+	assert(auth);
+
+	/* Saved by the flusher once the batch is synced. */
+	if (key == DB_KEY_NEXT_BATCH
+		&& batch->cache->durability == CACHE_DURABILITY_NOSYNC) {
+		free(batch->next_batch);
+		batch->next_batch = strdup(auth);
+
+		return batch->next_batch ? MDB_SUCCESS : ENOMEM;
+	}
+
+	return put_str(
+	  batch->txn, batch->cache->dbs[DB_AUTH], noconst(db_keys[key]), auth, 0);
+}
+
+char *
+cache_room_name(struct cache *cache, struct kv_txn *txn, const char *room_id) {
+	if (cache && txn && room_id) {
+		uint32_t room = 0;
+		char *res = NULL;
+		matrix_json_t *json = NULL;
+
+		if (room_id_get(cache, txn, room_id, &room) == MDB_SUCCESS) {
+			char state_key[] = "m.room.name";
+			char state_fallback[] = "m.room.canonical_alias";
+
+			MDB_val value = {0};
+			struct matrix_sync_event event;
+
+			if (((room_get(cache, txn, room, ROOM_DB_STATE, state_key, &value))
+					== MDB_SUCCESS
+				  || (room_get(cache, txn, room, ROOM_DB_STATE, state_fallback,
+						&value))
+					   == MDB_SUCCESS)
+				&& record_decode(&value, &event, &json)
+				&& event.type == MATRIX_EVENT_STATE) {
+				switch (event.state.type) {
+				case MATRIX_ROOM_NAME:
+					res = event.state.content.name.name;
+					break;
+				case MATRIX_ROOM_CANONICAL_ALIAS:
+					res = event.state.content.canonical_alias.alias;
+					break;
+				default:
+					break;
+				}
+			} else {
+				/* TODO Check if DM. */
+			}
+		}
+
+		if (res) {
+			res = strdup(res);
+		}
+
+		matrix_json_delete(json);
+
+		return res;
+	}
+
+	return NULL;
+}
+
+char *
+cache_room_topic(struct cache *cache, struct kv_txn *txn, const char *room_id) {
+	if (cache && txn && room_id) {
+		uint32_t room = 0;
+		char *res = NULL;
+		matrix_json_t *json = NULL;
+
+		if (room_id_get(cache, txn, room_id, &room) == MDB_SUCCESS) {
+			char state_key[] = "m.room.topic";
+
+			MDB_val value = {0};
+			struct matrix_sync_event event;
+
+			if ((room_get(cache, txn, room, ROOM_DB_STATE, state_key, &value))
+				  == MDB_SUCCESS
+				&& record_decode(&value, &event, &json)
+				&& event.type == MATRIX_EVENT_STATE
+				&& event.state.type == MATRIX_ROOM_TOPIC) {
+				res = event.state.content.topic.topic;
+			}
+		}
+
+		if (res) {
+			res = strdup(res);
+		}
+
+		matrix_json_delete(json);
+
+		return res;
+	}
+
+	return NULL;
+}
+
+static int (*const iterators[CACHE_ITERATOR_MAX])(struct cache_iterator *)
+  = {[CACHE_ITERATOR_ROOMS] = cache_rooms_next,
+	[CACHE_ITERATOR_EVENTS] = cache_event_next,
+	[CACHE_ITERATOR_MEMBER] = cache_member_next,
+	[CACHE_ITERATOR_SPACES] = cache_spaces_next,
+	[CACHE_ITERATOR_SPACE_CHILDREN] = cache_space_children_next};
+
+int
+cache_iterator_next(struct cache_iterator *iterator) {
+	assert(iterator);
+
+	if (iterator->type >= 0 && iterator->type < CACHE_ITERATOR_MAX) {
+		return iterators[iterator->type](iterator);
+	}
+
+	assert(0);
+}
+
+static bool
+room_is_space(struct cache *cache, struct kv_txn *txn, const char *room_id) {
+	assert(cache);
+	assert(txn);
+	assert(room_id);
+
+	bool is_space = false;
+	uint32_t room = 0;
+
+	if ((room_id_get(cache, txn, room_id, &room)) == MDB_SUCCESS) {
+		char state_key[] = "m.room.create";
+		MDB_val value = {0};
+		matrix_json_t *json = NULL;
+		struct matrix_sync_event event;
+		struct matrix_state_event *sevent = &event.state;
+
+		if ((room_get(cache, txn, room, ROOM_DB_STATE, state_key, &value))
+			  == MDB_SUCCESS
+			&& record_decode(&value, &event, &json)
+			&& event.type == MATRIX_EVENT_STATE) {
+			if (sevent->type != MATRIX_ROOM_CREATE) {
+				LOG(LOG_ERROR,
+				  "m.room.create state event isn't a state event in room "
+				  "'%s'!",
+				  room_id);
+				assert(0);
+			} else {
+				is_space = !!sevent->content.create.type
+						&& (strcmp(sevent->content.create.type, "m.space") == 0);
+			}
+		}
+
+		matrix_json_delete(json);
+	}
+
+	return is_space;
+}
+
+int
+cache_room_info_init(
+  struct cache_snapshot *snapshot, struct room_info *info, const char *room_id) {
+	assert(snapshot);
+	assert(snapshot->txn);
+	assert(info);
+	assert(room_id);
+
+	struct cache *cache = snapshot->cache;
+	struct kv_txn *txn = snapshot->txn;
+	MDB_val value = {0};
+
+	int ret = get_str(txn, cache->dbs[DB_ROOMS], room_id, &value);
+
+	if (ret != MDB_SUCCESS && ret != MDB_NOTFOUND) {
+		return ret;
+	}
+
+	return room_info_from_summary(
+	  cache, txn, room_id, ret == MDB_SUCCESS ? &value : NULL, info);
+}
+
+void
+cache_room_info_finish(struct room_info *info) {
+	if (info) {
+		free(info->name);
+		free(info->topic);
+		memset(info, 0, sizeof(*info));
+	}
+}
+
+static void
+summary_finish(struct room_summary *summary) {
+	assert(summary);
+
+	for (size_t i = 0; i < ROOM_SUMMARY_FIELD_MAX; i++) {
+		free(summary->fields[i]);
+	}
+
+	memset(summary, 0, sizeof(*summary));
+}
+
+/* Build the summary from the stored state of the room, for rooms saved before
+ * summaries existed. The strings of *summary are allocated. */
+static void
+summary_rebuild(struct cache *cache, struct kv_txn *txn, const char *room_id,
+  struct room_summary *summary) {
+	assert(cache);
+	assert(txn);
+	assert(room_id);
+	assert(summary);
+
+	*summary = (struct room_summary) {
+	  .flags = room_is_space(cache, txn, room_id) ? ROOM_SUMMARY_IS_SPACE : 0,
+	  /* Name with the alias as a fallback. */
+	  .fields = {[ROOM_SUMMARY_NAME] = cache_room_name(cache, txn, room_id),
+		[ROOM_SUMMARY_TOPIC] = cache_room_topic(cache, txn, room_id)},
+	};
+
+	uint32_t room = 0;
+
+	if ((room_id_get(cache, txn, room_id, &room)) != MDB_SUCCESS) {
+		return;
+	}
+
+	summary->member_count = count_joined(cache, txn, room);
+
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	if ((kv_cursor_open(txn, cache->room_dbs[ROOM_DB_EVENTS], &cursor))
+		== MDB_SUCCESS) {
+		if ((seek_last_event(cursor, room, &key)) == MDB_SUCCESS
+			&& (kv_cursor_get(cursor, &key, &data, MDB_GET_CURRENT))
+				 == MDB_SUCCESS) {
+			MDB_val index = room_key_data(&key);
+			cpy_index_be(&index, &summary->last_index);
+
+			struct event_record_header header = {0};
+
+			if ((event_record_header(data.mv_data, data.mv_size, &header))
+				== 0) {
+				summary->last_activity_ts = header.origin_server_ts;
+			}
+		}
+
+		kv_cursor_close(cursor);
+	}
+}
+
+static int
+room_info_from_summary(struct cache *cache, struct kv_txn *txn,
+  const char *room_id, MDB_val *value, struct room_info *info) {
+	assert(info);
+
+	struct room_summary summary = {0};
+	struct room_summary rebuilt = {0};
+
+	if (!value
+		|| (room_summary_decode(value->mv_data, value->mv_size, &summary))
+			 != 0) {
+		summary_rebuild(cache, txn, room_id, &rebuilt);
+		summary = rebuilt;
+	}
+
+	const char *name = summary.fields[ROOM_SUMMARY_NAME]
+						 ? summary.fields[ROOM_SUMMARY_NAME]
+						 : summary.fields[ROOM_SUMMARY_ALIAS];
+	const char *topic = summary.fields[ROOM_SUMMARY_TOPIC];
+
+	*info = (struct room_info) {
+	  .invite = !!(summary.flags & ROOM_SUMMARY_INVITE),
+	  .is_space = !!(summary.flags & ROOM_SUMMARY_IS_SPACE),
+	  .name = name ? strdup(name) : NULL,
+	  .topic = topic ? strdup(topic) : NULL,
+	  .member_count = summary.member_count,
+	  .last_activity_ts = summary.last_activity_ts,
+	  .last_index = summary.last_index,
+	};
+
+	summary_finish(&rebuilt);
+
+	if ((name && !info->name) || (topic && !info->topic)) {
+		cache_room_info_finish(info);
+		return ENOMEM;
+	}
+
+	return MDB_SUCCESS;
+}
+
+/* Load the stored summary into the txn so that it can be updated by the events
+ * that are saved. */
+static int
+summary_load(struct cache_save_txn *txn) {
+	assert(txn);
+
+	MDB_val value = {0};
+	struct room_summary stored = {0};
+
+	int ret
+	  = get_str(txn->txn, txn->cache->dbs[DB_ROOMS], txn->room_id, &value);
+
+	if (ret == MDB_SUCCESS
+		&& (room_summary_decode(value.mv_data, value.mv_size, &stored)) == 0) {
+		txn->summary = stored;
+
+		for (size_t i = 0; i < ROOM_SUMMARY_FIELD_MAX; i++) {
+			if (stored.fields[i]
+				&& !(txn->summary.fields[i] = strdup(stored.fields[i]))) {
+				summary_finish(&txn->summary);
+				return ENOMEM;
+			}
+		}
+	} else if (ret == MDB_SUCCESS || ret == MDB_NOTFOUND) {
+		summary_rebuild(txn->cache, txn->txn, txn->room_id, &txn->summary);
+		txn->summary_dirty = true;
+	} else {
+		return ret;
+	}
+
+	txn->summary_loaded = true;
+
+	return MDB_SUCCESS;
+}
+
+static void
+summary_set_field(struct cache_save_txn *txn, enum room_summary_field field,
+  const char *value) {
+	assert(txn);
+
+	free(txn->summary.fields[field]);
+	txn->summary.fields[field] = value ? strdup(value) : NULL;
+	txn->summary_dirty = true;
+}
+
+static void
+summary_set_flag(struct cache_save_txn *txn, unsigned flag, bool set) {
+	assert(txn);
+
+	unsigned flags = set ? (txn->summary.flags | flag)
+						 : (txn->summary.flags & ~flag);
+
+	if (flags != txn->summary.flags) {
+		txn->summary.flags = flags;
+		txn->summary_dirty = true;
+	}
+}
+
+/* Update the summary with a state event that has an empty state key. */
+static void
+summary_update_state(
+  struct cache_save_txn *txn, struct matrix_state_event *sevent) {
+	assert(txn);
+	assert(sevent);
+
+	switch (sevent->type) {
+	case MATRIX_ROOM_NAME:
+		summary_set_field(txn, ROOM_SUMMARY_NAME, sevent->content.name.name);
+		break;
+	case MATRIX_ROOM_CANONICAL_ALIAS:
+		summary_set_field(
+		  txn, ROOM_SUMMARY_ALIAS, sevent->content.canonical_alias.alias);
+		break;
+	case MATRIX_ROOM_TOPIC:
+		summary_set_field(txn, ROOM_SUMMARY_TOPIC, sevent->content.topic.topic);
+		break;
+	case MATRIX_ROOM_CREATE:
+		summary_set_flag(txn, ROOM_SUMMARY_IS_SPACE,
+		  sevent->content.create.type
+			&& (strcmp(sevent->content.create.type, "m.space")) == 0);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Update the summary with an event that was added to the timeline. */
+static void
+summary_add_event(struct cache_save_txn *txn, uint64_t index, uint64_t ts) {
+	assert(txn);
+
+	if (index == (uint64_t) -1) {
+		return;
+	}
 
-		if (res) {
-			res = strdup(res);
-		}
+	if (index > txn->summary.last_index) {
+		txn->summary.last_index = index;
+		txn->summary_dirty = true;
+	}
 
-		matrix_json_delete(json);
+	if (ts > txn->summary.last_activity_ts) {
+		txn->summary.last_activity_ts = ts;
+		txn->summary_dirty = true;
+	}
+}
 
-		return res;
+static int
+summary_save(struct cache_save_txn *txn) {
+	assert(txn);
+
+	MDB_val data = {room_summary_size(&txn->summary), NULL};
+
+	int ret = kv_put(txn->txn, txn->cache->dbs[DB_ROOMS],
+	  &(MDB_val) {strlen(txn->room_id) + 1, noconst(txn->room_id)}, &data,
+	  MDB_RESERVE);
+
+	if (ret == MDB_SUCCESS) {
+		room_summary_write(&txn->summary, data.mv_data);
+		txn->summary_dirty = false;
 	}
 
-	return NULL;
+	ABORT_OR_RETURN(ret);
 }
 
-char *
-cache_room_topic(struct cache *cache, MDB_txn *txn, const char *room_id) {
-	if (cache && txn && room_id) {
-		MDB_dbi dbi = 0;
-		char *res = NULL;
-		matrix_json_t *json = NULL;
+struct cache_staged_write {
+	enum room_db db;
+	/* Both are owned. */
+	MDB_val key;
+	MDB_val data;
+};
 
-		if (get_dbi(ROOM_DB_STATE, txn, &dbi, room_id) == MDB_SUCCESS) {
-			char state_key[] = "m.room.topic";
+/* Same order as LMDB's default comparator. */
+static int
+cmp_val(const MDB_val *a, const MDB_val *b) {
+	int ret = memcmp(a->mv_data, b->mv_data,
+	  a->mv_size < b->mv_size ? a->mv_size : b->mv_size);
 
-			MDB_val value = {0};
-			struct matrix_state_event sevent;
-
-			if ((get_str(txn, dbi, state_key, &value)) == MDB_SUCCESS
-				&& (json
-					= matrix_json_parse((char *) value.mv_data, value.mv_size))
-				&& (matrix_event_state_parse(&sevent, json)) == 0
-				&& (sevent.type == MATRIX_ROOM_TOPIC)) {
-				res = sevent.content.topic.topic;
-			}
-		}
+	if (ret == 0 && a->mv_size != b->mv_size) {
+		ret = a->mv_size < b->mv_size ? -1 : 1;
+	}
 
-		if (res) {
-			res = strdup(res);
-		}
+	return ret;
+}
 
-		matrix_json_delete(json);
+static int
+cmp_staged(const void *a, const void *b) {
+	const struct cache_staged_write *write_a = a;
+	const struct cache_staged_write *write_b = b;
 
-		return res;
+	if (write_a->db != write_b->db) {
+		return write_a->db < write_b->db ? -1 : 1;
 	}
 
-	return NULL;
+	int ret = cmp_val(&write_a->key, &write_b->key);
+
+	/* Duplicates of MDB_DUPSORT DBs are sorted by their data. */
+	return ret != 0 ? ret : cmp_val(&write_a->data, &write_b->data);
 }
 
-static int (*const iterators[CACHE_ITERATOR_MAX])(struct cache_iterator *)
-  = {[CACHE_ITERATOR_ROOMS] = cache_rooms_next,
-	[CACHE_ITERATOR_EVENTS] = cache_event_next,
-	[CACHE_ITERATOR_MEMBER] = cache_member_next,
-	[CACHE_ITERATOR_SPACES] = cache_spaces_next,
-	[CACHE_ITERATOR_SPACE_CHILDREN] = cache_space_children_next};
+/* Takes ownership of data, the key is copied. */
+static void
+stage_owned(struct cache_save_txn *txn, enum room_db db, const MDB_val *key,
+  void *data, size_t size) {
+	assert(txn);
+	assert(key);
+	assert(data);
 
-int
-cache_iterator_next(struct cache_iterator *iterator) {
-	assert(iterator);
+	void *key_buf = malloc(key->mv_size);
+	assert(key_buf);
+	memcpy(key_buf, key->mv_data, key->mv_size);
 
-	if (iterator->type >= 0 && iterator->type < CACHE_ITERATOR_MAX) {
-		return iterators[iterator->type](iterator);
-	}
+	struct cache_staged_write write = {
+	  .db = db, .key = {key->mv_size, key_buf}, .data = {size, data}};
 
-	assert(0);
+	arrput(txn->staged, write);
 }
 
-static bool
-room_is_space(struct cache *cache, MDB_txn *txn, const char *room_id) {
-	assert(cache);
+/* Write the staged events of the room sorted by key, which keeps the cursor
+ * on the same pages. LMDB only accepts MDB_APPEND for keys after the last key
+ * of the whole DB, and room keys start with the surrogate. So only the room
+ * with the newest surrogate appends, which is every room of an initial sync
+ * as it is saved. The other rooms are written with sorted puts. */
+static int
+flush_staged(struct cache_save_txn *txn) {
 	assert(txn);
-	assert(room_id);
 
-	bool is_space = false;
-	MDB_dbi dbi = 0;
+	size_t len = arrlenu(txn->staged);
+	int ret = MDB_SUCCESS;
 
-	if ((get_dbi(ROOM_DB_STATE, txn, &dbi, room_id)) == MDB_SUCCESS) {
-		char state_key[] = "m.room.create";
-		MDB_val value = {0};
-		matrix_json_t *json = NULL;
-		struct matrix_state_event sevent;
+	if (len > 0) {
+		qsort(txn->staged, len, sizeof(*txn->staged), cmp_staged);
+	}
 
-		if ((get_str(txn, dbi, state_key, &value)) == MDB_SUCCESS
-			&& (json = matrix_json_parse((char *) value.mv_data, value.mv_size))
-			&& (matrix_event_state_parse(&sevent, json)) == 0) {
-			if (sevent.type != MATRIX_ROOM_CREATE) {
-				LOG(LOG_ERROR,
-				  "m.room.create state event isn't a state event in room "
-				  "'%s'!",
-				  room_id);
-				assert(0);
-			} else {
-				is_space = !!sevent.content.create.type
-						&& (strcmp(sevent.content.create.type, "m.space") == 0);
-			}
+	for (size_t i = 0; i < len && ret == MDB_SUCCESS;) {
+		enum room_db db = txn->staged[i].db;
+		struct kv_cursor *cursor = NULL;
+
+		if ((ret = kv_cursor_open(txn->txn, txn->cache->room_dbs[db], &cursor))
+			!= MDB_SUCCESS) {
+			break;
 		}
 
-		matrix_json_delete(json);
-	}
+		MDB_val last = {0};
+		MDB_val data = {0};
 
-	return is_space;
-}
+		int last_ret = kv_cursor_get(cursor, &last, &data, MDB_LAST);
+
+		const bool append
+		  = last_ret == MDB_NOTFOUND
+		 || (last_ret == MDB_SUCCESS
+			 && (cmp_val(&txn->staged[i].key, &last)) > 0);
+		const bool dupsort = room_db_flags[db] & MDB_DUPSORT;
+
+		for (size_t first = i;
+			 i < len && txn->staged[i].db == db && ret == MDB_SUCCESS; i++) {
+			unsigned flags = 0;
+
+			/* MDB_APPEND fails with MDB_KEYEXIST for a key equal to the last
+			 * one even with MDB_APPENDDUP, so further duplicates of a key
+			 * (like events sent in the same ms) only append the data. */
+			if (append) {
+				flags = (dupsort && i > first
+						  && (cmp_val(&txn->staged[i].key,
+							   &txn->staged[i - 1].key))
+							   == 0)
+						? MDB_APPENDDUP
+						: MDB_APPEND;
+			}
 
-int
-cache_room_info_init(
-  struct cache *cache, struct room_info *info, const char *room_id) {
-	assert(cache);
-	assert(info);
-	assert(room_id);
+			ret = kv_cursor_put(
+			  cursor, &txn->staged[i].key, &txn->staged[i].data, flags);
 
-	MDB_txn *txn = NULL;
+			/* Staged twice, the write is the same as without appending. */
+			if (ret == MDB_KEYEXIST && flags != 0) {
+				ret = kv_cursor_put(
+				  cursor, &txn->staged[i].key, &txn->staged[i].data, 0);
+			}
+		}
 
-	int ret = get_txn(cache, MDB_RDONLY, &txn);
+		kv_cursor_close(cursor);
+	}
 
-	if (ret == MDB_SUCCESS) {
-		*info = (struct room_info) {
-		  .invite = false, /* TODO */
-		  .is_space = room_is_space(cache, txn, room_id),
-		  .name = cache_room_name(cache, txn, room_id),
-		  .topic = cache_room_topic(cache, txn, room_id),
-		};
+	for (size_t i = 0; i < len; i++) {
+		free(txn->staged[i].key.mv_data);
+		free(txn->staged[i].data.mv_data);
 	}
 
-	mdb_txn_commit(txn);
+	arrfree(txn->staged);
+	shfree(txn->staged_ids);
 
-	return ret;
-}
+	/* The flushed events are only found in the DB now. */
+	txn->no_events = false;
 
-void
-cache_room_info_finish(struct room_info *info) {
-	if (info) {
-		free(info->name);
-		free(info->topic);
-		memset(info, 0, sizeof(*info));
-	}
+	ABORT_OR_RETURN(ret);
 }
 
-int
+void
 cache_save_txn_init(
-  struct cache *cache, struct cache_save_txn *txn, const char *room_id) {
-	assert(cache);
-	assert(cache->env);
+  struct cache_batch *batch, struct cache_save_txn *txn, const char *room_id) {
+	assert(batch);
+	assert(batch->txn);
 	assert(txn);
 	assert(room_id);
 
@@ -879,47 +5364,65 @@ cache_save_txn_init(
 	  /* Start in the middle so we can easily backfill while filling in
 	   * events forward aswell. */
 	  .index = UINT64_MAX / 2,
-	  .cache = cache,
-	  .room_id = room_id};
-
-	return get_txn(cache, 0, &txn->txn);
+	  .cache = batch->cache,
+	  .batch = batch,
+	  .room_id = room_id,
+	  .txn = batch->txn};
 }
 
-void
+/* The txn itself is committed with the batch. */
+int
 cache_save_txn_finish(struct cache_save_txn *txn) {
-	if (txn) {
-		mdb_txn_commit(txn->txn);
+	if (!txn) {
+		return MDB_SUCCESS;
 	}
+
+	int ret = flush_staged(txn);
+
+	if (ret == MDB_SUCCESS && txn->summary_loaded && txn->summary_dirty) {
+		ret = summary_save(txn);
+	}
+
+	summary_finish(&txn->summary);
+
+	txn->batch->num_rooms++;
+	memset(txn, 0, sizeof(*txn));
+
+	return ret;
 }
 
 int
-cache_set_room_dbs(struct cache_save_txn *txn, struct matrix_room *room) {
+cache_save_txn_room(struct cache_save_txn *txn, struct matrix_room *room) {
 	assert(txn);
 	assert(room);
 
-	int ret = 0;
+	int ret = room_id_create(txn->cache, txn->txn, room->id, &txn->room);
 
-	for (enum room_db i = 0; i < ROOM_DB_MAX; i++) {
-		if ((ret = get_dbi(i, txn->txn, &txn->dbs[i], room->id))
-			!= MDB_SUCCESS) {
-			return ret;
-		}
+	if (ret != MDB_SUCCESS) {
+		return ret;
 	}
 
-	MDB_cursor *cursor = NULL;
+	struct kv_cursor *cursor = NULL;
 
-	if ((ret = mdb_cursor_open(
-		   txn->txn, txn->dbs[ROOM_DB_ORDER_TO_EVENTS], &cursor))
+	if ((ret = kv_cursor_open(
+		   txn->txn, txn->cache->room_dbs[ROOM_DB_EVENTS], &cursor))
 		== MDB_SUCCESS) {
 		MDB_val key = {0};
-		MDB_val val = {0};
 
-		if ((mdb_cursor_get(cursor, &key, &val, MDB_LAST)) == MDB_SUCCESS) {
-			cpy_index(&key, &txn->index);
+		if ((seek_last_event(cursor, txn->room, &key)) == MDB_SUCCESS) {
+			MDB_val index = room_key_data(&key);
+
+			cpy_index_be(&index, &txn->index);
 			txn->index++; /* Don't overwrite the last event. */
+		} else {
+			txn->no_events = true;
 		}
 
-		mdb_cursor_close(cursor);
+		kv_cursor_close(cursor);
+	}
+
+	if (ret == MDB_SUCCESS) {
+		ret = summary_load(txn);
 	}
 
 	return ret;
@@ -930,13 +5433,16 @@ cache_save_room(struct cache_save_txn *txn, struct matrix_room *room) {
 	assert(txn);
 	assert(room);
 
-	/* TODO dump summary. */
-	return put_str(
-	  txn->txn, txn->cache->dbs[DB_ROOMS], room->id, (char[]) {""}, 0);
+	/* The summary itself is saved by cache_save_txn_finish(). */
+	summary_set_flag(
+	  txn, ROOM_SUMMARY_INVITE, room->type == MATRIX_ROOM_INVITE);
+
+	return MDB_SUCCESS;
 }
 
+/* Returns MDB_KEYEXIST for events that are already stored or staged. */
 static int
-save_json_with_index(struct cache_save_txn *txn,
+save_event_with_index(struct cache_save_txn *txn,
   struct matrix_sync_event *event, uint64_t *index) {
 	assert(txn);
 	assert(event);
@@ -945,31 +5451,235 @@ save_json_with_index(struct cache_save_txn *txn,
 	const char *event_id = matrix_sync_event_id(event);
 	assert(event_id);
 
-	char *data = matrix_json_print(event->json);
-	assert(data);
+	if (!txn->staged_ids) {
+		sh_new_strdup(txn->staged_ids);
+	}
 
-	/* TODO sort by index */
-	if (event->type == MATRIX_EVENT_TIMELINE
-		&& event->timeline.relation.event_id) {
-		put_str(txn->txn, txn->dbs[ROOM_DB_RELATIONS], event_id,
-		  event->timeline.relation.event_id, 0);
+	if ((shgeti(txn->staged_ids, event_id)) != -1) {
+		return MDB_KEYEXIST;
 	}
 
-	int ret = put_str(
-	  txn->txn, txn->dbs[ROOM_DB_EVENTS], event_id, data, MDB_NOOVERWRITE);
+	struct room_key key;
+	int ret = room_key_str(&key, txn->room, event_id);
 
-	if (ret == MDB_SUCCESS
-		&& (ret = put_int(txn->txn, txn->dbs[ROOM_DB_ORDER_TO_EVENTS],
-			  txn->index, event_id, 0))
-			 == MDB_SUCCESS
-		&& (ret = put_str_int(txn->txn, txn->dbs[ROOM_DB_EVENTS_TO_ORDER],
-			  event_id, txn->index, 0))
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (!txn->no_events) {
+		MDB_val existing = {0};
+
+		ret = kv_get(txn->txn, txn->cache->room_dbs[ROOM_DB_EVENTS_TO_ORDER],
+		  &key.val, &existing);
+
+		if (ret != MDB_NOTFOUND) {
+			ABORT_OR_RETURN(ret == MDB_SUCCESS ? MDB_KEYEXIST : ret);
+		}
+	}
+
+	/* The other DBs are keyed by the index. */
+	struct room_key index_key;
+	room_key_index(&index_key, txn->room, txn->index);
+
+	unsigned record_flags = 0;
+
+	if (txn->cache->keep_event_json
+		|| (event->type == MATRIX_EVENT_TIMELINE
+			&& event->timeline.type == MATRIX_ROOM_ATTACHMENT)) {
+		record_flags |= EVENT_RECORD_HAS_JSON;
+	}
+
+	size_t record_size = event_record_size(event, record_flags);
+	void *record = malloc(record_size);
+	assert(record);
+
+	event_record_write(event, record_flags, record);
+	stage_owned(txn, ROOM_DB_EVENTS, &index_key.val, record, record_size);
+
+	if (record_flags & EVENT_RECORD_HAS_JSON) {
+		char *data = matrix_json_print(event->json);
+		assert(data);
+
+		stage_owned(
+		  txn, ROOM_DB_EVENTS_JSON, &index_key.val, data, strlen(data) + 1);
+	}
+
+	uint64_t *order = malloc(sizeof(*order));
+	assert(order);
+	*order = txn->index;
+
+	stage_owned(
+	  txn, ROOM_DB_EVENTS_TO_ORDER, &key.val, order, sizeof(*order));
+
+	struct room_key ts_key;
+	room_key_index(&ts_key, txn->room, event_ts(event));
+
+	unsigned char *ts_order = malloc(sizeof(txn->index));
+	assert(ts_order);
+	write_be(ts_order, txn->index, sizeof(txn->index));
+
+	stage_owned(txn, ROOM_DB_TS_TO_ORDER, &ts_key.val, ts_order,
+	  sizeof(txn->index));
+
+	if ((ret = search_index(txn->cache, txn->txn, txn->room, txn->index,
+		   event_ts(event), event_search_text(event), true))
+		!= MDB_SUCCESS) {
+		return ret;
+	}
+
+	shput(txn->staged_ids, noconst(event_id), txn->index);
+
+	*index = txn->index;
+	txn->index++;
+
+	return MDB_SUCCESS;
+}
+
+/* Look up the parent of a relation, which might still be staged, and relate
+ * the event to it. The relation is kept in the record if the parent isn't
+ * known. */
+static int
+save_relation(struct cache_save_txn *txn,
+  const struct matrix_timeline_event *tevent, uint64_t index,
+  uint64_t *parent) {
+	assert(txn);
+	assert(tevent);
+	assert(parent);
+
+	char *parent_id = noconst(tevent->relation.event_id);
+	ptrdiff_t staged = -1;
+
+	if (txn->staged_ids) {
+		staged = shgeti(txn->staged_ids, parent_id);
+	}
+
+	if (staged != -1) {
+		*parent = txn->staged_ids[staged].value;
+	} else {
+		MDB_val data = {0};
+		int ret = MDB_NOTFOUND;
+
+		if (!txn->no_events) {
+			ret = room_get(txn->cache, txn->txn, txn->room,
+			  ROOM_DB_EVENTS_TO_ORDER, parent_id, &data);
+		}
+
+		if (ret != MDB_SUCCESS) {
+			return ret == MDB_NOTFOUND ? MDB_SUCCESS : ret;
+		}
+
+		cpy_index(&data, parent);
+	}
+
+	return relation_update(txn->cache, txn->txn, txn->room, *parent,
+	  relation_type(tevent->relation.rel_type), index, true);
+}
+
+/* Strip the content of a stored event, leaving only it's base fields. */
+static int
+redact_event(struct cache_save_txn *txn, uint64_t index) {
+	assert(txn);
+
+	MDB_val record = {0};
+
+	int ret = room_get_index(
+	  txn->cache, txn->txn, txn->room, ROOM_DB_EVENTS, index, &record);
+
+	/* Compressed events are moved back so that they can be modified. */
+	if (ret == MDB_NOTFOUND
+		&& (ret = event_thaw(txn->cache, txn->txn, txn->room, index))
 			 == MDB_SUCCESS) {
-		*index = txn->index;
-		txn->index++;
+		ret = room_get_index(
+		  txn->cache, txn->txn, txn->room, ROOM_DB_EVENTS, index, &record);
+	}
+
+	/* Thawing writes a whole block, which can fill the map. */
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct room_key key;
+	room_key_index(&key, txn->room, index);
+
+	/* Invalidated once the redaction is visible to readers. */
+	arrput(txn->batch->redacted,
+	  ((struct event_cache_key) {.index = index, .room = txn->room}));
+
+	char parent_id[ROOM_KEY_MAX];
+	enum relation_type type = RELATION_OTHER;
+
+	/* Only the record is modified below, so it stays valid. */
+	if ((record_relation(&record, &type, parent_id))
+		&& (ret = relation_remove(
+			  txn->cache, txn->txn, txn->room, parent_id, type, index))
+			 != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if (event_record_is_legacy(record.mv_data, record.mv_size)) {
+		assert(is_str(&record));
+
+		matrix_json_t *json = matrix_json_parse(record.mv_data, record.mv_size);
+		assert(json);
+
+		struct matrix_sync_event event = {0};
+
+		if ((matrix_event_sync_parse(&event, json)) == 0
+			&& (ret = search_index(txn->cache, txn->txn, txn->room, index,
+				  event_ts(&event), event_search_text(&event), false))
+				 != MDB_SUCCESS) {
+			matrix_json_delete(json);
+			return ret;
+		}
+
+		matrix_json_clear_content(json);
+
+		char *cleaned_json = matrix_json_print(json);
+		assert(cleaned_json);
+
+		ret = kv_put(txn->txn, txn->cache->room_dbs[ROOM_DB_EVENTS], &key.val,
+		  &(MDB_val) {strlen(cleaned_json) + 1, cleaned_json}, 0);
+
+		free(cleaned_json);
+		matrix_json_delete(json);
+
+		ABORT_OR_RETURN(ret);
+	}
+
+	/* The record points into the map which is modified by the put below. */
+	void *copy = malloc(record.mv_size);
+	assert(copy);
+	memcpy(copy, record.mv_data, record.mv_size);
+
+	struct matrix_sync_event event = {0};
+	unsigned flags = 0;
+
+	if ((event_record_decode(copy, record.mv_size, &event, &flags)) == -1) {
+		LOG(LOG_ERROR,
+		  "Invalid record for event %" PRIu64 "! Corrupt database?", index);
+		abort();
+	}
+
+	if ((flags & EVENT_RECORD_HAS_JSON)
+		&& (ret = room_del_index(txn->cache, txn->txn, txn->room,
+			  ROOM_DB_EVENTS_JSON, index))
+			 != MDB_SUCCESS
+		&& ret != MDB_NOTFOUND) {
+		free(copy);
+		return ret;
+	}
+
+	if ((ret = search_index(txn->cache, txn->txn, txn->room, index,
+		   event_ts(&event), event_search_text(&event), false))
+		!= MDB_SUCCESS) {
+		free(copy);
+		return ret;
 	}
 
-	free(data);
+	ret = put_record(txn->txn, txn->cache->room_dbs[ROOM_DB_EVENTS], &key.val,
+	  &event, EVENT_RECORD_REDACTED, 0);
+
+	free(copy);
 
 	return ret;
 }
@@ -977,15 +5687,14 @@ save_json_with_index(struct cache_save_txn *txn,
 /* TODO Just clean up and re-create the relations of all rooms with any
  * space-related change. */
 enum cache_deferred_ret
-cache_process_deferred_event(
-  struct cache *cache, struct cache_deferred_space_event *deferred_event) {
-	assert(cache);
+cache_process_deferred_event(struct cache_batch *batch,
+  struct cache_deferred_space_event *deferred_event) {
+	assert(batch);
 	assert(deferred_event);
 
-	MDB_txn *txn = NULL;
-	int mdb_ret = get_txn(cache, 0, &txn);
-
-	assert(mdb_ret == MDB_SUCCESS);
+	struct cache *cache = batch->cache;
+	struct kv_txn *txn = batch->txn;
+	int mdb_ret = MDB_SUCCESS;
 
 	enum cache_deferred_ret ret = CACHE_DEFERRED_FAIL;
 
@@ -1003,15 +5712,11 @@ cache_process_deferred_event(
 			/* Neither a m.space.child event, nor a m.space.parent event
 			 * should be present for the relation to be broken. */
 			if (deferred_event->via_was_null) {
-				MDB_dbi child_parent_db = {0};
-				mdb_ret = get_dbi(ROOM_DB_SPACE_PARENT, txn, &child_parent_db,
-				  deferred_event->child);
-				assert(mdb_ret == MDB_SUCCESS);
 				bool parent_event_in_child = false;
 
 				MDB_val data = {0};
-				mdb_ret = get_str(
-				  txn, child_parent_db, deferred_event->parent, &data);
+				mdb_ret = room_get_by_id(cache, txn, deferred_event->child,
+				  ROOM_DB_SPACE_PARENT, deferred_event->parent, &data);
 
 				if (mdb_ret == MDB_SUCCESS) {
 					assert(is_str(&data));
@@ -1042,8 +5747,7 @@ cache_process_deferred_event(
 				LOG(LOG_WARN,
 				  "Tried to add child '%s' already present in space '%s'",
 				  deferred_event->child, deferred_event->parent);
-			} else {
-				assert(mdb_ret == MDB_SUCCESS);
+			} else if (mdb_ret == MDB_SUCCESS) {
 				LOG(LOG_MESSAGE, "Added child '%s' to space '%s'",
 				  deferred_event->child, deferred_event->parent);
 				ret = CACHE_DEFERRED_ADDED;
@@ -1052,22 +5756,11 @@ cache_process_deferred_event(
 		break;
 	case MATRIX_ROOM_SPACE_PARENT:
 		{
-			MDB_dbi parent_child_db = {0};
-			MDB_dbi parent_state_db = {0};
-
-			mdb_ret = get_dbi(ROOM_DB_SPACE_CHILD, txn, &parent_child_db,
-			  deferred_event->parent);
-			assert(mdb_ret == MDB_SUCCESS);
-
-			mdb_ret = get_dbi(
-			  ROOM_DB_STATE, txn, &parent_state_db, deferred_event->parent);
-			assert(mdb_ret == MDB_SUCCESS);
-
 			bool child_event_in_parent = false;
 
 			MDB_val data = {0};
-			mdb_ret
-			  = get_str(txn, parent_child_db, deferred_event->child, &data);
+			mdb_ret = room_get_by_id(cache, txn, deferred_event->parent,
+			  ROOM_DB_SPACE_CHILD, deferred_event->child, &data);
 
 			if (mdb_ret == MDB_SUCCESS) {
 				assert(is_str(&data));
@@ -1115,8 +5808,7 @@ cache_process_deferred_event(
 				  "Tried to add child '%s' already present in space "
 				  "'%s'",
 				  deferred_event->child, deferred_event->parent);
-			} else {
-				assert(mdb_ret == MDB_SUCCESS);
+			} else if (mdb_ret == MDB_SUCCESS) {
 				LOG(LOG_MESSAGE, "Added child '%s' to space '%s'",
 				  deferred_event->child, deferred_event->parent);
 				ret = CACHE_DEFERRED_ADDED;
@@ -1127,22 +5819,23 @@ cache_process_deferred_event(
 		assert(0);
 	}
 
-	mdb_txn_commit(txn);
 	return ret;
 }
 
 enum cache_save_error
 cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
-  uint64_t *index, uint64_t *redaction_index,
+  uint64_t *index, uint64_t *related_index,
   struct cache_deferred_space_event **deferred_events) {
 	assert(txn);
 	assert(event);
 	assert(index);
-	assert(redaction_index);
+	assert(related_index);
 	assert(deferred_events);
 
 	*index = (uint64_t) -1;
-	*redaction_index = (uint64_t) -1;
+	*related_index = (uint64_t) -1;
+
+	txn->batch->num_events++;
 
 	/* TODO power level checking. */
 
@@ -1152,18 +5845,63 @@ cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
 			struct matrix_state_event *sevent = &event->state;
 			assert(sevent->base.state_key);
 
-			if (sevent->is_in_timeline
-				&& (save_json_with_index(txn, event, index)) == MDB_KEYEXIST) {
-				return CACHE_EVENT_IGNORED;
+			if (sevent->is_in_timeline) {
+				if ((save_event_with_index(txn, event, index))
+					== MDB_KEYEXIST) {
+					return CACHE_EVENT_IGNORED;
+				}
+
+				summary_add_event(txn, *index, sevent->base.origin_server_ts);
 			}
 
 			switch (sevent->type) {
 			case MATRIX_ROOM_MEMBER:
 				{
-					char *data = matrix_json_print(event->json);
-					put_str(txn->txn, txn->dbs[ROOM_DB_MEMBERS],
-					  sevent->base.state_key, data, 0);
-					free(data);
+					MDB_val existing = {0};
+					const bool was_joined
+					  = (room_get(txn->cache, txn->txn, txn->room,
+						  ROOM_DB_MEMBER_NAMES, sevent->base.state_key,
+						  &existing))
+						 == MDB_SUCCESS
+					 && member_name_joined(&existing);
+					const bool joined
+					  = is_join(sevent->content.member.membership);
+
+					int ret = room_put_record(txn->cache, txn->txn, txn->room,
+					  ROOM_DB_MEMBERS, sevent->base.state_key, event);
+
+					struct room_key rkey;
+
+					if (ret == MDB_SUCCESS
+						&& (ret = room_key_str(
+							  &rkey, txn->room, sevent->base.state_key))
+							 == 0) {
+						ret = member_name_put(txn->cache, txn->txn, &rkey.val,
+						  sevent->content.member.displayname, joined);
+					}
+
+					if (ret == MDB_MAP_FULL || ret == MDB_BAD_TXN) {
+						return CACHE_EVENT_FAILED;
+					}
+
+					if (ret != MDB_SUCCESS) {
+						LOG(LOG_WARN,
+						  "Failed to save member '%s' of room '%s': %s",
+						  sevent->base.state_key, txn->room_id,
+						  mdb_strerror(ret));
+						return CACHE_EVENT_IGNORED;
+					}
+
+					/* Joins, leaves, kicks and bans of known users. */
+					if (joined != was_joined) {
+						if (joined) {
+							txn->summary.member_count++;
+						} else if (txn->summary.member_count > 0) {
+							txn->summary.member_count--;
+						}
+
+						txn->summary_dirty = true;
+					}
 				}
 
 				return CACHE_EVENT_SAVED;
@@ -1172,8 +5910,8 @@ cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
 
 				{
 					char *data = matrix_json_print(event->json);
-					put_str(txn->txn, txn->dbs[ROOM_DB_SPACE_CHILD],
-					  sevent->base.state_key, data, 0);
+					room_put_str(txn->cache, txn->txn, txn->room,
+					  ROOM_DB_SPACE_CHILD, sevent->base.state_key, data, 0);
 					free(data);
 					arrput(*deferred_events,
 					  ((struct cache_deferred_space_event) {
@@ -1190,8 +5928,8 @@ cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
 
 				{
 					char *data = matrix_json_print(event->json);
-					put_str(txn->txn, txn->dbs[ROOM_DB_SPACE_PARENT],
-					  sevent->base.state_key, data, 0);
+					room_put_str(txn->cache, txn->txn, txn->room,
+					  ROOM_DB_SPACE_PARENT, sevent->base.state_key, data, 0);
 					free(data);
 					arrput(*deferred_events,
 					  ((struct cache_deferred_space_event) {
@@ -1206,10 +5944,10 @@ cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
 			default:
 				/* Empty state key */
 				if ((strnlen(sevent->base.state_key, 1)) == 0) {
-					char *data = matrix_json_print(event->json);
-					put_str(txn->txn, txn->dbs[ROOM_DB_STATE],
-					  sevent->base.type, data, 0);
-					free(data);
+					room_put_record(txn->cache, txn->txn, txn->room,
+					  ROOM_DB_STATE, sevent->base.type, event);
+
+					summary_update_state(txn, sevent);
 
 					return CACHE_EVENT_SAVED;
 				} else {
@@ -1225,42 +5963,43 @@ cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
 		{
 			struct matrix_timeline_event *tevent = &event->timeline;
 
-			if ((save_json_with_index(txn, event, index)) == MDB_KEYEXIST) {
+			if ((save_event_with_index(txn, event, index)) == MDB_KEYEXIST) {
 				return CACHE_EVENT_IGNORED;
 			}
 
-			if (tevent->type == MATRIX_ROOM_REDACTION) {
-				MDB_val del_index = {0};
-
-				if ((get_str(txn->txn, txn->dbs[ROOM_DB_EVENTS_TO_ORDER],
-					  tevent->redaction.redacts, &del_index))
-					== MDB_SUCCESS) {
-					MDB_val raw_json = {0};
-
-					int ret = get_str(txn->txn, txn->dbs[ROOM_DB_EVENTS],
-					  tevent->redaction.redacts, &raw_json);
-
-					assert(ret == MDB_SUCCESS);
-					assert(is_str(&raw_json));
+			summary_add_event(txn, *index, tevent->base.origin_server_ts);
 
-					matrix_json_t *json
-					  = matrix_json_parse(raw_json.mv_data, raw_json.mv_size);
-					assert(json);
+			if (tevent->relation.event_id) {
+				save_relation(txn, tevent, *index, related_index);
+			}
 
-					matrix_json_clear_content(json);
+			if (tevent->type == MATRIX_ROOM_REDACTION) {
+				MDB_val del_index = {0};
 
-					char *cleaned_json = matrix_json_print(json);
-					assert(cleaned_json);
+				/* Redactions are rare, so the redacted event is looked up
+				 * in the DB instead of the staged writes. */
+				if ((flush_staged(txn)) != MDB_SUCCESS) {
+					return CACHE_EVENT_FAILED;
+				}
 
-					ret = put_str(txn->txn, txn->dbs[ROOM_DB_EVENTS],
-					  tevent->redaction.redacts, cleaned_json, 0);
+				if ((room_get(txn->cache, txn->txn, txn->room,
+					  ROOM_DB_EVENTS_TO_ORDER, tevent->redaction.redacts,
+					  &del_index))
+					== MDB_SUCCESS) {
+					cpy_index(&del_index, related_index);
 
-					assert(ret == MDB_SUCCESS);
+					int ret = redact_event(txn, *related_index);
 
-					free(cleaned_json);
-					matrix_json_delete(json);
+					if (ret == MDB_MAP_FULL || ret == MDB_BAD_TXN) {
+						return CACHE_EVENT_FAILED;
+					}
 
-					cpy_index(&del_index, redaction_index);
+					if (ret != MDB_SUCCESS) {
+						LOG(LOG_WARN,
+						  "Failed to redact event '%s' in room '%s': %s",
+						  tevent->redaction.redacts, txn->room_id,
+						  mdb_strerror(ret));
+					}
 				} else {
 					LOG(LOG_WARN,
 					  "Got redaction '%s' for unknown event '%s' in room "
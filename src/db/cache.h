@@ -1,10 +1,16 @@
 #pragma once
 /* SPDX-FileCopyrightText: 2021 git-bruh
  * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/event_cache.h"
+#include "db/kv.h"
+#include "db/room_summary.h"
 #include "matrix.h"
 
-#include <lmdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 enum db {
 	/* Access token, prev/next batch, MXID, Homeserver. */
@@ -13,6 +19,15 @@ enum db {
 	DB_ROOMS,
 	/* Map space id to child ids */
 	DB_SPACE_CHILDREN,
+	/* Room ID => uint32_t surrogate used in the keys of the room DBs. */
+	DB_ROOM_IDS,
+	/* Schema version, next room surrogate, migration progress. */
+	DB_META,
+	/* Token => [Posting, ...] Full-text index of message bodies, see
+	 * db/search.h. */
+	DB_SEARCH,
+	/* Big-endian room surrogate => Room ID, the reverse of DB_ROOM_IDS. */
+	DB_ROOM_SURROGATES,
 	DB_MAX,
 };
 
@@ -24,18 +39,38 @@ enum auth_key {
 	DB_KEY_MAX
 };
 
+/* Data of all rooms is stored in a single DB for each type, keys are prefixed
+ * with the big-endian room surrogate from DB_ROOM_IDS. */
 enum room_db {
-	/* Event ID => JSON */
+	/* [1, 2, 3, ...] => Binary record, see db/event_record.h. The big-endian
+	 * index of an event in the room is it's surrogate, event IDs are only
+	 * stored in the record and in ROOM_DB_EVENTS_TO_ORDER. */
 	ROOM_DB_EVENTS = 0,
-	/* [1, 2, 3, ...] => [Event ID, ...] */
-	ROOM_DB_ORDER_TO_EVENTS,
-	/* [Event ID, ...] => [1, 2, 3, ...] */
+	/* Index => JSON, only for events with EVENT_RECORD_HAS_JSON. */
+	ROOM_DB_EVENTS_JSON,
+	/* First index => Compressed block of consecutive events, see
+	 * db/event_block.h. Events in a block aren't in ROOM_DB_EVENTS and
+	 * ROOM_DB_EVENTS_JSON, they're moved back if they have to be modified. */
+	ROOM_DB_EVENT_BLOCKS,
+	/* [Event ID, ...] => [1, 2, 3, ...] The only lookup by event ID. */
 	ROOM_DB_EVENTS_TO_ORDER,
-	/* Event ID => [Event ID, ...] Array of related events. */
+	/* Parent index => [[u8 relation][Child index], ...] Sorted by the type of
+	 * relation and then by the big-endian index of the related event. */
 	ROOM_DB_RELATIONS,
-	/* "@username:server.tld" => JSON */
+	/* origin_server_ts => [1, 2, 3, ...] Both big-endian, so that events can
+	 * be found by date without walking the timeline. */
+	ROOM_DB_TS_TO_ORDER,
+	/* Parent index => struct cache_aggregation, maintained along with
+	 * ROOM_DB_RELATIONS so that it never has to be scanned. */
+	ROOM_DB_AGGREGATIONS,
+	/* "@username:server.tld" => Binary record, JSON if migrated from schema
+	 * version 1. */
 	ROOM_DB_MEMBERS,
-	/* "m.room.type" => JSON */
+	/* "@username:server.tld" => [u8 flags][Displayname, "" if unset].
+	 * Projection of ROOM_DB_MEMBERS along with the membership. */
+	ROOM_DB_MEMBER_NAMES,
+	/* "m.room.type" => Binary record, JSON if migrated from schema version
+	 * 1. */
 	ROOM_DB_STATE,
 	/* "!room_id:server.tld" => JSON */
 	ROOM_DB_SPACE_PARENT,
@@ -47,17 +82,225 @@ enum room_db {
 enum cache_save_error {
 	CACHE_EVENT_SAVED = 0,
 	CACHE_EVENT_IGNORED,
-	CACHE_EVENT_DEFERRED
+	CACHE_EVENT_DEFERRED,
+	/* The batch failed as the map is full, it must be saved again. */
+	CACHE_EVENT_FAILED
 };
 
+enum cache_durability {
+	/* Every commit is fsync'd. */
+	CACHE_DURABILITY_SYNC = 0,
+	/* The meta page isn't fsync'd on commit, a system crash can undo the last
+	 * commit but never leaves the cache inconsistent. */
+	CACHE_DURABILITY_NOMETASYNC,
+	/* Commits are written through the map and synced in the background every
+	 * commit_window_ms. A system crash loses the last window, next_batch is
+	 * only saved after the events it covers are synced so that they are
+	 * fetched again. */
+	CACHE_DURABILITY_NOSYNC,
+	CACHE_DURABILITY_MAX
+};
+
+struct cache_options {
+	/* Storage backend, kv_lmdb if NULL. */
+	const struct kv_ops *backend;
+	/* Directory of the environment, defaults to /tmp/db if NULL. Only used by
+	 * durable backends. */
+	const char *dir;
+	/* Initial size of the map in bytes, it is grown as required. */
+	size_t map_size;
+	enum cache_durability durability;
+	/* Interval (in ms) of the background sync with CACHE_DURABILITY_NOSYNC,
+	 * defaults to 1000 if 0. */
+	unsigned commit_window_ms;
+	/* Store the raw JSON of every event alongside it's record, instead of
+	 * only for events that can't be fully represented by a record. */
+	bool keep_event_json;
+	/* cache_prune() only keeps this many events per room, 0 for no limit. */
+	uint64_t retain_events;
+	/* cache_prune() deletes events older than this (in ms), 0 for no limit. */
+	uint64_t retain_age_ms;
+	/* cache_freeze() compresses events older than this (in ms), 0 to keep
+	 * every event uncompressed. */
+	uint64_t cold_age_ms;
+	/* Memory (in bytes) taken by decoded events kept around for iterators,
+	 * defaults to 8 MiB if 0. */
+	size_t event_cache_size;
+};
+
+enum {
+	CACHE_READ_TXN_POOL_MAX = 8,
+	/* Events per compressed block. */
+	CACHE_EVENT_BLOCK_SIZE = 64,
+	/* Decompressed blocks kept around, enough for paginating a few rooms. */
+	CACHE_BLOCK_CACHE_MAX = 16,
+	/* Postings of the rarest query token ranked by cache_search(). */
+	CACHE_SEARCH_CANDIDATES_MAX = 2048,
+};
+
+struct event_block;
+struct cache_snapshot;
+
+/* Called with the snapshot replacing the pinned one, to move every reference
+ * into the pinned snapshot over to it. Called with NULL to copy them instead
+ * as the pinned snapshot is about to end. The pinned snapshot is still open
+ * while it's called. */
+typedef void (*cache_pin_cb)(struct cache_snapshot *next, void *userp);
+/* Called when a thread other than the owner waits for the pinned snapshot to
+ * be released, so that the owner calls cache_pin_renew() even if it's idle.
+ * The mutex of the pin is held, so it must not call into the cache. */
+typedef void (*cache_pin_wake_cb)(void *userp);
+
 struct cache {
-	MDB_env *env;
-	MDB_dbi dbs[DB_MAX];
+	const struct kv_ops *backend;
+	struct kv_env *env;
+	kv_dbi dbs[DB_MAX];
+	kv_dbi room_dbs[ROOM_DB_MAX];
+	/* Needed to reopen the env after compacting it. */
+	char *dir;
+	unsigned env_flags;
+	enum cache_durability durability;
+	unsigned commit_window_ms;
+	bool keep_event_json;
+	uint64_t retain_events;
+	uint64_t retain_age_ms;
+	uint64_t cold_age_ms;
+	/* Syncs the env every commit_window_ms with CACHE_DURABILITY_NOSYNC. */
+	struct {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool initialized;
+		bool running;
+		bool stop;
+		/* Something was committed since the last sync. */
+		bool dirty;
+		/* Committed next_batch token that isn't saved yet, as the events it
+		 * covers might not be on disk. */
+		char *next_batch;
+	} flusher;
+	/* Held for reading by every txn, and for writing while the map is being
+	 * resized. Writers are preferred, so a thread must not begin a txn while
+	 * it already has one. Locks are taken in the order pin.mutex, write_lock,
+	 * resize_lock, and callers lock their own mutexes (like the load_mutex of
+	 * rooms) only after beginning a txn, never while waiting for one. */
+	pthread_rwlock_t resize_lock;
+	bool resize_lock_initialized;
+	/* Held by write txns, before resize_lock. Lets cache_compact() keep out
+	 * writers while swapping in its copy. */
+	pthread_mutex_t write_lock;
+	bool write_lock_initialized;
+	/* Reset read-only txns, renewed instead of beginning a new txn. MDB_NOTLS
+	 * allows a txn to be renewed by any thread so the pool is shared. */
+	struct {
+		pthread_mutex_t mutex;
+		bool initialized;
+		size_t len;
+		struct kv_txn *txns[CACHE_READ_TXN_POOL_MAX];
+	} read_txns;
+	/* Decompressed blocks of ROOM_DB_EVENT_BLOCKS by their ID, the most
+	 * recently used last, and the dictionary they're compressed with. The
+	 * dictionary is trained once and never changes. */
+	struct {
+		pthread_mutex_t mutex;
+		bool initialized;
+		size_t len;
+		struct event_block *lru[CACHE_BLOCK_CACHE_MAX];
+		unsigned char *dict;
+		size_t dict_size;
+	} blocks;
+	/* Decoded events, so that paginating over the same events again doesn't
+	 * decode them again. */
+	struct event_cache events;
+	/* Snapshot kept open by cache_pin_begin(). It doesn't hold resize_lock,
+	 * instead the map is only resized or swapped with the mutex held and the
+	 * snapshot released. */
+	struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool initialized;
+		/* NULL while released. */
+		struct kv_txn *txn;
+		cache_pin_cb cb;
+		cache_pin_wake_cb wake;
+		void *userp;
+		/* The thread that last began or renewed the pin, other threads wait
+		 * for it to release the snapshot. */
+		pthread_t owner;
+		bool release;
+	} pin;
+	_Atomic uint64_t txn_begins;
+	_Atomic uint64_t txn_renews;
+	struct timespec last_stats;
+	uint64_t last_stats_txns;
+};
+
+struct cache_stats {
+	/* Txns started with kv_txn_begin(), including write txns. */
+	uint64_t txn_begins;
+	/* Read-only txns taken from the pool. */
+	uint64_t txn_renews;
+	/* Pages used by the event DBs, including the event ID lookup. */
+	uint64_t event_pages;
+	/* Lookups of decoded events by iterators. */
+	uint64_t event_hits;
+	uint64_t event_misses;
+};
+
+struct cache_search_hit {
+	char *room_id;
+	/* Index of the event in the room. */
+	uint64_t index;
+	uint64_t origin_server_ts;
+	/* Number of query tokens found in the event. */
+	unsigned score;
+	char *body;
+};
+
+/* A read-only txn that multiple reads (iterators, room info) are done in, so
+ * that they see the same state and share the cost of starting a txn. */
+struct cache_snapshot {
+	struct cache *cache;
+	struct kv_txn *txn;
+	/* Epoch of the event cache before the txn began. */
+	uint64_t events_epoch;
+	/* Began by cache_pin_begin() or cache_pin_renew(). */
+	bool pinned;
+};
+
+/* A write txn shared by everything saved from a single sync response, so that
+ * all rooms, deferred space events and the next_batch token are committed
+ * atomically. */
+struct cache_batch {
+	struct kv_txn *txn;
+	struct cache *cache;
+	size_t num_rooms;
+	size_t num_events;
+	struct timespec start;
+	/* Handed to the flusher on commit with CACHE_DURABILITY_NOSYNC. */
+	char *next_batch;
+	/* Redacted events, dropped from the event cache once committed. */
+	struct event_cache_key *redacted;
+};
+
+/* Summary of the events relating to an event. */
+struct cache_aggregation {
+	/* Latest m.replace, (uint64_t) -1 if the event wasn't edited. */
+	uint64_t edit_index;
+	/* Number of m.annotation events, i.e. reactions. */
+	uint32_t annotations;
 };
 
 struct cache_iterator_event {
 	uint64_t index;
 	struct matrix_sync_event event;
+	/* Only filled for messages. */
+	struct cache_aggregation aggregation;
+	/* Body of the latest edit, NULL if there is none. */
+	const char *edit_body;
+	/* The strings of event point into the map of a pinned snapshot and stay
+	 * valid for as long as it does, instead of until the next iteration. */
+	bool pinned;
 };
 
 struct cache_iterator_member {
@@ -76,23 +319,41 @@ struct cache_iterator {
 		CACHE_ITERATOR_SPACE_CHILDREN,
 		CACHE_ITERATOR_MAX
 	} type;
-	MDB_txn *txn;
-	MDB_cursor *cursor;
+	/* Borrowed from the snapshot. */
+	struct kv_txn *txn;
+	struct kv_cursor *cursor;
 	struct cache *cache;
 	union {
-		const char **room_id;
 		struct {
-			bool fetched_once;
-			MDB_dbi events_dbi;
+			const char **room_id;
+			struct room_info *room_info;
+		};
+		struct {
+			/* The cursor is at an event that wasn't returned yet. */
+			bool hot_pending;
+			uint32_t events_room;
 			unsigned timeline_events;
 			unsigned state_events;
 			uint64_t num_fetch;
+			uint64_t events_epoch;
+			bool events_pinned;
 			struct cache_iterator_event *event;
-			matrix_json_t *event_json;
+			/* Referenced while event->event points into it. */
+			struct event_cache_entry *entry;
+			/* Cursor of ROOM_DB_EVENT_BLOCKS, the events it returns are
+			 * merged with those of the cursor in order. */
+			struct kv_cursor *block_cursor;
+			/* Referenced while the events point into it, block_pending is
+			 * the number of it's entries that weren't returned yet. */
+			struct event_block *block;
+			size_t block_pending;
+			/* Block of the edit in event->edit_body. */
+			struct event_block *edit_block;
 		};
 		struct {
+			bool member_iterated_once;
+			uint32_t member_room;
 			struct cache_iterator_member *member;
-			matrix_json_t *member_json;
 		};
 		struct cache_iterator_space *space;
 		struct {
@@ -108,12 +369,32 @@ struct cache_iterator_space {
 	struct cache_iterator children_iterator;
 };
 
+/* A write to one of the room DBs, buffered by the save txn. */
+struct cache_staged_write;
+
 struct cache_save_txn {
-	MDB_dbi dbs[ROOM_DB_MAX];
+	uint32_t room;
 	uint64_t index;
 	const char *room_id;
-	MDB_txn *txn;
+	struct kv_txn *txn;
 	struct cache *cache;
+	struct cache_batch *batch;
+	/* Written to DB_ROOMS when the txn is finished, the strings are owned. */
+	struct room_summary summary;
+	bool summary_loaded;
+	bool summary_dirty;
+	/* Writes of new events, sorted by key and appended to the DBs where
+	 * possible when the txn is finished. */
+	struct cache_staged_write *staged;
+	/* IDs of the staged events mapped to their index, to ignore duplicates
+	 * without probing the DB. */
+	struct {
+		char *key;
+		uint64_t value;
+	} *staged_ids;
+	/* The room had no events stored when the txn began, so only the staged
+	 * events have to be checked for duplicates. */
+	bool no_events;
 };
 
 struct room_info {
@@ -121,6 +402,9 @@ struct room_info {
 	bool is_space;
 	char *name;
 	char *topic;
+	uint32_t member_count;
+	uint64_t last_activity_ts;
+	uint64_t last_index;
 };
 
 enum cache_deferred_ret {
@@ -140,59 +424,162 @@ struct cache_deferred_space_event {
 };
 
 int
-cache_init(struct cache *cache);
+cache_init(struct cache *cache, const struct cache_options *options);
 void
 cache_finish(struct cache *cache);
+void
+cache_stats(struct cache *cache, struct cache_stats *stats);
+/* Iterators borrow the txn of the snapshot, so they must be finished before
+ * the snapshot is ended. */
+int
+cache_snapshot_begin(struct cache *cache, struct cache_snapshot *snapshot);
+void
+cache_snapshot_end(struct cache_snapshot *snapshot);
+/* Keep a snapshot open across writes, so that data read from it can be
+ * referenced in place instead of copied. *snapshot is the pinned snapshot,
+ * which is ended by the cache and stays valid until cb is called. ENOTSUP if
+ * the writers of the backend wait for read txns. */
+int
+cache_pin_begin(struct cache *cache, cache_pin_cb cb, cache_pin_wake_cb wake,
+  void *userp, struct cache_snapshot *snapshot);
+/* Replace the pinned snapshot with a new one, so that the old one stops
+ * holding back the reuse of the pages it references. Must be called from a
+ * point where cb can safely run, regularly and whenever wake was called, as
+ * growing or compacting the map waits for the next call to release the pinned
+ * snapshot if it's done by another thread. */
+int
+cache_pin_renew(struct cache *cache);
+/* Whether another thread waits for the pinned snapshot to be released. */
+bool
+cache_pin_release_pending(struct cache *cache);
+/* Release the pinned snapshot for good, for when the thread renewing it
+ * exits. */
+void
+cache_pin_end(struct cache *cache);
+/* Decode a stored event in place, so that it's strings point into the map.
+ * MDB_NOTFOUND if the event can't be referenced in place, as it is
+ * compressed, deleted, redacted or stored as JSON. */
+int
+cache_event_pinned(struct cache_snapshot *snapshot, const char *room_id,
+  uint64_t index, struct matrix_sync_event *event);
 char *
 cache_auth_get(struct cache *cache, enum auth_key key);
 int
 cache_auth_set(struct cache *cache, enum auth_key key, char *auth);
+/* Delete events exceeding the retention limits of the options, keeping the
+ * latest event of each room. Each room is pruned in a separate txn so that
+ * syncing isn't blocked for long. *pruned stores the number of deleted
+ * events. */
 int
-cache_save_txn_init(
-  struct cache *cache, struct cache_save_txn *txn, const char *room_id);
+cache_prune(struct cache *cache, size_t *pruned);
+/* Compress runs of CACHE_EVENT_BLOCK_SIZE events older than cold_age_ms into
+ * blocks, keeping the latest event of each room uncompressed. The dictionary
+ * is trained from the stored events on the first call. *frozen stores the
+ * number of compressed events. */
+int
+cache_freeze(struct cache *cache, size_t *frozen);
+/* Copy the env without free pages and swap it in place of the current one.
+ * Reads and writes continue while copying, the copy is only swapped in if
+ * nothing was written meanwhile. It's retried a few times before giving up
+ * with EAGAIN. If the copy can't be opened the original is reopened, only if
+ * that fails too the cache is left without an env and every txn fails with
+ * EIO. */
+int
+cache_compact(struct cache *cache);
+int
+cache_batch_init(struct cache *cache, struct cache_batch *batch);
+/* True if an operation failed as the map is full, nothing else should be
+ * saved in the batch. */
+bool
+cache_batch_failed(struct cache_batch *batch);
+/* Commits the batch, flushing it to disk if the commit window elapsed.
+ * Returns MDB_MAP_FULL if the map was full, in which case the batch was
+ * discarded and the map grown. The caller must save everything again in a new
+ * batch. */
+int
+cache_batch_finish(struct cache_batch *batch);
+int
+cache_batch_auth_set(
+  struct cache_batch *batch, enum auth_key key, const char *auth);
 void
+cache_save_txn_init(
+  struct cache_batch *batch, struct cache_save_txn *txn, const char *room_id);
+/* Writes the staged events and the summary of the room. MDB_MAP_FULL or
+ * MDB_BAD_TXN if the batch failed, in which case it's saved again. */
+int
 cache_save_txn_finish(struct cache_save_txn *txn);
+/* Look up (or allocate) the surrogate of the room. */
 int
-cache_set_room_dbs(struct cache_save_txn *txn, struct matrix_room *room);
+cache_save_txn_room(struct cache_save_txn *txn, struct matrix_room *room);
 int
 cache_save_room(struct cache_save_txn *txn, struct matrix_room *room);
 /* Returns 0 if the intended operation was possible, else -1 */
 enum cache_deferred_ret
-cache_process_deferred_event(
-  struct cache *cache, struct cache_deferred_space_event *deferred_event);
+cache_process_deferred_event(struct cache_batch *batch,
+  struct cache_deferred_space_event *deferred_event);
+/* *related_index is set to the index of the redacted event for redactions,
+ * and to the index of the parent for other relations. */
 enum cache_save_error
 cache_save_event(struct cache_save_txn *txn, struct matrix_sync_event *event,
-  uint64_t *index, uint64_t *redaction_index,
+  uint64_t *index, uint64_t *related_index,
   struct cache_deferred_space_event **deferred_events);
 int
 cache_iterator_next(struct cache_iterator *iterator);
 void
 cache_iterator_finish(struct cache_iterator *iterator);
-/* *room_id stores the ID of each room after an iteration. */
+/* *room_id stores the ID of each room after an iteration. If info isn't NULL,
+ * it is initialized with the room's info which must be finished by the
+ * caller. */
 int
-cache_iterator_rooms(
-  struct cache *cache, struct cache_iterator *iterator, const char **room_id);
-/* Fetch num_fetch events, starting from end_index and going backwards.
- * end_index == (uint64_t) -1 means start from end.
+cache_iterator_rooms(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char **room_id,
+  struct room_info *info);
+/* Fetch num_fetch events, starting from the last event at or before
+ * end_index and going backwards. end_index == (uint64_t) -1 means start
+ * from end.
  * timeline_events and state_events are the result of bitwise OR-ing
  * the type of events that should be iterated over.
  * The events are stored in *event. */
 int
-cache_iterator_events(struct cache *cache, struct cache_iterator *iterator,
-  const char *room_id, struct cache_iterator_event *event, uint64_t end_index,
-  uint64_t num_fetch, unsigned timeline_events, unsigned state_events);
+cache_iterator_events(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char *room_id,
+  struct cache_iterator_event *event, uint64_t end_index, uint64_t num_fetch,
+  unsigned timeline_events, unsigned state_events);
+/* Index of the first event sent at or after ts (ms since the epoch),
+ * MDB_NOTFOUND if every event of the room is older. */
+int
+cache_event_index_at(struct cache_snapshot *snapshot, const char *room_id,
+  uint64_t ts, uint64_t *index);
 /* Member stored in *member. */
 int
-cache_iterator_member(struct cache *cache, struct cache_iterator *iterator,
-  const char *room_id, struct cache_iterator_member *member);
+cache_iterator_member(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, const char *room_id,
+  struct cache_iterator_member *member);
+/* Look up a single member, MDB_NOTFOUND if they aren't in the room. The
+ * strings of *member are valid until the snapshot is ended. */
+int
+cache_member_get(struct cache_snapshot *snapshot, const char *room_id,
+  const char *mxid, struct cache_iterator_member *member);
+/* Full-text search over the message bodies of all rooms. Candidates are the
+ * events containing the rarest token of the query, ranked by the number of
+ * query tokens they contain and then by recency. They're read newest first
+ * until max_hits of them contain every token, and only the newest
+ * CACHE_SEARCH_CANDIDATES_MAX are ranked, so common words don't cost more
+ * than rare ones. *hits is an stb array of at most max_hits hits that must be
+ * freed with cache_search_hits_free(). */
+int
+cache_search(struct cache_snapshot *snapshot, const char *query,
+  size_t max_hits, struct cache_search_hit **hits);
+void
+cache_search_hits_free(struct cache_search_hit *hits);
 /* Space stored in *space, has a nested iterator spaces->children_iterator for
  * child spaces. */
 int
-cache_iterator_spaces(struct cache *cache, struct cache_iterator *iterator,
-  struct cache_iterator_space *space);
+cache_iterator_spaces(struct cache_snapshot *snapshot,
+  struct cache_iterator *iterator, struct cache_iterator_space *space);
 int
 cache_room_info_init(
-  struct cache *cache, struct room_info *info, const char *room_id);
+  struct cache_snapshot *snapshot, struct room_info *info, const char *room_id);
 void
 cache_room_info_finish(struct room_info *info);
 /* Hack for MDB APIs that don't mark their args as const. */
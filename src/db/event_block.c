@@ -0,0 +1,430 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/event_block.h"
+
+#include "stb_ds.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+enum {
+	OFFSET_VERSION = 0,
+	OFFSET_COUNT = 2,
+	OFFSET_RAW_SIZE = 4,
+	OFFSET_DICT_ID = 8,
+	OFFSET_ID = 16,
+	OFFSET_LAST_INDEX = 24,
+	OFFSET_FIRST_TS = 32,
+	ENTRY_HEADER_SIZE = sizeof(uint64_t) + (2 * sizeof(uint32_t)),
+};
+
+enum {
+	/* Substrings are counted by their first GRAM bytes. */
+	GRAM = 8,
+	/* Size of the substrings copied into the dictionary. */
+	SEGMENT = 64,
+	SEGMENT_STEP = 16,
+	/* Enough to see the common keys without training taking long. */
+	TRAIN_INPUT_MAX = 1024 * 1024,
+};
+
+static uint32_t
+dict_id(const unsigned char *dict, size_t dict_size) {
+	if (!dict || dict_size == 0) {
+		return 0;
+	}
+
+	return (uint32_t) adler32(adler32(0, NULL, 0), dict, (uInt) dict_size);
+}
+
+void
+event_block_append(unsigned char **raw, const struct event_block_entry *entry) {
+	assert(raw);
+	assert(entry);
+	assert(entry->record);
+	assert(!entry->json_size || entry->json);
+
+	size_t size = ENTRY_HEADER_SIZE + entry->record_size + entry->json_size;
+	unsigned char *out = arraddnptr(*raw, size);
+
+	memcpy(out, &entry->index, sizeof(entry->index));
+	out += sizeof(entry->index);
+	memcpy(out, &entry->record_size, sizeof(entry->record_size));
+	out += sizeof(entry->record_size);
+	memcpy(out, &entry->json_size, sizeof(entry->json_size));
+	out += sizeof(entry->json_size);
+	memcpy(out, entry->record, entry->record_size);
+	out += entry->record_size;
+
+	if (entry->json_size > 0) {
+		memcpy(out, entry->json, entry->json_size);
+	}
+}
+
+static void
+header_write(const struct event_block_header *header, unsigned char *out) {
+	memset(out, 0, EVENT_BLOCK_HEADER_SIZE);
+	out[OFFSET_VERSION] = EVENT_BLOCK_VERSION;
+	memcpy(&out[OFFSET_COUNT], &header->count, sizeof(header->count));
+	memcpy(&out[OFFSET_RAW_SIZE], &header->raw_size, sizeof(header->raw_size));
+	memcpy(&out[OFFSET_DICT_ID], &header->dict_id, sizeof(header->dict_id));
+	memcpy(&out[OFFSET_ID], &header->id, sizeof(header->id));
+	memcpy(&out[OFFSET_LAST_INDEX], &header->last_index,
+	  sizeof(header->last_index));
+	memcpy(
+	  &out[OFFSET_FIRST_TS], &header->first_ts, sizeof(header->first_ts));
+}
+
+int
+event_block_compress(struct event_block_header *header,
+  const unsigned char *raw, size_t raw_size, const unsigned char *dict,
+  size_t dict_size, unsigned char **out, size_t *out_size) {
+	assert(header);
+	assert(raw);
+	assert(out);
+	assert(out_size);
+
+	if (raw_size == 0 || raw_size > UINT32_MAX
+		|| dict_size > EVENT_BLOCK_DICT_MAX) {
+		return -1;
+	}
+
+	header->raw_size = (uint32_t) raw_size;
+	header->dict_id = dict_id(dict, dict_size);
+
+	z_stream stream = {0};
+
+	/* Blocks are written once and read many times. */
+	if ((deflateInit(&stream, Z_BEST_COMPRESSION)) != Z_OK) {
+		return -1;
+	}
+
+	if (header->dict_id != 0
+		&& (deflateSetDictionary(&stream, dict, (uInt) dict_size)) != Z_OK) {
+		deflateEnd(&stream);
+		return -1;
+	}
+
+	size_t bound
+	  = EVENT_BLOCK_HEADER_SIZE + deflateBound(&stream, (uLong) raw_size);
+	unsigned char *buf = malloc(bound);
+
+	if (!buf) {
+		deflateEnd(&stream);
+		return -1;
+	}
+
+	stream.next_in = (Bytef *) (uintptr_t) raw;
+	stream.avail_in = (uInt) raw_size;
+	stream.next_out = &buf[EVENT_BLOCK_HEADER_SIZE];
+	stream.avail_out = (uInt) (bound - EVENT_BLOCK_HEADER_SIZE);
+
+	int ret = deflate(&stream, Z_FINISH);
+	size_t compressed = stream.total_out;
+
+	deflateEnd(&stream);
+
+	if (ret != Z_STREAM_END) {
+		free(buf);
+		return -1;
+	}
+
+	header->version = EVENT_BLOCK_VERSION;
+	header_write(header, buf);
+
+	*out = buf;
+	*out_size = EVENT_BLOCK_HEADER_SIZE + compressed;
+
+	return 0;
+}
+
+int
+event_block_header(
+  const void *buf, size_t len, struct event_block_header *header) {
+	assert(header);
+
+	const unsigned char *in = buf;
+
+	if (!in || len <= EVENT_BLOCK_HEADER_SIZE
+		|| in[OFFSET_VERSION] != EVENT_BLOCK_VERSION) {
+		return -1;
+	}
+
+	*header = (struct event_block_header) {.version = in[OFFSET_VERSION]};
+
+	memcpy(&header->count, &in[OFFSET_COUNT], sizeof(header->count));
+	memcpy(&header->raw_size, &in[OFFSET_RAW_SIZE], sizeof(header->raw_size));
+	memcpy(&header->dict_id, &in[OFFSET_DICT_ID], sizeof(header->dict_id));
+	memcpy(&header->id, &in[OFFSET_ID], sizeof(header->id));
+	memcpy(
+	  &header->last_index, &in[OFFSET_LAST_INDEX], sizeof(header->last_index));
+	memcpy(&header->first_ts, &in[OFFSET_FIRST_TS], sizeof(header->first_ts));
+
+	return (header->count > 0 && header->raw_size > 0) ? 0 : -1;
+}
+
+/* Point the entries into the inflated payload, validating their sizes. */
+static int
+parse_entries(struct event_block *block, size_t count, size_t raw_size) {
+	assert(block);
+
+	size_t offset = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		struct event_block_entry entry = {0};
+
+		if ((raw_size - offset) < ENTRY_HEADER_SIZE) {
+			return -1;
+		}
+
+		const unsigned char *in = &block->raw[offset];
+
+		memcpy(&entry.index, in, sizeof(entry.index));
+		in += sizeof(entry.index);
+		memcpy(&entry.record_size, in, sizeof(entry.record_size));
+		in += sizeof(entry.record_size);
+		memcpy(&entry.json_size, in, sizeof(entry.json_size));
+		in += sizeof(entry.json_size);
+		offset += ENTRY_HEADER_SIZE;
+
+		if (entry.record_size == 0
+			|| (raw_size - offset) < entry.record_size
+			|| (raw_size - offset - entry.record_size) < entry.json_size
+			|| (i > 0 && entry.index <= block->entries[i - 1].index)) {
+			return -1;
+		}
+
+		entry.record = in;
+		offset += entry.record_size;
+
+		if (entry.json_size > 0) {
+			entry.json = (const char *) &block->raw[offset];
+			offset += entry.json_size;
+
+			if (entry.json[entry.json_size - 1] != '\0') {
+				return -1;
+			}
+		}
+
+		arrput(block->entries, entry);
+	}
+
+	return offset == raw_size ? 0 : -1;
+}
+
+struct event_block *
+event_block_decompress(
+  const void *buf, size_t len, const unsigned char *dict, size_t dict_size) {
+	struct event_block_header header = {0};
+
+	if ((event_block_header(buf, len, &header)) == -1
+		|| (header.dict_id != 0
+			&& header.dict_id != dict_id(dict, dict_size))) {
+		return NULL;
+	}
+
+	struct event_block *block = calloc(1, sizeof(*block));
+
+	if (!block || !(block->raw = malloc(header.raw_size))) {
+		free(block);
+		return NULL;
+	}
+
+	z_stream stream = {0};
+	bool ok = false;
+
+	if ((inflateInit(&stream)) == Z_OK) {
+		stream.next_in = (Bytef *) (uintptr_t) &(
+		  (const unsigned char *) buf)[EVENT_BLOCK_HEADER_SIZE];
+		stream.avail_in = (uInt) (len - EVENT_BLOCK_HEADER_SIZE);
+		stream.next_out = block->raw;
+		stream.avail_out = header.raw_size;
+
+		int ret = inflate(&stream, Z_FINISH);
+
+		if (ret == Z_NEED_DICT && header.dict_id != 0
+			&& (inflateSetDictionary(&stream, dict, (uInt) dict_size))
+				 == Z_OK) {
+			ret = inflate(&stream, Z_FINISH);
+		}
+
+		ok = ret == Z_STREAM_END && stream.total_out == header.raw_size;
+
+		inflateEnd(&stream);
+	}
+
+	if (!ok || (parse_entries(block, header.count, header.raw_size)) == -1) {
+		arrfree(block->entries);
+		free(block->raw);
+		free(block);
+		return NULL;
+	}
+
+	block->id = header.id;
+	block->refs = 1;
+
+	return block;
+}
+
+struct event_block *
+event_block_ref(struct event_block *block) {
+	assert(block);
+
+	block->refs++;
+
+	return block;
+}
+
+void
+event_block_unref(struct event_block *block) {
+	if (block && --block->refs == 0) {
+		arrfree(block->entries);
+		free(block->raw);
+		free(block);
+	}
+}
+
+size_t
+event_block_count_before(const struct event_block *block, uint64_t index) {
+	assert(block);
+
+	size_t low = 0;
+	size_t high = arrlenu(block->entries);
+
+	while (low < high) {
+		size_t mid = low + ((high - low) / 2);
+
+		if (block->entries[mid].index <= index) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low;
+}
+
+ptrdiff_t
+event_block_find(const struct event_block *block, uint64_t index) {
+	size_t count = event_block_count_before(block, index);
+
+	return (count > 0 && block->entries[count - 1].index == index)
+		   ? (ptrdiff_t) (count - 1)
+		   : -1;
+}
+
+struct gram_count {
+	uint64_t key;
+	uint32_t value;
+};
+
+struct segment {
+	const unsigned char *start;
+	uint64_t score;
+};
+
+static uint64_t
+gram_at(const unsigned char *p) {
+	uint64_t gram = 0;
+	memcpy(&gram, p, sizeof(gram));
+
+	return gram;
+}
+
+/* Grams seen once are noise, they don't add to the score. */
+static uint64_t
+segment_score(struct gram_count **counts, const unsigned char *start) {
+	uint64_t score = 0;
+
+	for (size_t i = 0; i + GRAM <= SEGMENT; i++) {
+		uint32_t count = hmget(*counts, gram_at(&start[i]));
+
+		if (count > 1) {
+			score += count;
+		}
+	}
+
+	return score;
+}
+
+static int
+cmp_segments(const void *a, const void *b) {
+	const struct segment *first = a;
+	const struct segment *second = b;
+
+	return (first->score < second->score) - (first->score > second->score);
+}
+
+size_t
+event_block_dict_train(const unsigned char *const *samples,
+  const size_t *sizes, size_t len, unsigned char *dict, size_t cap) {
+	assert(samples);
+	assert(sizes);
+	assert(dict);
+
+	struct gram_count *counts = NULL;
+	struct segment *segments = NULL;
+	size_t input = 0;
+
+	if (cap > EVENT_BLOCK_DICT_MAX) {
+		cap = EVENT_BLOCK_DICT_MAX;
+	}
+
+	for (size_t i = 0; i < len && input < TRAIN_INPUT_MAX; i++) {
+		if (sizes[i] < SEGMENT) {
+			continue;
+		}
+
+		for (size_t j = 0; j + GRAM <= sizes[i]; j++) {
+			uint64_t gram = gram_at(&samples[i][j]);
+			hmput(counts, gram, hmget(counts, gram) + 1);
+		}
+
+		for (size_t j = 0; j + SEGMENT <= sizes[i]; j += SEGMENT_STEP) {
+			struct segment segment = {.start = &samples[i][j]};
+			arrput(segments, segment);
+		}
+
+		input += sizes[i];
+	}
+
+	for (size_t i = 0, segments_len = arrlenu(segments); i < segments_len;
+		 i++) {
+		segments[i].score = segment_score(&counts, segments[i].start);
+	}
+
+	if (arrlenu(segments) > 0) {
+		qsort(segments, arrlenu(segments), sizeof(*segments), cmp_segments);
+	}
+
+	/* Filled from the end, so that the best segment is the last one. */
+	size_t used = 0;
+
+	for (size_t i = 0, segments_len = arrlenu(segments);
+		 i < segments_len && (used + SEGMENT) <= cap; i++) {
+		/* Rescored as the grams of the segments already picked don't count,
+		 * so that overlapping segments aren't repeated. */
+		uint64_t score = segment_score(&counts, segments[i].start);
+
+		if (score == 0 || score < (segments[i].score / 2)) {
+			continue;
+		}
+
+		used += SEGMENT;
+		memcpy(&dict[cap - used], segments[i].start, SEGMENT);
+
+		for (size_t j = 0; j + GRAM <= SEGMENT; j++) {
+			hmput(counts, gram_at(&segments[i].start[j]), 0);
+		}
+	}
+
+	memmove(dict, &dict[cap - used], used);
+
+	arrfree(segments);
+	hmfree(counts);
+
+	return used;
+}
@@ -0,0 +1,88 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Run of consecutive events of a room compressed together, stored in
+ * ROOM_DB_EVENT_BLOCKS once the events are old enough that they're rarely
+ * read. Layout:
+ *
+ * [u8 version][u8 padding][u16 count][u32 raw size][u32 dictionary ID]
+ * [u32 padding][u64 block ID][u64 last index][u64 first origin_server_ts]
+ * zlib(count * [u64 index][u32 record size][u32 JSON size][record][JSON])
+ *
+ * The header is uncompressed so that blocks can be located and filtered
+ * without inflating them. Blocks are never modified, a block ID always refers
+ * to the same events so decompressed blocks can be cached by their ID. */
+enum {
+	EVENT_BLOCK_VERSION = 1,
+	EVENT_BLOCK_HEADER_SIZE = 40,
+	/* zlib only looks back this far, a longer dictionary is useless. */
+	EVENT_BLOCK_DICT_MAX = 32768,
+};
+
+struct event_block_header {
+	uint8_t version;
+	uint16_t count;
+	uint32_t raw_size;
+	/* Adler-32 of the dictionary, 0 if the block was compressed without
+	 * one. */
+	uint32_t dict_id;
+	uint64_t id;
+	uint64_t last_index;
+	uint64_t first_ts;
+};
+
+struct event_block_entry {
+	uint64_t index;
+	const void *record;
+	uint32_t record_size;
+	/* NULL if the event had no raw JSON, includes the NUL terminator. */
+	const char *json;
+	uint32_t json_size;
+};
+
+/* Decompressed block, shared between the block cache and readers. */
+struct event_block {
+	uint64_t id;
+	_Atomic unsigned refs;
+	unsigned char *raw;
+	/* Sorted by index, pointing into raw. */
+	struct event_block_entry *entries;
+};
+
+/* Append an event to the uncompressed payload *raw, an stb array. */
+void
+event_block_append(unsigned char **raw, const struct event_block_entry *entry);
+/* Compress the payload, header->raw_size and header->dict_id are filled in.
+ * *out must be freed by the caller. */
+int
+event_block_compress(struct event_block_header *header,
+  const unsigned char *raw, size_t raw_size, const unsigned char *dict,
+  size_t dict_size, unsigned char **out, size_t *out_size);
+int
+event_block_header(
+  const void *buf, size_t len, struct event_block_header *header);
+/* Returns a block with a single reference, NULL if the block is corrupt or
+ * was compressed with a different dictionary. */
+struct event_block *
+event_block_decompress(
+  const void *buf, size_t len, const unsigned char *dict, size_t dict_size);
+struct event_block *
+event_block_ref(struct event_block *block);
+void
+event_block_unref(struct event_block *block);
+/* Position of the event in block->entries, -1 if it isn't in the block. */
+ptrdiff_t
+event_block_find(const struct event_block *block, uint64_t index);
+/* Number of entries with an index <= index. */
+size_t
+event_block_count_before(const struct event_block *block, uint64_t index);
+/* Build a dictionary of the substrings shared by most samples, with the most
+ * common ones at the end as they're the cheapest for zlib to reference.
+ * Returns the length of the dictionary, 0 if the samples are too small. */
+size_t
+event_block_dict_train(const unsigned char *const *samples,
+  const size_t *sizes, size_t len, unsigned char *dict, size_t cap);
@@ -0,0 +1,225 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/event_cache.h"
+
+#include "stb_ds.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	/* A parsed JSON tree takes a few times the size of it's text. */
+	JSON_OVERHEAD = 4,
+};
+
+static struct event_cache_key
+key_of(uint32_t room, uint64_t index) {
+	return (struct event_cache_key) {.index = index, .room = room};
+}
+
+static void
+link_head(struct event_cache *cache, struct event_cache_entry *entry) {
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+
+	cache->head = entry;
+}
+
+static void
+unlink_entry(struct event_cache *cache, struct event_cache_entry *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+/* Drop the cache's reference, readers might still hold their own. */
+static void
+remove_entry(struct event_cache *cache, struct event_cache_entry *entry) {
+	unlink_entry(cache, entry);
+	hmdel(cache->entries, entry->key);
+
+	assert(cache->size >= entry->size);
+	cache->size -= entry->size;
+
+	event_cache_entry_unref(entry);
+}
+
+int
+event_cache_init(struct event_cache *cache, size_t budget) {
+	assert(cache);
+
+	*cache = (struct event_cache) {.budget = budget};
+
+	if ((pthread_mutex_init(&cache->mutex, NULL)) != 0) {
+		return ENOMEM;
+	}
+
+	cache->initialized = true;
+
+	return 0;
+}
+
+void
+event_cache_finish(struct event_cache *cache) {
+	if (!cache || !cache->initialized) {
+		return;
+	}
+
+	while (cache->head) {
+		remove_entry(cache, cache->head);
+	}
+
+	hmfree(cache->entries);
+	pthread_mutex_destroy(&cache->mutex);
+
+	memset(cache, 0, sizeof(*cache));
+}
+
+struct event_cache_entry *
+event_cache_entry_new(
+  uint32_t room, uint64_t index, const void *record, size_t record_size) {
+	assert(record || record_size == 0);
+
+	struct event_cache_entry *entry = malloc(sizeof(*entry));
+	void *copy = malloc(record_size > 0 ? record_size : 1);
+
+	if (!entry || !copy) {
+		free(entry);
+		free(copy);
+		return NULL;
+	}
+
+	if (record_size > 0) {
+		memcpy(copy, record, record_size);
+	}
+
+	*entry = (struct event_cache_entry) {
+	  .key = key_of(room, index),
+	  .size = sizeof(*entry) + record_size,
+	  .record = copy,
+	};
+	entry->refs = 1;
+
+	return entry;
+}
+
+void
+event_cache_entry_set_json(
+  struct event_cache_entry *entry, matrix_json_t *json, size_t json_size) {
+	assert(entry);
+	assert(!entry->json);
+
+	entry->json = json;
+	entry->size += json_size * JSON_OVERHEAD;
+}
+
+struct event_cache_entry *
+event_cache_entry_ref(struct event_cache_entry *entry) {
+	assert(entry);
+
+	entry->refs++;
+
+	return entry;
+}
+
+void
+event_cache_entry_unref(struct event_cache_entry *entry) {
+	if (entry && --entry->refs == 0) {
+		matrix_json_delete(entry->json);
+		free(entry->record);
+		free(entry);
+	}
+}
+
+struct event_cache_entry *
+event_cache_get(struct event_cache *cache, uint32_t room, uint64_t index) {
+	assert(cache);
+
+	struct event_cache_entry *entry = NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	ptrdiff_t i = hmgeti(cache->entries, key_of(room, index));
+
+	if (i >= 0) {
+		entry = event_cache_entry_ref(cache->entries[i].value);
+
+		unlink_entry(cache, entry);
+		link_head(cache, entry);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (entry) {
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
+
+	return entry;
+}
+
+void
+event_cache_put(
+  struct event_cache *cache, struct event_cache_entry *entry, uint64_t epoch) {
+	assert(cache);
+	assert(entry);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	if (epoch == cache->epoch && entry->size <= cache->budget
+		&& hmgeti(cache->entries, entry->key) < 0) {
+		hmput(cache->entries, entry->key, event_cache_entry_ref(entry));
+		link_head(cache, entry);
+		cache->size += entry->size;
+
+		while (cache->size > cache->budget) {
+			remove_entry(cache, cache->tail);
+		}
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void
+event_cache_invalidate(
+  struct event_cache *cache, uint32_t room, uint64_t index) {
+	assert(cache);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	ptrdiff_t i = hmgeti(cache->entries, key_of(room, index));
+
+	if (i >= 0) {
+		remove_entry(cache, cache->entries[i].value);
+	}
+
+	cache->epoch++;
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+uint64_t
+event_cache_epoch(struct event_cache *cache) {
+	assert(cache);
+
+	return cache->epoch;
+}
@@ -0,0 +1,90 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "matrix.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Decoded events shared by the iterators of every snapshot, keyed by the room
+ * surrogate and the index of the event. The cache is bounded by the memory
+ * taken by the entries, the least recently used entries are evicted first.
+ *
+ * A snapshot may be older than an invalidation, so an entry decoded from it
+ * is only inserted if no invalidation happened since the epoch that was read
+ * before the snapshot began. */
+struct event_cache_key {
+	uint64_t index;
+	uint32_t room;
+	/* Keys are hashed bytewise, so the padding is explicit and zeroed. */
+	uint32_t padding;
+};
+
+/* Decoded event, shared between the cache and iterators. */
+struct event_cache_entry {
+	struct event_cache_key key;
+	_Atomic unsigned refs;
+	/* Bytes charged against the budget. */
+	size_t size;
+	/* Owned copy of the record that the event points into. */
+	void *record;
+	/* Parsed JSON that the event points into instead, NULL if the event was
+	 * decoded from the record. */
+	matrix_json_t *json;
+	struct matrix_sync_event event;
+	/* The most recently used entry is the head, only valid while the entry is
+	 * in the cache. */
+	struct event_cache_entry *prev;
+	struct event_cache_entry *next;
+};
+
+struct event_cache {
+	pthread_mutex_t mutex;
+	bool initialized;
+	size_t budget;
+	size_t size;
+	struct {
+		struct event_cache_key key;
+		struct event_cache_entry *value;
+	} *entries;
+	struct event_cache_entry *head;
+	struct event_cache_entry *tail;
+	_Atomic uint64_t epoch;
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+};
+
+int
+event_cache_init(struct event_cache *cache, size_t budget);
+void
+event_cache_finish(struct event_cache *cache);
+/* Returns an entry with a single reference and a copy of the record, NULL if
+ * out of memory. The caller decodes the event into it. */
+struct event_cache_entry *
+event_cache_entry_new(
+  uint32_t room, uint64_t index, const void *record, size_t record_size);
+/* Charge the parsed JSON of the entry, whose text was json_size bytes. */
+void
+event_cache_entry_set_json(
+  struct event_cache_entry *entry, matrix_json_t *json, size_t json_size);
+struct event_cache_entry *
+event_cache_entry_ref(struct event_cache_entry *entry);
+void
+event_cache_entry_unref(struct event_cache_entry *entry);
+/* Returns a new reference to the entry, NULL on a miss. */
+struct event_cache_entry *
+event_cache_get(struct event_cache *cache, uint32_t room, uint64_t index);
+/* Insert the entry unless it's key is already cached or the cache was
+ * invalidated after epoch, evicting entries until it fits the budget. */
+void
+event_cache_put(
+  struct event_cache *cache, struct event_cache_entry *entry, uint64_t epoch);
+/* Drop the event (which might not be cached) and start a new epoch. */
+void
+event_cache_invalidate(
+  struct event_cache *cache, uint32_t room, uint64_t index);
+uint64_t
+event_cache_epoch(struct event_cache *cache);
@@ -0,0 +1,284 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/event_record.h"
+
+#include <assert.h>
+#include <string.h>
+
+enum {
+	OFFSET_VERSION = 0,
+	OFFSET_EVENT_TYPE = 1,
+	OFFSET_FLAGS = 2,
+	OFFSET_TYPE = 4,
+	OFFSET_TS = 8,
+	HEADER_SIZE = 16,
+};
+
+/* Fields that are still present after a redaction. */
+static const bool base_fields[EVENT_RECORD_FIELD_MAX] = {
+  [EVENT_RECORD_EVENT_ID] = true,
+  [EVENT_RECORD_SENDER] = true,
+  [EVENT_RECORD_TYPE] = true,
+  [EVENT_RECORD_STATE_KEY] = true,
+};
+
+/* The state event field that is stored in EVENT_RECORD_BODY. */
+static char **
+state_body(struct matrix_state_event *event) {
+	assert(event);
+
+	switch (event->type) {
+	case MATRIX_ROOM_MEMBER:
+		return &event->content.member.displayname;
+	case MATRIX_ROOM_NAME:
+		return &event->content.name.name;
+	case MATRIX_ROOM_TOPIC:
+		return &event->content.topic.topic;
+	case MATRIX_ROOM_CANONICAL_ALIAS:
+		return &event->content.canonical_alias.alias;
+	case MATRIX_ROOM_CREATE:
+		return &event->content.create.type;
+	default:
+		return NULL;
+	}
+}
+
+/* Map each record field to the corresponding member of the event, NULL if the
+ * event doesn't have such a member. */
+static void
+event_fields(
+  struct matrix_sync_event *event, char **fields[EVENT_RECORD_FIELD_MAX]) {
+	assert(event);
+	assert(fields);
+
+	memset(fields, 0, sizeof(*fields) * EVENT_RECORD_FIELD_MAX);
+
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		{
+			struct matrix_state_event *sevent = &event->state;
+
+			fields[EVENT_RECORD_EVENT_ID] = &sevent->base.event_id;
+			fields[EVENT_RECORD_SENDER] = &sevent->base.sender;
+			fields[EVENT_RECORD_TYPE] = &sevent->base.type;
+			fields[EVENT_RECORD_STATE_KEY] = &sevent->base.state_key;
+			fields[EVENT_RECORD_BODY] = state_body(sevent);
+		}
+		break;
+	case MATRIX_EVENT_TIMELINE:
+		{
+			struct matrix_timeline_event *tevent = &event->timeline;
+
+			fields[EVENT_RECORD_EVENT_ID] = &tevent->base.event_id;
+			fields[EVENT_RECORD_SENDER] = &tevent->base.sender;
+			fields[EVENT_RECORD_TYPE] = &tevent->base.type;
+			fields[EVENT_RECORD_REL_TYPE] = &tevent->relation.rel_type;
+			fields[EVENT_RECORD_REL_EVENT_ID] = &tevent->relation.event_id;
+
+			switch (tevent->type) {
+			case MATRIX_ROOM_MESSAGE:
+				fields[EVENT_RECORD_BODY] = &tevent->message.body;
+				fields[EVENT_RECORD_MSGTYPE] = &tevent->message.msgtype;
+				fields[EVENT_RECORD_FORMAT] = &tevent->message.format;
+				fields[EVENT_RECORD_FORMATTED_BODY]
+				  = &tevent->message.formatted_body;
+				break;
+			case MATRIX_ROOM_REDACTION:
+				fields[EVENT_RECORD_REDACTS] = &tevent->redaction.redacts;
+				break;
+			default:
+				/* Attachments and such rely on the raw JSON. */
+				break;
+			}
+		}
+		break;
+	default:
+		assert(0);
+	}
+}
+
+static uint32_t
+event_subtype(const struct matrix_sync_event *event) {
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		return (uint32_t) event->state.type;
+	case MATRIX_EVENT_TIMELINE:
+		return (uint32_t) event->timeline.type;
+	default:
+		assert(0);
+		return 0;
+	}
+}
+
+static uint64_t
+event_ts(const struct matrix_sync_event *event) {
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		return event->state.base.origin_server_ts;
+	case MATRIX_EVENT_TIMELINE:
+		return event->timeline.base.origin_server_ts;
+	default:
+		assert(0);
+		return 0;
+	}
+}
+
+/* Length stored in the record, including the NUL terminator. */
+static uint32_t
+field_len(char **field, size_t i, unsigned flags) {
+	if (!field || !*field
+		|| ((flags & EVENT_RECORD_REDACTED) && !base_fields[i])) {
+		return 0;
+	}
+
+	size_t len = strlen(*field) + 1;
+	assert(len <= UINT32_MAX);
+
+	return (uint32_t) len;
+}
+
+size_t
+event_record_size(const struct matrix_sync_event *event, unsigned flags) {
+	assert(event);
+
+	char **fields[EVENT_RECORD_FIELD_MAX];
+	/* The event isn't modified, the fields are only read. */
+	event_fields((struct matrix_sync_event *) (uintptr_t) event, fields);
+
+	size_t size = HEADER_SIZE;
+
+	for (size_t i = 0; i < EVENT_RECORD_FIELD_MAX; i++) {
+		size += sizeof(uint32_t) + field_len(fields[i], i, flags);
+	}
+
+	return size;
+}
+
+void
+event_record_write(
+  const struct matrix_sync_event *event, unsigned flags, void *buf) {
+	assert(event);
+	assert(buf);
+
+	char **fields[EVENT_RECORD_FIELD_MAX];
+	event_fields((struct matrix_sync_event *) (uintptr_t) event, fields);
+
+	unsigned char *out = buf;
+	uint32_t type = event_subtype(event);
+	uint64_t ts = event_ts(event);
+
+	memset(out, 0, HEADER_SIZE);
+	out[OFFSET_VERSION] = EVENT_RECORD_VERSION;
+	out[OFFSET_EVENT_TYPE] = (unsigned char) event->type;
+	out[OFFSET_FLAGS] = (unsigned char) flags;
+	memcpy(&out[OFFSET_TYPE], &type, sizeof(type));
+	memcpy(&out[OFFSET_TS], &ts, sizeof(ts));
+
+	size_t offset = HEADER_SIZE;
+
+	for (size_t i = 0; i < EVENT_RECORD_FIELD_MAX; i++) {
+		uint32_t len = field_len(fields[i], i, flags);
+
+		memcpy(&out[offset], &len, sizeof(len));
+		offset += sizeof(len);
+
+		if (len > 0) {
+			memcpy(&out[offset], *fields[i], len);
+			offset += len;
+		}
+	}
+}
+
+bool
+event_record_is_legacy(const void *buf, size_t len) {
+	return buf && len > 0 && *((const char *) buf) == '{';
+}
+
+int
+event_record_header(
+  const void *buf, size_t len, struct event_record_header *header) {
+	assert(header);
+
+	const unsigned char *in = buf;
+
+	if (!in || len < HEADER_SIZE || in[OFFSET_VERSION] != EVENT_RECORD_VERSION
+		|| in[OFFSET_EVENT_TYPE] >= MATRIX_EVENT_MAX) {
+		return -1;
+	}
+
+	*header = (struct event_record_header) {
+	  .version = in[OFFSET_VERSION],
+	  .event_type = in[OFFSET_EVENT_TYPE],
+	  .flags = in[OFFSET_FLAGS],
+	};
+
+	memcpy(&header->type, &in[OFFSET_TYPE], sizeof(header->type));
+	memcpy(&header->origin_server_ts, &in[OFFSET_TS],
+	  sizeof(header->origin_server_ts));
+
+	return 0;
+}
+
+int
+event_record_decode(const void *buf, size_t len,
+  struct matrix_sync_event *event, unsigned *flags) {
+	assert(event);
+	assert(flags);
+
+	struct event_record_header header = {0};
+
+	if ((event_record_header(buf, len, &header)) == -1) {
+		return -1;
+	}
+
+	*flags = header.flags;
+	*event = (struct matrix_sync_event) {.type = header.event_type};
+
+	switch (event->type) {
+	case MATRIX_EVENT_STATE:
+		event->state.type = header.type;
+		event->state.base.origin_server_ts = header.origin_server_ts;
+		break;
+	case MATRIX_EVENT_TIMELINE:
+		event->timeline.type = header.type;
+		event->timeline.base.origin_server_ts = header.origin_server_ts;
+		break;
+	default:
+		return -1;
+	}
+
+	char **fields[EVENT_RECORD_FIELD_MAX];
+	event_fields(event, fields);
+
+	const unsigned char *in = buf;
+	size_t offset = HEADER_SIZE;
+
+	for (size_t i = 0; i < EVENT_RECORD_FIELD_MAX; i++) {
+		uint32_t field_size = 0;
+
+		if ((len - offset) < sizeof(field_size)) {
+			return -1;
+		}
+
+		memcpy(&field_size, &in[offset], sizeof(field_size));
+		offset += sizeof(field_size);
+
+		if (field_size == 0) {
+			continue;
+		}
+
+		if ((len - offset) < field_size
+			|| in[offset + field_size - 1] != '\0') {
+			return -1;
+		}
+
+		/* Unknown fields for this event type are skipped. */
+		if (fields[i]) {
+			*fields[i] = (char *) (uintptr_t) &in[offset];
+		}
+
+		offset += field_size;
+	}
+
+	return offset == len ? 0 : -1;
+}
@@ -0,0 +1,69 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "matrix.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compact representation of an event stored in ROOM_DB_EVENTS, so that
+ * timelines can be loaded without parsing JSON. Layout:
+ *
+ * [u8 version][u8 event type][u8 flags][u8 padding]
+ * [u32 state/timeline type][u64 origin_server_ts]
+ * EVENT_RECORD_FIELD_MAX * [u32 length][length bytes]
+ *
+ * Strings are stored with their NUL terminator so that decoded events can
+ * point directly into the record. A length of 0 means the field is NULL. */
+enum { EVENT_RECORD_VERSION = 1 };
+
+enum event_record_flags {
+	/* Content was removed, only the base fields are present. */
+	EVENT_RECORD_REDACTED = 1 << 0,
+	/* Raw JSON is stored in ROOM_DB_EVENTS_JSON. */
+	EVENT_RECORD_HAS_JSON = 1 << 1,
+};
+
+enum event_record_field {
+	EVENT_RECORD_EVENT_ID = 0,
+	EVENT_RECORD_SENDER,
+	EVENT_RECORD_TYPE,
+	EVENT_RECORD_STATE_KEY,
+	/* Message body, or the displayname/name/topic/... of state events. */
+	EVENT_RECORD_BODY,
+	EVENT_RECORD_MSGTYPE,
+	EVENT_RECORD_FORMAT,
+	EVENT_RECORD_FORMATTED_BODY,
+	EVENT_RECORD_REL_TYPE,
+	EVENT_RECORD_REL_EVENT_ID,
+	EVENT_RECORD_REDACTS,
+	EVENT_RECORD_FIELD_MAX
+};
+
+struct event_record_header {
+	uint8_t version;
+	uint8_t event_type;
+	uint8_t flags;
+	uint32_t type;
+	uint64_t origin_server_ts;
+};
+
+/* Size required to encode the event with the given flags. */
+size_t
+event_record_size(const struct matrix_sync_event *event, unsigned flags);
+/* buf must be atleast event_record_size() bytes. */
+void
+event_record_write(
+  const struct matrix_sync_event *event, unsigned flags, void *buf);
+/* Records written before the binary format existed are plain JSON. */
+bool
+event_record_is_legacy(const void *buf, size_t len);
+/* Only decodes the fixed-size header, used for cheap filtering. */
+int
+event_record_header(
+  const void *buf, size_t len, struct event_record_header *header);
+/* Strings in *event point into buf, so it must outlive the event. */
+int
+event_record_decode(const void *buf, size_t len,
+  struct matrix_sync_event *event, unsigned *flags);
@@ -0,0 +1,179 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/kv.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int
+kv_env_open(const struct kv_ops *ops, struct kv_env **env, const char *dir,
+  unsigned flags, size_t map_size, unsigned max_dbs) {
+	assert(ops);
+	assert(env);
+
+	return ops->env_open(env, dir, flags, map_size, max_dbs);
+}
+
+void
+kv_env_close(struct kv_env *env) {
+	if (env) {
+		env->ops->env_close(env);
+	}
+}
+
+int
+kv_env_info(struct kv_env *env, struct kv_env_info *info) {
+	assert(env);
+	assert(info);
+
+	return env->ops->env_info(env, info);
+}
+
+int
+kv_env_set_mapsize(struct kv_env *env, size_t map_size) {
+	assert(env);
+
+	return env->ops->env_set_mapsize(env, map_size);
+}
+
+int
+kv_env_sync(struct kv_env *env) {
+	assert(env);
+
+	return env->ops->env_sync(env);
+}
+
+int
+kv_env_copy(struct kv_env *env, const char *dir) {
+	assert(env);
+	assert(dir);
+
+	return env->ops->env_copy ? env->ops->env_copy(env, dir) : ENOTSUP;
+}
+
+int
+kv_txn_begin(struct kv_env *env, unsigned flags, struct kv_txn **txn) {
+	assert(env);
+	assert(txn);
+
+	return env->ops->txn_begin(env, flags, txn);
+}
+
+int
+kv_txn_commit(struct kv_txn *txn) {
+	assert(txn);
+
+	return txn->ops->txn_commit(txn);
+}
+
+void
+kv_txn_abort(struct kv_txn *txn) {
+	if (txn) {
+		txn->ops->txn_abort(txn);
+	}
+}
+
+void
+kv_txn_reset(struct kv_txn *txn) {
+	assert(txn);
+
+	txn->ops->txn_reset(txn);
+}
+
+int
+kv_txn_renew(struct kv_txn *txn) {
+	assert(txn);
+
+	return txn->ops->txn_renew(txn);
+}
+
+int
+kv_dbi_open(struct kv_txn *txn, const char *name, unsigned flags, kv_dbi *dbi) {
+	assert(txn);
+	assert(dbi);
+
+	return txn->ops->dbi_open(txn, name, flags, dbi);
+}
+
+int
+kv_drop(struct kv_txn *txn, kv_dbi dbi, bool del) {
+	assert(txn);
+
+	return txn->ops->drop(txn, dbi, del);
+}
+
+int
+kv_stat(struct kv_txn *txn, kv_dbi dbi, struct kv_stat *stat) {
+	assert(txn);
+	assert(stat);
+
+	return txn->ops->stat(txn, dbi, stat);
+}
+
+int
+kv_get(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	assert(txn);
+
+	return txn->ops->get(txn, dbi, key, data);
+}
+
+int
+kv_put(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data,
+  unsigned flags) {
+	assert(txn);
+
+	return txn->ops->put(txn, dbi, key, data, flags);
+}
+
+int
+kv_del(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	assert(txn);
+
+	return txn->ops->del(txn, dbi, key, data);
+}
+
+int
+kv_cursor_open(struct kv_txn *txn, kv_dbi dbi, struct kv_cursor **cursor) {
+	assert(txn);
+	assert(cursor);
+
+	return txn->ops->cursor_open(txn, dbi, cursor);
+}
+
+void
+kv_cursor_close(struct kv_cursor *cursor) {
+	if (cursor) {
+		cursor->ops->cursor_close(cursor);
+	}
+}
+
+int
+kv_cursor_get(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, MDB_cursor_op op) {
+	assert(cursor);
+
+	return cursor->ops->cursor_get(cursor, key, data, op);
+}
+
+int
+kv_cursor_put(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, unsigned flags) {
+	assert(cursor);
+
+	return cursor->ops->cursor_put(cursor, key, data, flags);
+}
+
+int
+kv_cursor_del(struct kv_cursor *cursor, unsigned flags) {
+	assert(cursor);
+
+	return cursor->ops->cursor_del(cursor, flags);
+}
+
+int
+kv_cursor_count(struct kv_cursor *cursor, size_t *count) {
+	assert(cursor);
+	assert(count);
+
+	return cursor->ops->cursor_count(cursor, count);
+}
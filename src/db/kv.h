@@ -0,0 +1,145 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include <lmdb.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ordered key-value store backing the cache. The interface is a subset of
+ * LMDB's and keeps it's vocabulary: MDB_val, the DB, put and cursor flags,
+ * MDB_cursor_op and the error codes (printable with mdb_strerror()) mean the
+ * same for every backend. Handles are allocated by the backend and start with
+ * the ops that created them. */
+struct kv_ops;
+
+struct kv_env {
+	const struct kv_ops *ops;
+};
+
+struct kv_txn {
+	const struct kv_ops *ops;
+};
+
+struct kv_cursor {
+	const struct kv_ops *ops;
+};
+
+typedef unsigned kv_dbi;
+
+struct kv_env_info {
+	size_t map_size;
+	/* Bytes of the map in use. */
+	size_t used;
+	/* ID of the last committed txn, which only changes with commits that
+	 * modified the env. */
+	uint64_t last_txn;
+};
+
+struct kv_stat {
+	size_t entries;
+	/* Pages (or page-sized chunks) taken by the entries. */
+	size_t pages;
+};
+
+struct kv_ops {
+	const char *name;
+	/* The env is durable if dir is used to store it. */
+	bool durable;
+	/* Read txns don't hold off write txns, so a snapshot can be kept open. */
+	bool concurrent_readers;
+	/* flags are LMDB's env flags, which a backend may ignore. */
+	int (*env_open)(struct kv_env **env, const char *dir, unsigned flags,
+	  size_t map_size, unsigned max_dbs);
+	void (*env_close)(struct kv_env *env);
+	int (*env_info)(struct kv_env *env, struct kv_env_info *info);
+	/* Only when there are no active txns. */
+	int (*env_set_mapsize)(struct kv_env *env, size_t map_size);
+	int (*env_sync)(struct kv_env *env);
+	/* Compacting copy of the env to dir, NULL if not durable. */
+	int (*env_copy)(struct kv_env *env, const char *dir);
+	int (*txn_begin)(struct kv_env *env, unsigned flags, struct kv_txn **txn);
+	int (*txn_commit)(struct kv_txn *txn);
+	void (*txn_abort)(struct kv_txn *txn);
+	/* Release the snapshot of a read-only txn, so that it can be renewed
+	 * (from any thread) instead of beginning a new txn. */
+	void (*txn_reset)(struct kv_txn *txn);
+	int (*txn_renew)(struct kv_txn *txn);
+	int (*dbi_open)(
+	  struct kv_txn *txn, const char *name, unsigned flags, kv_dbi *dbi);
+	int (*drop)(struct kv_txn *txn, kv_dbi dbi, bool del);
+	int (*stat)(struct kv_txn *txn, kv_dbi dbi, struct kv_stat *stat);
+	int (*get)(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data);
+	int (*put)(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data,
+	  unsigned flags);
+	int (*del)(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data);
+	int (*cursor_open)(
+	  struct kv_txn *txn, kv_dbi dbi, struct kv_cursor **cursor);
+	void (*cursor_close)(struct kv_cursor *cursor);
+	int (*cursor_get)(
+	  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, MDB_cursor_op op);
+	int (*cursor_put)(
+	  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, unsigned flags);
+	int (*cursor_del)(struct kv_cursor *cursor, unsigned flags);
+	int (*cursor_count)(struct kv_cursor *cursor, size_t *count);
+};
+
+/* The default backend, an LMDB env in a directory. */
+extern const struct kv_ops kv_lmdb;
+/* Everything is kept in the process' memory and lost on close. Txns are
+ * serializable like LMDB's, but a write txn waits for the read txns to end
+ * instead of running alongside them. */
+extern const struct kv_ops kv_memory;
+
+int
+kv_env_open(const struct kv_ops *ops, struct kv_env **env, const char *dir,
+  unsigned flags, size_t map_size, unsigned max_dbs);
+void
+kv_env_close(struct kv_env *env);
+int
+kv_env_info(struct kv_env *env, struct kv_env_info *info);
+int
+kv_env_set_mapsize(struct kv_env *env, size_t map_size);
+int
+kv_env_sync(struct kv_env *env);
+/* ENOTSUP if the backend isn't durable. */
+int
+kv_env_copy(struct kv_env *env, const char *dir);
+int
+kv_txn_begin(struct kv_env *env, unsigned flags, struct kv_txn **txn);
+int
+kv_txn_commit(struct kv_txn *txn);
+void
+kv_txn_abort(struct kv_txn *txn);
+void
+kv_txn_reset(struct kv_txn *txn);
+int
+kv_txn_renew(struct kv_txn *txn);
+int
+kv_dbi_open(struct kv_txn *txn, const char *name, unsigned flags, kv_dbi *dbi);
+/* Empty the DB, and also delete it if del is true. */
+int
+kv_drop(struct kv_txn *txn, kv_dbi dbi, bool del);
+int
+kv_stat(struct kv_txn *txn, kv_dbi dbi, struct kv_stat *stat);
+int
+kv_get(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data);
+int
+kv_put(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data,
+  unsigned flags);
+int
+kv_del(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data);
+int
+kv_cursor_open(struct kv_txn *txn, kv_dbi dbi, struct kv_cursor **cursor);
+void
+kv_cursor_close(struct kv_cursor *cursor);
+int
+kv_cursor_get(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, MDB_cursor_op op);
+int
+kv_cursor_put(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, unsigned flags);
+int
+kv_cursor_del(struct kv_cursor *cursor, unsigned flags);
+int
+kv_cursor_count(struct kv_cursor *cursor, size_t *count);
@@ -0,0 +1,287 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/kv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/* Thin wrappers carrying the ops along with the LMDB handles. */
+struct lmdb_env {
+	struct kv_env base;
+	MDB_env *env;
+};
+
+struct lmdb_txn {
+	struct kv_txn base;
+	MDB_txn *txn;
+};
+
+struct lmdb_cursor {
+	struct kv_cursor base;
+	MDB_cursor *cursor;
+};
+
+static MDB_env *
+env_of(struct kv_env *env) {
+	return ((struct lmdb_env *) env)->env;
+}
+
+static MDB_txn *
+txn_of(struct kv_txn *txn) {
+	return ((struct lmdb_txn *) txn)->txn;
+}
+
+static MDB_cursor *
+cursor_of(struct kv_cursor *cursor) {
+	return ((struct lmdb_cursor *) cursor)->cursor;
+}
+
+static int
+env_open(struct kv_env **out, const char *dir, unsigned flags,
+  size_t map_size, unsigned max_dbs) {
+	assert(dir);
+
+	const mode_t db_perms = 0600;
+	struct lmdb_env *env = malloc(sizeof(*env));
+
+	if (!env) {
+		return ENOMEM;
+	}
+
+	*env = (struct lmdb_env) {.base = {&kv_lmdb}};
+
+	int ret = mdb_env_create(&env->env);
+
+	if (ret == MDB_SUCCESS
+		&& ((ret = mdb_env_set_maxdbs(env->env, max_dbs)) != MDB_SUCCESS
+			|| (ret = mdb_env_set_mapsize(env->env, map_size))
+				 != MDB_SUCCESS
+			|| (ret = mdb_env_open(env->env, dir, flags, db_perms))
+				 != MDB_SUCCESS)) {
+		mdb_env_close(env->env);
+	}
+
+	if (ret != MDB_SUCCESS) {
+		free(env);
+		return ret;
+	}
+
+	*out = &env->base;
+
+	return MDB_SUCCESS;
+}
+
+static void
+env_close(struct kv_env *env) {
+	mdb_env_close(env_of(env));
+	free(env);
+}
+
+static int
+env_info(struct kv_env *env, struct kv_env_info *info) {
+	MDB_envinfo envinfo = {0};
+	MDB_stat db = {0};
+
+	int ret = mdb_env_info(env_of(env), &envinfo);
+
+	if (ret == MDB_SUCCESS
+		&& (ret = mdb_env_stat(env_of(env), &db)) == MDB_SUCCESS) {
+		*info = (struct kv_env_info) {
+		  .map_size = envinfo.me_mapsize,
+		  .used = (envinfo.me_last_pgno + 1) * db.ms_psize,
+		  .last_txn = envinfo.me_last_txnid,
+		};
+	}
+
+	return ret;
+}
+
+static int
+env_set_mapsize(struct kv_env *env, size_t map_size) {
+	return mdb_env_set_mapsize(env_of(env), map_size);
+}
+
+static int
+env_sync(struct kv_env *env) {
+	return mdb_env_sync(env_of(env), 1);
+}
+
+static int
+env_copy(struct kv_env *env, const char *dir) {
+	return mdb_env_copy2(env_of(env), dir, MDB_CP_COMPACT);
+}
+
+static int
+txn_begin(struct kv_env *env, unsigned flags, struct kv_txn **out) {
+	struct lmdb_txn *txn = malloc(sizeof(*txn));
+
+	if (!txn) {
+		return ENOMEM;
+	}
+
+	*txn = (struct lmdb_txn) {.base = {&kv_lmdb}};
+
+	int ret = mdb_txn_begin(env_of(env), NULL, flags, &txn->txn);
+
+	if (ret != MDB_SUCCESS) {
+		free(txn);
+		return ret;
+	}
+
+	*out = &txn->base;
+
+	return MDB_SUCCESS;
+}
+
+static int
+txn_commit(struct kv_txn *txn) {
+	int ret = mdb_txn_commit(txn_of(txn));
+	free(txn);
+
+	return ret;
+}
+
+static void
+txn_abort(struct kv_txn *txn) {
+	mdb_txn_abort(txn_of(txn));
+	free(txn);
+}
+
+static void
+txn_reset(struct kv_txn *txn) {
+	mdb_txn_reset(txn_of(txn));
+}
+
+static int
+txn_renew(struct kv_txn *txn) {
+	return mdb_txn_renew(txn_of(txn));
+}
+
+static int
+dbi_open(struct kv_txn *txn, const char *name, unsigned flags, kv_dbi *dbi) {
+	MDB_dbi mdb_dbi = 0;
+	int ret = mdb_dbi_open(txn_of(txn), name, flags, &mdb_dbi);
+
+	if (ret == MDB_SUCCESS) {
+		*dbi = mdb_dbi;
+	}
+
+	return ret;
+}
+
+static int
+drop(struct kv_txn *txn, kv_dbi dbi, bool del) {
+	return mdb_drop(txn_of(txn), dbi, del ? 1 : 0);
+}
+
+static int
+dbi_stat(struct kv_txn *txn, kv_dbi dbi, struct kv_stat *out) {
+	MDB_stat db = {0};
+	int ret = mdb_stat(txn_of(txn), dbi, &db);
+
+	if (ret == MDB_SUCCESS) {
+		*out = (struct kv_stat) {
+		  .entries = db.ms_entries,
+		  .pages
+		  = db.ms_branch_pages + db.ms_leaf_pages + db.ms_overflow_pages,
+		};
+	}
+
+	return ret;
+}
+
+static int
+get(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	return mdb_get(txn_of(txn), dbi, key, data);
+}
+
+static int
+put(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data,
+  unsigned flags) {
+	return mdb_put(txn_of(txn), dbi, key, data, flags);
+}
+
+static int
+del(struct kv_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	return mdb_del(txn_of(txn), dbi, key, data);
+}
+
+static int
+cursor_open(struct kv_txn *txn, kv_dbi dbi, struct kv_cursor **out) {
+	struct lmdb_cursor *cursor = malloc(sizeof(*cursor));
+
+	if (!cursor) {
+		return ENOMEM;
+	}
+
+	*cursor = (struct lmdb_cursor) {.base = {&kv_lmdb}};
+
+	int ret = mdb_cursor_open(txn_of(txn), dbi, &cursor->cursor);
+
+	if (ret != MDB_SUCCESS) {
+		free(cursor);
+		return ret;
+	}
+
+	*out = &cursor->base;
+
+	return MDB_SUCCESS;
+}
+
+static void
+cursor_close(struct kv_cursor *cursor) {
+	mdb_cursor_close(cursor_of(cursor));
+	free(cursor);
+}
+
+static int
+cursor_get(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, MDB_cursor_op op) {
+	return mdb_cursor_get(cursor_of(cursor), key, data, op);
+}
+
+static int
+cursor_put(
+  struct kv_cursor *cursor, MDB_val *key, MDB_val *data, unsigned flags) {
+	return mdb_cursor_put(cursor_of(cursor), key, data, flags);
+}
+
+static int
+cursor_del(struct kv_cursor *cursor, unsigned flags) {
+	return mdb_cursor_del(cursor_of(cursor), flags);
+}
+
+static int
+cursor_count(struct kv_cursor *cursor, size_t *count) {
+	return mdb_cursor_count(cursor_of(cursor), count);
+}
+
+const struct kv_ops kv_lmdb = {
+  .name = "lmdb",
+  .durable = true,
+  .concurrent_readers = true,
+  .env_open = env_open,
+  .env_close = env_close,
+  .env_info = env_info,
+  .env_set_mapsize = env_set_mapsize,
+  .env_sync = env_sync,
+  .env_copy = env_copy,
+  .txn_begin = txn_begin,
+  .txn_commit = txn_commit,
+  .txn_abort = txn_abort,
+  .txn_reset = txn_reset,
+  .txn_renew = txn_renew,
+  .dbi_open = dbi_open,
+  .drop = drop,
+  .stat = dbi_stat,
+  .get = get,
+  .put = put,
+  .del = del,
+  .cursor_open = cursor_open,
+  .cursor_close = cursor_close,
+  .cursor_get = cursor_get,
+  .cursor_put = cursor_put,
+  .cursor_del = cursor_del,
+  .cursor_count = cursor_count,
+};
@@ -0,0 +1,1248 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/kv.h"
+#include "stb_ds.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each DB is a skip list ordered like LMDB orders it, by key and then by data
+ * for MDB_DUPSORT, with every duplicate in it's own node. Write txns log their
+ * changes so that they can be undone on abort, removed nodes and replaced
+ * data are only freed on commit. */
+enum {
+	LEVEL_MAX = 24,
+	/* Same limits as LMDB's defaults, so that both reject the same keys. */
+	KEY_SIZE_MAX = 511,
+	PAGE_SIZE = 4096,
+};
+
+struct node {
+	MDB_val key;
+	MDB_val data;
+	bool removed;
+	unsigned level;
+	/* The DB's head if this is the first node. A removed node keeps the
+	 * neighbours it had, so that cursors at it can still move. */
+	struct node *prev;
+	struct node *next[];
+};
+
+struct db {
+	/* NULL once deleted by kv_drop(). */
+	char *name;
+	unsigned flags;
+	/* Sentinel with LEVEL_MAX levels and no key. */
+	struct node *head;
+	size_t entries;
+	size_t bytes;
+};
+
+struct memory_env {
+	struct kv_env base;
+	/* Guards readers and writer, txns wait on cond for them to change. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t readers;
+	bool writer;
+	size_t map_size;
+	/* Bytes taken by the nodes of all DBs. */
+	size_t used;
+	/* Number of commits that modified the env. */
+	uint64_t last_txn;
+	unsigned max_dbs;
+	unsigned num_dbs;
+	struct db *dbs;
+	/* Only used by the writer. */
+	uint64_t seed;
+};
+
+struct undo {
+	enum { UNDO_INSERT = 0, UNDO_REMOVE, UNDO_UPDATE, UNDO_NAME } type;
+	kv_dbi dbi;
+	struct node *node;
+	/* Replaced data for UNDO_UPDATE. */
+	MDB_val data;
+	/* Name of the DB before UNDO_NAME. */
+	char *name;
+};
+
+struct memory_txn {
+	struct kv_txn base;
+	struct memory_env *env;
+	bool rdonly;
+	/* Holds the env's reader or writer slot, false after a reset. */
+	bool active;
+	/* Like LMDB, a txn that failed can only be aborted. */
+	bool failed;
+	struct undo *undo;
+};
+
+struct memory_cursor {
+	struct kv_cursor base;
+	struct memory_txn *txn;
+	struct db *db;
+	/* NULL until positioned. */
+	struct node *node;
+	/* Duplicates copied by MDB_GET_MULTIPLE. */
+	unsigned char *multiple;
+};
+
+static int
+cmp_val(const MDB_val *a, const MDB_val *b) {
+	const size_t len = a->mv_size < b->mv_size ? a->mv_size : b->mv_size;
+	int ret = len > 0 ? memcmp(a->mv_data, b->mv_data, len) : 0;
+
+	if (ret == 0) {
+		ret = (a->mv_size > b->mv_size) - (a->mv_size < b->mv_size);
+	}
+
+	return ret;
+}
+
+/* MDB_INTEGERKEY keys are native unsigned ints or size_ts. */
+static int
+cmp_int(const MDB_val *a, const MDB_val *b) {
+	if (a->mv_size != b->mv_size) {
+		return cmp_val(a, b);
+	}
+
+	if (a->mv_size == sizeof(unsigned)) {
+		unsigned x = 0;
+		unsigned y = 0;
+		memcpy(&x, a->mv_data, sizeof(x));
+		memcpy(&y, b->mv_data, sizeof(y));
+
+		return (x > y) - (x < y);
+	}
+
+	if (a->mv_size == sizeof(size_t)) {
+		size_t x = 0;
+		size_t y = 0;
+		memcpy(&x, a->mv_data, sizeof(x));
+		memcpy(&y, b->mv_data, sizeof(y));
+
+		return (x > y) - (x < y);
+	}
+
+	return cmp_val(a, b);
+}
+
+static int
+cmp_key(const struct db *db, const MDB_val *a, const MDB_val *b) {
+	return (db->flags & MDB_INTEGERKEY) ? cmp_int(a, b) : cmp_val(a, b);
+}
+
+/* data is only compared for MDB_DUPSORT, and not at all if NULL. */
+static int
+cmp_node(const struct db *db, const struct node *node, const MDB_val *key,
+  const MDB_val *data) {
+	int ret = cmp_key(db, &node->key, key);
+
+	if (ret == 0 && data && (db->flags & MDB_DUPSORT)) {
+		ret = cmp_val(&node->data, data);
+	}
+
+	return ret;
+}
+
+static bool
+same_key(const struct db *db, const struct node *a, const struct node *b) {
+	return a && b && cmp_key(db, &a->key, &b->key) == 0;
+}
+
+static size_t
+node_size(const struct node *node) {
+	return sizeof(*node) + (node->level * sizeof(node->next[0]))
+		 + node->key.mv_size + node->data.mv_size;
+}
+
+static unsigned
+random_level(struct memory_env *env) {
+	/* xorshift64 */
+	env->seed ^= env->seed << 13;
+	env->seed ^= env->seed >> 7;
+	env->seed ^= env->seed << 17;
+
+	uint64_t bits = env->seed;
+	unsigned level = 1;
+
+	/* Each level has a quarter of the nodes of the one below. */
+	while (level < LEVEL_MAX && (bits & 3) == 0) {
+		level++;
+		bits >>= 2;
+	}
+
+	return level;
+}
+
+static struct node *
+node_new(const MDB_val *key, size_t data_size, unsigned level) {
+	struct node *node
+	  = malloc(sizeof(*node) + (level * sizeof(node->next[0])) + key->mv_size);
+
+	if (!node) {
+		return NULL;
+	}
+
+	*node = (struct node) {
+	  .key = {key->mv_size, &node->next[level]},
+	  /* Never NULL, even for empty data. */
+	  .data = {data_size, malloc(data_size > 0 ? data_size : 1)},
+	  .level = level,
+	};
+
+	if (!node->data.mv_data) {
+		free(node);
+		return NULL;
+	}
+
+	memset(node->next, 0, level * sizeof(node->next[0]));
+
+	if (key->mv_size > 0) {
+		memcpy(node->key.mv_data, key->mv_data, key->mv_size);
+	}
+
+	return node;
+}
+
+static void
+node_free(struct node *node) {
+	if (node) {
+		free(node->data.mv_data);
+		free(node);
+	}
+}
+
+/* Fills update (if not NULL) with the last node before (key, data) at each
+ * level, returns the first node at or after it. */
+static struct node *
+seek(const struct db *db, const MDB_val *key, const MDB_val *data,
+  struct node *update[LEVEL_MAX]) {
+	struct node *node = db->head;
+
+	for (unsigned i = LEVEL_MAX; i-- > 0;) {
+		while (node->next[i] && cmp_node(db, node->next[i], key, data) < 0) {
+			node = node->next[i];
+		}
+
+		if (update) {
+			update[i] = node;
+		}
+	}
+
+	return node->next[0];
+}
+
+/* First node of the key, NULL if there is none. */
+static struct node *
+seek_key(const struct db *db, const MDB_val *key) {
+	struct node *node = seek(db, key, NULL, NULL);
+
+	return (node && cmp_key(db, &node->key, key) == 0) ? node : NULL;
+}
+
+static struct node *
+last_node(const struct db *db) {
+	struct node *node = db->head;
+
+	for (unsigned i = LEVEL_MAX; i-- > 0;) {
+		while (node->next[i]) {
+			node = node->next[i];
+		}
+	}
+
+	return node == db->head ? NULL : node;
+}
+
+static struct node *
+next_live(const struct node *node) {
+	struct node *next = node->next[0];
+
+	while (next && next->removed) {
+		next = next->next[0];
+	}
+
+	return next;
+}
+
+static struct node *
+prev_live(const struct db *db, const struct node *node) {
+	struct node *prev = node->prev;
+
+	while (prev != db->head && prev->removed) {
+		prev = prev->prev;
+	}
+
+	return prev == db->head ? NULL : prev;
+}
+
+static void
+link_node(struct memory_env *env, struct db *db, struct node *node) {
+	struct node *update[LEVEL_MAX];
+	struct node *next = seek(db, &node->key, &node->data, update);
+
+	for (unsigned i = 0; i < node->level; i++) {
+		node->next[i] = update[i]->next[i];
+		update[i]->next[i] = node;
+	}
+
+	node->prev = update[0];
+	node->removed = false;
+
+	if (next) {
+		next->prev = node;
+	}
+
+	db->entries++;
+	db->bytes += node_size(node);
+	env->used += node_size(node);
+}
+
+static void
+unlink_node(struct memory_env *env, struct db *db, struct node *node) {
+	struct node *update[LEVEL_MAX];
+	seek(db, &node->key, &node->data, update);
+
+	for (unsigned i = 0; i < node->level; i++) {
+		assert(update[i]->next[i] == node);
+		update[i]->next[i] = node->next[i];
+	}
+
+	if (node->next[0]) {
+		node->next[0]->prev = node->prev;
+	}
+
+	node->removed = true;
+
+	db->entries--;
+	db->bytes -= node_size(node);
+	env->used -= node_size(node);
+}
+
+static void
+lock_read(struct memory_env *env) {
+	pthread_mutex_lock(&env->mutex);
+
+	while (env->writer) {
+		pthread_cond_wait(&env->cond, &env->mutex);
+	}
+
+	env->readers++;
+
+	pthread_mutex_unlock(&env->mutex);
+}
+
+static void
+lock_write(struct memory_env *env) {
+	pthread_mutex_lock(&env->mutex);
+
+	while (env->writer || env->readers > 0) {
+		pthread_cond_wait(&env->cond, &env->mutex);
+	}
+
+	env->writer = true;
+
+	pthread_mutex_unlock(&env->mutex);
+}
+
+static void
+unlock(struct memory_env *env, bool rdonly) {
+	pthread_mutex_lock(&env->mutex);
+
+	if (rdonly) {
+		assert(env->readers > 0);
+		env->readers--;
+	} else {
+		env->writer = false;
+	}
+
+	pthread_cond_broadcast(&env->cond);
+	pthread_mutex_unlock(&env->mutex);
+}
+
+static int
+env_open(struct kv_env **out, const char *dir, unsigned flags,
+  size_t map_size, unsigned max_dbs) {
+	(void) dir;
+	(void) flags;
+
+	struct memory_env *env = malloc(sizeof(*env));
+
+	if (!env) {
+		return ENOMEM;
+	}
+
+	*env = (struct memory_env) {
+	  .base = {&kv_memory},
+	  .map_size = map_size,
+	  .max_dbs = max_dbs,
+	  .dbs = calloc(max_dbs, sizeof(*env->dbs)),
+	  .seed = 0x9E3779B97F4A7C15,
+	};
+
+	if (!env->dbs) {
+		free(env);
+		return ENOMEM;
+	}
+
+	if ((pthread_mutex_init(&env->mutex, NULL)) != 0) {
+		free(env->dbs);
+		free(env);
+		return ENOMEM;
+	}
+
+	if ((pthread_cond_init(&env->cond, NULL)) != 0) {
+		pthread_mutex_destroy(&env->mutex);
+		free(env->dbs);
+		free(env);
+		return ENOMEM;
+	}
+
+	*out = &env->base;
+
+	return MDB_SUCCESS;
+}
+
+static void
+env_close(struct kv_env *base) {
+	struct memory_env *env = (struct memory_env *) base;
+
+	assert(!env->writer);
+	assert(env->readers == 0);
+
+	for (unsigned i = 0; i < env->num_dbs; i++) {
+		for (struct node *node = env->dbs[i].head, *next = NULL; node;
+			 node = next) {
+			next = node->next[0];
+			node_free(node);
+		}
+
+		free(env->dbs[i].name);
+	}
+
+	pthread_cond_destroy(&env->cond);
+	pthread_mutex_destroy(&env->mutex);
+	free(env->dbs);
+	free(env);
+}
+
+static int
+env_info(struct kv_env *base, struct kv_env_info *info) {
+	struct memory_env *env = (struct memory_env *) base;
+
+	pthread_mutex_lock(&env->mutex);
+	*info = (struct kv_env_info) {
+	  .map_size = env->map_size,
+	  .used = env->used,
+	  .last_txn = env->last_txn,
+	};
+	pthread_mutex_unlock(&env->mutex);
+
+	return MDB_SUCCESS;
+}
+
+static int
+env_set_mapsize(struct kv_env *base, size_t map_size) {
+	struct memory_env *env = (struct memory_env *) base;
+
+	pthread_mutex_lock(&env->mutex);
+	env->map_size = map_size;
+	pthread_mutex_unlock(&env->mutex);
+
+	return MDB_SUCCESS;
+}
+
+static int
+env_sync(struct kv_env *env) {
+	(void) env;
+
+	return MDB_SUCCESS;
+}
+
+static int
+txn_begin(struct kv_env *base, unsigned flags, struct kv_txn **out) {
+	struct memory_env *env = (struct memory_env *) base;
+	struct memory_txn *txn = malloc(sizeof(*txn));
+
+	if (!txn) {
+		return ENOMEM;
+	}
+
+	*txn = (struct memory_txn) {
+	  .base = {&kv_memory},
+	  .env = env,
+	  .rdonly = (flags & MDB_RDONLY),
+	  .active = true,
+	};
+
+	if (txn->rdonly) {
+		lock_read(env);
+	} else {
+		lock_write(env);
+	}
+
+	*out = &txn->base;
+
+	return MDB_SUCCESS;
+}
+
+/* Apply the undo log in reverse to abort, or free what it kept alive to
+ * commit. */
+static void
+txn_finish(struct memory_txn *txn, bool commit) {
+	struct memory_env *env = txn->env;
+
+	for (size_t i = 0, len = arrlenu(txn->undo); i < len; i++) {
+		struct undo *undo = &txn->undo[commit ? i : len - i - 1];
+		struct db *db = &env->dbs[undo->dbi];
+
+		switch (undo->type) {
+		case UNDO_INSERT:
+			if (!commit) {
+				unlink_node(env, db, undo->node);
+				node_free(undo->node);
+			}
+			break;
+		case UNDO_REMOVE:
+			if (commit) {
+				node_free(undo->node);
+			} else {
+				link_node(env, db, undo->node);
+			}
+			break;
+		case UNDO_UPDATE:
+			if (commit) {
+				free(undo->data.mv_data);
+			} else {
+				db->bytes -= undo->node->data.mv_size;
+				env->used -= undo->node->data.mv_size;
+
+				free(undo->node->data.mv_data);
+				undo->node->data = undo->data;
+
+				db->bytes += undo->node->data.mv_size;
+				env->used += undo->node->data.mv_size;
+			}
+			break;
+		case UNDO_NAME:
+			if (commit) {
+				free(undo->name);
+			} else {
+				free(db->name);
+				db->name = undo->name;
+			}
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+	if (commit && arrlenu(txn->undo) > 0) {
+		env->last_txn++;
+	}
+
+	arrfree(txn->undo);
+}
+
+static void
+txn_abort(struct kv_txn *base) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	if (txn->active) {
+		if (!txn->rdonly) {
+			txn_finish(txn, false);
+		}
+
+		unlock(txn->env, txn->rdonly);
+	}
+
+	free(txn);
+}
+
+static int
+txn_commit(struct kv_txn *base) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	if (txn->failed) {
+		txn_abort(base);
+		return MDB_BAD_TXN;
+	}
+
+	if (txn->active) {
+		if (!txn->rdonly) {
+			txn_finish(txn, true);
+		}
+
+		unlock(txn->env, txn->rdonly);
+	}
+
+	free(txn);
+
+	return MDB_SUCCESS;
+}
+
+static void
+txn_reset(struct kv_txn *base) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	assert(txn->rdonly);
+
+	if (txn->active) {
+		unlock(txn->env, true);
+		txn->active = false;
+	}
+}
+
+static int
+txn_renew(struct kv_txn *base) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	if (!txn->rdonly || txn->active) {
+		return EINVAL;
+	}
+
+	lock_read(txn->env);
+	txn->active = true;
+
+	return MDB_SUCCESS;
+}
+
+static int
+check_txn(const struct memory_txn *txn, kv_dbi dbi, bool write) {
+	if (!txn->active || txn->failed) {
+		return MDB_BAD_TXN;
+	}
+
+	if (write && txn->rdonly) {
+		return EACCES;
+	}
+
+	if (dbi >= txn->env->num_dbs || !txn->env->dbs[dbi].name) {
+		return EINVAL;
+	}
+
+	return MDB_SUCCESS;
+}
+
+static void
+log_undo(struct memory_txn *txn, const struct undo *undo) {
+	arrput(txn->undo, *undo);
+}
+
+static int
+dbi_open(struct kv_txn *base, const char *name, unsigned flags, kv_dbi *dbi) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+	struct memory_env *env = txn->env;
+
+	assert(name);
+
+	if (!txn->active || txn->failed) {
+		return MDB_BAD_TXN;
+	}
+
+	for (unsigned i = 0; i < env->num_dbs; i++) {
+		if (env->dbs[i].name && strcmp(env->dbs[i].name, name) == 0) {
+			*dbi = i;
+			return MDB_SUCCESS;
+		}
+	}
+
+	if (!(flags & MDB_CREATE)) {
+		return MDB_NOTFOUND;
+	}
+
+	if (txn->rdonly) {
+		return EACCES;
+	}
+
+	if (env->num_dbs == env->max_dbs) {
+		return MDB_DBS_FULL;
+	}
+
+	/* Not undone on abort, like the handles LMDB keeps open. */
+	struct db *db = &env->dbs[env->num_dbs];
+	*db = (struct db) {
+	  .name = strdup(name),
+	  .flags = flags & (MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERKEY),
+	  .head = node_new(&(MDB_val) {0}, 0, LEVEL_MAX),
+	};
+
+	if (!db->name || !db->head) {
+		free(db->name);
+		node_free(db->head);
+		*db = (struct db) {0};
+		return ENOMEM;
+	}
+
+	*dbi = env->num_dbs++;
+
+	return MDB_SUCCESS;
+}
+
+static void
+remove_node(struct memory_txn *txn, kv_dbi dbi, struct node *node) {
+	log_undo(
+	  txn, &(struct undo) {.type = UNDO_REMOVE, .dbi = dbi, .node = node});
+	unlink_node(txn->env, &txn->env->dbs[dbi], node);
+}
+
+static int
+drop(struct kv_txn *base, kv_dbi dbi, bool del) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	int ret = check_txn(txn, dbi, true);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct db *db = &txn->env->dbs[dbi];
+
+	for (struct node *node = db->head->next[0], *next = NULL; node;
+		 node = next) {
+		next = node->next[0];
+		remove_node(txn, dbi, node);
+	}
+
+	if (del) {
+		log_undo(txn,
+		  &(struct undo) {.type = UNDO_NAME, .dbi = dbi, .name = db->name});
+		db->name = NULL;
+	}
+
+	return MDB_SUCCESS;
+}
+
+static int
+dbi_stat(struct kv_txn *base, kv_dbi dbi, struct kv_stat *stat) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	int ret = check_txn(txn, dbi, false);
+
+	if (ret == MDB_SUCCESS) {
+		const struct db *db = &txn->env->dbs[dbi];
+
+		*stat = (struct kv_stat) {
+		  .entries = db->entries,
+		  .pages = (db->bytes + PAGE_SIZE - 1) / PAGE_SIZE,
+		};
+	}
+
+	return ret;
+}
+
+static int
+get(struct kv_txn *base, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	int ret = check_txn(txn, dbi, false);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct node *node = seek_key(&txn->env->dbs[dbi], key);
+
+	if (!node) {
+		return MDB_NOTFOUND;
+	}
+
+	*data = node->data;
+
+	return MDB_SUCCESS;
+}
+
+/* Same as LMDB, MDB_APPEND fails unless the key sorts after every other key,
+ * even with MDB_APPENDDUP. MDB_APPENDDUP fails unless the data sorts after
+ * every other duplicate of the key, if it exists. */
+static bool
+appends(const struct db *db, const MDB_val *key, const MDB_val *data,
+  unsigned flags) {
+	if (flags & MDB_APPEND) {
+		const struct node *last = last_node(db);
+
+		if (last && cmp_key(db, &last->key, key) >= 0) {
+			return false;
+		}
+	}
+
+	if ((db->flags & MDB_DUPSORT) && (flags & MDB_APPENDDUP)) {
+		const struct node *last = seek_key(db, key);
+
+		while (last && same_key(db, last, last->next[0])) {
+			last = last->next[0];
+		}
+
+		if (last && cmp_val(&last->data, data) >= 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int
+put_node(struct memory_txn *txn, kv_dbi dbi, MDB_val *key, MDB_val *data,
+  unsigned flags, struct node **out) {
+	int ret = check_txn(txn, dbi, true);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct memory_env *env = txn->env;
+	struct db *db = &env->dbs[dbi];
+	const bool dupsort = db->flags & MDB_DUPSORT;
+
+	if (key->mv_size == 0 || key->mv_size > KEY_SIZE_MAX
+		|| (dupsort && data->mv_size > KEY_SIZE_MAX)) {
+		return MDB_BAD_VALSIZE;
+	}
+
+	if ((flags & (MDB_APPEND | MDB_APPENDDUP))
+		&& !appends(db, key, data, flags)) {
+		return MDB_KEYEXIST;
+	}
+
+	struct node *node = seek_key(db, key);
+
+	if (node && (flags & MDB_NOOVERWRITE)) {
+		*data = node->data;
+		return MDB_KEYEXIST;
+	}
+
+	if (node && dupsort) {
+		node = seek(db, key, data, NULL);
+
+		/* Duplicates are only stored once. */
+		if (node && cmp_node(db, node, key, data) == 0) {
+			*out = node;
+			return (flags & MDB_NODUPDATA) ? MDB_KEYEXIST : MDB_SUCCESS;
+		}
+
+		node = NULL;
+	}
+
+	const bool insert = !node;
+	const unsigned level = insert ? random_level(env) : 0;
+	const size_t new_size
+	  = !insert ? data->mv_size
+			 : sizeof(*node) + (level * sizeof(node->next[0])) + key->mv_size
+				 + data->mv_size;
+
+	if (new_size > env->map_size || env->used > env->map_size - new_size) {
+		txn->failed = true;
+		return MDB_MAP_FULL;
+	}
+
+	if (!insert) {
+		void *buf = malloc(data->mv_size > 0 ? data->mv_size : 1);
+
+		if (!buf) {
+			txn->failed = true;
+			return ENOMEM;
+		}
+
+		log_undo(txn, &(struct undo) {.type = UNDO_UPDATE,
+						.dbi = dbi,
+						.node = node,
+						.data = node->data});
+
+		db->bytes += data->mv_size - node->data.mv_size;
+		env->used += data->mv_size - node->data.mv_size;
+		node->data = (MDB_val) {data->mv_size, buf};
+	} else {
+		if (!(node = node_new(key, data->mv_size, level))) {
+			txn->failed = true;
+			return ENOMEM;
+		}
+
+		log_undo(txn,
+		  &(struct undo) {.type = UNDO_INSERT, .dbi = dbi, .node = node});
+	}
+
+	if (flags & MDB_RESERVE) {
+		data->mv_data = node->data.mv_data;
+	} else if (data->mv_size > 0) {
+		memcpy(node->data.mv_data, data->mv_data, data->mv_size);
+	}
+
+	/* Linked once the data is in place, as it's part of the order. */
+	if (insert) {
+		link_node(env, db, node);
+	}
+
+	*out = node;
+
+	return MDB_SUCCESS;
+}
+
+static int
+put(struct kv_txn *base, kv_dbi dbi, MDB_val *key, MDB_val *data,
+  unsigned flags) {
+	struct node *node = NULL;
+
+	return put_node((struct memory_txn *) base, dbi, key, data, flags, &node);
+}
+
+static int
+del(struct kv_txn *base, kv_dbi dbi, MDB_val *key, MDB_val *data) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	int ret = check_txn(txn, dbi, true);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct db *db = &txn->env->dbs[dbi];
+	struct node *node = seek_key(db, key);
+
+	if (node && data && (db->flags & MDB_DUPSORT)) {
+		node = seek(db, key, data, NULL);
+
+		if (!node || cmp_node(db, node, key, data) != 0) {
+			return MDB_NOTFOUND;
+		}
+
+		remove_node(txn, dbi, node);
+		return MDB_SUCCESS;
+	}
+
+	if (!node) {
+		return MDB_NOTFOUND;
+	}
+
+	/* Every duplicate of the key. */
+	for (struct node *next = NULL; node; node = next) {
+		next = next_live(node);
+		next = same_key(db, node, next) ? next : NULL;
+
+		remove_node(txn, dbi, node);
+	}
+
+	return MDB_SUCCESS;
+}
+
+static int
+cursor_open(struct kv_txn *base, kv_dbi dbi, struct kv_cursor **out) {
+	struct memory_txn *txn = (struct memory_txn *) base;
+
+	int ret = check_txn(txn, dbi, false);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	struct memory_cursor *cursor = malloc(sizeof(*cursor));
+
+	if (!cursor) {
+		return ENOMEM;
+	}
+
+	*cursor = (struct memory_cursor) {
+	  .base = {&kv_memory},
+	  .txn = txn,
+	  .db = &txn->env->dbs[dbi],
+	};
+
+	*out = &cursor->base;
+
+	return MDB_SUCCESS;
+}
+
+static void
+cursor_close(struct kv_cursor *base) {
+	struct memory_cursor *cursor = (struct memory_cursor *) base;
+
+	arrfree(cursor->multiple);
+	free(cursor);
+}
+
+/* Copy the duplicates from the cursor's node onwards, leaving the cursor at
+ * the last one like LMDB does with a page of them. */
+static int
+get_multiple(struct memory_cursor *cursor, MDB_val *data) {
+	struct node *node = cursor->node;
+
+	if (!(cursor->db->flags & MDB_DUPFIXED)) {
+		return EINVAL;
+	}
+
+	arrsetlen(cursor->multiple, 0);
+
+	for (struct node *next = node; same_key(cursor->db, node, next);
+		 next = next_live(next)) {
+		memcpy(arraddnptr(cursor->multiple, next->data.mv_size),
+		  next->data.mv_data, next->data.mv_size);
+		cursor->node = next;
+	}
+
+	*data = (MDB_val) {arrlenu(cursor->multiple), cursor->multiple};
+
+	return MDB_SUCCESS;
+}
+
+static int
+get_current(struct memory_cursor *cursor, MDB_val *key, MDB_val *data) {
+	if (!cursor->node) {
+		return EINVAL;
+	}
+
+	/* A deleted node is replaced by the one after it. */
+	const struct node *node
+	  = cursor->node->removed ? next_live(cursor->node) : cursor->node;
+
+	if (!node) {
+		return MDB_NOTFOUND;
+	}
+
+	*key = node->key;
+	*data = node->data;
+
+	return MDB_SUCCESS;
+}
+
+/* Position the cursor at a node found by the op. */
+static struct node *
+cursor_move(struct memory_cursor *cursor, MDB_val *key, MDB_val *data,
+  MDB_cursor_op op) {
+	const struct db *db = cursor->db;
+	struct node *node = cursor->node;
+
+	switch (op) {
+	case MDB_FIRST:
+		return db->head->next[0];
+	case MDB_LAST:
+		return last_node(db);
+	case MDB_NEXT:
+		return node ? next_live(node) : db->head->next[0];
+	case MDB_PREV:
+		return node ? prev_live(db, node) : last_node(db);
+	case MDB_NEXT_DUP:
+		return (node && same_key(db, node, next_live(node))) ? next_live(node)
+															 : NULL;
+	case MDB_PREV_DUP:
+		return (node && same_key(db, node, prev_live(db, node)))
+				 ? prev_live(db, node)
+				 : NULL;
+	case MDB_NEXT_NODUP:
+		if (!node) {
+			return db->head->next[0];
+		}
+
+		while (same_key(db, node, next_live(node))) {
+			node = next_live(node);
+		}
+
+		return next_live(node);
+	case MDB_PREV_NODUP:
+		if (!node) {
+			return last_node(db);
+		}
+
+		return prev_live(db, seek_key(db, &node->key));
+	case MDB_FIRST_DUP:
+		return node ? seek_key(db, &node->key) : NULL;
+	case MDB_LAST_DUP:
+		while (same_key(db, node, next_live(node))) {
+			node = next_live(node);
+		}
+
+		return node;
+	case MDB_SET:
+	case MDB_SET_KEY:
+		return seek_key(db, key);
+	case MDB_SET_RANGE:
+		return seek(db, key, NULL, NULL);
+	case MDB_GET_BOTH:
+	case MDB_GET_BOTH_RANGE:
+		if (db->flags & MDB_DUPSORT) {
+			node = seek(db, key, data, NULL);
+
+			return (node && cmp_key(db, &node->key, key) == 0
+					 && (op == MDB_GET_BOTH_RANGE
+						 || cmp_val(&node->data, data) == 0))
+					 ? node
+					 : NULL;
+		}
+
+		node = seek_key(db, key);
+
+		return (node
+				 && (op == MDB_GET_BOTH ? cmp_val(&node->data, data) == 0
+										: cmp_val(&node->data, data) >= 0))
+				 ? node
+				 : NULL;
+	default:
+		return NULL;
+	}
+}
+
+static int
+cursor_get(struct kv_cursor *base, MDB_val *key, MDB_val *data,
+  MDB_cursor_op op) {
+	struct memory_cursor *cursor = (struct memory_cursor *) base;
+
+	if (!cursor->txn->active || cursor->txn->failed) {
+		return MDB_BAD_TXN;
+	}
+
+	switch (op) {
+	case MDB_GET_CURRENT:
+		return get_current(cursor, key, data);
+	case MDB_GET_MULTIPLE:
+		if (!cursor->node || cursor->node->removed) {
+			return EINVAL;
+		}
+
+		return get_multiple(cursor, data);
+	case MDB_NEXT_MULTIPLE:
+		if (!(cursor->db->flags & MDB_DUPFIXED)) {
+			return EINVAL;
+		}
+
+		if (!(cursor->node = cursor_move(cursor, key, data, MDB_NEXT_DUP))) {
+			return MDB_NOTFOUND;
+		}
+
+		*key = cursor->node->key;
+
+		return get_multiple(cursor, data);
+	case MDB_FIRST_DUP:
+	case MDB_LAST_DUP:
+	case MDB_NEXT_DUP:
+	case MDB_PREV_DUP:
+		if (!cursor->node) {
+			return EINVAL;
+		}
+		break;
+	case MDB_GET_BOTH:
+	case MDB_GET_BOTH_RANGE:
+	case MDB_SET:
+	case MDB_SET_KEY:
+	case MDB_SET_RANGE:
+		if (key->mv_size == 0 || key->mv_size > KEY_SIZE_MAX) {
+			return MDB_BAD_VALSIZE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	struct node *node = cursor_move(cursor, key, data, op);
+
+	if (!node) {
+		/* Moving past the ends keeps the position, failed lookups don't. */
+		if (op != MDB_NEXT && op != MDB_PREV && op != MDB_NEXT_DUP
+			&& op != MDB_PREV_DUP && op != MDB_NEXT_NODUP
+			&& op != MDB_PREV_NODUP) {
+			cursor->node = NULL;
+		}
+
+		return MDB_NOTFOUND;
+	}
+
+	cursor->node = node;
+
+	/* MDB_SET only returns the data. */
+	if (op != MDB_SET) {
+		*key = node->key;
+	}
+
+	*data = node->data;
+
+	return MDB_SUCCESS;
+}
+
+static int
+cursor_put(
+  struct kv_cursor *base, MDB_val *key, MDB_val *data, unsigned flags) {
+	struct memory_cursor *cursor = (struct memory_cursor *) base;
+	struct node *node = NULL;
+
+	int ret = put_node(cursor->txn,
+	  (kv_dbi) (cursor->db - cursor->txn->env->dbs), key, data, flags, &node);
+
+	if (ret == MDB_SUCCESS) {
+		cursor->node = node;
+	}
+
+	return ret;
+}
+
+static int
+cursor_del(struct kv_cursor *base, unsigned flags) {
+	struct memory_cursor *cursor = (struct memory_cursor *) base;
+	const kv_dbi dbi = (kv_dbi) (cursor->db - cursor->txn->env->dbs);
+
+	int ret = check_txn(cursor->txn, dbi, true);
+
+	if (ret != MDB_SUCCESS) {
+		return ret;
+	}
+
+	if (!cursor->node || cursor->node->removed) {
+		return EINVAL;
+	}
+
+	if ((flags & MDB_NODUPDATA) && (cursor->db->flags & MDB_DUPSORT)) {
+		return del(&cursor->txn->base, dbi, &cursor->node->key, NULL);
+	}
+
+	remove_node(cursor->txn, dbi, cursor->node);
+
+	return MDB_SUCCESS;
+}
+
+static int
+cursor_count(struct kv_cursor *base, size_t *count) {
+	struct memory_cursor *cursor = (struct memory_cursor *) base;
+
+	if (!cursor->node || cursor->node->removed) {
+		return EINVAL;
+	}
+
+	*count = 0;
+
+	for (struct node *node = seek_key(cursor->db, &cursor->node->key);
+		 same_key(cursor->db, node, cursor->node); node = next_live(node)) {
+		(*count)++;
+	}
+
+	return MDB_SUCCESS;
+}
+
+const struct kv_ops kv_memory = {
+  .name = "memory",
+  .durable = false,
+  .concurrent_readers = false,
+  .env_open = env_open,
+  .env_close = env_close,
+  .env_info = env_info,
+  .env_set_mapsize = env_set_mapsize,
+  .env_sync = env_sync,
+  .env_copy = NULL,
+  .txn_begin = txn_begin,
+  .txn_commit = txn_commit,
+  .txn_abort = txn_abort,
+  .txn_reset = txn_reset,
+  .txn_renew = txn_renew,
+  .dbi_open = dbi_open,
+  .drop = drop,
+  .stat = dbi_stat,
+  .get = get,
+  .put = put,
+  .del = del,
+  .cursor_open = cursor_open,
+  .cursor_close = cursor_close,
+  .cursor_get = cursor_get,
+  .cursor_put = cursor_put,
+  .cursor_del = cursor_del,
+  .cursor_count = cursor_count,
+};
@@ -0,0 +1,121 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/room_summary.h"
+
+#include <assert.h>
+#include <string.h>
+
+enum {
+	OFFSET_VERSION = 0,
+	OFFSET_FLAGS = 1,
+	OFFSET_MEMBER_COUNT = 4,
+	OFFSET_LAST_ACTIVITY_TS = 8,
+	OFFSET_LAST_INDEX = 16,
+	HEADER_SIZE = 24,
+};
+
+/* Length stored in the record, including the NUL terminator. */
+static uint32_t
+field_len(const char *field) {
+	if (!field) {
+		return 0;
+	}
+
+	size_t len = strlen(field) + 1;
+	assert(len <= UINT32_MAX);
+
+	return (uint32_t) len;
+}
+
+size_t
+room_summary_size(const struct room_summary *summary) {
+	assert(summary);
+
+	size_t size = HEADER_SIZE;
+
+	for (size_t i = 0; i < ROOM_SUMMARY_FIELD_MAX; i++) {
+		size += sizeof(uint32_t) + field_len(summary->fields[i]);
+	}
+
+	return size;
+}
+
+void
+room_summary_write(const struct room_summary *summary, void *buf) {
+	assert(summary);
+	assert(buf);
+
+	unsigned char *out = buf;
+
+	memset(out, 0, HEADER_SIZE);
+	out[OFFSET_VERSION] = ROOM_SUMMARY_VERSION;
+	out[OFFSET_FLAGS] = (unsigned char) summary->flags;
+	memcpy(&out[OFFSET_MEMBER_COUNT], &summary->member_count,
+	  sizeof(summary->member_count));
+	memcpy(&out[OFFSET_LAST_ACTIVITY_TS], &summary->last_activity_ts,
+	  sizeof(summary->last_activity_ts));
+	memcpy(&out[OFFSET_LAST_INDEX], &summary->last_index,
+	  sizeof(summary->last_index));
+
+	size_t offset = HEADER_SIZE;
+
+	for (size_t i = 0; i < ROOM_SUMMARY_FIELD_MAX; i++) {
+		uint32_t len = field_len(summary->fields[i]);
+
+		memcpy(&out[offset], &len, sizeof(len));
+		offset += sizeof(len);
+
+		if (len > 0) {
+			memcpy(&out[offset], summary->fields[i], len);
+			offset += len;
+		}
+	}
+}
+
+int
+room_summary_decode(const void *buf, size_t len, struct room_summary *summary) {
+	assert(summary);
+
+	const unsigned char *in = buf;
+
+	if (!in || len < HEADER_SIZE
+		|| in[OFFSET_VERSION] != ROOM_SUMMARY_VERSION) {
+		return -1;
+	}
+
+	*summary = (struct room_summary) {.flags = in[OFFSET_FLAGS]};
+
+	memcpy(&summary->member_count, &in[OFFSET_MEMBER_COUNT],
+	  sizeof(summary->member_count));
+	memcpy(&summary->last_activity_ts, &in[OFFSET_LAST_ACTIVITY_TS],
+	  sizeof(summary->last_activity_ts));
+	memcpy(&summary->last_index, &in[OFFSET_LAST_INDEX],
+	  sizeof(summary->last_index));
+
+	size_t offset = HEADER_SIZE;
+
+	for (size_t i = 0; i < ROOM_SUMMARY_FIELD_MAX; i++) {
+		uint32_t field_size = 0;
+
+		if ((len - offset) < sizeof(field_size)) {
+			return -1;
+		}
+
+		memcpy(&field_size, &in[offset], sizeof(field_size));
+		offset += sizeof(field_size);
+
+		if (field_size == 0) {
+			continue;
+		}
+
+		if ((len - offset) < field_size
+			|| in[offset + field_size - 1] != '\0') {
+			return -1;
+		}
+
+		summary->fields[i] = (char *) (uintptr_t) &in[offset];
+		offset += field_size;
+	}
+
+	return offset == len ? 0 : -1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Summary of a room stored in DB_ROOMS, kept up to date as events are saved
+ * so that the room list can be loaded without parsing any state events.
+ * Layout:
+ *
+ * [u8 version][u8 flags][u16 padding][u32 member count]
+ * [u64 last activity ts][u64 last event index]
+ * ROOM_SUMMARY_FIELD_MAX * [u32 length][length bytes]
+ *
+ * Strings are stored with their NUL terminator, a length of 0 means NULL. */
+enum { ROOM_SUMMARY_VERSION = 1 };
+
+enum room_summary_flags {
+	ROOM_SUMMARY_IS_SPACE = 1 << 0,
+	ROOM_SUMMARY_INVITE = 1 << 1,
+};
+
+enum room_summary_field {
+	/* m.room.name */
+	ROOM_SUMMARY_NAME = 0,
+	/* m.room.canonical_alias, shown if there is no name. */
+	ROOM_SUMMARY_ALIAS,
+	/* m.room.topic */
+	ROOM_SUMMARY_TOPIC,
+	ROOM_SUMMARY_FIELD_MAX
+};
+
+struct room_summary {
+	unsigned flags;
+	uint32_t member_count;
+	/* origin_server_ts of the latest timeline event. */
+	uint64_t last_activity_ts;
+	/* Index of the latest event in ROOM_DB_EVENTS. */
+	uint64_t last_index;
+	char *fields[ROOM_SUMMARY_FIELD_MAX];
+};
+
+size_t
+room_summary_size(const struct room_summary *summary);
+/* buf must be atleast room_summary_size() bytes. */
+void
+room_summary_write(const struct room_summary *summary, void *buf);
+/* Strings in *summary point into buf, so it must outlive the summary. */
+int
+room_summary_decode(const void *buf, size_t len, struct room_summary *summary);
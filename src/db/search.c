@@ -0,0 +1,105 @@
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include "db/search.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdbool.h>
+
+enum {
+	TS_SIZE = sizeof(uint64_t),
+	ROOM_SIZE = sizeof(uint32_t),
+	INDEX_SIZE = sizeof(uint64_t),
+};
+
+static bool
+is_token_char(unsigned char c) {
+	return c >= 0x80 || isalnum(c);
+}
+
+size_t
+search_token_next(const char **text, char token[SEARCH_TOKEN_MAX + 1]) {
+	assert(text);
+	assert(token);
+
+	const unsigned char *p = (const unsigned char *) *text;
+
+	for (;;) {
+		while (*p && !is_token_char(*p)) {
+			p++;
+		}
+
+		if (!*p) {
+			*text = (const char *) p;
+			return 0;
+		}
+
+		size_t len = 0;
+
+		for (; *p && is_token_char(*p); p++) {
+			if (len < SEARCH_TOKEN_MAX) {
+				token[len++] = (char) (*p < 0x80 ? tolower(*p) : *p);
+			}
+		}
+
+		/* Don't end with a partial UTF-8 sequence if it was truncated. */
+		if (len == SEARCH_TOKEN_MAX) {
+			while (len > 0 && ((unsigned char) token[len - 1] & 0xC0) == 0x80) {
+				len--;
+			}
+
+			if (len > 0 && ((unsigned char) token[len - 1]) >= 0xC0) {
+				len--;
+			}
+		}
+
+		token[len] = '\0';
+
+		if (len >= SEARCH_TOKEN_MIN) {
+			*text = (const char *) p;
+			return len;
+		}
+	}
+}
+
+static void
+write_be(unsigned char *buf, uint64_t num, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		buf[len - i - 1] = (unsigned char) (num >> (i * CHAR_BIT));
+	}
+}
+
+static uint64_t
+read_be(const unsigned char *buf, size_t len) {
+	uint64_t num = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		num = (num << CHAR_BIT) | buf[i];
+	}
+
+	return num;
+}
+
+void
+search_posting_write(unsigned char posting[SEARCH_POSTING_SIZE], uint64_t ts,
+  uint32_t room, uint64_t index) {
+	assert(posting);
+
+	write_be(posting, ts, TS_SIZE);
+	write_be(&posting[TS_SIZE], room, ROOM_SIZE);
+	write_be(&posting[TS_SIZE + ROOM_SIZE], index, INDEX_SIZE);
+}
+
+void
+search_posting_read(const unsigned char posting[SEARCH_POSTING_SIZE],
+  uint64_t *ts, uint32_t *room, uint64_t *index) {
+	assert(posting);
+	assert(ts);
+	assert(room);
+	assert(index);
+
+	*ts = read_be(posting, TS_SIZE);
+	*room = (uint32_t) read_be(&posting[TS_SIZE], ROOM_SIZE);
+	*index = read_be(&posting[TS_SIZE + ROOM_SIZE], INDEX_SIZE);
+}
@@ -0,0 +1,36 @@
+#pragma once
+/* SPDX-FileCopyrightText: 2021 git-bruh
+ * SPDX-License-Identifier: GPL-3.0-or-later */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Tokens of the full-text index in DB_SEARCH. Text is split on ASCII
+ * punctuation and whitespace, ASCII letters are lowercased and bytes >= 0x80
+ * are kept as is so that UTF-8 words aren't split. */
+enum {
+	/* Shorter tokens are too common to be useful. */
+	SEARCH_TOKEN_MIN = 2,
+	/* Longer tokens are truncated. */
+	SEARCH_TOKEN_MAX = 64,
+};
+
+/* Postings are the data of DB_SEARCH, fixed-size so that the DB can use
+ * MDB_DUPFIXED. Layout:
+ *
+ * [u64 origin_server_ts][u32 room surrogate][u64 event index], all
+ * big-endian.
+ *
+ * So that the postings of a token sort by time and the newest matches can be
+ * read first. The same event has the same posting for every token. */
+enum { SEARCH_POSTING_SIZE = 20 };
+
+/* Copy the next token of *text to token and advance *text past it. Returns
+ * the length of the token, 0 if there are no more tokens. */
+size_t
+search_token_next(const char **text, char token[SEARCH_TOKEN_MAX + 1]);
+void
+search_posting_write(unsigned char posting[SEARCH_POSTING_SIZE], uint64_t ts,
+  uint32_t room, uint64_t index);
+void
+search_posting_read(const unsigned char posting[SEARCH_POSTING_SIZE],
+  uint64_t *ts, uint32_t *room, uint64_t *index);
@@ -7,14 +7,23 @@
 #include <langinfo.h>
 #include <locale.h>
 #include <poll.h>
+#include <string.h>
+#include <unistd.h>
 
-enum { FD_TTY = 0, FD_RESIZE, FD_PIPE, FD_MAX };
+enum { FD_TTY = 0, FD_RESIZE, FD_PIPE, FD_SEARCH, FD_MAX };
+/* Each worker takes one of LMDB's 126 reader slots while loading a room. */
+enum { PREFETCH_MAX_WORKERS = 64 };
+enum { INGEST_MAX_WORKERS = 64 };
 
 static void
 cleanup(struct state *state) {
 	tb_shutdown();
 
 	state->done = true;
+	/* Wake up the syncer thread if it's waiting for the queue to drain. */
+	pthread_mutex_lock(&state->sync_mutex);
+	pthread_cond_broadcast(&state->sync_cond);
+	pthread_mutex_unlock(&state->sync_mutex);
 	/* Cancel here as we might be logging in, so the syncer thread would
 	 * not have started. */
 	matrix_cancel(state->matrix);
@@ -23,17 +32,62 @@ cleanup(struct state *state) {
 		pthread_join(state->threads[THREAD_SYNC], NULL);
 	}
 
+	/* The syncer waits for it to commit, so it's stopped after it. */
+	if (state->threads[THREAD_WRITER]) {
+		pthread_mutex_lock(&state->writer.mutex);
+		state->writer.stop = true;
+		pthread_cond_broadcast(&state->writer.cond);
+		pthread_mutex_unlock(&state->writer.mutex);
+
+		pthread_join(state->threads[THREAD_WRITER], NULL);
+	}
+
 	if (state->threads[THREAD_QUEUE]) {
 		pthread_cond_signal(&state->queue_cond);
 		pthread_join(state->threads[THREAD_QUEUE], NULL);
 	}
 
+	if (state->threads[THREAD_MAINTENANCE]) {
+		pthread_join(state->threads[THREAD_MAINTENANCE], NULL);
+	}
+
+	for (size_t i = 0, len = arrlenu(state->prefetch_threads); i < len; i++) {
+		pthread_join(state->prefetch_threads[i], NULL);
+	}
+
+	/* The rooms were populated, and every thread that modifies them has
+	 * exited. */
+	if (state->threads[THREAD_SYNC]) {
+		state_write_image(state);
+	}
+
+	/* Free any syncs that the UI thread didn't get to. */
+	for (size_t i = 0; i < state->syncs_queued; i++) {
+		uintptr_t data = 0;
+
+		ssize_t ret
+		  = safe_read(state->thread_comm_pipe[PIPE_READ], &data, sizeof(data));
+
+		assert(ret == 0);
+
+		/* NOLINTNEXTLINE(performance-no-int-to-ptr) */
+		accumulated_sync_free((struct accumulated_sync_data *) data, false);
+	}
+
 	for (size_t i = 0; i < PIPE_MAX; i++) {
 		if (state->thread_comm_pipe[i] != -1) {
 			close(state->thread_comm_pipe[i]);
 		}
+
+		if (state->search_pipe[i] != -1) {
+			close(state->search_pipe[i]);
+		}
 	}
 
+	/* The queue thread has exited. */
+	search_results_free(state->search_results);
+	pthread_mutex_destroy(&state->search_mutex);
+
 	pthread_cond_destroy(&state->queue_cond);
 	pthread_mutex_destroy(&state->queue_mutex);
 
@@ -55,6 +109,13 @@ cleanup(struct state *state) {
 
 	shfree(state->state_rooms.rooms);
 	shfree(state->state_rooms.orphaned_rooms);
+	shfree(state->unpublished_rooms);
+	arrfree(state->prefetch);
+	arrfree(state->prefetch_threads);
+
+	/* After the rooms which borrow from it. */
+	startup_image_finish(&state->image);
+	free(state->next_batch);
 
 	memset(state, 0, sizeof(*state));
 
@@ -92,6 +153,43 @@ syncer(void *arg) {
 	pthread_exit(NULL);
 }
 
+static void *
+writer(void *arg) {
+	assert(arg);
+
+	sync_writer_run(arg);
+
+	pthread_exit(NULL);
+}
+
+/* Prune, compress and compact the cache in the background, the UI stays
+ * usable. */
+static void *
+maintenance(void *arg) {
+	assert(arg);
+
+	struct state *state = arg;
+	size_t pruned = 0;
+	size_t frozen = 0;
+
+	int ret = cache_prune(&state->cache, &pruned);
+
+	if (ret != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to prune cache: %s", mdb_strerror(ret));
+	}
+
+	if (!state->done
+		&& (ret = cache_freeze(&state->cache, &frozen)) != MDB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to compress cache: %s", mdb_strerror(ret));
+	}
+
+	if (state->compact_cache && !state->done) {
+		cache_compact(&state->cache);
+	}
+
+	pthread_exit(NULL);
+}
+
 static void *
 queue_listener(void *arg) {
 	struct state *state = arg;
@@ -119,14 +217,95 @@ queue_listener(void *arg) {
 	pthread_exit(NULL);
 }
 
+/* Load the member lists of all rooms, and the rooms that weren't loaded on
+ * startup unless they're selected first. Each room is taken by a single
+ * worker, which writes only to it. */
+static void *
+prefetcher(void *arg) {
+	assert(arg);
+
+	struct state *state = arg;
+	const size_t len = arrlenu(state->prefetch);
+
+	while (!state->done) {
+		size_t i = state->prefetch_next++;
+
+		if (i >= len) {
+			break;
+		}
+
+		state_load_room(
+		  state, state->prefetch[i].key, state->prefetch[i].value);
+		state_load_members(
+		  state, state->prefetch[i].key, state->prefetch[i].value);
+	}
+
+	pthread_exit(NULL);
+}
+
+static int
+start_prefetch(struct state *state) {
+	size_t workers = state->prefetch_workers;
+
+	/* Readers would hold off the syncer's writes. */
+	if (!state->cache.backend->concurrent_readers) {
+		workers = workers > 0 ? 1 : 0;
+	}
+
+	if (workers > arrlenu(state->prefetch)) {
+		workers = arrlenu(state->prefetch);
+	}
+
+	for (size_t i = 0; i < workers; i++) {
+		pthread_t thread = 0;
+		int ret = pthread_create(&thread, NULL, prefetcher, state);
+
+		if (ret != 0) {
+			errno = ret;
+			perror("Failed to initialize prefetch thread");
+
+			return -1;
+		}
+
+		arrput(state->prefetch_threads, thread);
+	}
+
+	if (workers > 0) {
+		LOG(LOG_MESSAGE, "Prefetching %zu rooms with %zu workers",
+		  arrlenu(state->prefetch), workers);
+	}
+
+	return 0;
+}
+
 static void
-reset_selected_room_buffer(struct tab_room *tab_room) {
+reset_selected_room_buffer(struct state *state, struct tab_room *tab_room) {
+	/* However another room was selected. */
+	if (tab_room->window.room
+		&& (!tab_room->selected_room
+			|| tab_room->selected_room->value != tab_room->window.of)) {
+		tab_room_close_window(tab_room);
+	}
+
 	if (tab_room->selected_room) {
+		/* Rooms are loaded on their first selection, no matter how they were
+		 * selected. */
+		state_load_room(
+		  state, tab_room->selected_room->key, tab_room->selected_room->value);
+
 		struct widget_points points[TAB_ROOM_MAX] = {0};
 		tab_room_get_points(tab_room, points);
 
 		room_maybe_reset_and_fill_events(
 		  tab_room->selected_room->value, &points[TAB_ROOM_MESSAGE_BUFFER]);
+
+		/* Filled when it's opened or after a resize. */
+		if (tab_room->window.room
+			&& room_maybe_reset_and_fill_events(
+			  tab_room->window.room, &points[TAB_ROOM_MESSAGE_BUFFER])) {
+			message_buffer_scroll_to(
+			  &tab_room->window.room->buffer, tab_room->window.index);
+		}
 	}
 }
 
@@ -150,6 +329,8 @@ get_fds(struct state *state, struct pollfd fds[FD_MAX]) {
 	fds[FD_RESIZE] = (struct pollfd) {.fd = resizefd, .events = POLLIN};
 	fds[FD_PIPE] = (struct pollfd) {
 	  .fd = state->thread_comm_pipe[PIPE_READ], .events = POLLIN};
+	fds[FD_SEARCH] = (struct pollfd) {
+	  .fd = state->search_pipe[PIPE_READ], .events = POLLIN};
 
 	return 0;
 }
@@ -175,7 +356,7 @@ ui_loop(struct state *state) {
 			tb_clear();
 			tb_hide_cursor();
 
-			reset_selected_room_buffer(&tab_room);
+			reset_selected_room_buffer(state, &tab_room);
 
 			tab_room_redraw(&tab_room);
 
@@ -195,13 +376,20 @@ ui_loop(struct state *state) {
 			assert(ret == 0);
 			assert(data);
 
-			/* Ensure that we redraw if we had changes. */
-			redraw = handle_accumulated_sync(&state->state_rooms, &tab_room,
+			struct accumulated_sync_data *sync_data
 			  /* NOLINTNEXTLINE(performance-no-int-to-ptr) */
-			  (struct accumulated_sync_data *) data);
+			  = (struct accumulated_sync_data *) data;
+
+			/* Ensure that we redraw if we had changes. */
+			redraw = state_handle_sync(state, &tab_room, sync_data);
+		}
+
+		if (fds_with_data > 0 && (fds[FD_SEARCH].revents & POLLIN)) {
+			fds_with_data--;
 
-			state->sync_cond_signaled = true;
-			pthread_cond_signal(&state->sync_cond);
+			if (state_handle_search(state, &tab_room)) {
+				redraw = true;
+			}
 		}
 
 		if (fds_with_data <= 0 || (tb_poll_event(&event)) != TB_OK) {
@@ -209,11 +397,7 @@ ui_loop(struct state *state) {
 		}
 
 		if (event.key == TB_KEY_CTRL_C) {
-			/* Ensure that the syncer thread never deadlocks if we break here.
-			 * TODO verify that this works. */
-			state->sync_cond_signaled = true;
-			pthread_cond_signal(&state->sync_cond);
-
+			/* The syncer thread is woken up in cleanup(). */
 			break;
 		}
 
@@ -355,6 +539,77 @@ ui_init(void) {
 	return ret;
 }
 
+/* Returns fallback if the variable is unset or isn't a valid number. */
+static unsigned long
+env_ulong(const char *name, unsigned long fallback) {
+	/* Only called from the main thread before others are spawned. */
+	/* NOLINTNEXTLINE(concurrency-mt-unsafe) */
+	const char *value = getenv(name);
+
+	if (!value || *value == '\0') {
+		return fallback;
+	}
+
+	char *end = NULL;
+	errno = 0;
+	unsigned long ret = strtoul(value, &end, 10);
+
+	if (errno != 0 || *end != '\0') {
+		LOG(LOG_WARN, "Ignoring invalid value '%s' for %s", value, name);
+		return fallback;
+	}
+
+	return ret;
+}
+
+static enum cache_durability
+env_durability(const char *name) {
+	const char *const modes[CACHE_DURABILITY_MAX] = {
+	  [CACHE_DURABILITY_SYNC] = "sync",
+	  [CACHE_DURABILITY_NOMETASYNC] = "nometasync",
+	  [CACHE_DURABILITY_NOSYNC] = "nosync",
+	};
+
+	/* NOLINTNEXTLINE(concurrency-mt-unsafe) */
+	const char *value = getenv(name);
+
+	if (!value || *value == '\0') {
+		return CACHE_DURABILITY_SYNC;
+	}
+
+	for (size_t i = 0; i < CACHE_DURABILITY_MAX; i++) {
+		if ((strcmp(value, modes[i])) == 0) {
+			return (enum cache_durability) i;
+		}
+	}
+
+	LOG(LOG_WARN, "Ignoring invalid value '%s' for %s", value, name);
+
+	return CACHE_DURABILITY_SYNC;
+}
+
+static const struct kv_ops *
+env_backend(const char *name) {
+	const struct kv_ops *const backends[] = {&kv_lmdb, &kv_memory};
+
+	/* NOLINTNEXTLINE(concurrency-mt-unsafe) */
+	const char *value = getenv(name);
+
+	if (!value || *value == '\0') {
+		return &kv_lmdb;
+	}
+
+	for (size_t i = 0; i < (sizeof(backends) / sizeof(*backends)); i++) {
+		if ((strcmp(value, backends[i]->name)) == 0) {
+			return backends[i];
+		}
+	}
+
+	LOG(LOG_WARN, "Ignoring invalid value '%s' for %s", value, name);
+
+	return &kv_lmdb;
+}
+
 static int
 init_everything(struct state *state) {
 	if ((matrix_global_init()) != 0) {
@@ -362,14 +617,54 @@ init_everything(struct state *state) {
 		return -1;
 	}
 
-	if ((pipe(state->thread_comm_pipe)) != 0) {
+	if ((pipe(state->thread_comm_pipe)) != 0
+		|| (pipe(state->search_pipe)) != 0) {
 		perror("Failed to initialize pipe");
 		return -1;
 	}
 
 	int ret = -1;
 
-	ret = cache_init(&state->cache);
+	/* NOLINTNEXTLINE(concurrency-mt-unsafe) */
+	const char *cache_dir = getenv("MATRIX_TUI_CACHE_DIR");
+	const unsigned long mib = 1024 * 1024;
+	const uint64_t ms_in_day = 24ULL * 60 * 60 * 1000;
+	const uint64_t ms_in_minute = 60ULL * 1000;
+
+	const struct cache_options cache_options = {
+	  .backend = env_backend("MATRIX_TUI_CACHE_BACKEND"),
+	  .dir = cache_dir,
+	  .map_size = env_ulong("MATRIX_TUI_MAP_SIZE_MB", 0) * mib,
+	  .durability = env_durability("MATRIX_TUI_DURABILITY"),
+	  .commit_window_ms
+	  = (unsigned) env_ulong("MATRIX_TUI_COMMIT_WINDOW_MS", 0),
+	  .keep_event_json = env_ulong("MATRIX_TUI_KEEP_EVENT_JSON", 0) != 0,
+	  .retain_events = env_ulong("MATRIX_TUI_RETAIN_EVENTS", 0),
+	  .retain_age_ms = env_ulong("MATRIX_TUI_RETAIN_DAYS", 0) * ms_in_day,
+	  .cold_age_ms = env_ulong("MATRIX_TUI_COLD_DAYS", 0) * ms_in_day,
+	};
+
+	state->compact_cache = env_ulong("MATRIX_TUI_COMPACT", 0) != 0;
+	state->zero_copy = env_ulong("MATRIX_TUI_ZERO_COPY", 0) != 0;
+	state->image_interval_ms
+	  = env_ulong("MATRIX_TUI_STARTUP_IMAGE_MINUTES", 5) * ms_in_minute;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long workers = env_ulong(
+	  "MATRIX_TUI_PREFETCH_THREADS", cores > 0 ? (unsigned long) cores : 1);
+
+	state->prefetch_workers = (unsigned) (workers > PREFETCH_MAX_WORKERS
+											? PREFETCH_MAX_WORKERS
+											: workers);
+
+	workers = env_ulong(
+	  "MATRIX_TUI_INGEST_THREADS", cores > 0 ? (unsigned long) cores : 1);
+
+	state->ingest_workers = (unsigned) (workers > INGEST_MAX_WORKERS
+										  ? INGEST_MAX_WORKERS
+										  : workers);
+
+	ret = cache_init(&state->cache, &cache_options);
 
 	if (ret != 0) {
 		LOG(LOG_ERROR, "Failed to initialize database: %s", mdb_strerror(ret));
@@ -402,6 +697,7 @@ init_everything(struct state *state) {
 	}
 
 	SHMAP_INIT(state->state_rooms.rooms);
+	SHMAP_INIT(state->unpublished_rooms);
 	/* No need to call SHMAP_INIT on state->state_rooms.orphaned_rooms as it
 	 * just takes pointers from state->state_rooms.rooms. */
 
@@ -412,6 +708,15 @@ init_everything(struct state *state) {
 		return -1;
 	}
 
+	ret = pthread_create(&state->threads[THREAD_WRITER], NULL, writer, state);
+
+	if (ret != 0) {
+		errno = ret;
+		perror("Failed to initialize writer thread");
+
+		return -1;
+	}
+
 	ret = pthread_create(&state->threads[THREAD_SYNC], NULL, syncer, state);
 
 	if (ret != 0) {
@@ -421,6 +726,23 @@ init_everything(struct state *state) {
 		return -1;
 	}
 
+	if ((start_prefetch(state)) != 0) {
+		return -1;
+	}
+
+	if (cache_options.retain_events > 0 || cache_options.retain_age_ms > 0
+		|| cache_options.cold_age_ms > 0 || state->compact_cache) {
+		ret = pthread_create(
+		  &state->threads[THREAD_MAINTENANCE], NULL, maintenance, state);
+
+		if (ret != 0) {
+			errno = ret;
+			perror("Failed to initialize maintenance thread");
+
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -457,6 +779,11 @@ main(void) {
 	  .sync_cond = PTHREAD_COND_INITIALIZER,
 	  .sync_mutex = PTHREAD_MUTEX_INITIALIZER,
 	  .thread_comm_pipe = {-1, -1},
+	  .search_pipe = {-1, -1},
+	  .search_mutex = PTHREAD_MUTEX_INITIALIZER,
+	  .state_rooms = {.lock = PTHREAD_RWLOCK_INITIALIZER},
+	  .writer = {.cond = PTHREAD_COND_INITIALIZER,
+		.mutex = PTHREAD_MUTEX_INITIALIZER},
 	};
 
 	if ((init_everything(&state)) == 0) {
@@ -3,6 +3,7 @@
 #include "app/hm_room.h"
 #include "app/room_ds.h"
 #include "ui/message_buffer.h"
+#include "ui/tab_room.h"
 #include "ui/ui.h"
 #include "widgets.h"
 
@@ -101,6 +102,56 @@ border_highlight(struct widget_points *points, bool highlight) {
 	  &copy, highlight ? BORDER_HIGHLIGHT_FG : TB_DEFAULT, TB_DEFAULT);
 }
 
+/* The search prompt takes the place of the message input. */
+static struct input *
+active_input(struct tab_room *tab_room) {
+	return tab_room->search.active ? &tab_room->search.input : &tab_room->input;
+}
+
+static void
+search_results_redraw(struct tab_room *tab_room, struct widget_points *points) {
+	assert(tab_room);
+	assert(points);
+
+	size_t len = arrlenu(tab_room->search.results);
+
+	if (len == 0) {
+		const char *hint = "Type a query and press Enter";
+
+		if (tab_room->search.searching) {
+			hint = "Searching...";
+		} else if (tab_room->search.query) {
+			hint = tab_room->search.mode == TAB_ROOM_SEARCH_DATE
+				   ? "Invalid date"
+				   : "No results";
+		} else if (tab_room->search.mode == TAB_ROOM_SEARCH_DATE) {
+			hint = "Type a date (YYYY-MM-DD [HH:MM]) and press Enter";
+		}
+
+		widget_print_str(
+		  points->x1, points->y1, points->x2, TB_DEFAULT, TB_DEFAULT, hint);
+		return;
+	}
+
+	size_t rows = (size_t) (points->y2 - points->y1);
+
+	if (rows == 0) {
+		return;
+	}
+
+	/* Scroll so that the selected result is always visible. */
+	size_t start = tab_room->search.selected >= rows
+				   ? (tab_room->search.selected - rows) + 1
+				   : 0;
+
+	for (size_t i = start, y = (size_t) points->y1;
+		 i < len && y < (size_t) points->y2; i++, y++) {
+		widget_print_str(points->x1, (int) y, points->x2,
+		  i == tab_room->search.selected ? TB_REVERSE : TB_DEFAULT, TB_DEFAULT,
+		  tab_room->search.results[i].line);
+	}
+}
+
 void
 tab_room_get_points(
   struct tab_room *tab_room, struct widget_points points[TAB_ROOM_MAX]) {
@@ -118,7 +169,8 @@ tab_room_get_points(
 	adjust_inside_border(
 	  &points[TAB_ROOM_INPUT]); /* Do a dry run of drawing the input field to
 								   get rows. */
-	input_redraw(&tab_room->input, &points[TAB_ROOM_INPUT], &input_rows, true);
+	input_redraw(
+	  active_input(tab_room), &points[TAB_ROOM_INPUT], &input_rows, true);
 	assert(input_rows >= 0);
 
 	if (input_rows == 0) {
@@ -144,6 +196,8 @@ tab_room_redraw(struct tab_room *tab_room) {
 	struct widget_points points[TAB_ROOM_MAX] = {0};
 	tab_room_get_points(tab_room, points);
 
+	struct room *room = NULL;
+
 	for (enum tab_room_widget widget = 0; widget < TAB_ROOM_MAX; widget++) {
 		border_highlight(&points[widget], widget == tab_room->widget);
 
@@ -153,12 +207,13 @@ tab_room_redraw(struct tab_room *tab_room) {
 			break;
 		case TAB_ROOM_INPUT:
 			/* Don't pass input_rows as we don't neex it here. */
-			input_redraw(&tab_room->input, &points[widget], &(int) {0}, false);
+			input_redraw(
+			  active_input(tab_room), &points[widget], &(int) {0}, false);
 			break;
 		case TAB_ROOM_MESSAGE_BUFFER:
-			if (tab_room->selected_room) {
-				struct room *room = tab_room->selected_room->value;
-
+			if (tab_room->search.active) {
+				search_results_redraw(tab_room, &points[widget]);
+			} else if ((room = tab_room_shown_room(tab_room))) {
 				pthread_mutex_lock(&room->realloc_or_modify_mutex);
 				message_buffer_redraw(&room->buffer, &points[widget]);
 				pthread_mutex_unlock(&room->realloc_or_modify_mutex);
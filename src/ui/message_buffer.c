@@ -6,6 +6,7 @@
 #include "stb_ds.h"
 
 #include <assert.h>
+#include <string.h>
 #include <wctype.h>
 
 int
@@ -39,31 +40,86 @@ ch_can_split_word(uint32_t ch) {
 	}
 }
 
+/* Decode the character at byte i of the UTF-8 buffer, *next is the byte after
+ * it. Invalid or truncated sequences are a single replacement character, so
+ * that they are still rendered. */
+static uint32_t
+uc_at(const char *buf, size_t len, size_t i, size_t *next) {
+	assert(buf);
+	assert(i < len);
+	assert(next);
+
+	enum { replacement_character = 0xFFFD };
+
+	uint32_t uc = replacement_character;
+	int ch_len = tb_utf8_char_length(buf[i]);
+
+	if (ch_len < 1 || (size_t) ch_len > (len - i)
+		|| (tb_utf8_char_to_unicode(&uc, &buf[i])) != ch_len) {
+		uc = replacement_character;
+		ch_len = 1;
+	}
+
+	*next = i + (size_t) ch_len;
+
+	return uc;
+}
+
+/* Byte index of the character before the one at byte i. */
+static size_t
+prev_index(const char *buf, size_t len, size_t i) {
+	assert(buf);
+	assert(i > 0);
+
+	enum { max_continuation_bytes = 3 };
+
+	size_t prev = i - 1;
+
+	for (size_t n = 0; prev > 0 && n < max_continuation_bytes
+					   && (((unsigned char) buf[prev]) & 0xC0) == 0x80;
+		 n++) {
+		prev--;
+	}
+
+	size_t next = 0;
+	uc_at(buf, len, prev, &next);
+
+	/* Part of an invalid sequence, which is decoded bytewise. */
+	return next == i ? prev : i - 1;
+}
+
 static int
 find_word_start_end(
-  const uint32_t *buf, size_t current, size_t len, size_t *start, size_t *end) {
+  const char *buf, size_t current, size_t len, size_t *start, size_t *end) {
 	assert(buf);
 	assert(start);
 	assert(end);
 
 	int tmp_width = 0;
 	int width = 0;
+	size_t next = 0;
 
-	for (*start = current; *start > 0; (*start)--) {
-		if ((ch_can_split_word(buf[*start - 1]))) {
+	for (*start = current; *start > 0;) {
+		size_t prev = prev_index(buf, len, *start);
+		uint32_t uc = uc_at(buf, len, prev, &next);
+
+		if ((ch_can_split_word(uc))) {
 			break;
 		}
 
-		widget_uc_sanitize(buf[*start - 1], &tmp_width);
+		widget_uc_sanitize(uc, &tmp_width);
 		width += tmp_width;
+		*start = prev;
 	}
 
-	for (*end = current; *end < len; (*end)++) {
-		if ((ch_can_split_word(buf[*end]))) {
+	for (*end = current; *end < len; *end = next) {
+		uint32_t uc = uc_at(buf, len, *end, &next);
+
+		if ((ch_can_split_word(uc))) {
 			break;
 		}
 
-		widget_uc_sanitize(buf[*end], &tmp_width);
+		widget_uc_sanitize(uc, &tmp_width);
 		width += tmp_width;
 	}
 
@@ -72,17 +128,18 @@ find_word_start_end(
 
 static size_t
 find_next_word_start(
-  const uint32_t *buf, size_t current, size_t len, int x, int max_x) {
+  const char *buf, size_t current, size_t len, int x, int max_x) {
 	assert(buf);
 
 	size_t last_large_word_start = current;
 
-	for (; current < len; current++) {
+	for (size_t next = 0; current < len; current = next) {
 		int width = 0;
 
-		if ((ch_can_split_word(widget_uc_sanitize(buf[current], &width)))
-			|| (current + 1) == len) {
-			last_large_word_start = current + 1;
+		if ((ch_can_split_word(
+			  widget_uc_sanitize(uc_at(buf, len, current, &next), &width)))
+			|| next == len) {
+			last_large_word_start = next;
 		}
 
 		if ((widget_should_scroll(x, width, max_x))) {
@@ -153,34 +210,37 @@ message_buffer_insert(struct message_buffer *buf, struct widget_points *points,
 	}
 
 	int x = start_x;
+	const char *body = message->body;
+	const size_t len = strlen(body);
 
-	for (size_t i = 0, prev_end = i, len = arrlenu(message->body); i < len;
-		 i++) {
+	for (size_t i = 0, next = 0, prev_end = i; i < len; i = next) {
 		int width = 0;
-		widget_uc_sanitize(message->body[i], &width);
+		widget_uc_sanitize(uc_at(body, len, i, &next), &width);
 
 		bool overflow = widget_should_scroll(x, width, points->x2);
 
 		/* Check if the next character would overflow the screen, allowing
 		 * it to be placed on the next line. */
-		if (!overflow && (i + 1) < len) {
+		if (!overflow && next < len) {
 			int next_width = 0;
-			widget_uc_sanitize(message->body[i + 1], &next_width);
+			size_t after_next = 0;
+			widget_uc_sanitize(
+			  uc_at(body, len, next, &after_next), &next_width);
 			overflow = (!(widget_should_forcebreak(next_width))
 						&& widget_should_scroll(x, next_width, points->x2));
 		}
 
 		x += width;
 
-		if (overflow || (i + 1) == len) {
+		if (overflow || next == len) {
 			if (overflow && !(widget_should_forcebreak(width))) {
 				size_t word_start = 0;
 				size_t word_end = 0;
 
 				/* We could keep track of the words in-place but that gets
 				 * pretty messy so we just find it on-demand. */
-				int word_width = find_word_start_end(
-				  message->body, i, len, &word_start, &word_end);
+				int word_width
+				  = find_word_start_end(body, i, len, &word_start, &word_end);
 
 				if (!widget_should_scroll(start_x, word_width, points->x2)) {
 					arrput(buf->buf, ((struct buf_item) {.padding = padding,
@@ -188,17 +248,15 @@ message_buffer_insert(struct message_buffer *buf, struct widget_points *points,
 									   .end = word_start,
 									   .message = message}));
 
-					size_t next_word_start = find_next_word_start(message->body,
-					  word_end, len, start_x + word_width, points->x2);
+					size_t next_word_start = find_next_word_start(
+					  body, word_end, len, start_x + word_width, points->x2);
 
 					arrput(buf->buf, ((struct buf_item) {.padding = padding,
 									   .start = word_start,
 									   .end = next_word_start,
 									   .message = message}));
 
-					/* We must subtract 1 as i will be iterated after continue.
-					 */
-					i = next_word_start - 1;
+					next = next_word_start;
 					prev_end = next_word_start;
 					x = start_x;
 
@@ -208,10 +266,10 @@ message_buffer_insert(struct message_buffer *buf, struct widget_points *points,
 
 			arrput(buf->buf, ((struct buf_item) {.padding = padding,
 							   .start = prev_end,
-							   .end = i + 1,
+							   .end = next,
 							   .message = message}));
 
-			prev_end = i + 1;
+			prev_end = next;
 			x = start_x;
 		}
 	}
@@ -306,6 +364,43 @@ message_buffer_ensure_sane_scroll(struct message_buffer *buf) {
 	}
 }
 
+int
+message_buffer_scroll_to(struct message_buffer *buf, uint64_t index) {
+	assert(buf);
+
+	size_t len = arrlenu(buf->buf);
+	size_t line = 0;
+
+	/* First line of the message, the lines are sorted by index. */
+	for (size_t end = len; line < end;) {
+		size_t mid = line + ((end - line) / 2);
+
+		if (buf->buf[mid].message->index < index) {
+			line = mid + 1;
+		} else {
+			end = mid;
+		}
+	}
+
+	if (line == len) {
+		return -1;
+	}
+
+	assert(!buf->zeroed);
+
+	int height = (buf->last_points.y2 - buf->last_points.y1);
+	assert(height >= 0);
+
+	size_t below = len - (line + 1);
+	size_t half = (size_t) height / 2;
+
+	/* Like MESSAGE_BUFFER_UP, don't scroll unless we don't fit. */
+	buf->scroll = (len > (size_t) height && below > half) ? below - half : 0;
+	buf->selected = buf->buf[line].message;
+
+	return 0;
+}
+
 bool
 message_buffer_should_recalculate(
   struct message_buffer *buf, struct widget_points *points) {
@@ -472,15 +567,15 @@ message_buffer_redraw(
 		int x = item->padding;
 		int width = 0;
 
-		for (size_t msg_index = item->start; msg_index < item->end;
-			 msg_index++) {
-			uint32_t uc
-			  = widget_uc_sanitize(item->message->body[msg_index], &width);
+		for (size_t msg_index = item->start, next = 0; msg_index < item->end;
+			 msg_index = next) {
+			uint32_t uc = widget_uc_sanitize(
+			  uc_at(item->message->body, item->end, msg_index, &next), &width);
 
 			if ((widget_should_forcebreak(width))) {
 				/* Newlines should only exist before a break,
 				 * i.e. be the last character. */
-				assert((msg_index + 1) == item->end);
+				assert(next == item->end);
 				continue;
 			}
 
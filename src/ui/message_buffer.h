@@ -7,8 +7,9 @@
 struct message;
 
 /* This struct must be small since 1 terminal row == 1 struct buf_item. Instead
- * of breaking up message content into lines, we just store indices into
- * the message buffer. This struct will be allocated very frequently. */
+ * of breaking up message content into lines, we just store byte offsets into
+ * the UTF-8 body of the message. This struct will be allocated very
+ * frequently. */
 struct buf_item {
 	int padding; /* Padding for sender. */
 	/* TODO get rid of `end` and assert start == prev_index */
@@ -44,6 +45,10 @@ void
 message_buffer_zero(struct message_buffer *buf);
 void
 message_buffer_ensure_sane_scroll(struct message_buffer *buf);
+/* Scroll so that the first message at or after index is in the middle of the
+ * buffer and select it. Returns -1 if there is no such message. */
+int
+message_buffer_scroll_to(struct message_buffer *buf, uint64_t index);
 bool
 message_buffer_should_recalculate(
   struct message_buffer *buf, struct widget_points *points);
@@ -6,6 +6,7 @@
 #include "stb_ds.h"
 
 #include <assert.h>
+#include <stdlib.h>
 
 const char *const root_node_str[NODE_MAX] = {
   [NODE_INVITES] = "Invites",
@@ -36,9 +37,49 @@ room_draw_cb(void *data, struct widget_points *points, bool is_selected) {
 	  is_selected ? TB_REVERSE : TB_DEFAULT, TB_DEFAULT, str);
 }
 
+void
+tab_room_search_reset(struct tab_room *tab_room) {
+	assert(tab_room);
+
+	for (size_t i = 0; i < arrlenu(tab_room->search.results); i++) {
+		free(tab_room->search.results[i].room_id);
+		free(tab_room->search.results[i].line);
+	}
+
+	arrfree(tab_room->search.results);
+	free(tab_room->search.query);
+
+	tab_room->search.query = NULL;
+	tab_room->search.searching = false;
+	tab_room->search.selected = 0;
+}
+
+void
+tab_room_close_window(struct tab_room *tab_room) {
+	assert(tab_room);
+
+	room_destroy(tab_room->window.room);
+	tab_room->window.room = NULL;
+	tab_room->window.of = NULL;
+}
+
+struct room *
+tab_room_shown_room(struct tab_room *tab_room) {
+	assert(tab_room);
+
+	if (tab_room->window.room) {
+		return tab_room->window.room;
+	}
+
+	return tab_room->selected_room ? tab_room->selected_room->value : NULL;
+}
+
 void
 tab_room_finish(struct tab_room *tab_room) {
 	if (tab_room) {
+		tab_room_close_window(tab_room);
+		tab_room_search_reset(tab_room);
+		input_finish(&tab_room->search.input);
 		input_finish(&tab_room->input);
 		treeview_node_finish(&tab_room->treeview.root);
 		arrfree(tab_room->room_nodes);
@@ -56,6 +97,9 @@ tab_room_init(struct tab_room *tab_room) {
 	int ret = input_init(&tab_room->input, TB_DEFAULT, false);
 	assert(ret == 0);
 
+	ret = input_init(&tab_room->search.input, TB_DEFAULT, false);
+	assert(ret == 0);
+
 	ret = treeview_init(&tab_room->treeview);
 	assert(ret == 0);
 
@@ -166,3 +210,46 @@ tab_room_reset_rooms(
 
 	tab_room->selected_room = NULL;
 }
+
+void
+tab_room_select_room(struct tab_room *tab_room,
+  struct state_rooms *state_rooms, struct hm_room *room) {
+	assert(tab_room);
+	assert(state_rooms);
+	assert(room);
+
+	tab_room->selected_room = room;
+
+	/* Already shown in the current space. */
+	for (size_t i = 0; i < NODE_MAX; i++) {
+		struct treeview_node **nodes = tab_room->treeview.root.nodes[i]->nodes;
+
+		for (size_t j = 0, len = arrlenu(nodes); j < len; j++) {
+			if (((struct hm_room *) nodes[j]->data)->value == room->value) {
+				enum widget_error ret = treeview_event(
+				  &tab_room->treeview, TREEVIEW_JUMP, nodes[j]);
+				assert(ret == WIDGET_REDRAW);
+				return;
+			}
+		}
+	}
+
+	arrsetlen(tab_room->path, 0);
+
+	if (shgeti(state_rooms->orphaned_rooms, room->key) == -1) {
+		for (size_t i = 0, len = shlenu(state_rooms->rooms); i < len; i++) {
+			struct room *space = state_rooms->rooms[i].value;
+
+			if (space->info.is_space
+				&& shgeti(space->children, room->key) != -1) {
+				arrput(tab_room->path, state_rooms->rooms[i].key);
+				break;
+			}
+		}
+	}
+
+	/* Jumps to the selected room's node, the first room is selected if it
+	 * isn't found but the room stays selected anyway. */
+	tab_room_reset_rooms(tab_room, state_rooms);
+	tab_room->selected_room = room;
+}
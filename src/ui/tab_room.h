@@ -9,6 +9,21 @@ tab_room_finish(struct tab_room *tab_room);
 int
 tab_room_init(struct tab_room *tab_room);
 
+/* Clear the results and the query but keep the search active. */
+void
+tab_room_search_reset(struct tab_room *tab_room);
+/* Show the live timeline of the selected room again. */
+void
+tab_room_close_window(struct tab_room *tab_room);
+/* The room whose message buffer is shown, the window if one is open. */
+struct room *
+tab_room_shown_room(struct tab_room *tab_room);
+/* Select room and it's node in the tree, showing the space that it's in if
+ * it isn't an orphan. */
+void
+tab_room_select_room(struct tab_room *tab_room,
+  struct state_rooms *state_rooms, struct hm_room *room);
+
 void
 tab_room_reset_rooms(
   struct tab_room *tab_room, struct state_rooms *state_rooms);
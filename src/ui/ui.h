@@ -34,6 +34,14 @@ enum tab_room_nodes {
 	NODE_MAX
 };
 
+struct tab_room_search_result {
+	char *room_id;
+	/* Index of the matched event in the room. */
+	uint64_t index;
+	/* Room name and body on a single line. */
+	char *line;
+};
+
 struct tab_room {
 	enum tab_room_widget {
 		TAB_ROOM_INPUT = 0,
@@ -48,6 +56,30 @@ struct tab_room {
 	struct hm_room *selected_room;
 	struct treeview_node *room_nodes;
 	char **path; /* Path to follow to reach the current parent space. */
+	/* Ctrl-F search or Ctrl-G jump to date, replaces the input field and the
+	 * message buffer while active. */
+	struct {
+		bool active;
+		enum tab_room_search_mode {
+			TAB_ROOM_SEARCH_TEXT = 0,
+			/* Opens a window of the selected room around a date. */
+			TAB_ROOM_SEARCH_DATE,
+		} mode;
+		struct input input;
+		char *query; /* The query that the results are for. */
+		/* The text search for query runs on the queue thread. */
+		bool searching;
+		struct tab_room_search_result *results;
+		size_t selected;
+	} search;
+	/* Read-only copy of the messages of the selected room around a search
+	 * result or a date, shown in the message buffer instead of the live
+	 * timeline until it's closed with Esc or another room is selected. */
+	struct {
+		struct room *room;
+		struct room *of; /* The selected room that it's a window of. */
+		uint64_t index;	 /* Event that the buffer is scrolled to. */
+	} window;
 };
 
 struct tab_login {
@@ -2,6 +2,8 @@
 
 #include "unity.h"
 
+#include <string.h>
+
 static struct room *room = NULL;
 
 static char displayname[] = "Testing";
@@ -192,6 +194,130 @@ test_fill(void) {
 	TEST_ASSERT_TRUE(room_maybe_reset_and_fill_events(room, &points));
 }
 
+void
+test_edit(void) {
+	char rel_type[] = "m.replace";
+	char edited_body[] = "* Edited";
+
+	struct matrix_sync_event edit = sync_message;
+	edit.timeline.message.body = edited_body;
+	edit.timeline.relation.rel_type = rel_type;
+
+	TEST_ASSERT_EQUAL(
+	  0, room_put_event(room, &sync_message, false, 0, (uint64_t) -1));
+	/* Unknown target. */
+	TEST_ASSERT_EQUAL(-1, room_put_event(room, &edit, false, 1, 5));
+	TEST_ASSERT_EQUAL(0, room_put_event(room, &edit, false, 2, 0));
+
+	struct message *message = room_bsearch(room, 0);
+
+	TEST_ASSERT_NOT_NULL(message);
+	TEST_ASSERT_TRUE(message->edited);
+	/* Fallback prefix is stripped. */
+	TEST_ASSERT_EQUAL_STRING("Edited", message->body);
+
+	/* Edits aren't shown as separate messages. */
+	TEST_ASSERT_NULL(room_bsearch(room, 1));
+	TEST_ASSERT_NULL(room_bsearch(room, 2));
+}
+
+void
+test_borrow(void) {
+	struct cache_iterator_event event = {
+	  .event = sync_message, .index = 1, .pinned = true};
+
+	TEST_ASSERT_EQUAL(0, room_put_cached_event(room, &event));
+	event.index = 0;
+	TEST_ASSERT_EQUAL(0, room_put_cached_event(room, &event));
+
+	struct message *message = room_bsearch(room, 1);
+
+	TEST_ASSERT_NOT_NULL(message);
+	TEST_ASSERT_TRUE(message->borrowed);
+	TEST_ASSERT_EQUAL_PTR(displayname, message->body);
+	TEST_ASSERT_EQUAL_PTR(sender, message->sender);
+
+	/* The sender outlives the redacted body. */
+	TEST_ASSERT_EQUAL(0, room_put_event(room, &redaction, false, 2, 1));
+	TEST_ASSERT_FALSE(message->borrowed);
+	TEST_ASSERT_NULL(message->body);
+	TEST_ASSERT_TRUE(message->sender != sender);
+	TEST_ASSERT_EQUAL_STRING(sender, message->sender);
+
+	/* Copied once the snapshot ends. */
+	message = room_bsearch(room, 0);
+	TEST_ASSERT_TRUE(message->borrowed);
+
+	room_rebind(room, NULL, "!room:localhost");
+
+	TEST_ASSERT_FALSE(message->borrowed);
+	TEST_ASSERT_TRUE(message->body != displayname);
+	TEST_ASSERT_EQUAL_STRING(displayname, message->body);
+	TEST_ASSERT_EQUAL_STRING(sender, message->sender);
+}
+
+void
+test_wants_event(void) {
+	/* Rooms allocated on sync take every event. */
+	TEST_ASSERT_TRUE(room_wants_event(room, 0));
+
+	room->loaded = false;
+	TEST_ASSERT_FALSE(room_wants_event(room, 5));
+
+	room_set_loaded(
+	  room, &(struct room_info) {.last_activity_ts = 1, .last_index = 4});
+	TEST_ASSERT_FALSE(room_wants_event(room, 4));
+	TEST_ASSERT_TRUE(room_wants_event(room, 5));
+	TEST_ASSERT_TRUE(room_wants_event(room, (uint64_t) -1));
+
+	/* No events were read. */
+	room_set_loaded(room, &(struct room_info) {0});
+	TEST_ASSERT_TRUE(room_wants_event(room, 0));
+}
+
+void
+test_put_saved_events(void) {
+	enum { ROOMS = 64, EVENTS = 10 };
+
+	struct saved_room rooms[ROOMS] = {0};
+
+	for (size_t i = 0; i < ROOMS; i++) {
+		rooms[i].room = room_alloc((struct room_info) {0});
+		TEST_ASSERT_NOT_NULL(rooms[i].room);
+		TEST_ASSERT_EQUAL(
+		  0, room_put_member(rooms[i].room, sender, displayname));
+
+		for (uint64_t j = 0; j < EVENTS; j++) {
+			arrput(rooms[i].events,
+			  ((struct saved_event) {.event = sync_message,
+				.index = j,
+				.related_index = (uint64_t) -1}));
+		}
+	}
+
+	rooms[0].room->loaded = false;
+
+	rooms_put_saved_events(rooms, ROOMS, 4);
+
+	/* Left to be read back when it's loaded. */
+	TEST_ASSERT_EQUAL(0, rooms[0].room->timelines[TIMELINE_FORWARD].len);
+
+	for (size_t i = 1; i < ROOMS; i++) {
+		struct timeline *timeline = &rooms[i].room->timelines[TIMELINE_FORWARD];
+
+		TEST_ASSERT_EQUAL(EVENTS, timeline->len);
+
+		for (uint64_t j = 0; j < EVENTS; j++) {
+			TEST_ASSERT_EQUAL(j, timeline->buf[j]->index);
+		}
+	}
+
+	for (size_t i = 0; i < ROOMS; i++) {
+		arrfree(rooms[i].events);
+		room_destroy(rooms[i].room);
+	}
+}
+
 int
 main(void) {
 	UNITY_BEGIN();
@@ -200,5 +326,9 @@ main(void) {
 	RUN_TEST(test_insertion_deletion);
 	RUN_TEST(test_child);
 	RUN_TEST(test_fill);
+	RUN_TEST(test_edit);
+	RUN_TEST(test_borrow);
+	RUN_TEST(test_wants_event);
+	RUN_TEST(test_put_saved_events);
 	return UNITY_END();
 }
@@ -0,0 +1,201 @@
+#include "app/startup_image.h"
+
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/startup_image_XXXXXX";
+static char path[sizeof(dir) + sizeof("/startup.img")];
+
+static char room_id[] = "!room:localhost";
+static char child_id[] = "!child:localhost";
+static char displayname[] = "Testing";
+static char sender[] = "@sender:localhost";
+static char body[] = "Body";
+
+static struct state_rooms state_rooms;
+static struct startup_image image;
+
+static void
+rooms_finish(struct state_rooms *rooms) {
+	for (size_t i = 0, len = shlenu(rooms->rooms); i < len; i++) {
+		room_destroy(rooms->rooms[i].value);
+	}
+
+	shfree(rooms->rooms);
+}
+
+void
+setUp(void) {
+	TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+	snprintf(path, sizeof(path), "%s/startup.img", dir);
+
+	SHMAP_INIT(state_rooms.rooms);
+
+	struct room *room
+	  = room_alloc((struct room_info) {.name = strdup("Room"),
+		.member_count = 1,
+		.last_index = 4});
+	TEST_ASSERT_NOT_NULL(room);
+
+	TEST_ASSERT_EQUAL(0, room_put_member(room, sender, displayname));
+	room_add_child(room, child_id);
+
+	const struct matrix_sync_event message = {
+	  .type = MATRIX_EVENT_TIMELINE,
+	  .timeline = {
+		.type = MATRIX_ROOM_MESSAGE,
+		.base = {.sender = sender},
+		.message = {.body = body},
+	  }};
+	const struct matrix_sync_event redaction = {
+	  .type = MATRIX_EVENT_TIMELINE,
+	  .timeline = {.type = MATRIX_ROOM_REDACTION},
+	};
+
+	for (uint64_t i = 1; i <= 3; i++) {
+		TEST_ASSERT_EQUAL(
+		  0, room_put_event(room, &message, false, i, (uint64_t) -1));
+	}
+
+	TEST_ASSERT_EQUAL(0, room_put_event(room, &redaction, false, 4, 2));
+
+	shput(state_rooms.rooms, room_id, room);
+}
+
+void
+tearDown(void) {
+	rooms_finish(&state_rooms);
+	startup_image_finish(&image);
+
+	unlink(path);
+	rmdir(dir);
+	memcpy(dir + sizeof(dir) - sizeof("XXXXXX"), "XXXXXX", sizeof("XXXXXX"));
+}
+
+void
+test_round_trip(void) {
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "batch"));
+	TEST_ASSERT_EQUAL(0, startup_image_map(&image, path, "batch"));
+
+	struct state_rooms loaded = {0};
+	SHMAP_INIT(loaded.rooms);
+
+	startup_image_populate(&image, &loaded);
+	TEST_ASSERT_EQUAL(1, shlenu(loaded.rooms));
+
+	struct room *room = rooms_get_room(loaded.rooms, room_id);
+	TEST_ASSERT_NOT_NULL(room);
+	TEST_ASSERT_EQUAL_STRING("Room", room->info.name);
+	TEST_ASSERT_NULL(room->info.topic);
+	TEST_ASSERT_EQUAL(1, room->info.member_count);
+	TEST_ASSERT_EQUAL(4, room->info.last_index);
+	TEST_ASSERT_TRUE(room->loaded);
+	TEST_ASSERT_TRUE(room_has_member(room, sender));
+	TEST_ASSERT_TRUE(shget(room->children, child_id));
+
+	/* The redacted message is left out. */
+	TEST_ASSERT_NULL(room_bsearch(room, 2));
+
+	const uint64_t indices[] = {3, 1};
+	struct timeline *timeline = &room->timelines[TIMELINE_BACKWARD];
+
+	TEST_ASSERT_EQUAL(2, timeline->len);
+
+	for (size_t i = 0; i < timeline->len; i++) {
+		struct message *message = timeline->buf[i];
+
+		TEST_ASSERT_EQUAL(indices[i], message->index);
+		TEST_ASSERT_TRUE(message->borrowed);
+		TEST_ASSERT_EQUAL_STRING(body, message->body);
+		TEST_ASSERT_EQUAL_STRING(sender, message->sender);
+		TEST_ASSERT_EQUAL(strlen(displayname), arrlenu(message->username));
+
+		/* Borrowed from the mapping. */
+		TEST_ASSERT_TRUE(message->body >= (const char *) image.map
+						 && message->body
+							  < (const char *) image.map + image.size);
+	}
+
+	rooms_finish(&loaded);
+}
+
+void
+test_unloaded(void) {
+	state_rooms.rooms[0].value->loaded = false;
+
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "batch"));
+	TEST_ASSERT_EQUAL(0, startup_image_map(&image, path, "batch"));
+
+	struct state_rooms loaded = {0};
+	SHMAP_INIT(loaded.rooms);
+
+	startup_image_populate(&image, &loaded);
+
+	/* Only the info and children are kept until it's loaded. */
+	struct room *room = rooms_get_room(loaded.rooms, room_id);
+	TEST_ASSERT_NOT_NULL(room);
+	TEST_ASSERT_FALSE(room->loaded);
+	TEST_ASSERT_EQUAL_STRING("Room", room->info.name);
+	TEST_ASSERT_TRUE(shget(room->children, child_id));
+	TEST_ASSERT_FALSE(room_has_member(room, sender));
+	TEST_ASSERT_NULL(room_bsearch(room, 1));
+
+	rooms_finish(&loaded);
+}
+
+void
+test_stale(void) {
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "batch"));
+	TEST_ASSERT_EQUAL(-1, startup_image_map(&image, path, "newer"));
+	TEST_ASSERT_NULL(image.map);
+
+	/* Replaced by a newer image. */
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "newer"));
+	TEST_ASSERT_EQUAL(0, startup_image_map(&image, path, "newer"));
+}
+
+void
+test_corrupt(void) {
+	TEST_ASSERT_EQUAL(-1, startup_image_map(&image, path, "batch"));
+
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "batch"));
+
+	FILE *file = fopen(path, "r+b");
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_EQUAL(0, fseek(file, 0, SEEK_END));
+
+	long size = ftell(file);
+
+	/* The size doesn't match the header. */
+	TEST_ASSERT_EQUAL(0, ftruncate(fileno(file), size / 2));
+	TEST_ASSERT_EQUAL(-1, startup_image_map(&image, path, "batch"));
+	TEST_ASSERT_NULL(image.map);
+
+	TEST_ASSERT_EQUAL(0, startup_image_write(&state_rooms, path, "batch"));
+	TEST_ASSERT_EQUAL(0, fclose(file));
+
+	/* Bad magic. */
+	file = fopen(path, "r+b");
+	TEST_ASSERT_NOT_NULL(file);
+	TEST_ASSERT_NOT_EQUAL(EOF, fputc('X', file));
+	TEST_ASSERT_EQUAL(0, fclose(file));
+
+	TEST_ASSERT_EQUAL(-1, startup_image_map(&image, path, "batch"));
+
+	TEST_ASSERT_EQUAL(0, truncate(path, 0));
+	TEST_ASSERT_EQUAL(-1, startup_image_map(&image, path, "batch"));
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_unloaded);
+	RUN_TEST(test_stale);
+	RUN_TEST(test_corrupt);
+	return UNITY_END();
+}
@@ -0,0 +1,1063 @@
+#include "db/cache.h"
+#include "stb_ds.h"
+
+#include "unity.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum { EVENTS_MAX = 16, ID_MAX = 64 };
+
+/* Every test runs against each backend, which must behave the same. */
+static const struct kv_ops *const backends[] = {&kv_lmdb, &kv_memory};
+static const struct kv_ops *backend = NULL;
+static char dir[] = "/tmp/cache_test_XXXXXX";
+static struct cache cache = {0};
+
+static char room_id[] = "!room:localhost";
+static char other_room_id[] = "!other:localhost";
+static char sender[] = "@sender:localhost";
+static char type[] = "m.room.message";
+static char msgtype[] = "m.text";
+/* Event IDs stay unique across the batches of a test. */
+static size_t next_event = 0;
+
+static void
+remove_files(void) {
+	char path[sizeof(dir) + 16];
+
+	snprintf(path, sizeof(path), "%s/data.mdb", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/lock.mdb", dir);
+	unlink(path);
+}
+
+/* Save a message for each timestamp to the room in a single batch, *indices
+ * stores the index of each message. */
+static void
+save_messages(char *id, const uint64_t *ts, const char *const *bodies,
+  size_t len, uint64_t *indices) {
+	TEST_ASSERT_TRUE(len <= EVENTS_MAX);
+
+	char event_ids[EVENTS_MAX][ID_MAX];
+	struct matrix_room room = {.id = id, .type = MATRIX_ROOM_JOIN};
+	struct cache_batch batch = {0};
+	struct cache_save_txn txn = {0};
+	struct cache_deferred_space_event *deferred_events = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_batch_init(&cache, &batch));
+
+	cache_save_txn_init(&batch, &txn, room.id);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_txn_room(&txn, &room));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_room(&txn, &room));
+
+	for (size_t i = 0; i < len; i++) {
+		snprintf(event_ids[i], ID_MAX, "$event%zu:%s", next_event++, id);
+
+		struct matrix_sync_event event = {
+		  .type = MATRIX_EVENT_TIMELINE,
+		  .timeline = {
+			.type = MATRIX_ROOM_MESSAGE,
+			.base = {
+			  .event_id = event_ids[i],
+			  .sender = sender,
+			  .type = type,
+			  .origin_server_ts = ts[i],
+			},
+			.message = {.body = noconst(bodies[i]), .msgtype = msgtype},
+		  }};
+		uint64_t related_index = 0;
+
+		TEST_ASSERT_EQUAL(CACHE_EVENT_SAVED,
+		  cache_save_event(
+			&txn, &event, &indices[i], &related_index, &deferred_events));
+	}
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_txn_finish(&txn));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_batch_finish(&batch));
+
+	arrfree(deferred_events);
+}
+
+/* Save the events given as JSON to the room in a single batch, *indices
+ * stores the index of each event if it isn't NULL. */
+static void
+save_json(
+  char *id, const char *const *events, size_t len, uint64_t *indices) {
+	struct matrix_room room = {.id = id, .type = MATRIX_ROOM_JOIN};
+	struct cache_batch batch = {0};
+	struct cache_save_txn txn = {0};
+	struct cache_deferred_space_event *deferred_events = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_batch_init(&cache, &batch));
+
+	cache_save_txn_init(&batch, &txn, room.id);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_txn_room(&txn, &room));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_room(&txn, &room));
+
+	for (size_t i = 0; i < len; i++) {
+		matrix_json_t *json = matrix_json_parse(events[i], strlen(events[i]));
+		struct matrix_sync_event event = {0};
+		uint64_t index = 0;
+		uint64_t related_index = 0;
+
+		TEST_ASSERT_NOT_NULL(json);
+		TEST_ASSERT_EQUAL(0, matrix_event_sync_parse(&event, json));
+		TEST_ASSERT_EQUAL(CACHE_EVENT_SAVED,
+		  cache_save_event(
+			&txn, &event, &index, &related_index, &deferred_events));
+
+		if (indices) {
+			indices[i] = index;
+		}
+
+		matrix_json_delete(json);
+	}
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_save_txn_finish(&txn));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_batch_finish(&batch));
+
+	arrfree(deferred_events);
+}
+
+static void
+save_state(const char *const *events, size_t len) {
+	save_json(room_id, events, len, NULL);
+}
+
+static uint32_t
+member_count(void) {
+	struct cache_snapshot snapshot = {0};
+	struct room_info info = {0};
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_room_info_init(&snapshot, &info, room_id));
+	cache_snapshot_end(&snapshot);
+
+	uint32_t count = info.member_count;
+	cache_room_info_finish(&info);
+
+	return count;
+}
+
+static void
+init_cache_options(struct cache_options options) {
+	options.backend = backend;
+	options.dir = dir;
+
+	TEST_ASSERT_EQUAL(0, cache_init(&cache, &options));
+}
+
+static void
+init_cache(void) {
+	init_cache_options((struct cache_options) {0});
+}
+
+static void
+finish_cache(void) {
+	cache_finish(&cache);
+	memset(&cache, 0, sizeof(cache));
+}
+
+void
+setUp(void) {
+	next_event = 0;
+	init_cache();
+}
+
+void
+tearDown(void) {
+	finish_cache();
+	remove_files();
+}
+
+void
+test_index_at_same_ts(void) {
+	const uint64_t ts[] = {1000, 2000, 2000, 3000};
+	const char *const bodies[] = {"first", "second", "third", "fourth"};
+	uint64_t indices[4];
+
+	save_messages(room_id, ts, bodies, 4, indices);
+
+	struct cache_snapshot snapshot = {0};
+	uint64_t index = 0;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+
+	/* The oldest of the events sent in the same ms. */
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_event_index_at(&snapshot, room_id, 2000, &index));
+	TEST_ASSERT_TRUE(index == indices[1]);
+
+	/* Indexed after the duplicate timestamp. */
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_event_index_at(&snapshot, room_id, 2001, &index));
+	TEST_ASSERT_TRUE(index == indices[3]);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, cache_event_index_at(&snapshot, room_id, 3001, &index));
+
+	cache_snapshot_end(&snapshot);
+}
+
+void
+test_search_ranking(void) {
+	const uint64_t ts[] = {1000, 2000, 3000};
+	const char *const bodies[] = {"hello world", "World, hello again", "hello"};
+	uint64_t indices[3];
+
+	save_messages(room_id, ts, bodies, 3, indices);
+
+	struct cache_snapshot snapshot = {0};
+	struct cache_search_hit *hits = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_search(&snapshot, "Hello world", 10, &hits));
+	cache_snapshot_end(&snapshot);
+
+	/* Events with every token first, the newest of equal ones first. */
+	TEST_ASSERT_EQUAL(3, arrlenu(hits));
+	TEST_ASSERT_TRUE(hits[0].index == indices[1]);
+	TEST_ASSERT_EQUAL(2, hits[0].score);
+	TEST_ASSERT_TRUE(hits[0].origin_server_ts == 2000);
+	TEST_ASSERT_EQUAL_STRING("World, hello again", hits[0].body);
+	TEST_ASSERT_EQUAL_STRING(room_id, hits[0].room_id);
+	TEST_ASSERT_TRUE(hits[1].index == indices[0]);
+	TEST_ASSERT_EQUAL(2, hits[1].score);
+	TEST_ASSERT_TRUE(hits[2].index == indices[2]);
+	TEST_ASSERT_EQUAL(1, hits[2].score);
+
+	cache_search_hits_free(hits);
+}
+
+void
+test_search_max_hits(void) {
+	const uint64_t ts[] = {5000, 1000, 4000, 2000, 3000};
+	const char *const bodies[] = {"spam", "spam", "spam", "spam", "spam"};
+	uint64_t indices[5];
+
+	save_messages(room_id, ts, bodies, 5, indices);
+
+	struct cache_snapshot snapshot = {0};
+	struct cache_search_hit *hits = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_search(&snapshot, "spam", 2, &hits));
+	cache_snapshot_end(&snapshot);
+
+	/* The newest ones by timestamp, not by index. */
+	TEST_ASSERT_EQUAL(2, arrlenu(hits));
+	TEST_ASSERT_TRUE(hits[0].index == indices[0]);
+	TEST_ASSERT_TRUE(hits[1].index == indices[2]);
+
+	cache_search_hits_free(hits);
+}
+
+void
+test_search_rooms(void) {
+	const uint64_t ts[] = {1000, 2000};
+	const char *const bodies[] = {"lunch today?", "unrelated"};
+	const char *const other_bodies[] = {"unrelated", "lunch tomorrow"};
+	uint64_t indices[2];
+	uint64_t other_indices[2];
+
+	save_messages(room_id, ts, bodies, 2, indices);
+	save_messages(other_room_id, ts, other_bodies, 2, other_indices);
+
+	struct cache_snapshot snapshot = {0};
+	struct cache_search_hit *hits = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_search(&snapshot, "lunch", 10, &hits));
+	cache_snapshot_end(&snapshot);
+
+	TEST_ASSERT_EQUAL(2, arrlenu(hits));
+	TEST_ASSERT_EQUAL_STRING(other_room_id, hits[0].room_id);
+	TEST_ASSERT_TRUE(hits[0].index == other_indices[1]);
+	TEST_ASSERT_EQUAL_STRING(room_id, hits[1].room_id);
+	TEST_ASSERT_TRUE(hits[1].index == indices[0]);
+
+	cache_search_hits_free(hits);
+
+	/* Tokens without postings don't match anything. */
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_search(&snapshot, "dinner", 10, &hits));
+	cache_snapshot_end(&snapshot);
+
+	TEST_ASSERT_EQUAL(0, arrlenu(hits));
+
+	cache_search_hits_free(hits);
+}
+
+#define MEMBER(id, user, membership)                                           \
+	"{\"type\":\"m.room.member\",\"event_id\":\"" id                           \
+	"\",\"sender\":\"" user "\",\"state_key\":\"" user                         \
+	"\",\"origin_server_ts\":1,\"content\":{\"membership\":\""                 \
+	membership "\"}}"
+
+void
+test_member_count(void) {
+	const char *const events[] = {
+	  MEMBER("$a", "@a:localhost", "join"),
+	  MEMBER("$b", "@b:localhost", "join"),
+	  MEMBER("$c", "@c:localhost", "invite"),
+	  MEMBER("$d", "@d:localhost", "ban"),
+	  /* Counted once. */
+	  MEMBER("$a2", "@a:localhost", "join"),
+	  MEMBER("$b2", "@b:localhost", "leave"),
+	};
+
+	save_state(events, 6);
+	TEST_ASSERT_EQUAL(1, member_count());
+
+	const char *const transitions[] = {
+	  MEMBER("$b3", "@b:localhost", "join"),
+	  MEMBER("$c2", "@c:localhost", "join"),
+	  MEMBER("$a3", "@a:localhost", "ban"),
+	};
+
+	save_state(transitions, 3);
+	TEST_ASSERT_EQUAL(2, member_count());
+}
+
+enum { V1_MAP_SIZE = 16 * 1024 * 1024, V1_MAX_DBS = 64 };
+
+static char space_id[] = "!space:localhost";
+
+#define MESSAGE(id, ts, body)                                                  \
+	"{\"type\":\"m.room.message\",\"event_id\":\"" id                          \
+	"\",\"sender\":\"@a:localhost\",\"origin_server_ts\":" #ts                \
+	",\"content\":{\"msgtype\":\"m.text\",\"body\":\"" body "\"}}"
+
+#define EDIT(id, ts, body, parent)                                             \
+	"{\"type\":\"m.room.message\",\"event_id\":\"" id                          \
+	"\",\"sender\":\"@a:localhost\",\"origin_server_ts\":" #ts                \
+	",\"content\":{\"msgtype\":\"m.text\",\"body\":\"* " body                  \
+	"\",\"m.new_content\":{\"msgtype\":\"m.text\",\"body\":\"" body            \
+	"\"},\"m.relates_to\":{\"rel_type\":\"m.replace\",\"event_id\":\"" parent \
+	"\"}}}"
+
+#define STATE(type, state_key, content)                                        \
+	"{\"type\":\"" type "\",\"event_id\":\"$" type                             \
+	"\",\"sender\":\"@a:localhost\",\"state_key\":\"" state_key                \
+	"\",\"origin_server_ts\":1,\"content\":" content "}"
+
+static struct kv_env *
+v1_open(void) {
+	struct kv_env *env = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_env_open(&kv_lmdb, &env, dir, 0, V1_MAP_SIZE, V1_MAX_DBS));
+
+	return env;
+}
+
+/* DB of schema version 1, room is NULL for global DBs. */
+static kv_dbi
+v1_dbi(struct kv_txn *txn, const char *room, const char *name,
+  unsigned flags) {
+	char path[128];
+	kv_dbi dbi = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", room ? room : "", name);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_dbi_open(txn, room ? path : name, MDB_CREATE | flags, &dbi));
+
+	return dbi;
+}
+
+static void
+v1_put(struct kv_txn *txn, const char *room, const char *name,
+  const char *key, const char *value) {
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_put(txn, v1_dbi(txn, room, name, 0),
+		&(MDB_val) {strlen(key) + 1, noconst(key)},
+		&(MDB_val) {strlen(value) + 1, noconst(value)}, 0));
+}
+
+/* Events keyed by event ID, in the order of their native-endian index. */
+static void
+v1_put_events(struct kv_txn *txn, const char *room,
+  const char *const *event_ids, const char *const *events, size_t len) {
+	kv_dbi order = v1_dbi(txn, room, "order2event", MDB_INTEGERKEY);
+	kv_dbi rev_order = v1_dbi(txn, room, "event2order", 0);
+
+	for (uint64_t i = 0; i < len; i++) {
+		MDB_val id = {strlen(event_ids[i]) + 1, noconst(event_ids[i])};
+
+		v1_put(txn, room, "events", event_ids[i], events[i]);
+		TEST_ASSERT_EQUAL(MDB_SUCCESS,
+		  kv_put(txn, order, &(MDB_val) {sizeof(i), &i}, &id, 0));
+		TEST_ASSERT_EQUAL(MDB_SUCCESS,
+		  kv_put(txn, rev_order, &id, &(MDB_val) {sizeof(i), &i}, 0));
+	}
+}
+
+static void
+v1_put_room(struct kv_txn *txn) {
+	const char *const event_ids[] = {"$m0", "$m1", "$m2"};
+	const char *const events[] = {
+	  MESSAGE("$m0", 1000, "lunch today?"),
+	  MESSAGE("$m1", 2000, "unrelated"),
+	  EDIT("$m2", 3000, "lunch tomorrow?", "$m0"),
+	};
+
+	v1_put(txn, NULL, "rooms", room_id, "");
+	v1_put_events(txn, room_id, event_ids, events, 3);
+	v1_put(txn, room_id, "members", "@a:localhost",
+	  "{\"type\":\"m.room.member\",\"event_id\":\"$a\",\"sender\":\"@a:"
+	  "localhost\",\"state_key\":\"@a:localhost\",\"origin_server_ts\":1,"
+	  "\"content\":{\"membership\":\"join\",\"displayname\":\"Alice\"}}");
+	v1_put(txn, room_id, "members", "@b:localhost",
+	  MEMBER("$b", "@b:localhost", "leave"));
+	v1_put(txn, room_id, "state", "m.room.name",
+	  STATE("m.room.name", "", "{\"name\":\"Lunch\"}"));
+}
+
+static void
+v1_put_space(struct kv_txn *txn) {
+	v1_put(txn, NULL, "rooms", space_id, "");
+	v1_put(txn, space_id, "state", "m.room.create",
+	  STATE("m.room.create", "",
+		"{\"creator\":\"@a:localhost\",\"type\":\"m.space\"}"));
+	v1_put(txn, space_id, "space_child", room_id,
+	  STATE("m.space.child", "!room:localhost", "{\"via\":[\"localhost\"]}"));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_put(txn, v1_dbi(txn, NULL, "space_children", MDB_DUPSORT),
+		&(MDB_val) {sizeof(space_id), space_id},
+		&(MDB_val) {sizeof(room_id), room_id}, 0));
+}
+
+/* Everything written by v1_put_room() and v1_put_space() is readable. */
+static void
+assert_v1_migrated(void) {
+	struct cache_snapshot snapshot = {0};
+	struct cache_iterator iterator = {0};
+	struct cache_iterator_event event = {0};
+	struct cache_iterator_member member = {0};
+	struct cache_iterator_space space = {0};
+	struct cache_search_hit *hits = NULL;
+	struct room_info info = {0};
+	uint64_t index = 0;
+	bool found_edited = false;
+
+	char *next_batch = cache_auth_get(&cache, DB_KEY_NEXT_BATCH);
+	TEST_ASSERT_EQUAL_STRING("s42", next_batch);
+	free(next_batch);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  cache_iterator_events(&snapshot, &iterator, room_id, &event,
+		(uint64_t) -1, EVENTS_MAX, MATRIX_ROOM_MESSAGE, 0));
+
+	while ((cache_iterator_next(&iterator)) == MDB_SUCCESS) {
+		if (event.index == 0) {
+			TEST_ASSERT_EQUAL_STRING(
+			  "lunch today?", event.event.timeline.message.body);
+			TEST_ASSERT_TRUE(event.aggregation.edit_index == 2);
+			found_edited = true;
+		}
+	}
+
+	cache_iterator_finish(&iterator);
+	TEST_ASSERT_TRUE(found_edited);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_event_index_at(&snapshot, room_id, 1500, &index));
+	TEST_ASSERT_TRUE(index == 1);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  cache_member_get(&snapshot, room_id, "@a:localhost", &member));
+	TEST_ASSERT_EQUAL_STRING("Alice", member.username);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_room_info_init(&snapshot, &info, room_id));
+	TEST_ASSERT_EQUAL_STRING("Lunch", info.name);
+	TEST_ASSERT_EQUAL(1, info.member_count);
+	cache_room_info_finish(&info);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_room_info_init(&snapshot, &info, space_id));
+	TEST_ASSERT_TRUE(info.is_space);
+	cache_room_info_finish(&info);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_iterator_spaces(&snapshot, &iterator, &space));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_iterator_next(&iterator));
+	TEST_ASSERT_EQUAL_STRING(space_id, space.id);
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_iterator_next(&space.children_iterator));
+	TEST_ASSERT_EQUAL_STRING(room_id, space.child_id);
+	cache_iterator_finish(&iterator);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_search(&snapshot, "lunch", 10, &hits));
+	cache_snapshot_end(&snapshot);
+
+	/* The message and it's edit. */
+	TEST_ASSERT_EQUAL(2, arrlenu(hits));
+	TEST_ASSERT_TRUE(hits[0].index == 2);
+	TEST_ASSERT_TRUE(hits[0].origin_server_ts == 3000);
+	TEST_ASSERT_TRUE(hits[1].index == 0);
+
+	cache_search_hits_free(hits);
+}
+
+void
+test_migrate_v1(void) {
+	if (!backend->durable) {
+		TEST_IGNORE_MESSAGE("Nothing to migrate without a durable backend");
+	}
+
+	/* Replace the cache of setUp() with one of schema version 1. */
+	finish_cache();
+	remove_files();
+
+	struct kv_env *env = v1_open();
+	struct kv_txn *txn = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(env, 0, &txn));
+	v1_put_room(txn);
+	v1_put_space(txn);
+	v1_put(txn, NULL, "auth", "next_batch", "s42");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+	kv_env_close(env);
+
+	init_cache();
+	assert_v1_migrated();
+}
+
+void
+test_migrate_v1_resume(void) {
+	if (!backend->durable) {
+		TEST_IGNORE_MESSAGE("Nothing to migrate without a durable backend");
+	}
+
+	finish_cache();
+	remove_files();
+
+	/* Sorts before the other rooms, so it's migrated first. */
+	const char *const event_ids[] = {"$o0"};
+	const char *const events[] = {MESSAGE("$o0", 500, "meet at noon")};
+
+	struct kv_env *env = v1_open();
+	struct kv_txn *txn = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(env, 0, &txn));
+	v1_put(txn, NULL, "rooms", other_room_id, "");
+	v1_put_events(txn, other_room_id, event_ids, events, 1);
+	v1_put(txn, NULL, "auth", "next_batch", "s42");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+	kv_env_close(env);
+
+	init_cache();
+	finish_cache();
+
+	/* As if the migration was interrupted after the first room. */
+	const char version_key[] = "schema_version";
+	const char progress_key[] = "migrated_room";
+	MDB_val progress = {0};
+
+	env = v1_open();
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(env, 0, &txn));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_del(txn, v1_dbi(txn, NULL, "meta", 0),
+		&(MDB_val) {sizeof(version_key), noconst(version_key)}, NULL));
+	v1_put(txn, NULL, "meta", progress_key, other_room_id);
+	v1_put_room(txn);
+	v1_put_space(txn);
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+	kv_env_close(env);
+
+	init_cache();
+	assert_v1_migrated();
+
+	struct cache_snapshot snapshot = {0};
+	struct cache_search_hit *hits = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_search(&snapshot, "noon", 10, &hits));
+	cache_snapshot_end(&snapshot);
+
+	/* The first room was kept as it was and not migrated again. */
+	TEST_ASSERT_EQUAL(1, arrlenu(hits));
+	TEST_ASSERT_EQUAL_STRING(other_room_id, hits[0].room_id);
+	TEST_ASSERT_TRUE(hits[0].index == 0);
+
+	cache_search_hits_free(hits);
+	finish_cache();
+
+	/* The progress is cleared once every room is migrated. */
+	env = v1_open();
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(env, 0, &txn));
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND,
+	  kv_get(txn, v1_dbi(txn, NULL, "meta", 0),
+		&(MDB_val) {sizeof(progress_key), noconst(progress_key)},
+		&progress));
+	kv_txn_abort(txn);
+	kv_env_close(env);
+
+	init_cache();
+}
+
+/* Replace the cache of setUp() with an empty one using the options. */
+static void
+reopen_cache(struct cache_options options) {
+	finish_cache();
+	remove_files();
+	init_cache_options(options);
+}
+
+/* Number of entries in the DB, counting each duplicate. */
+static size_t
+db_entries(kv_dbi dbi) {
+	struct cache_snapshot snapshot = {0};
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = {0};
+	MDB_val data = {0};
+	size_t len = 0;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(snapshot.txn, dbi, &cursor));
+
+	while ((kv_cursor_get(cursor, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+		len++;
+	}
+
+	kv_cursor_close(cursor);
+	cache_snapshot_end(&snapshot);
+
+	return len;
+}
+
+/* Indices of the messages in the room, newest first. */
+static size_t
+message_indices(uint64_t *indices, size_t max) {
+	struct cache_snapshot snapshot = {0};
+	struct cache_iterator iterator = {0};
+	struct cache_iterator_event event = {0};
+	size_t len = 0;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  cache_iterator_events(&snapshot, &iterator, room_id, &event,
+		(uint64_t) -1, max, MATRIX_ROOM_MESSAGE, 0));
+
+	while (len < max && (cache_iterator_next(&iterator)) == MDB_SUCCESS) {
+		indices[len++] = event.index;
+	}
+
+	cache_iterator_finish(&iterator);
+	cache_snapshot_end(&snapshot);
+
+	return len;
+}
+
+static size_t
+search_hits(const char *query) {
+	struct cache_snapshot snapshot = {0};
+	struct cache_search_hit *hits = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_search(&snapshot, query, 100, &hits));
+	cache_snapshot_end(&snapshot);
+
+	size_t len = arrlenu(hits);
+	cache_search_hits_free(hits);
+
+	return len;
+}
+
+/* The first 3 events are over the limits of both tests below, the others
+ * are from the year 2100. */
+static void
+save_prunable(uint64_t *indices) {
+	const char *const events[] = {
+	  MESSAGE("$p0", 1000, "alpha"),
+	  EDIT("$p1", 2000, "alpha beta", "$p0"),
+	  MESSAGE("$p2", 3000, "gamma"),
+	  MESSAGE("$p3", 4102444800000, "delta"),
+	  MESSAGE("$p4", 4102444800001, "epsilon"),
+	};
+
+	save_json(room_id, events, 5, indices);
+}
+
+/* Only $p3 and $p4 are left, along with their postings and timestamps. */
+static void
+assert_pruned(const uint64_t *indices) {
+	struct cache_snapshot snapshot = {0};
+	uint64_t left[EVENTS_MAX];
+	uint64_t index = 0;
+
+	TEST_ASSERT_EQUAL(2, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_TRUE(left[0] == indices[4]);
+	TEST_ASSERT_TRUE(left[1] == indices[3]);
+
+	TEST_ASSERT_EQUAL(0, search_hits("alpha"));
+	TEST_ASSERT_EQUAL(0, search_hits("gamma"));
+	TEST_ASSERT_EQUAL(1, search_hits("delta"));
+	TEST_ASSERT_EQUAL(2, db_entries(cache.dbs[DB_SEARCH]));
+
+	TEST_ASSERT_EQUAL(2, db_entries(cache.room_dbs[ROOM_DB_TS_TO_ORDER]));
+	TEST_ASSERT_EQUAL(0, db_entries(cache.room_dbs[ROOM_DB_RELATIONS]));
+	TEST_ASSERT_EQUAL(0, db_entries(cache.room_dbs[ROOM_DB_AGGREGATIONS]));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_event_index_at(&snapshot, room_id, 0, &index));
+	cache_snapshot_end(&snapshot);
+
+	TEST_ASSERT_TRUE(index == indices[3]);
+}
+
+void
+test_prune_retain_events(void) {
+	reopen_cache((struct cache_options) {.retain_events = 2});
+
+	uint64_t indices[5];
+	size_t pruned = 0;
+
+	save_prunable(indices);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_prune(&cache, &pruned));
+	TEST_ASSERT_EQUAL(3, pruned);
+	assert_pruned(indices);
+}
+
+void
+test_prune_retain_age(void) {
+	const uint64_t year_ms = 365ULL * 24 * 60 * 60 * 1000;
+
+	reopen_cache((struct cache_options) {.retain_age_ms = year_ms});
+
+	uint64_t indices[5];
+	size_t pruned = 0;
+
+	save_prunable(indices);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_prune(&cache, &pruned));
+	TEST_ASSERT_EQUAL(3, pruned);
+	assert_pruned(indices);
+}
+
+void
+test_prune_keeps_latest(void) {
+	reopen_cache(
+	  (struct cache_options) {.retain_events = 1, .retain_age_ms = 1});
+
+	const uint64_t ts[] = {1000, 2000, 3000};
+	const char *const bodies[] = {"first", "second", "third"};
+	uint64_t indices[3];
+
+	save_messages(room_id, ts, bodies, 3, indices);
+
+	size_t pruned = 0;
+	uint64_t left[EVENTS_MAX];
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_prune(&cache, &pruned));
+	TEST_ASSERT_EQUAL(2, pruned);
+	TEST_ASSERT_EQUAL(1, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_TRUE(left[0] == indices[2]);
+
+	/* Nothing is left to prune. */
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_prune(&cache, &pruned));
+	TEST_ASSERT_EQUAL(0, pruned);
+	TEST_ASSERT_EQUAL(1, message_indices(left, EVENTS_MAX));
+}
+
+void
+test_prune_frozen(void) {
+	enum { total = CACHE_EVENT_BLOCK_SIZE + 6, kept = 10 };
+
+	const uint64_t day_ms = 24ULL * 60 * 60 * 1000;
+
+	reopen_cache(
+	  (struct cache_options) {.retain_events = kept, .cold_age_ms = day_ms});
+
+	const char *bodies[EVENTS_MAX];
+	uint64_t ts[EVENTS_MAX];
+	uint64_t indices[EVENTS_MAX];
+	uint64_t first = 0;
+
+	for (size_t i = 0; i < EVENTS_MAX; i++) {
+		bodies[i] = "spam";
+	}
+
+	for (size_t saved = 0; saved < total;) {
+		size_t len = total - saved < EVENTS_MAX ? total - saved : EVENTS_MAX;
+
+		for (size_t i = 0; i < len; i++) {
+			ts[i] = 1000 + saved + i;
+		}
+
+		save_messages(room_id, ts, bodies, len, indices);
+
+		if (saved == 0) {
+			first = indices[0];
+		}
+
+		saved += len;
+	}
+
+	size_t frozen = 0;
+	size_t pruned = 0;
+	uint64_t left[total];
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_freeze(&cache, &frozen));
+	TEST_ASSERT_EQUAL(CACHE_EVENT_BLOCK_SIZE, frozen);
+	TEST_ASSERT_EQUAL(1, db_entries(cache.room_dbs[ROOM_DB_EVENT_BLOCKS]));
+	TEST_ASSERT_EQUAL(total, message_indices(left, total));
+
+	/* The block is thawed, as the events to keep start within it. */
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_prune(&cache, &pruned));
+	TEST_ASSERT_EQUAL(total - kept, pruned);
+	TEST_ASSERT_EQUAL(0, db_entries(cache.room_dbs[ROOM_DB_EVENT_BLOCKS]));
+	TEST_ASSERT_EQUAL(kept, message_indices(left, total));
+
+	for (size_t i = 0; i < kept; i++) {
+		TEST_ASSERT_TRUE(left[i] == first + total - 1 - i);
+	}
+
+	TEST_ASSERT_EQUAL(kept, search_hits("spam"));
+	TEST_ASSERT_EQUAL(kept, db_entries(cache.dbs[DB_SEARCH]));
+	TEST_ASSERT_EQUAL(kept, db_entries(cache.room_dbs[ROOM_DB_TS_TO_ORDER]));
+}
+
+void
+test_compact(void) {
+	if (!backend->durable) {
+		TEST_ASSERT_EQUAL(ENOTSUP, cache_compact(&cache));
+		return;
+	}
+
+	const uint64_t ts[] = {1000, 2000, 3000};
+	const char *const bodies[] = {"before", "compacting", "before"};
+	const char *const after_bodies[] = {"after"};
+	uint64_t indices[3];
+	uint64_t after_index = 0;
+	uint64_t left[EVENTS_MAX];
+
+	save_messages(room_id, ts, bodies, 3, indices);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_compact(&cache));
+	TEST_ASSERT_EQUAL(3, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_EQUAL(2, search_hits("before"));
+
+	/* The swapped in env can be written to. */
+	save_messages(room_id, &ts[2], after_bodies, 1, &after_index);
+
+	TEST_ASSERT_TRUE(after_index == indices[2] + 1);
+	TEST_ASSERT_EQUAL(4, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_EQUAL(1, search_hits("after"));
+
+	/* And survives being reopened. */
+	finish_cache();
+	init_cache();
+
+	TEST_ASSERT_EQUAL(4, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_EQUAL(2, search_hits("before"));
+}
+
+void
+test_state_rebuild(void) {
+	const char *const events[] = {
+	  STATE("m.room.name", "", "{\"name\":\"Lunch\"}"),
+	  STATE("m.room.topic", "", "{\"topic\":\"Where to eat\"}"),
+	  STATE("m.room.create", "",
+		"{\"creator\":\"@a:localhost\",\"type\":\"m.space\"}"),
+	};
+
+	save_state(events, 3);
+
+	/* The summary is rebuilt from the stored state if it's missing. */
+	struct kv_txn *txn = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(cache.env, 0, &txn));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_del(txn, cache.dbs[DB_ROOMS],
+		&(MDB_val) {sizeof(room_id), room_id}, NULL));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+
+	struct cache_snapshot snapshot = {0};
+	struct room_info info = {0};
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_snapshot_begin(&cache, &snapshot));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, cache_room_info_init(&snapshot, &info, room_id));
+	cache_snapshot_end(&snapshot);
+
+	TEST_ASSERT_EQUAL_STRING("Lunch", info.name);
+	TEST_ASSERT_EQUAL_STRING("Where to eat", info.topic);
+	TEST_ASSERT_TRUE(info.is_space);
+
+	cache_room_info_finish(&info);
+}
+
+enum { TINY_MAP_SIZE = 256 * 1024, BIG_BODY_SIZE = 16 * 1024 };
+
+/* Save the messages and next_batch in a single batch like the sync writer
+ * does, nothing else is saved once the map is full. */
+static int
+try_save_messages(
+  const char *const *bodies, size_t len, const char *next_batch) {
+	struct matrix_room room = {.id = room_id, .type = MATRIX_ROOM_JOIN};
+	struct cache_batch batch = {0};
+	struct cache_save_txn txn = {0};
+	struct cache_deferred_space_event *deferred_events = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, cache_batch_init(&cache, &batch));
+
+	cache_save_txn_init(&batch, &txn, room.id);
+
+	int ret = cache_save_txn_room(&txn, &room);
+
+	if (ret == MDB_SUCCESS) {
+		ret = cache_save_room(&txn, &room);
+	}
+
+	for (size_t i = 0; i < len && ret == MDB_SUCCESS; i++) {
+		char event_id[ID_MAX];
+		snprintf(event_id, sizeof(event_id), "$big%zu:%s", i, room_id);
+
+		struct matrix_sync_event event = {
+		  .type = MATRIX_EVENT_TIMELINE,
+		  .timeline = {
+			.type = MATRIX_ROOM_MESSAGE,
+			.base = {
+			  .event_id = event_id,
+			  .sender = sender,
+			  .type = type,
+			  .origin_server_ts = 1000 + i,
+			},
+			.message = {.body = noconst(bodies[i]), .msgtype = msgtype},
+		  }};
+		uint64_t index = 0;
+		uint64_t related_index = 0;
+
+		enum cache_save_error saved = cache_save_event(
+		  &txn, &event, &index, &related_index, &deferred_events);
+
+		if (saved == CACHE_EVENT_FAILED) {
+			ret = MDB_MAP_FULL;
+		} else {
+			TEST_ASSERT_EQUAL(CACHE_EVENT_SAVED, saved);
+		}
+	}
+
+	int finish_ret = cache_save_txn_finish(&txn);
+
+	if (ret == MDB_SUCCESS) {
+		ret = finish_ret;
+	}
+
+	if (ret == MDB_SUCCESS) {
+		ret = cache_batch_auth_set(&batch, DB_KEY_NEXT_BATCH, next_batch);
+	}
+
+	TEST_ASSERT_TRUE(
+	  ret == MDB_SUCCESS || ret == MDB_MAP_FULL || ret == MDB_BAD_TXN);
+
+	arrfree(deferred_events);
+
+	/* The batch knows whether it failed, like in write_response(). */
+	return cache_batch_finish(&batch);
+}
+
+/* The messages and next_batch of the batch replayed by
+ * test_map_full_replay(). */
+static void
+assert_replayed(void) {
+	uint64_t left[EVENTS_MAX];
+
+	TEST_ASSERT_EQUAL(EVENTS_MAX, message_indices(left, EVENTS_MAX));
+	TEST_ASSERT_EQUAL(EVENTS_MAX, search_hits("aaaaaaa"));
+
+	char *next_batch = cache_auth_get(&cache, DB_KEY_NEXT_BATCH);
+	TEST_ASSERT_EQUAL_STRING("s1", next_batch);
+	free(next_batch);
+}
+
+void
+test_map_full_replay(void) {
+	enum { max_replays = 4 };
+
+	static char body[BIG_BODY_SIZE];
+	const char *bodies[EVENTS_MAX];
+	struct kv_env_info info = {0};
+	size_t replays = 0;
+	int ret = MDB_SUCCESS;
+
+	/* The batch only fits after the map is grown once. */
+	reopen_cache((struct cache_options) {.map_size = TINY_MAP_SIZE});
+
+	/* A single token, so that the records take up the space. */
+	for (size_t i = 0; i < sizeof(body) - 1; i++) {
+		body[i] = (i % 8 == 7) ? ' ' : 'a';
+	}
+
+	for (size_t i = 0; i < EVENTS_MAX; i++) {
+		bodies[i] = body;
+	}
+
+	while ((ret = try_save_messages(bodies, EVENTS_MAX, "s1")) == MDB_MAP_FULL
+		   && replays < max_replays) {
+		replays++;
+	}
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, ret);
+	TEST_ASSERT_EQUAL(1, replays);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_env_info(cache.env, &info));
+	TEST_ASSERT_TRUE(info.map_size >= 2 * TINY_MAP_SIZE);
+
+	assert_replayed();
+
+	/* Committed for good, not only visible to the env it was saved with. */
+	if (backend->durable) {
+		finish_cache();
+		init_cache();
+		assert_replayed();
+	}
+}
+
+int
+main(void) {
+	if (!mkdtemp(dir)) {
+		return EXIT_FAILURE;
+	}
+
+	UNITY_BEGIN();
+
+	for (size_t i = 0; i < (sizeof(backends) / sizeof(*backends)); i++) {
+		backend = backends[i];
+
+		RUN_TEST(test_index_at_same_ts);
+		RUN_TEST(test_search_ranking);
+		RUN_TEST(test_search_max_hits);
+		RUN_TEST(test_search_rooms);
+		RUN_TEST(test_member_count);
+		RUN_TEST(test_migrate_v1);
+		RUN_TEST(test_migrate_v1_resume);
+		RUN_TEST(test_prune_retain_events);
+		RUN_TEST(test_prune_retain_age);
+		RUN_TEST(test_prune_keeps_latest);
+		RUN_TEST(test_prune_frozen);
+		RUN_TEST(test_compact);
+		RUN_TEST(test_map_full_replay);
+		RUN_TEST(test_state_rebuild);
+	}
+
+	rmdir(dir);
+
+	return UNITY_END();
+}
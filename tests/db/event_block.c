@@ -0,0 +1,181 @@
+#include "db/event_block.h"
+
+#include "stb_ds.h"
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { NUM_EVENTS = 64 };
+
+static unsigned char *raw = NULL;
+static char records[NUM_EVENTS][128];
+static char json[] = "{\"type\":\"m.room.message\",\"content\":{}}";
+
+static void
+fill(uint64_t first_index) {
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		int len = snprintf(records[i], sizeof(records[i]),
+		  "{\"sender\":\"@user%zu:localhost\",\"origin_server_ts\":%zu,"
+		  "\"content\":{\"body\":\"Message %zu\"}}",
+		  i % 4, 1000 + i, i);
+		TEST_ASSERT_TRUE(len > 0);
+
+		event_block_append(&raw, &(struct event_block_entry) {
+								   .index = first_index + i,
+								   .record = records[i],
+								   .record_size = (uint32_t) len + 1,
+								   .json = (i % 2) ? json : NULL,
+								   .json_size = (i % 2) ? sizeof(json) : 0,
+								 });
+	}
+}
+
+static unsigned char *
+compress(const unsigned char *dict, size_t dict_size, size_t *len) {
+	struct event_block_header header = {
+	  .count = NUM_EVENTS,
+	  .id = 42,
+	  .last_index = 100 + NUM_EVENTS - 1,
+	  .first_ts = 1000,
+	};
+	unsigned char *buf = NULL;
+
+	TEST_ASSERT_EQUAL(0, event_block_compress(&header, raw, arrlenu(raw), dict,
+						   dict_size, &buf, len));
+	TEST_ASSERT_NOT_NULL(buf);
+
+	return buf;
+}
+
+void
+setUp(void) {
+	fill(100);
+}
+
+void
+tearDown(void) {
+	arrfree(raw);
+	raw = NULL;
+}
+
+void
+test_roundtrip(void) {
+	size_t len = 0;
+	unsigned char *buf = compress(NULL, 0, &len);
+
+	TEST_ASSERT_TRUE(len < arrlenu(raw));
+
+	struct event_block_header header = {0};
+	TEST_ASSERT_EQUAL(0, event_block_header(buf, len, &header));
+	TEST_ASSERT_EQUAL(NUM_EVENTS, header.count);
+	TEST_ASSERT_EQUAL(42, header.id);
+	TEST_ASSERT_EQUAL(100 + NUM_EVENTS - 1, header.last_index);
+	TEST_ASSERT_EQUAL(1000, header.first_ts);
+	TEST_ASSERT_EQUAL(0, header.dict_id);
+
+	struct event_block *block = event_block_decompress(buf, len, NULL, 0);
+	TEST_ASSERT_NOT_NULL(block);
+	TEST_ASSERT_EQUAL(42, block->id);
+	TEST_ASSERT_EQUAL(NUM_EVENTS, arrlenu(block->entries));
+
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		struct event_block_entry *entry = &block->entries[i];
+
+		TEST_ASSERT_EQUAL(100 + i, entry->index);
+		TEST_ASSERT_EQUAL_STRING(records[i], entry->record);
+
+		if (i % 2) {
+			TEST_ASSERT_EQUAL_STRING(json, entry->json);
+		} else {
+			TEST_ASSERT_NULL(entry->json);
+		}
+	}
+
+	TEST_ASSERT_EQUAL(-1, event_block_find(block, 99));
+	TEST_ASSERT_EQUAL(0, event_block_find(block, 100));
+	TEST_ASSERT_EQUAL(10, event_block_find(block, 110));
+	TEST_ASSERT_EQUAL(-1, event_block_find(block, 100 + NUM_EVENTS));
+
+	TEST_ASSERT_EQUAL(0, event_block_count_before(block, 99));
+	TEST_ASSERT_EQUAL(1, event_block_count_before(block, 100));
+	TEST_ASSERT_EQUAL(NUM_EVENTS, event_block_count_before(block, UINT64_MAX));
+
+	/* Shared with the block cache. */
+	event_block_ref(block);
+	event_block_unref(block);
+	TEST_ASSERT_EQUAL(1, block->refs);
+	event_block_unref(block);
+
+	free(buf);
+}
+
+void
+test_dict(void) {
+	const unsigned char *samples[NUM_EVENTS];
+	size_t sizes[NUM_EVENTS];
+
+	for (size_t i = 0; i < NUM_EVENTS; i++) {
+		samples[i] = (const unsigned char *) records[i];
+		sizes[i] = strlen(records[i]);
+	}
+
+	static unsigned char dict[EVENT_BLOCK_DICT_MAX];
+	size_t dict_size
+	  = event_block_dict_train(samples, sizes, NUM_EVENTS, dict, sizeof(dict));
+
+	TEST_ASSERT_TRUE(dict_size > 0);
+	TEST_ASSERT_TRUE(dict_size <= sizeof(dict));
+
+	/* Small blocks benefit the most from the dictionary. */
+	arrsetlen(raw, 0);
+	fill(100);
+
+	size_t plain_len = 0;
+	unsigned char *plain = compress(NULL, 0, &plain_len);
+	size_t len = 0;
+	unsigned char *buf = compress(dict, dict_size, &len);
+
+	TEST_ASSERT_TRUE(len < plain_len);
+
+	struct event_block *block
+	  = event_block_decompress(buf, len, dict, dict_size);
+	TEST_ASSERT_NOT_NULL(block);
+	TEST_ASSERT_EQUAL_STRING(records[5], block->entries[5].record);
+	event_block_unref(block);
+
+	/* Missing or different dictionary. */
+	TEST_ASSERT_NULL(event_block_decompress(buf, len, NULL, 0));
+	dict[0]++;
+	TEST_ASSERT_NULL(event_block_decompress(buf, len, dict, dict_size));
+
+	free(plain);
+	free(buf);
+}
+
+void
+test_corrupt(void) {
+	size_t len = 0;
+	unsigned char *buf = compress(NULL, 0, &len);
+
+	/* Truncated. */
+	TEST_ASSERT_NULL(event_block_decompress(buf, len - 1, NULL, 0));
+	TEST_ASSERT_NULL(
+	  event_block_decompress(buf, EVENT_BLOCK_HEADER_SIZE, NULL, 0));
+
+	/* Unknown version. */
+	buf[0] = EVENT_BLOCK_VERSION + 1;
+	TEST_ASSERT_NULL(event_block_decompress(buf, len, NULL, 0));
+
+	free(buf);
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_roundtrip);
+	RUN_TEST(test_dict);
+	RUN_TEST(test_corrupt);
+	return UNITY_END();
+}
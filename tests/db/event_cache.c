@@ -0,0 +1,166 @@
+#include "db/event_cache.h"
+
+#include "unity.h"
+
+#include <string.h>
+
+enum { RECORD_SIZE = 100 };
+
+static struct event_cache cache;
+static char record[RECORD_SIZE];
+
+/* Budget for exactly num entries without JSON. */
+static size_t
+budget_for(size_t num) {
+	return num * (sizeof(struct event_cache_entry) + RECORD_SIZE);
+}
+
+static struct event_cache_entry *
+put(uint32_t room, uint64_t index, uint64_t epoch) {
+	struct event_cache_entry *entry
+	  = event_cache_entry_new(room, index, record, sizeof(record));
+	TEST_ASSERT_NOT_NULL(entry);
+
+	event_cache_put(&cache, entry, epoch);
+	event_cache_entry_unref(entry);
+
+	return entry;
+}
+
+static bool
+cached(uint32_t room, uint64_t index) {
+	struct event_cache_entry *entry = event_cache_get(&cache, room, index);
+	bool found = entry;
+	event_cache_entry_unref(entry);
+
+	return found;
+}
+
+void
+setUp(void) {
+	memset(record, 'a', sizeof(record));
+	TEST_ASSERT_EQUAL(0, event_cache_init(&cache, budget_for(3)));
+}
+
+void
+tearDown(void) {
+	event_cache_finish(&cache);
+}
+
+void
+test_get(void) {
+	TEST_ASSERT_NULL(event_cache_get(&cache, 1, 1));
+
+	put(1, 1, 0);
+	put(2, 1, 0);
+
+	struct event_cache_entry *entry = event_cache_get(&cache, 1, 1);
+	TEST_ASSERT_NOT_NULL(entry);
+	TEST_ASSERT_EQUAL(1, entry->key.room);
+	TEST_ASSERT_EQUAL(1, entry->key.index);
+	TEST_ASSERT_EQUAL_MEMORY(record, entry->record, sizeof(record));
+
+	/* The record is copied. */
+	TEST_ASSERT_TRUE(entry->record != record);
+	event_cache_entry_unref(entry);
+
+	TEST_ASSERT_TRUE(cached(2, 1));
+	TEST_ASSERT_FALSE(cached(1, 2));
+
+	TEST_ASSERT_EQUAL(2, cache.hits);
+	TEST_ASSERT_EQUAL(2, cache.misses);
+}
+
+void
+test_duplicate(void) {
+	struct event_cache_entry *first = put(1, 1, 0);
+	put(1, 1, 0);
+
+	struct event_cache_entry *entry = event_cache_get(&cache, 1, 1);
+	TEST_ASSERT_EQUAL_PTR(first, entry);
+	event_cache_entry_unref(entry);
+
+	TEST_ASSERT_EQUAL(budget_for(1), cache.size);
+}
+
+void
+test_evict(void) {
+	put(1, 1, 0);
+	put(1, 2, 0);
+	put(1, 3, 0);
+
+	/* 1 becomes the most recently used, so 2 is evicted. */
+	TEST_ASSERT_TRUE(cached(1, 1));
+	put(1, 4, 0);
+
+	TEST_ASSERT_TRUE(cached(1, 1));
+	TEST_ASSERT_FALSE(cached(1, 2));
+	TEST_ASSERT_TRUE(cached(1, 3));
+	TEST_ASSERT_TRUE(cached(1, 4));
+	TEST_ASSERT_EQUAL(budget_for(3), cache.size);
+
+	/* Entries larger than the budget are never cached. */
+	struct event_cache_entry *entry = event_cache_entry_new(1, 5, NULL, 0);
+	TEST_ASSERT_NOT_NULL(entry);
+	entry->size = budget_for(4);
+
+	event_cache_put(&cache, entry, 0);
+	event_cache_entry_unref(entry);
+
+	TEST_ASSERT_FALSE(cached(1, 5));
+	TEST_ASSERT_TRUE(cached(1, 4));
+}
+
+void
+test_evicted_in_use(void) {
+	put(1, 1, 0);
+
+	struct event_cache_entry *entry = event_cache_get(&cache, 1, 1);
+	TEST_ASSERT_NOT_NULL(entry);
+
+	put(1, 2, 0);
+	put(1, 3, 0);
+	put(1, 4, 0);
+	TEST_ASSERT_FALSE(cached(1, 1));
+
+	/* Still owned by the reader. */
+	TEST_ASSERT_EQUAL(1, entry->refs);
+	TEST_ASSERT_EQUAL_MEMORY(record, entry->record, sizeof(record));
+	event_cache_entry_unref(entry);
+}
+
+void
+test_invalidate(void) {
+	uint64_t epoch = event_cache_epoch(&cache);
+
+	put(1, 1, epoch);
+	put(1, 2, epoch);
+
+	event_cache_invalidate(&cache, 1, 1);
+	TEST_ASSERT_FALSE(cached(1, 1));
+	TEST_ASSERT_TRUE(cached(1, 2));
+	TEST_ASSERT_EQUAL(budget_for(1), cache.size);
+
+	/* Decoded from a snapshot older than the invalidation. */
+	put(1, 1, epoch);
+	TEST_ASSERT_FALSE(cached(1, 1));
+
+	/* Events that aren't cached still start a new epoch. */
+	epoch = event_cache_epoch(&cache);
+	event_cache_invalidate(&cache, 2, 1);
+	TEST_ASSERT_NOT_EQUAL(epoch, event_cache_epoch(&cache));
+
+	put(1, 1, event_cache_epoch(&cache));
+	TEST_ASSERT_TRUE(cached(1, 1));
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_get);
+	RUN_TEST(test_duplicate);
+	RUN_TEST(test_evict);
+	RUN_TEST(test_evicted_in_use);
+	RUN_TEST(test_invalidate);
+	return UNITY_END();
+}
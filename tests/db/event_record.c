@@ -0,0 +1,170 @@
+#include "db/event_record.h"
+
+#include "unity.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static char event_id[] = "$event:localhost";
+static char sender[] = "@sender:localhost";
+static char type[] = "m.room.message";
+static char body[] = "Body";
+static char formatted_body[] = "<b>Body</b>";
+static char format[] = "org.matrix.custom.html";
+
+static const struct matrix_sync_event message = {
+	.type = MATRIX_EVENT_TIMELINE,
+	.timeline = {
+		.type = MATRIX_ROOM_MESSAGE,
+		.base = {
+			.event_id = event_id,
+			.sender = sender,
+			.type = type,
+			.origin_server_ts = 1234,
+		},
+		.message = {
+			.body = body,
+			.format = format,
+			.formatted_body = formatted_body,
+		},
+	},
+};
+
+static char *
+encode(const struct matrix_sync_event *event, unsigned flags, size_t *len) {
+	*len = event_record_size(event, flags);
+
+	char *buf = malloc(*len);
+	TEST_ASSERT_NOT_NULL(buf);
+
+	event_record_write(event, flags, buf);
+
+	return buf;
+}
+
+void
+setUp(void) {
+}
+
+void
+tearDown(void) {
+}
+
+void
+test_roundtrip(void) {
+	size_t len = 0;
+	char *buf = encode(&message, 0, &len);
+
+	TEST_ASSERT_FALSE(event_record_is_legacy(buf, len));
+
+	struct matrix_sync_event decoded = {0};
+	unsigned flags = 1;
+
+	TEST_ASSERT_EQUAL(0, event_record_decode(buf, len, &decoded, &flags));
+	TEST_ASSERT_EQUAL(0, flags);
+	TEST_ASSERT_EQUAL(MATRIX_EVENT_TIMELINE, decoded.type);
+	TEST_ASSERT_EQUAL(MATRIX_ROOM_MESSAGE, decoded.timeline.type);
+	TEST_ASSERT_EQUAL(1234, decoded.timeline.base.origin_server_ts);
+	TEST_ASSERT_EQUAL_STRING(event_id, decoded.timeline.base.event_id);
+	TEST_ASSERT_EQUAL_STRING(sender, decoded.timeline.base.sender);
+	TEST_ASSERT_EQUAL_STRING(body, decoded.timeline.message.body);
+	TEST_ASSERT_EQUAL_STRING(
+	  formatted_body, decoded.timeline.message.formatted_body);
+	TEST_ASSERT_NULL(decoded.timeline.message.msgtype);
+	TEST_ASSERT_NULL(decoded.timeline.relation.event_id);
+
+	free(buf);
+}
+
+void
+test_redacted(void) {
+	size_t len = 0;
+	char *buf = encode(&message, EVENT_RECORD_REDACTED, &len);
+
+	TEST_ASSERT_TRUE(len < event_record_size(&message, 0));
+
+	struct matrix_sync_event decoded = {0};
+	unsigned flags = 0;
+
+	TEST_ASSERT_EQUAL(0, event_record_decode(buf, len, &decoded, &flags));
+	TEST_ASSERT_EQUAL(EVENT_RECORD_REDACTED, flags);
+	TEST_ASSERT_EQUAL_STRING(event_id, decoded.timeline.base.event_id);
+	TEST_ASSERT_NULL(decoded.timeline.message.body);
+	TEST_ASSERT_NULL(decoded.timeline.message.formatted_body);
+
+	free(buf);
+}
+
+void
+test_state(void) {
+	char member_type[] = "m.room.member";
+	char displayname[] = "Sender";
+
+	struct matrix_sync_event member = {
+		.type = MATRIX_EVENT_STATE,
+		.state = {
+			.type = MATRIX_ROOM_MEMBER,
+			.base = {
+				.event_id = event_id,
+				.sender = sender,
+				.type = member_type,
+				.state_key = sender,
+			},
+			.content = {
+				.member = {
+					.displayname = displayname,
+				},
+			},
+		},
+	};
+
+	size_t len = 0;
+	char *buf = encode(&member, 0, &len);
+
+	struct event_record_header header = {0};
+	TEST_ASSERT_EQUAL(0, event_record_header(buf, len, &header));
+	TEST_ASSERT_EQUAL(MATRIX_EVENT_STATE, header.event_type);
+	TEST_ASSERT_EQUAL(MATRIX_ROOM_MEMBER, header.type);
+
+	struct matrix_sync_event decoded = {0};
+	unsigned flags = 0;
+
+	TEST_ASSERT_EQUAL(0, event_record_decode(buf, len, &decoded, &flags));
+	TEST_ASSERT_EQUAL_STRING(sender, decoded.state.base.state_key);
+	TEST_ASSERT_EQUAL_STRING(
+	  displayname, decoded.state.content.member.displayname);
+
+	free(buf);
+}
+
+void
+test_corrupt(void) {
+	size_t len = 0;
+	char *buf = encode(&message, 0, &len);
+
+	struct matrix_sync_event decoded = {0};
+	unsigned flags = 0;
+
+	/* Truncated. */
+	TEST_ASSERT_EQUAL(-1, event_record_decode(buf, len - 1, &decoded, &flags));
+	TEST_ASSERT_EQUAL(-1, event_record_decode(buf, 4, &decoded, &flags));
+
+	/* Unknown version. */
+	buf[0] = EVENT_RECORD_VERSION + 1;
+	TEST_ASSERT_EQUAL(-1, event_record_decode(buf, len, &decoded, &flags));
+
+	free(buf);
+
+	const char json[] = "{\"type\":\"m.room.message\"}";
+	TEST_ASSERT_TRUE(event_record_is_legacy(json, sizeof(json)));
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_roundtrip);
+	RUN_TEST(test_redacted);
+	RUN_TEST(test_state);
+	RUN_TEST(test_corrupt);
+	return UNITY_END();
+}
@@ -0,0 +1,428 @@
+#include "db/kv.h"
+
+#include "unity.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Every test runs against each backend, which must behave the same. */
+static const struct kv_ops *const backends[] = {&kv_lmdb, &kv_memory};
+static const struct kv_ops *backend = NULL;
+static char dir[] = "/tmp/kv_test_XXXXXX";
+static struct kv_env *env = NULL;
+static kv_dbi plain = 0;
+static kv_dbi dups = 0;
+static kv_dbi fixed = 0;
+
+static MDB_val
+str(const char *s) {
+	return (MDB_val) {strlen(s), (void *) (uintptr_t) s};
+}
+
+static void
+remove_files(void) {
+	char path[sizeof(dir) + 16];
+
+	snprintf(path, sizeof(path), "%s/data.mdb", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/lock.mdb", dir);
+	unlink(path);
+}
+
+static struct kv_txn *
+begin(unsigned flags) {
+	struct kv_txn *txn = NULL;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_begin(env, flags, &txn));
+
+	return txn;
+}
+
+static void
+put(kv_dbi dbi, const char *key, const char *data) {
+	struct kv_txn *txn = begin(0);
+	MDB_val key_val = str(key);
+	MDB_val data_val = str(data);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_put(txn, dbi, &key_val, &data_val, 0));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+static void
+assert_val(const char *expected, const MDB_val *val) {
+	TEST_ASSERT_EQUAL(strlen(expected), val->mv_size);
+	TEST_ASSERT_EQUAL_MEMORY(expected, val->mv_data, val->mv_size);
+}
+
+void
+setUp(void) {
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_env_open(backend, &env, dir, MDB_NOTLS, 1 << 20, 4));
+
+	struct kv_txn *txn = begin(0);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_dbi_open(txn, "plain", MDB_CREATE, &plain));
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_dbi_open(txn, "dups", MDB_CREATE | MDB_DUPSORT, &dups));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_dbi_open(
+		txn, "fixed", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED, &fixed));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+void
+tearDown(void) {
+	kv_env_close(env);
+	env = NULL;
+	remove_files();
+}
+
+void
+test_put_get(void) {
+	struct kv_txn *txn = begin(0);
+	MDB_val key = str("key");
+	MDB_val data = str("value");
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_put(txn, plain, &key, &data, 0));
+
+	data = str("other");
+	TEST_ASSERT_EQUAL(
+	  MDB_KEYEXIST, kv_put(txn, plain, &key, &data, MDB_NOOVERWRITE));
+	assert_val("value", &data);
+
+	/* Overwritten, with the space reserved by the backend. */
+	data = (MDB_val) {3, NULL};
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_put(txn, plain, &key, &data, MDB_RESERVE));
+	memcpy(data.mv_data, "new", 3);
+
+	data = (MDB_val) {0};
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_get(txn, plain, &key, &data));
+	assert_val("new", &data);
+
+	MDB_val empty = str("");
+	TEST_ASSERT_EQUAL(MDB_BAD_VALSIZE, kv_put(txn, plain, &empty, &data, 0));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_del(txn, plain, &key, NULL));
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, kv_get(txn, plain, &key, &data));
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, kv_del(txn, plain, &key, NULL));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+void
+test_order(void) {
+	const char *keys[] = {"b", "ab", "a", "abc", "ba"};
+	const char *sorted[] = {"a", "ab", "abc", "b", "ba"};
+
+	for (size_t i = 0; i < (sizeof(keys) / sizeof(*keys)); i++) {
+		put(plain, keys[i], keys[i]);
+	}
+
+	struct kv_txn *txn = begin(MDB_RDONLY);
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(txn, plain, &cursor));
+
+	for (size_t i = 0; i < (sizeof(sorted) / sizeof(*sorted)); i++) {
+		TEST_ASSERT_EQUAL(
+		  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_NEXT));
+		assert_val(sorted[i], &key);
+	}
+
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, kv_cursor_get(cursor, &key, &data, MDB_NEXT));
+
+	key = str("abd");
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE));
+	assert_val("b", &key);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_PREV));
+	assert_val("abc", &key);
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_LAST));
+	assert_val("ba", &key);
+
+	key = str("c");
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, kv_cursor_get(cursor, &key, &data, MDB_SET_RANGE));
+
+	kv_cursor_close(cursor);
+	kv_txn_abort(txn);
+}
+
+void
+test_dups(void) {
+	const char *values[] = {"3", "1", "22", "2"};
+
+	for (size_t i = 0; i < (sizeof(values) / sizeof(*values)); i++) {
+		put(dups, "key", values[i]);
+	}
+
+	put(dups, "other", "0");
+
+	struct kv_txn *txn = begin(0);
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = str("key");
+	MDB_val data = str("1");
+	size_t count = 0;
+
+	TEST_ASSERT_EQUAL(
+	  MDB_KEYEXIST, kv_put(txn, dups, &key, &data, MDB_NODUPDATA));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(txn, dups, &cursor));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_SET));
+	assert_val("1", &data);
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_count(cursor, &count));
+	TEST_ASSERT_EQUAL(4, count);
+
+	const char *sorted[] = {"2", "22", "3"};
+
+	for (size_t i = 0; i < (sizeof(sorted) / sizeof(*sorted)); i++) {
+		TEST_ASSERT_EQUAL(
+		  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_NEXT_DUP));
+		assert_val(sorted[i], &data);
+	}
+
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, kv_cursor_get(cursor, &key, &data, MDB_NEXT_DUP));
+
+	key = str("key");
+	data = str("21");
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_GET_BOTH_RANGE));
+	assert_val("22", &data);
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_PREV_DUP));
+	assert_val("2", &data);
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_LAST_DUP));
+	assert_val("3", &data);
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_FIRST_DUP));
+	assert_val("1", &data);
+
+	data = str("21");
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, kv_cursor_get(cursor, &key, &data, MDB_GET_BOTH));
+
+	kv_cursor_close(cursor);
+
+	/* A single duplicate, then the rest of them. */
+	key = str("key");
+	data = str("22");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_del(txn, dups, &key, &data));
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, kv_del(txn, dups, &key, &data));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_del(txn, dups, &key, NULL));
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, kv_get(txn, dups, &key, &data));
+
+	key = str("other");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_get(txn, dups, &key, &data));
+	assert_val("0", &data);
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+void
+test_multiple(void) {
+	enum { num_values = 100 };
+
+	struct kv_txn *txn = begin(0);
+	MDB_val key = str("key");
+
+	for (uint32_t i = num_values; i > 0; i--) {
+		unsigned char value[4] = {(unsigned char) (i >> 8), (unsigned char) i};
+		MDB_val data = {sizeof(value), value};
+
+		TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_put(txn, fixed, &key, &data, 0));
+	}
+
+	struct kv_cursor *cursor = NULL;
+	MDB_val data = {0};
+	uint32_t expected = 1;
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(txn, fixed, &cursor));
+
+	int ret = kv_cursor_get(cursor, &key, &data, MDB_SET);
+
+	for (ret = ret == MDB_SUCCESS
+				 ? kv_cursor_get(cursor, &key, &data, MDB_GET_MULTIPLE)
+				 : ret;
+		 ret == MDB_SUCCESS;
+		 ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT_MULTIPLE)) {
+		const unsigned char *values = data.mv_data;
+
+		for (size_t i = 0; i < data.mv_size; i += 4, expected++) {
+			TEST_ASSERT_EQUAL(expected, (values[i] << 8) | values[i + 1]);
+		}
+	}
+
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, ret);
+	TEST_ASSERT_EQUAL(num_values + 1, expected);
+
+	kv_cursor_close(cursor);
+	kv_txn_abort(txn);
+}
+
+void
+test_abort(void) {
+	put(plain, "kept", "old");
+	put(plain, "deleted", "old");
+
+	struct kv_txn *txn = begin(0);
+	MDB_val key = str("kept");
+	MDB_val data = str("new");
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_put(txn, plain, &key, &data, 0));
+	key = str("deleted");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_del(txn, plain, &key, NULL));
+	key = str("added");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_put(txn, plain, &key, &data, 0));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_drop(txn, dups, false));
+
+	kv_txn_abort(txn);
+
+	txn = begin(MDB_RDONLY);
+
+	key = str("kept");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_get(txn, plain, &key, &data));
+	assert_val("old", &data);
+	key = str("deleted");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_get(txn, plain, &key, &data));
+	assert_val("old", &data);
+	key = str("added");
+	TEST_ASSERT_EQUAL(MDB_NOTFOUND, kv_get(txn, plain, &key, &data));
+
+	struct kv_stat stat = {0};
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_stat(txn, plain, &stat));
+	TEST_ASSERT_EQUAL(2, stat.entries);
+
+	/* Renewed txns see later commits. */
+	kv_txn_reset(txn);
+	put(plain, "added", "new");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_renew(txn));
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_get(txn, plain, &key, &data));
+	assert_val("new", &data);
+
+	kv_txn_abort(txn);
+}
+
+void
+test_cursor_del(void) {
+	const char *keys[] = {"a", "b", "c", "d", "e"};
+
+	for (size_t i = 0; i < (sizeof(keys) / sizeof(*keys)); i++) {
+		put(plain, keys[i], keys[i]);
+	}
+
+	struct kv_txn *txn = begin(0);
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = {0};
+	MDB_val data = {0};
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(txn, plain, &cursor));
+
+	/* The cursor moves to the item after the deleted one. */
+	for (int ret = kv_cursor_get(cursor, &key, &data, MDB_FIRST);
+		 ret == MDB_SUCCESS;
+		 ret = kv_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+		if (((const char *) key.mv_data)[0] != 'c') {
+			TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_del(cursor, 0));
+		}
+	}
+
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_FIRST));
+	assert_val("c", &key);
+	TEST_ASSERT_EQUAL(
+	  MDB_NOTFOUND, kv_cursor_get(cursor, &key, &data, MDB_NEXT));
+
+	/* Appending needs keys after the last one. */
+	key = str("b");
+	data = str("b");
+	TEST_ASSERT_EQUAL(
+	  MDB_KEYEXIST, kv_cursor_put(cursor, &key, &data, MDB_APPEND));
+	key = str("d");
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_put(cursor, &key, &data, MDB_APPEND));
+
+	kv_cursor_close(cursor);
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+void
+test_append_dups(void) {
+	put(dups, "a", "1");
+
+	struct kv_txn *txn = begin(0);
+	struct kv_cursor *cursor = NULL;
+	MDB_val key = str("a");
+	MDB_val data = str("2");
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_open(txn, dups, &cursor));
+
+	/* The key must sort after the last one even with MDB_APPENDDUP. */
+	TEST_ASSERT_EQUAL(MDB_KEYEXIST,
+	  kv_cursor_put(cursor, &key, &data, MDB_APPEND | MDB_APPENDDUP));
+
+	/* MDB_APPENDDUP alone appends to the duplicates of the key. */
+	TEST_ASSERT_EQUAL(
+	  MDB_SUCCESS, kv_cursor_put(cursor, &key, &data, MDB_APPENDDUP));
+	data = str("0");
+	TEST_ASSERT_EQUAL(
+	  MDB_KEYEXIST, kv_cursor_put(cursor, &key, &data, MDB_APPENDDUP));
+	data = str("2");
+	TEST_ASSERT_EQUAL(
+	  MDB_KEYEXIST, kv_cursor_put(cursor, &key, &data, MDB_APPENDDUP));
+
+	key = str("b");
+	data = str("0");
+	TEST_ASSERT_EQUAL(MDB_SUCCESS,
+	  kv_cursor_put(cursor, &key, &data, MDB_APPEND | MDB_APPENDDUP));
+
+	size_t count = 0;
+	key = str("a");
+
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_get(cursor, &key, &data, MDB_SET));
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_cursor_count(cursor, &count));
+	TEST_ASSERT_EQUAL(2, count);
+
+	kv_cursor_close(cursor);
+	TEST_ASSERT_EQUAL(MDB_SUCCESS, kv_txn_commit(txn));
+}
+
+int
+main(void) {
+	if (!mkdtemp(dir)) {
+		return EXIT_FAILURE;
+	}
+
+	UNITY_BEGIN();
+
+	for (size_t i = 0; i < (sizeof(backends) / sizeof(*backends)); i++) {
+		backend = backends[i];
+
+		RUN_TEST(test_put_get);
+		RUN_TEST(test_order);
+		RUN_TEST(test_dups);
+		RUN_TEST(test_multiple);
+		RUN_TEST(test_abort);
+		RUN_TEST(test_cursor_del);
+		RUN_TEST(test_append_dups);
+	}
+
+	rmdir(dir);
+
+	return UNITY_END();
+}
@@ -0,0 +1,88 @@
+#include "db/room_summary.h"
+
+#include "unity.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static char name[] = "Room";
+static char topic[] = "Topic";
+
+static const struct room_summary summary = {
+	.flags = ROOM_SUMMARY_IS_SPACE,
+	.member_count = 42,
+	.last_activity_ts = 1234,
+	.last_index = 5678,
+	.fields = {
+		[ROOM_SUMMARY_NAME] = name,
+		[ROOM_SUMMARY_TOPIC] = topic,
+	},
+};
+
+static char *
+encode(const struct room_summary *in, size_t *len) {
+	*len = room_summary_size(in);
+
+	char *buf = malloc(*len);
+	TEST_ASSERT_NOT_NULL(buf);
+
+	room_summary_write(in, buf);
+
+	return buf;
+}
+
+void
+setUp(void) {
+}
+
+void
+tearDown(void) {
+}
+
+void
+test_roundtrip(void) {
+	size_t len = 0;
+	char *buf = encode(&summary, &len);
+
+	struct room_summary decoded = {0};
+
+	TEST_ASSERT_EQUAL(0, room_summary_decode(buf, len, &decoded));
+	TEST_ASSERT_EQUAL(ROOM_SUMMARY_IS_SPACE, decoded.flags);
+	TEST_ASSERT_EQUAL(42, decoded.member_count);
+	TEST_ASSERT_EQUAL(1234, decoded.last_activity_ts);
+	TEST_ASSERT_EQUAL(5678, decoded.last_index);
+	TEST_ASSERT_EQUAL_STRING(name, decoded.fields[ROOM_SUMMARY_NAME]);
+	TEST_ASSERT_NULL(decoded.fields[ROOM_SUMMARY_ALIAS]);
+	TEST_ASSERT_EQUAL_STRING(topic, decoded.fields[ROOM_SUMMARY_TOPIC]);
+
+	free(buf);
+}
+
+void
+test_corrupt(void) {
+	size_t len = 0;
+	char *buf = encode(&summary, &len);
+
+	struct room_summary decoded = {0};
+
+	/* Truncated. */
+	TEST_ASSERT_EQUAL(-1, room_summary_decode(buf, len - 1, &decoded));
+	TEST_ASSERT_EQUAL(-1, room_summary_decode(buf, 4, &decoded));
+
+	/* Unknown version. */
+	buf[0] = ROOM_SUMMARY_VERSION + 1;
+	TEST_ASSERT_EQUAL(-1, room_summary_decode(buf, len, &decoded));
+
+	free(buf);
+
+	/* The empty string that was stored before summaries existed. */
+	TEST_ASSERT_EQUAL(-1, room_summary_decode("", 1, &decoded));
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_roundtrip);
+	RUN_TEST(test_corrupt);
+	return UNITY_END();
+}
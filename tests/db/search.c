@@ -0,0 +1,92 @@
+#include "db/search.h"
+
+#include "unity.h"
+
+#include <string.h>
+
+void
+setUp(void) {
+}
+
+void
+tearDown(void) {
+}
+
+void
+test_tokens(void) {
+	const char *text = "Hello, World! a  foo_bar 42";
+	char token[SEARCH_TOKEN_MAX + 1];
+
+	TEST_ASSERT_EQUAL(5, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("hello", token);
+	TEST_ASSERT_EQUAL(5, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("world", token);
+	/* "a" is too short. */
+	TEST_ASSERT_EQUAL(3, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("foo", token);
+	TEST_ASSERT_EQUAL(3, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("bar", token);
+	TEST_ASSERT_EQUAL(2, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("42", token);
+	TEST_ASSERT_EQUAL(0, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL(0, search_token_next(&text, token));
+}
+
+void
+test_utf8(void) {
+	const char *text = "Grüße, Welt";
+	char token[SEARCH_TOKEN_MAX + 1];
+
+	TEST_ASSERT_EQUAL(strlen("grüße"), search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("grüße", token);
+	TEST_ASSERT_EQUAL(4, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL_STRING("welt", token);
+}
+
+void
+test_truncated(void) {
+	char long_text[SEARCH_TOKEN_MAX * 2 + 1];
+	memset(long_text, 'a', sizeof(long_text) - 1);
+	long_text[sizeof(long_text) - 1] = '\0';
+
+	/* A 2 byte sequence straddling the limit is dropped. */
+	long_text[SEARCH_TOKEN_MAX - 1] = (char) 0xC3;
+	long_text[SEARCH_TOKEN_MAX] = (char) 0xA4;
+
+	const char *text = long_text;
+	char token[SEARCH_TOKEN_MAX + 1];
+
+	TEST_ASSERT_EQUAL(SEARCH_TOKEN_MAX - 1, search_token_next(&text, token));
+	TEST_ASSERT_EQUAL(0, search_token_next(&text, token));
+}
+
+void
+test_posting(void) {
+	unsigned char first[SEARCH_POSTING_SIZE];
+	unsigned char second[SEARCH_POSTING_SIZE];
+
+	search_posting_write(first, 1000, 2, UINT64_MAX - 1);
+	search_posting_write(second, 2000, 1, 0);
+
+	/* Sorted by time, then room and index. */
+	TEST_ASSERT_TRUE(memcmp(first, second, SEARCH_POSTING_SIZE) < 0);
+
+	uint64_t ts = 0;
+	uint32_t room = 0;
+	uint64_t index = 0;
+
+	search_posting_read(first, &ts, &room, &index);
+	TEST_ASSERT_TRUE(ts == 1000);
+	TEST_ASSERT_EQUAL(2, room);
+	TEST_ASSERT_TRUE(index == UINT64_MAX - 1);
+}
+
+int
+main(void) {
+	UNITY_BEGIN();
+	RUN_TEST(test_tokens);
+	RUN_TEST(test_utf8);
+	RUN_TEST(test_truncated);
+	RUN_TEST(test_posting);
+	return UNITY_END();
+}
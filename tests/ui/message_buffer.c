@@ -11,32 +11,30 @@ struct widget_points points = {.x1 = 20, .x2 = 80, .y1 = 2, .y2 = 10 + 1};
 struct message messages[20] = {0};
 
 static char sender[] = "@Hello:localhost";
-static uint32_t *body;
+static char body[] = "Hello";
 static struct members_map *map = NULL;
 static uint32_t *name = NULL;
 static uint32_t **names = NULL;
 
 void
 setUp(void) {
-	body = buf_to_uint32_t("Hello", 0);
+	name = buf_to_uint32_t("Hello", 0);
 	message_buffer_init(&buf);
 
 	for (size_t i = 0; i < (sizeof(messages) / sizeof(*messages)); i++) {
 		messages[i].index = i;
 		messages[i].body = body;
 		messages[i].sender = sender;
-		messages[i].username = body;
+		messages[i].username = name;
 	}
 
 	SHMAP_INIT(map);
-	name = buf_to_uint32_t("Hello", 0);
 	arrput(names, name);
 	shput(map, sender, names);
 }
 
 void
 tearDown(void) {
-	arrfree(body);
 	message_buffer_finish(&buf);
 	memset(messages, 0, sizeof(*messages));
 	shfree(map);
@@ -176,29 +174,26 @@ test_actions(void) {
 
 void
 test_wrapping(void) {
-	uint32_t *wrapped_bufs[] = {
-	  buf_to_uint32_t(
-		"nqjkdnqwjkdnqwdnqwjkdqwndjkqwndkjqwndkqwjndqwkjndqwjkddqwdqwt", 0),
-	  buf_to_uint32_t(
-		"asjkdnasdkjnsadsakdadkjsandsajkndaskjdaskjdnkjdqdwqfwqfqw\nqqwfqwngjkq"
-		"engjkerwngjqngkjengjkqwgjkenwkjgqnwjkgnewqjkq😄\naflkasmfklqmgwqgqwghng"
-		"jngbnjgfbfgbfgbgfew qfqw "
-		"https://"
-		"urlq\nfqwflqwmflqwqwqwfqwgqwjnkgqwjkgnkjgwnqjkgnqwgqwkjngwqkjngq🤔",
-		0)};
-
-	/* The exact values where we wrap. */
+	const char *wrapped_bufs[] = {
+	  "nqjkdnqwjkdnqwdnqwjkdqwndjkqwndkjqwndkqwjndqwkjndqwjkddqwdqwt",
+	  "asjkdnasdkjnsadsakdadkjsandsajkndaskjdaskjdnkjdqdwqfwqfqw\nqqwfqwngjkq"
+	  "engjkerwngjqngkjengjkqwgjkenwkjgqnwjkgnewqjkq😄\naflkasmfklqmgwqgqwghng"
+	  "jngbnjgfbfgbfgbgfew qfqw "
+	  "https://"
+	  "urlq\nfqwflqwmflqwqwqwfqwgqwjnkgqwjkgnkjgwnqjkgnqwgqwkjngwqkjngq🤔"};
+
+	/* The exact byte offsets where we wrap, the emojis are 4 bytes. */
 	const size_t start_end[][2] = {
 	  {  0,  52},
 	  { 52,  61},
 	  {  0,  52},
 	  { 52,  58},
 	  { 58, 110},
-	  {110, 116},
-	  {116, 163},
-	  {163, 176},
-	  {176, 228},
-	  {228, 235},
+	  {110, 119},
+	  {119, 166},
+	  {166, 179},
+	  {179, 231},
+	  {231, 241},
 	};
 
 	size_t len = sizeof(wrapped_bufs) / sizeof(*wrapped_bufs);
@@ -217,10 +212,45 @@ test_wrapping(void) {
 		TEST_ASSERT_EQUAL(start_end[i][0], buf.buf[i].start);
 		TEST_ASSERT_EQUAL(start_end[i][1], buf.buf[i].end);
 	}
+}
 
-	for (size_t i = 0; i < len; i++) {
-		arrfree(wrapped_bufs[i]);
+void
+test_scroll_to(void) {
+	size_t size = sizeof(messages) / sizeof(*messages);
+
+	TEST_ASSERT_EQUAL(-1, message_buffer_scroll_to(&buf, 0));
+
+	for (size_t i = 0; i < size; i++) {
+		messages[i].index = i * 2;
+		TEST_ASSERT_EQUAL(
+		  0, message_buffer_insert(&buf, &points, &messages[i]));
 	}
+
+	/* The first message after a missing index, in the middle of the 9
+	 * rows. */
+	TEST_ASSERT_EQUAL(0, message_buffer_scroll_to(&buf, 11));
+	TEST_ASSERT_EQUAL(&messages[6], buf.selected);
+	TEST_ASSERT_EQUAL(size - 7 - 4, buf.scroll);
+
+	/* Can't scroll further down. */
+	TEST_ASSERT_EQUAL(0, message_buffer_scroll_to(&buf, (size - 1) * 2));
+	TEST_ASSERT_EQUAL(&messages[size - 1], buf.selected);
+	TEST_ASSERT_EQUAL(0, buf.scroll);
+
+	TEST_ASSERT_EQUAL(-1, message_buffer_scroll_to(&buf, size * 2));
+	TEST_ASSERT_EQUAL(&messages[size - 1], buf.selected);
+
+	message_buffer_zero(&buf);
+
+	/* Fits in the buffer. */
+	for (size_t i = 0; i < 5; i++) {
+		TEST_ASSERT_EQUAL(
+		  0, message_buffer_insert(&buf, &points, &messages[i]));
+	}
+
+	TEST_ASSERT_EQUAL(0, message_buffer_scroll_to(&buf, 0));
+	TEST_ASSERT_EQUAL(&messages[0], buf.selected);
+	TEST_ASSERT_EQUAL(0, buf.scroll);
 }
 
 int
@@ -228,5 +258,6 @@ main(void) {
 	UNITY_BEGIN();
 	RUN_TEST(test_actions);
 	RUN_TEST(test_wrapping);
+	RUN_TEST(test_scroll_to);
 	return UNITY_END();
 }
@@ -130,6 +130,39 @@ test_basic(void) {
 	}
 }
 
+void
+test_select_room(void) {
+	const room_children_t children[] = {
+	  [R1] = {	  R2, R4, R_TERM},
+	  [R2] = {R_TERM	},
+	  [R3] = {R_TERM	},
+	  [R4] = {R_TERM	},
+	};
+
+	test_init_state_rooms(children);
+
+	tab_room_reset_rooms(&tab_room, &state_rooms);
+
+	/* Shown in the current space. */
+	tab_room_select_room(&tab_room, &state_rooms, &state_rooms.rooms[R3]);
+	TEST_ASSERT_EQUAL(0, arrlenu(tab_room.path));
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R3], tab_room.selected_room);
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R3], tab_room.treeview.selected->data);
+
+	/* Inside a space. */
+	tab_room_select_room(&tab_room, &state_rooms, &state_rooms.rooms[R4]);
+	TEST_ASSERT_EQUAL(1, arrlenu(tab_room.path));
+	TEST_ASSERT_EQUAL_STRING(R_TO_STR[R1], tab_room.path[0]);
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R4], tab_room.selected_room);
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R4], tab_room.treeview.selected->data);
+
+	/* Back to an orphan. */
+	tab_room_select_room(&tab_room, &state_rooms, &state_rooms.rooms[R3]);
+	TEST_ASSERT_EQUAL(0, arrlenu(tab_room.path));
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R3], tab_room.selected_room);
+	TEST_ASSERT_EQUAL(&state_rooms.rooms[R3], tab_room.treeview.selected->data);
+}
+
 void
 test_recursive(void) {
 }
@@ -138,6 +171,7 @@ int
 main(void) {
 	UNITY_BEGIN();
 	RUN_TEST(test_basic);
+	RUN_TEST(test_select_room);
 	RUN_TEST(test_recursive);
 	return UNITY_END();
 }